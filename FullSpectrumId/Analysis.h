@@ -27,13 +27,16 @@
 
 #include "FullSpectrumId_config.h"
 
+#include <map>
+#include <atomic>
+#include <chrono>
 #include <string>
 #include <vector>
 #include <memory>
 #include <cstdint>
 #include <functional>
 
-#include <Wt/Json/Object.h>
+#include "FullSpectrumId/EngineJson.h"
 
 //Forward declarations
 //struct IsotopeIDResult;  //In GadrasIsotopeID.h
@@ -80,6 +83,28 @@ int32_t gadras_version_number();
 // e.x. "18.1.1"
 std::string gadras_version_string();
 
+/** The result of analyzing with one of the candidate DRFs of an ensemble (see AnalysisEnsemble.h). */
+struct EnsembleCandidate
+{
+  std::string drf;
+  
+  /** If this is the result given as the #AnalysisOutput. */
+  bool chosen = false;
+  
+  int gadras_intialization_error = -999;
+  int gadras_analysis_error = -999;
+  std::string error_message;
+  float chi_sqr = -1.0f;
+  std::string isotopes;
+  
+  /** Seconds waiting for the ensemble to have an analysis slot available. */
+  double wait_seconds = 0.0;
+  
+  /** Seconds from being posted to the analysis queue, until the result was received. */
+  double wall_seconds = 0.0;
+};//struct EnsembleCandidate
+
+
 /** Result for a simple analysis of single foreground and background */
 struct AnalysisOutput
 {
@@ -129,9 +154,12 @@ struct AnalysisOutput
    */
   std::shared_ptr<SpecUtils::SpecFile> spec_file;
   
+  /** For an analysis with several candidate DRFs, the results for each of them; empty otherwise. */
+  std::vector<EnsembleCandidate> ensemble;
+  
   AnalysisOutput();
   
-  Wt::Json::Object toJson() const;
+  EngineJson::Object toJson() const;
   
   std::string briefTxtSummary() const;
   
@@ -139,6 +167,22 @@ struct AnalysisOutput
 };//struct AnalysisOutput
 
 
+/** How far along an analysis is, given to #AnalysisInput::progress while the analysis is running. */
+struct AnalysisProgress
+{
+  /** The #AnalysisInput::ana_number of the analysis. */
+  size_t ana_number = 0;
+  
+  /** Fraction of the analysis done, from 0 to 1. */
+  double fraction_done = 0.0;
+  
+  /** The isotopes found so far, formatted like #AnalysisOutput::isotopes (e.g., "Cs137(H)+Co60(M)");
+   empty if none yet.
+   */
+  std::string isotopes;
+};//struct AnalysisProgress
+
+
 enum class AnalysisType
 {
   /** Analysis to perform isotope ID on a single foreground spectrum that has a background spectrum.
@@ -172,8 +216,8 @@ struct AnalysisInput
   size_t ana_number;
   
   // If wt_app_id is non-empty, then #AnalysisInput::callback will be posted to the WApplication
-  //  instance.  If it is empty, then #AnalysisInput::callback will be called immediately in the
-  //  analysis thread.
+  //  instance (see #QueueHooks::post_to_session).  If it is empty, then #AnalysisInput::callback
+  //  will be called immediately in the analysis thread.
   std::string wt_app_id;
   
   std::string drf_folder;
@@ -188,17 +232,194 @@ struct AnalysisInput
   std::shared_ptr<SpecUtils::SpecFile> input;
   
   std::function<void(AnalysisOutput)> callback;
+  
+  /** The request ID used to tag tracing events (see Tracing.h); zero if not being traced. */
+  uint64_t trace_id = 0;
+  
+  /** Who requested the analysis (e.g., a REST API client, see ClientLimits.h).  When several
+   clients have analyses queued, the queue takes them in turn, instead of first come first served,
+   so one client cant hold up the others.  If empty, inputs are grouped by #wt_app_id.
+   */
+  std::string client;
+  
+  /** The clients share of analysis time, relative to the other clients with analyses queued. */
+  double client_weight = 1.0;
+  
+  /** When the requester will have given up on the result (e.g., a REST client timing out); once it
+   has passed, the analysis is skipped if it hasnt started, or stopped before DRF initialization or
+   between search windows, and an error returned.  The default (the clocks epoch) is no deadline.
+   */
+  std::chrono::steady_clock::time_point deadline;
+  
+  /** If non-null, the requester sets it to true when it has gone away (e.g., the HTTP connection was
+   closed), which is treated like a passed deadline.
+   */
+  std::shared_ptr<std::atomic<bool>> cancelled;
+  
+  /** If set, called while the analysis runs with how far along it is, and what it has found so
+   far, so the requester can act on early detections.  Posted the same way as #callback (see
+   #post_analysis_progress), and never after the result.
+   
+   Only search-mode analyses (many time-slices) report progress, and only when analyzed in this
+   process (not in a worker process, or on a cluster or broker); other analyses just give their result.
+   */
+  std::function<void(const AnalysisProgress &)> progress;
+  
+  /** Minimum time between calls to #progress; zero to not limit by time. */
+  double progress_interval_seconds = 1.0;
+  
+  /** If non-zero, #progress is also called after this many search windows, even if
+   #progress_interval_seconds hasnt passed.
+   */
+  size_t progress_interval_windows = 0;
+  
+  /** Set by #QueueHooks::lookup when there was no stored result (e.g., the result stores hash of
+   the input), so #QueueHooks::on_result can store the result without computing it again.  Opaque
+   to the analysis engine; empty if not set.
+   */
+  std::string result_key;
 };//struct AnalysisInput
 
 
 
+/** The function that performs an analysis in the calling thread. */
+typedef AnalysisOutput (*AnalyzeFcn)( const AnalysisInput &input );
+
+
+/** Optional ways for the application to extend the analysis queue, without the analysis engine
+ depending on them; e.g., the web-server posts results to GUI sessions, runs analyses in worker
+ processes or on other machines, and stores results.  All hooks are optional.
+ */
+struct QueueHooks
+{
+  /** Called by #start_analysis_thread before the analysis thread is started, with the function
+   that analyzes in-process (e.g., to fork worker processes from).
+   */
+  std::function<void( AnalyzeFcn analyze )> on_start;
+  
+  /** Called by #stop_analysis_thread after the analysis thread has finished. */
+  std::function<void()> on_stop;
+  
+  /** Called by #post_analysis before queuing the input; if it returns true, the output it set is
+   given to the inputs callback instead of analyzing.  It may set #AnalysisInput::result_key of the
+   input that is then queued.
+   */
+  std::function<bool( AnalysisInput &input, AnalysisOutput &output )> lookup;
+  
+  /** Called from the analysis thread for each input; if it returns true, the hook has taken the
+   input, and will call done with the result (from any thread), instead of it being analyzed in
+   this process.
+   */
+  std::function<bool( const AnalysisInput &input,
+                      std::function<void( const AnalysisOutput &output )> done )> dispatch;
+  
+  /** Called from the analysis thread for inputs not dispatched; if it returns true, the analysis
+   was run (e.g., in a worker process) and output set.  If it throws, the analysis is run in-process.
+   */
+  std::function<bool( const AnalysisInput &input, AnalysisOutput &output )> run;
+  
+  /** Called with every analysis result after it is given to the callback; not called for results
+   from #lookup.
+   */
+  std::function<void( const AnalysisInput &input, const AnalysisOutput &output )> on_result;
+  
+  /** Calls the callback from the WApplication session with the given ID; required to post
+   results for inputs with a #AnalysisInput::wt_app_id.
+   */
+  std::function<void( const AnalysisInput &input, std::function<void()> callback )> post_to_session;
+};//struct QueueHooks
+
+
+/** Sets the queue hooks; must be called before #start_analysis_thread. */
+void set_queue_hooks( const QueueHooks &hooks );
+
+
 void start_analysis_thread();
 
 void stop_analysis_thread();
 
+/** Queues the input for analysis; the result is given to the inputs callback.
+ 
+ If #QueueHooks::lookup finds a result for the input (e.g., from the result store, see
+ ResultStore.h), it is given to the callback before this function returns, instead of queuing
+ the input.
+ */
 void post_analysis( const AnalysisInput &input );
 
 size_t analysis_queue_length();
+
+/** Returns the number of queued analyses for each client with any (see #AnalysisInput::client). */
+std::map<std::string,size_t> analysis_queue_lengths_by_client();
+
+
+/** The analysis queue has a lane for cheap analyses, and one for expensive analyses, so a quick
+ two-spectrum analysis isnt stuck behind a long search or portal analysis.  See #LaneOptions.
+ */
+enum class AnalysisLane
+{
+  Fast,
+  Slow
+};//enum class AnalysisLane
+
+const char *to_str( const AnalysisLane lane );
+
+/** Returns the expected relative cost of analyzing the input: the number of channels in all its
+ measurements, in units of 1024 channels, plus an allowance for portal analyses setup.  A
+ foreground and background of 1024 channels each is 2; a search file with thousands of samples is
+ thousands.
+ */
+double expected_cost( const AnalysisInput &input );
+
+struct LaneOptions
+{
+  /** Inputs with an #expected_cost up to this go in the fast lane; others go in the slow lane.
+   The default covers a foreground and background of up to 8192 channels each.
+   */
+  double fast_lane_max_cost = 16.0;
+  
+  /** After this many fast lane inputs in a row, a waiting slow lane input is taken next. */
+  size_t fast_lane_burst = 8;
+  
+  /** Within a lane, each clients inputs are taken cheapest first; an input that has had this many
+   cheaper inputs from the same client put ahead of it isnt passed over again.
+   */
+  size_t max_times_passed = 16;
+  
+  /** The most slow lane inputs that may be dispatched (see #QueueHooks::dispatch) and still
+   running at once; e.g., one less than the number of analyses the application can run at once,
+   to keep capacity for the fast lane.  Zero for no limit.
+   */
+  size_t slow_lane_max_in_flight = 0;
+};//struct LaneOptions
+
+void set_lane_options( const LaneOptions &options );
+
+/** Returns the number of queued, dispatched, and finished analyses, and their p50 and p99 latency
+ (from being posted to the result being ready) and queue wait, for each lane, as JSON.
+ */
+EngineJson::Object lane_status_json();
+
+/** Returns true if the inputs result is no longer wanted; i.e., its #AnalysisInput::deadline has
+ passed, or its #AnalysisInput::cancelled flag is set.
+ */
+bool is_abandoned( const AnalysisInput &input );
+
+/** Returns the number of analyses skipped, or stopped partway through, because they were abandoned,
+ and the number of seconds spent analyzing inputs that were abandoned by the time their result was
+ ready, as JSON.
+ */
+EngineJson::Object abandoned_status_json();
+
+/** Gives the result to the inputs callback; if the input has a WApplication ID, the callback is
+ posted to that session (see #QueueHooks::post_to_session), otherwise it is called from the
+ current thread.
+ */
+void post_analysis_result( const AnalysisInput &input, const AnalysisOutput &result );
+
+/** Gives the progress to the inputs #AnalysisInput::progress callback, the same way as
+ #post_analysis_result; does nothing if the input has no progress callback.
+ */
+void post_analysis_progress( const AnalysisInput &input, const AnalysisProgress &progress );
 }//namespace Analysis
 
 #endif //FullSpectrum_Analysis_h
@@ -0,0 +1,123 @@
+#ifndef AnalysisBatch_h
+#define AnalysisBatch_h
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <vector>
+#include <cstddef>
+#include <functional>
+
+#include "FullSpectrumId/Analysis.h"
+#include "FullSpectrumId/EngineJson.h"
+
+namespace AnalysisFromFiles
+{
+  struct SampleInput;
+}
+
+/** Fans a group of related analyses (e.g., the candidate DRFs of an ensemble, see
+ AnalysisEnsemble.h, or every sample of a multi-record file) out to the analysis queue, and gives
+ back all their results once the last one finishes.
+
+ Each analysis is posted to the normal analysis queue, so with the cluster (see AnalysisCluster.h)
+ they are spread across workers, and in the broker with zygote workers (see
+ #AnalysisBroker::run_concurrently) up to its concurrency limit run at once.  Otherwise there is
+ only the one, in-process, GADRAS instance, and the analyses run one after another; the group then
+ only saves the caller from submitting them one at a time.  So a large group doesnt starve other
+ traffic, at most
+ #Options::max_in_flight analyses from all groups are in the analysis queue at once; the others
+ wait here until a slot frees up.  Waiting analyses are kept per client (see
+ #Analysis::AnalysisInput::client), and the clients take turns at free slots, so one client's large
+ group doesnt make other clients' groups wait for all of it.
+ */
+namespace AnalysisBatch
+{
+  struct Options
+  {
+    /** The maximum number of analyses, over all groups, in the analysis queue at once. */
+    size_t max_in_flight = 4;
+
+    /** The maximum number of samples #analyze_samples will analyze from a single file. */
+    size_t max_samples = 256;
+  };//struct Options
+
+  void set_options( const Options &options );
+
+  Options options();
+
+  struct Result
+  {
+    Analysis::AnalysisOutput output;
+
+    /** Seconds waiting for an analysis slot to be available. */
+    double wait_seconds = 0.0;
+
+    /** Seconds from being posted to the analysis queue, until the result was received. */
+    double wall_seconds = 0.0;
+  };//struct Result
+
+  /** Analyzes each of the inputs, and calls done with the results, in the same order as the inputs.
+
+   The inputs callbacks and WApplication IDs are ignored; done is called from the thread the last
+   result is received on, or from this thread if all the inputs were looked up from the result
+   store, or couldnt be queued (these count as failed).  Returns immediately.
+   */
+  void post( const std::vector<Analysis::AnalysisInput> &inputs,
+             std::function<void( std::vector<Result> results )> done );
+
+  /** The result of analyzing one sample of a file. */
+  struct SampleResult
+  {
+    /** The sample number of the foreground in the original file. */
+    int sample_number = 0;
+
+    Analysis::AnalysisOutput output;
+
+    double wall_seconds = 0.0;
+  };//struct SampleResult
+
+  /** Analyzes each of the per-sample inputs (see #AnalysisFromFiles::create_sample_inputs) using
+   #post, and waits for the results.
+
+   @param base The DRF, analysis type, trace ID, etc, to use for each sample; its input spectrum
+          file and callback are ignored.
+
+   Samples that couldnt be prepared for analysis have their error message in the result.  Throws
+   exception if there are more than #Options::max_samples samples.
+   */
+  std::vector<SampleResult> analyze_samples( const Analysis::AnalysisInput &base,
+                                             const std::vector<AnalysisFromFiles::SampleInput> &samples );
+
+  /** Returns the results as a JSON object with a "samples" array, each entry of which is the
+   #Analysis::AnalysisOutput::toJson of that sample, with "sample" and "seconds" added.
+   */
+  EngineJson::Object to_json( const std::vector<SampleResult> &results );
+
+  /** Returns the number of groups running, and analyses waiting and in flight, as JSON. */
+  EngineJson::Object status_json();
+}//namespace AnalysisBatch
+
+#endif //AnalysisBatch_h
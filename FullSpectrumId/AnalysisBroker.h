@@ -0,0 +1,130 @@
+#ifndef AnalysisBroker_h
+#define AnalysisBroker_h
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <string>
+#include <cstddef>
+#include <functional>
+
+#include "FullSpectrumId/Analysis.h"
+#include "FullSpectrumId/EngineJson.h"
+
+
+/** A host-wide analysis broker, for when the web-server runs each session in its own process (Wt's
+ dedicated-process session management, as config/wt_4.5.0_config_web.xml uses).
+
+ Without the broker, every session process has its own analysis thread and GADRAS state, so each
+ initializes its DRFs from cold, and under load many processes call into GADRAS at once.  Instead,
+ a single `full-spec --mode=broker` process runs the analyses for the whole host: session processes
+ started with the "AnalysisBroker" option hand each analysis to it over a Unix-domain socket, and
+ get the result back.
+ - The broker puts the analyses from all sessions into its analysis queue, where they share the
+   analysis thread fairly (see #Analysis::AnalysisInput::client), and runs at most
+   #Options::max_concurrent at once, capping the CPU and memory GADRAS uses on the host.
+ - DRF state is shared between sessions: the brokers analysis thread keeps GADRAS initialized
+   between analyses with the same DRF, or, with "UseZygoteWorkers", analyses run in processes
+   forked from a warm GADRAS state (see AnalysisZygote.h).
+ - Spectra are passed in POSIX shared memory: the session process writes the serialized input (see
+   AnalysisSerialization.h) to a shared memory object, and sends only its name; the broker maps and
+   reads it, and then removes the object.
+ - When a session process disconnects, its analyses that havent started yet are skipped (see
+   #Analysis::AnalysisInput::cancelled).
+
+ Protocol: length-prefixed frames (see MessageChannel.h), whose first byte is the message type.
+ - Session -> broker: Hello (protocol version, process ID), Submit (job ID, client, client weight,
+   seconds until the deadline, and the shared memory objects name and size).
+ - Broker -> session: Result (job ID, success flag, then either the serialized output, or an error
+   message).
+
+ Only supported on POSIX systems.
+ */
+namespace AnalysisBroker
+{
+  struct Options
+  {
+    /** The Unix-domain socket the broker listens on, and session processes connect to; empty to
+     not use a broker.
+     */
+    std::string socket_path;
+
+    /** If this process is the broker, instead of a session process using it. */
+    bool is_broker = false;
+
+    /** The maximum number of analyses the broker runs at once.  Analyses only run concurrently
+     when zygote workers are used, since GADRAS runs one analysis at a time in a process.
+     */
+    size_t max_concurrent = 2;
+  };//struct Options
+
+
+  void set_options( const Options &options );
+
+  Options options();
+
+  /** Returns true if this is a session process that should send its analyses to a broker. */
+  bool is_client();
+
+  /** Runs this process as the broker, listening on #Options::socket_path, until #stop_broker is
+   called; the analysis thread must be running.
+
+   Returns the process exit code.
+   */
+  int run_broker();
+
+  /** Causes #run_broker to return; safe to call from a signal handler. */
+  void stop_broker();
+
+  /** In the broker, runs the analysis in a zygote worker on one of #Options::max_concurrent threads,
+   and calls done with the result, from that thread; blocks while all the threads are busy.
+
+   Returns false, without doing anything, if this process isnt the broker, or zygote workers arent
+   running, in which case the analysis should be run in-process.
+   */
+  bool run_concurrently( const Analysis::AnalysisInput &input,
+                         std::function<void(const Analysis::AnalysisOutput &)> done );
+
+  /** Waits for analyses started by #run_concurrently to finish, and stops its threads. */
+  void stop_run_threads();
+
+  /** In a session process, sends the analysis to the broker.
+
+   done is called exactly once, with the result, or an output with its error message set; from the
+   thread that reads results from the broker, or from this thread if the broker cant be reached.
+   */
+  void submit( const Analysis::AnalysisInput &input,
+               std::function<void(const Analysis::AnalysisOutput &)> done );
+
+  /** Closes the connection to the broker, failing the analyses still waiting on it. */
+  void disconnect();
+
+  /** Returns the number of connected sessions and analyses (in the broker), or of submitted and
+   completed analyses (in a session process), as JSON.
+   */
+  EngineJson::Object status_json();
+}//namespace AnalysisBroker
+
+#endif //AnalysisBroker_h
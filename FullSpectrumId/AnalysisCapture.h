@@ -0,0 +1,155 @@
+#ifndef AnalysisCapture_h
+#define AnalysisCapture_h
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <fstream>
+
+#include "FullSpectrumId/Analysis.h"
+
+namespace SpecUtils
+{
+class SpecFile;
+}
+
+
+/** Optionally records each analysis request submitted through the GUI or REST API into a compact
+ binary log, so the load can later be replayed (see tools/FullSpecReplay.cpp) when evaluating
+ changes to the analysis engine.
+
+ Capturing is enabled using the "AnalysisCaptureFile" app config option.
+
+ File format (all integers little-endian):
+ - Header: the 8 bytes "FSACAP01", followed by uint64 microseconds since the UNIX epoch that the
+   capture was started.
+ - Then one record per request: a uint64 number of bytes in the rest of the record, followed by
+   the submission time (uint64 microseconds since UNIX epoch), the #Submitter, the
+   #Analysis::AnalysisType, the DRF name, the input warnings, and the spectrum file; see
+   #serialize_request for details.
+
+ Gamma counts that are all non-negative integers (the usual case) are stored as variable length
+ integers, so most channels take a single byte.
+ */
+namespace AnalysisCapture
+{
+  /** Where an analysis request was submitted from. */
+  enum class Submitter : uint8_t
+  {
+    Gui = 0,
+    Rest = 1,
+    Other = 2
+  };//enum class Submitter
+
+
+  /** A request read back from a capture file. */
+  struct CapturedRequest
+  {
+    /** Microseconds since the UNIX epoch the request was submitted. */
+    uint64_t submit_time_us;
+
+    Submitter submitter;
+
+    Analysis::AnalysisType analysis_type;
+
+    std::string drf;
+
+    std::vector<std::string> input_warnings;
+
+    std::shared_ptr<SpecUtils::SpecFile> input;
+
+    /** Creates an AnalysisInput from this request; the callback and WApplication ID are not set. */
+    Analysis::AnalysisInput to_analysis_input( const size_t ana_number ) const;
+  };//struct CapturedRequest
+
+
+  /** Starts capturing requests to the given file, which will be appended to if it already exists.
+
+   Throws exception if the file can not be opened, or capturing has already been started.
+   */
+  void start_capture( const std::string &filename );
+
+  /** Stops capturing, waits for already-queued requests to be written, and closes the file; does
+   nothing if not capturing.
+   */
+  void stop_capture();
+
+  /** Returns if requests are currently being captured. */
+  bool is_capturing();
+
+  /** Serializes the request and queues it to be appended to the capture file by a background
+   thread, if capturing; otherwise does nothing.
+
+   Safe to call from any thread.  The writer thread is started on the first call, so no thread is
+   running between #start_capture and the first request.  If the writer falls too far behind,
+   requests are dropped (and counted) rather than blocking the caller.  Errors writing the file are
+   logged, and stop capturing, but do not throw.
+   */
+  void capture( const Analysis::AnalysisInput &input, const Submitter submitter );
+
+  /** Serializes the request into the record format used in the capture file (not including the
+   leading record length).
+   */
+  std::string serialize_request( const Analysis::AnalysisInput &input, const Submitter submitter,
+                                 const uint64_t submit_time_us );
+
+  /** Deserializes a record created by #serialize_request.
+
+   Throws exception on invalid input.
+   */
+  CapturedRequest deserialize_request( const std::string &record );
+
+
+  /** Reads requests sequentially from a capture file. */
+  class CaptureReader
+  {
+  public:
+    /** Opens the capture file and reads its header.
+
+     Throws exception if the file can not be opened, or isnt a capture file.
+     */
+    explicit CaptureReader( const std::string &filename );
+
+    /** Microseconds since the UNIX epoch the capture was started. */
+    uint64_t capture_start_us() const;
+
+    /** Reads the next request.
+
+     Returns false if at the end of the file; a truncated last record (e.g., the server was killed
+     while writing) is treated as the end of the file.  Throws exception on a corrupt record.
+     */
+    bool next( CapturedRequest &request );
+
+  protected:
+    std::ifstream m_input;
+    uint64_t m_capture_start_us;
+  };//class CaptureReader
+}//namespace AnalysisCapture
+
+#endif //AnalysisCapture_h
@@ -0,0 +1,148 @@
+#ifndef AnalysisCluster_h
+#define AnalysisCluster_h
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <string>
+#include <cstddef>
+#include <functional>
+
+#include "FullSpectrumId/Analysis.h"
+#include "FullSpectrumId/EngineJson.h"
+
+
+/** Distributes analyses from a server to `full-spec` worker processes on other machines.
+
+ A server started with the "ClusterListen" option runs a coordinator that listens on a TCP or
+ Unix-domain socket.  Workers (`full-spec --mode=worker --Coordinator=...`) connect to it, register
+ the DRFs they have, and then repeatedly pull a job, analyze it using their own analysis thread
+ (and so their own zygote workers, if enabled), and send back the result.
+
+ Protocol: length-prefixed frames (see MessageChannel.h), whose first byte is the message type;
+ analysis inputs and outputs use the AnalysisSerialization encoding, so spectra are sent compactly.
+ - Coordinator -> worker: Challenge (protocol version, random nonce), Job, Heartbeat.
+ - Worker -> coordinator: Hello (protocol version, proof of the shared secret, worker name, DRFs),
+   Pull, Result, Heartbeat.
+
+ Both sides send heartbeats, and drop the connection when they havent heard from the other side
+ for #Options::heartbeat_timeout_seconds; jobs on a worker that disconnects, goes silent, or runs a
+ job longer than its time limit (see #Options::job_timeout_base_seconds), are put back at the front
+ of the queue, up to #Options::max_attempts times.  Workers reconnect until stopped.
+
+ Placement is DRF-aware: jobs only go to workers that have the DRF, and preferentially to a worker
+ whose last job used the same DRF, so it does not need to re-initialize GADRAS.
+
+ A jobs deadline (#Analysis::AnalysisInput::deadline) is sent to the worker as the time left when
+ the job is dispatched, and the worker stops the analysis once it passes; jobs whose deadline has
+ passed, or whose requester has gone away, while still queued are failed rather than sent.
+ Cancellation of a job already sent to a worker is not propagated to it.
+
+ If #Options::shared_secret is set, a worker must answer the coordinators challenge with the
+ SHA-256 of the nonce and secret before it is given any jobs, so other machines that can connect
+ can not take analyses, and the secret itself is not sent.  Nothing is encrypted, though, so
+ spectra and results can still be read by anyone on the network; only listen on interfaces
+ reachable by trusted machines.  Only supported on POSIX systems.
+ */
+namespace AnalysisCluster
+{
+  struct Options
+  {
+    /** The address the coordinator listens on: "unix:/path/to/socket", or "tcp:host:port" (or
+     just "host:port").  Empty to not run a coordinator.
+     */
+    std::string listen_address;
+
+    /** The coordinator address a worker connects to, in the same format as #listen_address. */
+    std::string coordinator_address;
+
+    /** The name a worker reports to the coordinator; defaults to "hostname:pid". */
+    std::string worker_name;
+
+    double heartbeat_interval_seconds = 2.0;
+
+    double heartbeat_timeout_seconds = 10.0;
+
+    /** The number of times a job is given to a worker, before failing it. */
+    size_t max_attempts = 3;
+
+    /** Queued jobs fail if no connected worker has their DRF for this long. */
+    double no_worker_timeout_seconds = 60.0;
+
+    /** The seconds a job may run on a worker, not counting the #job_timeout_per_sample_seconds
+     allowance, before the worker is dropped, as it is presumably stuck.  If the jobs deadline
+     (plus #heartbeat_timeout_seconds, for the worker to report it stopped) comes first, that is
+     used instead, and the job then fails rather than being tried again.
+     */
+    double job_timeout_base_seconds = 300.0;
+
+    /** Additional seconds a job may run, for each 1024 channels of each measurement in its input. */
+    double job_timeout_per_sample_seconds = 2.0;
+
+    /** If non-empty, workers must know this same secret to be given jobs. */
+    std::string shared_secret;
+  };//struct Options
+
+
+  void set_options( const Options &options );
+
+  Options options();
+
+  /** Starts the coordinator thread listening on #Options::listen_address.
+
+   Throws exception on error (e.g., address in use), or if already started.
+   */
+  void start_coordinator();
+
+  /** Stops the coordinator; queued and running jobs are failed.  Does nothing if not running. */
+  void stop_coordinator();
+
+  /** Returns if the coordinator is running, and a connected worker has the DRF. */
+  bool can_run( const std::string &drf );
+
+  /** Queues the analysis to run on a worker.
+
+   The callback is called exactly once, from the coordinator thread (or from this thread, if the
+   input cant be serialized), with the result, or an output with its error message set.
+   */
+  void submit( const Analysis::AnalysisInput &input,
+               std::function<void(const Analysis::AnalysisOutput &)> callback );
+
+  /** Returns the connected workers, and job counts, as JSON. */
+  EngineJson::Object status_json();
+
+  /** Runs this process as a worker for the coordinator at #Options::coordinator_address, until
+   #stop_worker is called; analyses are run using Analysis::post_analysis, so the analysis thread
+   must be running.
+
+   Returns the process exit code.
+   */
+  int run_worker();
+
+  /** Causes #run_worker to return, after any job in progress; safe to call from a signal handler. */
+  void stop_worker();
+}//namespace AnalysisCluster
+
+#endif //AnalysisCluster_h
@@ -0,0 +1,115 @@
+#ifndef AnalysisEnsemble_h
+#define AnalysisEnsemble_h
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+#include "FullSpectrumId/Analysis.h"
+
+namespace SpecUtils
+{
+  class SpecFile;
+}
+
+/** Analyzes a spectrum file against several candidate DRFs, for when the DRF can not be determined
+ from the file (#Analysis::get_drf_name returns empty), or only a generic DRF (e.g., a "NaI 3x3")
+ would be used, and a wrong guess would cost the user another round trip.
+
+ The candidates are analyzed as a batch (see AnalysisBatch.h), so with the cluster (see
+ AnalysisCluster.h) they are spread across workers, and they dont starve other traffic; at most
+ #Options::max_candidates DRFs are tried for an input.  The result with the best chi2 is given to
+ the callback, with the results for all the candidates, and how long each took, in
+ #Analysis::AnalysisOutput::ensemble.  Results whose chi2 is within #Options::chi2_tolerance of the
+ best are considered equally good fits, and the one whose isotopes agree with the most other
+ candidates is chosen.
+ */
+namespace AnalysisEnsemble
+{
+  struct Options
+  {
+    /** If true, an input whose DRF is "auto" is analyzed as an ensemble when the DRF can not be
+     determined, or the determined DRF is generic (see #is_generic_drf).
+     */
+    bool on_auto_failure = true;
+
+    /** The maximum number of DRFs tried for a single input. */
+    size_t max_candidates = 4;
+
+    /** Results whose chi2 is no more than this factor larger than the best chi2 are chosen between
+     by how many other candidates found the same isotopes.
+     */
+    float chi2_tolerance = 1.25f;
+  };//struct Options
+
+  void set_options( const Options &options );
+
+  Options options();
+
+  /** Returns if the DRF specification requests an ensemble; either "ensemble" to have the
+   candidates chosen using #candidate_drfs, or "ensemble:" followed by a comma separated list of
+   DRFs (e.g., "ensemble:NaI 2x2,NaI 3x3").  Case insensitive.
+   */
+  bool is_ensemble_request( const std::string &drf );
+
+  /** Returns if the DRF name looks to be for a generic detector, rather than a specific model; i.e.,
+   contains "generic", or a size like "3x3" or "1.5x1.5".
+   */
+  bool is_generic_drf( const std::string &drf );
+
+  /** Returns if an input with a DRF of "auto", where #Analysis::get_drf_name returned the given
+   guess, should be analyzed as an ensemble, according to #Options::on_auto_failure.
+   */
+  bool should_use_ensemble( const std::string &auto_drf );
+
+  /** Returns the DRFs to analyze the spectrum file with, most likely first, no more than
+   #Options::max_candidates of them.
+
+   @param drf Either "auto" or "ensemble" to choose the candidates from #Analysis::available_drfs
+          by detector material (from the file, or number of channels), how many words of the DRF
+          name are in the instrument model, manufacturer, and detector description, and similarity
+          to the DRF #Analysis::get_drf_name would use; or an explicit list (see
+          #is_ensemble_request), which is checked against the available DRFs.
+
+   Throws exception with a user-appropriate message if a listed DRF is not available, or there
+   are no candidates.
+   */
+  std::vector<std::string> candidate_drfs( const std::shared_ptr<SpecUtils::SpecFile> &spec,
+                                           const std::string &drf );
+
+  /** Analyzes the input with each of the DRFs (the inputs #Analysis::AnalysisInput::drf_folder is
+   ignored), and gives the chosen result to the inputs callback, the same way
+   #Analysis::post_analysis would.
+
+   Returns immediately; candidate analyses that couldnt be queued count as failed.
+   */
+  void post_analysis( const Analysis::AnalysisInput &input, const std::vector<std::string> &drfs );
+}//namespace AnalysisEnsemble
+
+#endif //AnalysisEnsemble_h
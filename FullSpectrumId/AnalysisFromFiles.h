@@ -29,6 +29,7 @@
 
 #include <set>
 #include <tuple>
+#include <memory>
 #include <vector>
 #include <string>
 
@@ -91,6 +92,34 @@ std::shared_ptr<SpecUtils::SpecFile> create_input( const std::tuple<SpecClassTyp
                                                    boost::optional<std::tuple<SpecClassType,std::string,std::string>> input2 = boost::none );
 
 
+/** A foreground sample of a file, paired with a background, ready to feed to Analysis. */
+struct SampleInput
+{
+  /** The sample number of the foreground in the spectrum file. */
+  int sample_number = 0;
+  
+  /** The foreground and background; null if there was an error. */
+  std::shared_ptr<SpecUtils::SpecFile> input;
+  
+  /** Why the sample couldnt be prepared for analysis, suitable for displaying to the user. */
+  std::string error;
+};//struct SampleInput
+
+/** Returns an input for each foreground sample of a multi-record file (e.g., a handheld file with
+ dozens of measurements), instead of requiring the file to have a single foreground like
+ #create_input does.
+
+ If a second file is given, its (single) background is paired with each foreground; otherwise each
+ foreground is paired with the closest preceding background sample of the same file (or the first
+ one, if there are none before it).  Samples not marked as background are taken as foreground.
+
+ Throws exception on error (e.g., no foreground or background), with the message being appropriate
+ for displaying to the user; errors for individual samples are put in #SampleInput::error.
+ */
+std::vector<SampleInput> create_sample_inputs( const std::tuple<SpecClassType,std::string,std::string> &input1,
+                                               boost::optional<std::tuple<SpecClassType,std::string,std::string>> input2 = boost::none );
+
+
 bool maybe_foreground_from_filename( const std::string &name );
 bool maybe_background_from_filename( const std::string &name );
 
@@ -104,6 +104,9 @@ private:
   void anaResultCallback( const Analysis::AnalysisInput &input,
                           const Analysis::AnalysisOutput &output );
   
+  /** Shows how far along the current analysis is, and what it has found so far. */
+  void anaProgressCallback( const Analysis::AnalysisProgress &progress );
+  
   Wt::WLabel *m_foreUploadLabel;
   Wt::WFileUpload *m_foregroundUpload;
   SampleSelect *m_foreSelectForeSample;
@@ -0,0 +1,144 @@
+#ifndef AnalysisSerialization_h
+#define AnalysisSerialization_h
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "FullSpectrumId/Analysis.h"
+
+namespace SpecUtils
+{
+class SpecFile;
+}
+
+
+/** A compact binary encoding of spectrum files, analysis inputs, and analysis outputs, used where
+ they need to be written to disk or sent to another process (analysis capture files, analysis
+ worker processes, etc).
+
+ All integers are little-endian.  Gamma counts that are all non-negative integers (the usual case)
+ are stored as variable length integers, so most channels take a single byte, and energy
+ calibrations shared between measurements are only stored once.
+
+ The encoding is not meant to be stable between versions of this code, except as used by the
+ analysis capture file format (see AnalysisCapture.h).
+ */
+namespace AnalysisSerialization
+{
+  /** Appends values to a buffer. */
+  struct Writer
+  {
+    std::string &buffer;
+
+    explicit Writer( std::string &buf );
+
+    void u8( const uint8_t val );
+    void u32( const uint32_t val );
+    void u64( const uint64_t val );
+    void i32( const int32_t val );
+    void i64( const int64_t val );
+    void f32( const float val );
+    void f64( const double val );
+    void varint( uint64_t val );
+    void str( const std::string &val );
+    void floats( const std::vector<float> &vals );
+    void strs( const std::vector<std::string> &vals );
+  };//struct Writer
+
+
+  /** Reads values written by #Writer; throws exception on reading past the end of the buffer. */
+  struct Reader
+  {
+    const std::string &buffer;
+    size_t pos;
+
+    explicit Reader( const std::string &buf );
+
+    /** Throws exception if there are fewer than nbytes left to read. */
+    void need( const uint64_t nbytes ) const;
+
+    /** Throws exception if not all of the buffer has been read. */
+    void check_at_end() const;
+
+    uint8_t u8();
+    uint32_t u32();
+    uint64_t u64();
+    int32_t i32();
+    int64_t i64();
+    float f32();
+    double f64();
+    uint64_t varint();
+    std::string str();
+    std::vector<float> floats();
+    std::vector<std::string> strs();
+  };//struct Reader
+
+
+  void write_spec( Writer &out, const SpecUtils::SpecFile &spec );
+
+  std::shared_ptr<SpecUtils::SpecFile> read_spec( Reader &in );
+
+  /** Writes how long until the deadline (see #Analysis::AnalysisInput::deadline), rather than the
+   time point, as the reader may have a different steady clock; zero if it has passed.
+   */
+  void write_deadline( Writer &out, const std::chrono::steady_clock::time_point &deadline );
+
+  /** Reads a deadline written by #write_deadline, as that long after now; the clocks epoch if there
+   was no deadline.
+   */
+  std::chrono::steady_clock::time_point read_deadline( Reader &in );
+
+  /** Writes the analysis number, type, DRF, input warnings, trace ID, time left until the deadline,
+   and spectrum file of the input; the WApplication ID, callback, and cancellation flag are not
+   written.  The reader gets a deadline that long after it reads the input.
+   */
+  void write_input( Writer &out, const Analysis::AnalysisInput &input );
+
+  Analysis::AnalysisInput read_input( Reader &in );
+
+  /** Writes the analysis output.
+
+   @param input_spec If the output spectrum file is this same object, only a flag is written,
+          instead of the whole file.  May be nullptr.
+   */
+  void write_output( Writer &out, const Analysis::AnalysisOutput &output,
+                     const std::shared_ptr<const SpecUtils::SpecFile> &input_spec );
+
+  /** Reads an output written by #write_output.
+
+   @param input_spec The spectrum file to use for the output, if #write_output was given the
+          output spectrum file as its input_spec.
+   */
+  Analysis::AnalysisOutput read_output( Reader &in,
+                                        const std::shared_ptr<SpecUtils::SpecFile> &input_spec );
+}//namespace AnalysisSerialization
+
+#endif //AnalysisSerialization_h
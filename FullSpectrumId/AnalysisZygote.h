@@ -0,0 +1,141 @@
+#ifndef AnalysisZygote_h
+#define AnalysisZygote_h
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <string>
+#include <cstddef>
+
+#include "FullSpectrumId/Analysis.h"
+#include "FullSpectrumId/EngineJson.h"
+
+namespace SpecUtils
+{
+class SpecFile;
+}
+
+
+/** Runs analyses in forked worker processes that start from an already-initialized GADRAS state.
+
+ GADRAS has no API to save and restore its state, and DRF initialization is expensive, so instead
+ we use the operating system to snapshot it: a "zygote" process is kept for each recently used DRF
+ (and analysis type and number of channels); each zygote runs the first job it is given itself,
+ leaving GADRAS initialized, and then fork()s a copy-on-write child for every later job.  The child
+ runs the job from the warm state, sends back the result, and exits, so the zygote's state is never
+ modified.  This gives the same GADRAS state as the analysis thread would have had after running the
+ zygote's first job, since GADRAS is already re-used between jobs that way in-process.
+
+ Process structure:
+ - The server process sends jobs to a single "master" process, which is fork()ed from the server
+   when #start is called.  The app calls #start from the analysis queue's on_start hook, inside
+   Analysis::start_analysis_thread, before the web-server and any other threads are started (see
+   AppUtils::start_background_threads), so the master is single-threaded and holds no locks.
+ - The master starts, and stops, one zygote per key, keeping at most #Options::max_zygotes of them
+   and stopping zygotes idle for longer than #Options::idle_timeout_seconds.
+ - Each zygote forks one child per job.
+
+ If a job's child crashes, only that job fails (with an error in #Analysis::AnalysisOutput); if a
+ zygote crashes (e.g., while running its first job), its jobs fail, and a new zygote is started
+ for the next job with that key.
+
+ Each job also has a watchdog timeout, based on the size of its input (see #timeout_seconds): the
+ zygote kills a job's child that runs past it, and the master kills a zygote that has not reported
+ on a job a few seconds after its deadline (i.e., one stuck in its own first job), so a GADRAS
+ infinite loop fails only the jobs involved, instead of wedging the analysis queue.  A job's
+ deadline counts from when the zygote starts it, not from when it was queued, so jobs waiting behind
+ a cold zygote's first job arent timed out for the wait.
+
+ Only supported on POSIX systems.  Tracing and performance counter events that happen inside the
+ worker processes are not reported back to the server.
+ */
+namespace AnalysisZygote
+{
+  struct Options
+  {
+    /** Whether #Analysis::start_analysis_thread should start the zygote master. */
+    bool enabled = false;
+
+    /** The maximum number of zygotes kept running; when a new one is needed, the least recently
+     used idle zygote is stopped.
+     */
+    size_t max_zygotes = 4;
+
+    /** Zygotes that havent been used for this long are stopped. */
+    double idle_timeout_seconds = 1800.0;
+
+    /** The watchdog timeout for each analysis is this, plus #timeout_per_sample_seconds times the
+     size of the input; analyses that take longer are killed, and return an error.
+     */
+    double timeout_base_seconds = 60.0;
+
+    /** Additional watchdog time allowed for each 1024 channels of each measurement in the input. */
+    double timeout_per_sample_seconds = 0.5;
+  };//struct Options
+
+
+  /** Sets the options; must be called before #start. */
+  void set_options( const Options &options );
+
+  Options options();
+
+  /** The function that performs the analysis, in the worker processes. */
+  typedef Analysis::AnalysisOutput (*AnalyzeFcn)( const Analysis::AnalysisInput &input );
+
+  /** Forks the master process.
+
+   The master is forked from the calling process, so this should be called before starting
+   threads that may hold locks the workers need.
+
+   Throws exception if already started, or on error.
+   */
+  void start( AnalyzeFcn analyze );
+
+  /** Stops the master process, and with it, all zygotes; does nothing if not running. */
+  void stop();
+
+  /** Returns if the master process is running. */
+  bool is_running();
+
+  /** Returns the watchdog timeout for analyzing the spectrum file; see #Options. */
+  double timeout_seconds( const SpecUtils::SpecFile &spec );
+
+  /** Runs the analysis in a worker process, and returns the result.
+
+   Blocks until the analysis is finished.  May be called from multiple threads at once.  If the
+   analysis crashed, or ran longer than #timeout_seconds, the returned output will have its error
+   message set.
+
+   Throws exception if the master process isnt running, or exits while the job is running.
+   */
+  Analysis::AnalysisOutput run( const Analysis::AnalysisInput &input );
+
+  /** Returns the number of zygotes running, started, crashed, restarted, and the number of jobs
+   completed, failed, crashed, and timed out, as JSON.
+   */
+  EngineJson::Object status_json();
+}//namespace AnalysisZygote
+
+#endif //AnalysisZygote_h
@@ -40,7 +40,13 @@ namespace AppUtils
 /** An enum to help specify how the invocation of the application is supposed to be used. */
 enum class AppUseMode
 {
-  Server, CommandLine
+  Server, CommandLine,
+  
+  /** Analyzes spectra for a server running the analysis cluster coordinator; see AnalysisCluster.h */
+  Worker,
+  
+  /** Analyzes spectra for the web-server processes on this host; see AnalysisBroker.h */
+  Broker
 };
 
 /** Configures application based on command line arguments, and returns whether is being used in command-line mode, or
@@ -51,6 +57,19 @@ enum class AppUseMode
 std::tuple<AppUseMode,std::vector<std::string>> init_app_config( const int argc, char **argv );
 
 
+/** Starts the background threads configured by #init_app_config:
+ - writing log messages from a background thread (see EngineLog::start_async), unless in
+   command-line mode, or the LogQueueSize option is 0;
+ - the session log and upload archive writer (see SessionArchive::start), if a data directory
+   was given;
+ - on POSIX, the thread that writes the request trace on SIGUSR1, if tracing is enabled.
+
+ Must be called after Analysis::start_analysis_thread, so the zygote master process has already
+ been forked, while the process was still single-threaded.
+ */
+void start_background_threads();
+
+
 /** Starts the web-server.
  
  Note: not for use with isapi or fcgi connectors.
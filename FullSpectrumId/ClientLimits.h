@@ -0,0 +1,126 @@
+#ifndef ClientLimits_h
+#define ClientLimits_h
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <map>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <cstddef>
+
+#include "FullSpectrumId/EngineJson.h"
+
+/** Per-client accounting for the REST API, so one client looping on requests cant fill the analysis
+ queue and lock everyone else out.
+
+ Clients are identified by their API key (see #Options::api_keys), or else by their address.  Each
+ client has:
+ - a token bucket: each request takes a token, and tokens refill at #Options::rate_per_second, up
+   to #Options::burst; requests when the bucket is empty are rejected.
+ - a limit of #Options::max_pending requests being analyzed (queued or running) at once.
+ - a weight, that sets its share of analysis time when several clients have analyses queued (see
+   #Analysis::AnalysisInput::client).
+ The requests, rejections, pending analyses, and latency of each client are kept for the metrics.
+ */
+namespace ClientLimits
+{
+  struct Options
+  {
+    /** The request header the API key is read from. */
+    std::string api_key_header = "X-API-Key";
+
+    /** The accepted API keys, and the weight of each.  Since anyone can send any key, clients with
+     a key not listed here are identified by their address, and have a weight of 1.
+     */
+    std::map<std::string,double> api_keys;
+
+    /** The rate requests are allowed from each client; zero for no limit. */
+    double rate_per_second = 0.0;
+
+    /** The number of requests a client can make at once, after being idle. */
+    double burst = 10.0;
+
+    /** The maximum number of requests from a client being analyzed at once; zero for no limit. */
+    size_t max_pending = 10;
+  };//struct Options
+
+  void set_options( const Options &options );
+
+  Options options();
+
+  /** Parses a comma-separated list of API keys, each optionally followed by '=' and its weight
+   (e.g., "abc123=2,def456"); throws exception if a weight isnt a positive number.
+   */
+  std::map<std::string,double> parse_api_keys( const std::string &spec );
+
+  /** Returns the ID of the client; "key:" followed by the API key if it is one of
+   #Options::api_keys, otherwise "addr:" followed by the address.
+   */
+  std::string client_id( const std::string &api_key, const std::string &address );
+
+  /** An admitted request; it counts as pending for its client until destroyed, at which point its
+   latency is recorded.
+   */
+  class Ticket
+  {
+  public:
+    Ticket( const std::string &client, const double weight );
+    ~Ticket();
+
+    Ticket( const Ticket & ) = delete;
+    Ticket &operator=( const Ticket & ) = delete;
+
+    const std::string &client() const;
+    double weight() const;
+
+  protected:
+    const std::string m_client;
+    const double m_weight;
+    const std::chrono::steady_clock::time_point m_start;
+  };//class Ticket
+
+  enum class Rejection
+  {
+    None,
+    RateLimited,
+    TooManyPending
+  };//enum class Rejection
+
+  /** Admits a request from the client, returning its ticket; or if the client is out of tokens, or
+   has too many pending requests, returns nullptr and sets why, and the number of seconds the client
+   should wait before retrying.
+   */
+  std::unique_ptr<Ticket> admit( const std::string &client, Rejection &rejection,
+                                 double &retry_after_seconds );
+
+  /** Returns, for each client seen recently, its requests, rejections, pending and queued analyses,
+   and latency percentiles, as JSON.  API keys are abbreviated.
+   */
+  EngineJson::Object status_json();
+}//namespace ClientLimits
+
+#endif //ClientLimits_h
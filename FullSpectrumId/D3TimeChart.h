@@ -29,6 +29,7 @@
 
 #include <map>
 #include <memory>
+#include <string>
 #include <vector>
 #include <utility>
 
@@ -134,7 +135,19 @@ public:
   static std::vector<std::pair<int,int>> sampleNumberRangesWithOccupancyStatus(
                                                 const SpecUtils::OccupancyStatus status,
                                                 std::shared_ptr<const SpecUtils::SpecFile> spec );
-  
+
+  /** Creates the JSON (well, JS object) time history data sent to the client-side chart; see
+   comments in #setDataToClient for the format.
+
+   Default colors will be replaced with the default line colors.
+
+   @returns empty string if 'spec' is null or has no samples.
+   */
+  static std::string timeDataJson( std::shared_ptr<const SpecUtils::SpecFile> spec,
+                                   const Wt::WColor &gammaLineColor,
+                                   const Wt::WColor &neutronLineColor,
+                                   const Wt::WColor &occLineColor );
+
   /** Schedules (re)-rendering data + highlight regions. */
   void scheduleRenderAll();
   
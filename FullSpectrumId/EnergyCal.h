@@ -42,6 +42,7 @@
 
 namespace SpecUtils
 {
+  class SpecFile;
   enum class EnergyCalType : int;
   struct EnergyCalibration;
 }//namespace SpecUtils
@@ -97,6 +98,19 @@ double fit_energy_cal_frf( const std::vector<EnergyCal::RecalPeakInfo> &peakinfo
                            std::vector<float> &coefs,
                            std::vector<float> &coefs_uncert );
 
+/** Performs the same fit as #fit_energy_cal_poly (or #fit_energy_cal_frf, if 'is_frf' is true),
+ but always using the general least squares solution (a matrix inverse), rather than the fixed-size
+ solution those functions use when fitting for four or fewer coefficients.  Used to check the two
+ solutions agree (e.g., by full-spec-bench).
+ */
+double fit_energy_cal_general( const bool is_frf,
+                               const std::vector<EnergyCal::RecalPeakInfo> &peakinfos,
+                               const std::vector<bool> &fitfor,
+                               const size_t nchannels,
+                               const std::vector<std::pair<float,float>> &dev_pairs,
+                               std::vector<float> &coefs,
+                               std::vector<float> &coefs_uncert );
+
 /// \TODO: we could probably make a fit_energy_cal_lower_channel_energies that adjusts the offset
 ///        and gain equivalents for lower channel energy defined calibrations.
 
@@ -131,6 +145,46 @@ double fit_full_range_fraction_from_channel_energies( const size_t ncoeffs,
                                              std::vector<float> &coefs );
 
 
+/** Evaluates a polynomial or full range fraction energy calibration, including deviation pair
+ corrections, at a batch of (possibly fractional) channel numbers.
+
+ Gives the same answer as calling #SpecUtils::polynomial_energy or
+ #SpecUtils::fullrangefraction_energy for each channel, but evaluates the equation using simple
+ loops over contiguous arrays (that the compiler can vectorize), and rather than evaluating the
+ deviation pair spline for every channel, the correction is reduced to a cubic for each interval
+ between deviation pairs, that is then applied as the (sorted) channels are walked through.
+
+ @param type The calibration type; must be Polynomial, UnspecifiedUsingDefaultPolynomial, or
+        FullRangeFraction.
+ @param coefs The calibration coefficients.
+ @param nchannel The number of channels of the spectrum; only used for full range fraction.
+ @param dev_pairs The non-linear deviation pairs.
+ @param channels The channel numbers to evaluate at; should be increasing for best performance,
+        but does not need to be.
+ @param energies Will be resized to same size as 'channels', and filled with answers.
+
+ Throws exception if calibration type is not polynomial or full range fraction.
+ */
+void evaluate_channel_energies( const SpecUtils::EnergyCalType type,
+                                const std::vector<float> &coefs,
+                                const size_t nchannel,
+                                const std::vector<std::pair<float,float>> &dev_pairs,
+                                const std::vector<double> &channels,
+                                std::vector<float> &energies );
+
+/** Computes the lower channel energies (with an extra entry for the upper energy of the last
+ channel, so nchannel+1 entries) for a polynomial or full range fraction calibration; equivalent
+ to #SpecUtils::polynomial_binning or #SpecUtils::fullrangefraction_binning, but using
+ #evaluate_channel_energies.
+
+ Throws exception on invalid input, or if the resulting energies are not increasing.
+ */
+std::vector<float> batch_lower_channel_energies( const SpecUtils::EnergyCalType type,
+                                                const std::vector<float> &coefs,
+                                                const size_t nchannel,
+                                                const std::vector<std::pair<float,float>> &dev_pairs );
+
+
 /** Propogates the difference of energy calibration between 'orig_cal' and 'new_cal' to
  'other_cal', returning the answer.  E.g., if you map what channels coorispond to what other
  channels for orig_cal<==>other_cal, then the returned answer gives new_cal<==>answer.
@@ -160,6 +214,100 @@ propogate_energy_cal_change( const std::shared_ptr<const SpecUtils::EnergyCalibr
                              const std::shared_ptr<const SpecUtils::EnergyCalibration> &other_cal );
 
 
+
+/** Result of #locate_reference_peak. */
+struct ReferencePeakScreen
+{
+  /** Counts between the search window energies (including fractions of the edge channels). */
+  double window_counts;
+  /** Counts between the wide region energies (including fractions of the edge channels). */
+  double wide_counts;
+  /** Continuum subtracted counts of the located peak; zero if no peak was located. */
+  double net_counts;
+  /** Energy centroid of the located peak, in keV; NaN if no peak was located. */
+  double centroid;
+  /** Net counts divided by their estimated uncertainty; zero if no peak was located. */
+  double significance;
+  /** If the search was done; false if the search window had too few channels, or was too narrow
+   for a peak 'fwhm' wide plus the continuum regions.  If false, #significance says nothing about
+   whether there is a peak.
+   */
+  bool searched;
+};//struct ReferencePeakScreen
+
+
+/** A quick, native, locator for a reference background peak (e.g., K40 at 1460.8 keV, or Th232
+ at 2614.5 keV), used to decide if it is worth calling into GADRAS to check the energy
+ calibration.
+
+ In a single pass over the channels it integrates the search window and a wider region (to
+ replace separate #SpecUtils::Measurement::gamma_integral calls), then estimates a linear
+ continuum from the outer tenth of channels on each side of the search window, finds the
+ continuum-subtracted region about 'fwhm' wide with the most counts, and computes its centroid
+ and significance.
+
+ @param channel_energies Lower channel energies; must have one more entry than 'channel_counts'.
+ @param channel_counts The spectrum to search.
+ @param window_lower Lower energy of the peak search window (ex., 1260 for K40).
+ @param window_upper Upper energy of the peak search window (ex., 1660 for K40).
+ @param wide_lower Lower energy of wide region to integrate (ex., 1000 keV).
+ @param wide_upper Upper energy of wide region to integrate (ex., 3000 keV).
+ @param fwhm Approximate full width at half maximum of the peak, in keV.
+
+ Throws exception if the number of channel energies and counts are inconsistent.
+ */
+ReferencePeakScreen locate_reference_peak( const std::vector<float> &channel_energies,
+                                           const std::vector<float> &channel_counts,
+                                           const double window_lower, const double window_upper,
+                                           const double wide_lower, const double wide_upper,
+                                           const double fwhm );
+
+
+/** Returns the calibration from a process-wide pool that is equal to 'cal' (same type,
+ coefficients, deviation pairs, and number of channels - or channel energies for lower channel
+ energy calibrations), adding 'cal' to the pool if there isnt one.
+
+ A number of places (ex., the `fill_inputs` lambda of search analysis, or checking if foreground
+ and background need rebinning for simple analysis) only skip rebinning if the calibration
+ pointers are the same, so passing calibrations through this function lets equal calibrations
+ from different files, or from separate sums, take those fast paths.
+
+ The pool only holds weak references, so calibrations are still freed when no longer used.
+ A calibration object already in the pool is found by its address; otherwise it is hashed, which
+ for lower channel energy calibrations means looking at every channel energy.
+
+ Returns nullptr if 'cal' is nullptr.
+ */
+std::shared_ptr<const SpecUtils::EnergyCalibration>
+intern_energy_cal( const std::shared_ptr<const SpecUtils::EnergyCalibration> &cal );
+
+/** Sets the energy calibration of each measurement in 'spec' to its interned equivalent (see
+ #intern_energy_cal); each distinct calibration object is only looked up once.
+
+ @returns the number of measurements whose calibration object was changed.
+ */
+size_t intern_energy_cals( SpecUtils::SpecFile &spec );
+
+/** Notes that a rebin was skipped because two spectra shared the same calibration object; the
+ count is reported by #energy_cal_intern_stats.
+ */
+void record_rebin_skipped();
+
+struct EnergyCalInternStats
+{
+  /** Number of calls to #intern_energy_cal with a non-null calibration. */
+  size_t num_lookups;
+  /** Number of lookups where an equal, but different, calibration object was already pooled. */
+  size_t num_merged;
+  /** Number of times a rebin was skipped due to shared calibration objects. */
+  size_t num_rebins_skipped;
+  /** Current number of entries (including expired) in the pool. */
+  size_t pool_size;
+};//struct EnergyCalInternStats
+
+/** Returns the statistics of the calibration pool since the process started. */
+EnergyCalInternStats energy_cal_intern_stats();
+
 }//namespace EnergyCal
 
 #endif //EnergyCal_h
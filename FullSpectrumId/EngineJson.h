@@ -0,0 +1,132 @@
+#ifndef EngineJson_h
+#define EngineJson_h
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <ostream>
+#include <utility>
+
+
+/** A small JSON document model for the analysis engine, so analysis results can be written as JSON
+ without depending on Wt::Json; see #AnalysisOutput::toJson.
+
+ Only what the engine needs is provided: building values, and writing them out.  Object members are
+ written in the order they were first set.
+ */
+namespace EngineJson
+{
+  class Value;
+  class Object;
+
+  typedef std::vector<Value> Array;
+
+
+  class Value
+  {
+  public:
+    enum class Type { Null, Bool, Integer, Number, String, Array, Object };
+
+    Value();
+    Value( const bool val );
+    Value( const int val );
+    Value( const long val );
+    Value( const long long val );
+    Value( const size_t val );
+    Value( const float val );
+    Value( const double val );
+    Value( const char *val );
+    Value( std::string val );
+    Value( Array val );
+    Value( Object val );
+
+    Value( const Value &rhs );
+    Value( Value &&rhs );
+    Value &operator=( const Value &rhs );
+    Value &operator=( Value &&rhs );
+    ~Value();
+
+    Type type() const;
+    bool is_null() const;
+
+    /** Returns true if the value is a number that was set from a float. */
+    bool is_float() const;
+
+    /** Accessors; throw exception if the value isnt of the requested type (integers may be read as
+     numbers).
+     */
+    bool as_bool() const;
+    long long as_integer() const;
+    double as_number() const;
+    const std::string &as_string() const;
+    const Array &as_array() const;
+    Array &as_array();
+    const Object &as_object() const;
+    Object &as_object();
+
+  protected:
+    Type m_type;
+    bool m_bool;
+    long long m_integer;
+    double m_number;
+    bool m_is_float = false;
+    std::string m_string;
+    std::unique_ptr<Array> m_array;
+    std::unique_ptr<Object> m_object;
+  };//class Value
+
+
+  class Object
+  {
+  public:
+    typedef std::vector<std::pair<std::string,Value>> Members;
+    typedef Members::const_iterator const_iterator;
+
+    /** Returns the member with the given name, adding a null member if there isnt one. */
+    Value &operator[]( const std::string &name );
+
+    /** Returns the member with the given name, or nullptr if there isnt one. */
+    const Value *find( const std::string &name ) const;
+
+    bool empty() const;
+    size_t size() const;
+    const_iterator begin() const;
+    const_iterator end() const;
+
+  protected:
+    Members m_members;
+  };//class Object
+
+
+  /** Writes the value as compact JSON; non-finite numbers are written as null. */
+  void serialize( const Value &value, std::ostream &out );
+
+  std::string serialize( const Value &value );
+}//namespace EngineJson
+
+#endif //EngineJson_h
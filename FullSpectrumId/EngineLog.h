@@ -0,0 +1,244 @@
+#ifndef EngineLog_h
+#define EngineLog_h
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <string>
+#include <memory>
+#include <sstream>
+#include <functional>
+#include <type_traits>
+
+#include "FullSpectrumId/EngineJson.h"
+
+/** Messages below this level (0 debug, 1 info, 2 warning, 3 error) are compiled out; set with the
+ ENGINE_LOG_MIN_LEVEL CMake variable.
+ */
+#ifndef ENGINE_LOG_MIN_LEVEL
+#define ENGINE_LOG_MIN_LEVEL 0
+#endif
+
+
+/** Logging for the analysis engine (the code in the "fullspec_engine" library), which doesnt
+ depend on Wt, so it can be used by the command-line tool without linking the web toolkit.
+
+ Messages are written like Wt::log:
+   EngineLog::log("error:app") << "Something went wrong: " << e.what();
+ and are given to the sink set by #set_sink when the statement ends; the web-server forwards them
+ to Wt::log.  By default, messages are written to stderr.
+
+ Messages below the run-time level (see #set_level), or below ENGINE_LOG_MIN_LEVEL, are not
+ formatted, but the values given with operator<< are still evaluated, as they are ordinary function
+ arguments.  Where computing them is costly, use the #ENGINE_LOG macro instead:
+   ENGINE_LOG("debug") << "Calibration: " << describe( cal );
+ which only evaluates the rest of the statement if the message will be logged, and with
+ ENGINE_LOG_MIN_LEVEL above the messages level, compiles to nothing.  Numbers and strings are only
+ copied into the message, and are formatted when it is written.  Once #start_async is called, messages are put in a fixed-size
+ ring buffer, and written to the sink by a background thread, so logging doesnt wait on the sink.
+ */
+namespace EngineLog
+{
+  enum class Level : int
+  {
+    Debug = 0,
+    Info = 1,
+    Warning = 2,
+    Error = 3
+  };//enum class Level
+  
+  /** Returns the level of a message type; e.g., "debug:app" is Debug, "warn" or "warning" is Warning,
+   "error", "fatal", and "secure" are Error, and anything else is Info.
+   */
+  constexpr Level level_of( const char *type )
+  {
+    auto starts_with = []( const char *str, const char *prefix ) -> bool {
+      for( ; *prefix; ++str, ++prefix )
+      {
+        if( *str != *prefix )
+          return false;
+      }
+      return true;
+    };
+    
+    if( !type )
+      return Level::Info;
+    if( starts_with( type, "debug" ) )
+      return Level::Debug;
+    if( starts_with( type, "warn" ) )
+      return Level::Warning;
+    if( starts_with( type, "error" ) || starts_with( type, "fatal" ) || starts_with( type, "secure" ) )
+      return Level::Error;
+    return Level::Info;
+  }//constexpr Level level_of( const char *type )
+  
+  /** Parses "debug", "info", "warning" (or "warn"), or "error"; throws std::exception otherwise. */
+  Level level_from_str( const std::string &level );
+  
+  
+  /** Receives each message; the type is as given to #log (e.g., "info", "error:app"). */
+  typedef std::function<void( const std::string &type, const std::string &message )> Sink;
+
+  /** Sets where messages go; a null sink discards all messages.  Should be called before any
+   threads are started.
+   */
+  void set_sink( Sink sink );
+  
+  /** Sets the lowest level of message that is logged; defaults to Info. */
+  void set_level( Level level );
+  
+  /** Returns if messages of the given level are currently logged. */
+  bool enabled( Level level );
+  
+  /** Starts writing messages from a background thread, with room for queue_size messages waiting
+   to be written.  If the queue is full, Debug to Warning messages are dropped (and counted), and
+   Error messages wait for room.
+   
+   Must be called after any processes have been forked (e.g., zygote workers, see
+   AnalysisZygote.h), as the child process wont have the writer thread.
+   */
+  void start_async( size_t queue_size = 8192 );
+  
+  /** Writes all queued messages, and stops the background thread; later messages are written from
+   the thread that logs them.  Must be called before the program exits, if #start_async was called.
+   */
+  void stop_async();
+  
+  /** For a child process just forked; messages are written from the logging thread, without
+   touching the (possibly locked) queue of the parent process.
+   */
+  void after_fork_in_child();
+  
+  /** Returns the number of messages logged, dropped because the queue was full, and waiting to be
+   written, as JSON.
+   */
+  EngineJson::Object status_json();
+  
+
+  /** Collects a message, and gives it to the sink when destroyed.
+   
+   Numbers, characters, and strings are copied into a compact binary record, and formatted when
+   the message is written; other types are formatted with operator<< when given.
+   */
+  class Entry
+  {
+  public:
+    /** A disabled entry; ignores everything given to it. */
+    Entry();
+    
+    Entry( Level level, const char *type );
+    Entry( Entry &&rhs );
+    ~Entry();
+
+    template<class T>
+    Entry &operator<<( const T &value )
+    {
+      if( !m_type )
+        return *this;
+      
+      if constexpr( std::is_same<T,bool>::value )
+        put_bool( value );
+      else if constexpr( std::is_same<T,char>::value || std::is_same<T,signed char>::value
+                         || std::is_same<T,unsigned char>::value )
+        put_char( static_cast<char>(value) );
+      else if constexpr( std::is_integral<T>::value && std::is_signed<T>::value )
+        put_int( static_cast<long long>(value) );
+      else if constexpr( std::is_integral<T>::value )
+        put_uint( static_cast<unsigned long long>(value) );
+      else if constexpr( std::is_floating_point<T>::value )
+        put_double( static_cast<double>(value) );
+      else if constexpr( std::is_convertible<const T &, const char *>::value )
+        put_text( static_cast<const char *>(value) );
+      else if constexpr( std::is_same<T,std::string>::value )
+        put_text( value.data(), value.size() );
+      else
+      {
+        std::ostringstream strm;
+        strm << value;
+        const std::string str = strm.str();
+        put_text( str.data(), str.size() );
+      }
+      
+      return *this;
+    }//operator<<
+
+  protected:
+    void put_bool( bool value );
+    void put_char( char value );
+    void put_int( long long value );
+    void put_uint( unsigned long long value );
+    void put_double( double value );
+    void put_text( const char *value );
+    void put_text( const char *value, size_t length );
+    
+    Level m_level;
+    
+    /** The message type; null if this entry is disabled. */
+    const char *m_type;
+    
+    /** The values given to this entry, each a tag byte followed by its value. */
+    std::string m_record;
+  };//class Entry
+
+
+  /** Returns if a message of the given type would be logged. */
+  inline bool is_logged( const char *type )
+  {
+    const Level level = level_of( type );
+    return (static_cast<int>(level) >= ENGINE_LOG_MIN_LEVEL) && enabled( level );
+  }
+  
+  /** Used by #ENGINE_LOG to make both branches of its conditional void; `&` binds looser than `<<`,
+   so the whole streamed message is on its right.
+   */
+  struct Voidify
+  {
+    void operator&( const Entry & ) const {}
+  };
+  
+  /** Starts a log message of the given type; a disabled entry if the level of the type isnt logged.
+   
+   The values given to the entry are evaluated either way; see #ENGINE_LOG to avoid that.
+   */
+  inline Entry log( const char *type )
+  {
+    if( !is_logged( type ) )
+      return Entry();
+    return Entry( level_of( type ), type );
+  }//Entry log( const char *type )
+}//namespace EngineLog
+
+
+/** Like EngineLog::log(type), but the values streamed to it are only evaluated if the message will
+ be logged; e.g.,
+   ENGINE_LOG("debug") << "Have " << expensive_summary();
+ The type should be a string literal, so its level is known at compile time.  Written as a single
+ expression (not an if/else), so it can be the body of an unbraced if without a dangling else.
+ */
+#define ENGINE_LOG( type ) \
+  !EngineLog::is_logged( type ) ? (void)0 \
+    : EngineLog::Voidify() & EngineLog::Entry( EngineLog::level_of( type ), type )
+
+#endif //EngineLog_h
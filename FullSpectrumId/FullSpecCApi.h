@@ -0,0 +1,275 @@
+#ifndef FullSpecCApi_h
+#define FullSpecCApi_h
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* A C interface to the analysis engine, for calling the analysis in-process from other programs
+ (e.g., acquisition software), instead of POSTing spectrum files to the REST API.
+
+ Usage:
+   fsid_engine *engine = fsid_engine_create( "libgadrasiid.so", "gadras_isotope_id_run_directory" );
+   if( !engine || (fsid_engine_select_drf( engine, "Detective-EX" ) != FSID_OK) )
+     printf( "Error: %s\n", fsid_last_error() );
+
+   fsid_spectrum spectra[2] = { ... };  // foreground and background, pointing at your arrays
+   const fsid_job_id job = fsid_submit( engine, FSID_SIMPLE, spectra, 2, NULL, NULL );
+
+   fsid_result *result = NULL;
+   if( fsid_wait( engine, job, -1, &result ) == FSID_OK )
+   {
+     printf( "%s\n", result->isotopes );
+     fsid_result_free( result );
+   }
+   fsid_engine_destroy( engine );
+
+ Spectra are copied when submitted, so your arrays may be reused or freed once #fsid_submit returns.
+ Jobs go straight onto the analysis queue, which the engines share; when several engines have jobs
+ queued, the queue takes one from each in turn.  Jobs are not necessarily analyzed, or their results
+ delivered, in the order submitted, even for one engine: small spectra go ahead of large ones (e.g.,
+ a foreground and background ahead of a search file), so match results to submissions by their job
+ ID (see #fsid_result::job, or use #fsid_wait), not by order.
+
+ All functions may be called from any thread, except as noted for #fsid_result_callback.  There is
+ a single GADRAS instance per process, so jobs from all engines are analyzed one at a time.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+  #if defined(FSID_C_API_EXPORTS)
+    #define FSID_API __declspec(dllexport)
+  #else
+    #define FSID_API __declspec(dllimport)
+  #endif
+#else
+  #define FSID_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fsid_engine fsid_engine;
+
+/** Identifies a submitted job; zero is never a valid job. */
+typedef uint64_t fsid_job_id;
+
+/** Return codes. */
+enum
+{
+  FSID_OK = 0,
+  /** The job hasnt finished yet. */
+  FSID_PENDING = 1,
+  FSID_INVALID_ARGUMENT = -1,
+  /** The job isnt known, or its result was already taken, or was given to a callback. */
+  FSID_NOT_FOUND = -2,
+  FSID_ERROR = -3
+};
+
+/** Analysis types; see #Analysis::AnalysisType. */
+enum
+{
+  FSID_SIMPLE = 0,
+  FSID_SEARCH = 1,
+  FSID_PORTAL = 2
+};
+
+/** Spectrum source types. */
+enum
+{
+  FSID_UNKNOWN = 0,
+  FSID_FOREGROUND = 1,
+  FSID_BACKGROUND = 2
+};
+
+/** Energy calibration types. */
+enum
+{
+  FSID_CAL_POLYNOMIAL = 0,
+  FSID_CAL_FULL_RANGE_FRACTION = 1,
+  /** Coefficients are the lower energy of each channel (num_channels, or num_channels + 1, values). */
+  FSID_CAL_LOWER_CHANNEL_ENERGY = 2
+};
+
+
+/** A gamma spectrum (and optionally neutron counts) from one detector, for one time period. */
+typedef struct fsid_spectrum
+{
+  /** Gamma counts for each channel; at least 32 channels. */
+  const float *counts;
+  uint32_t num_channels;
+
+  /** Live and real times, in seconds. */
+  float live_time;
+  float real_time;
+
+  /** Energy calibration; see FSID_CAL_POLYNOMIAL, etc. */
+  int32_t energy_cal_type;
+  const float *energy_cal_coefs;
+  uint32_t num_energy_cal_coefs;
+
+  /** Neutron counts; may be NULL if there is no neutron detector. */
+  const float *neutron_counts;
+  uint32_t num_neutron_counts;
+
+  /** FSID_FOREGROUND, FSID_BACKGROUND, or FSID_UNKNOWN. */
+  int32_t source_type;
+
+  /** Time-slice number, for search and portal data; spectra from different detectors for the same
+   time-slice have the same sample number.
+   */
+  int32_t sample_number;
+
+  /** Detector name, for search and portal data with multiple detectors; may be NULL.  Copied when
+   the job is submitted.
+   */
+  const char *detector_name;
+
+  /** Start time of the measurement, in microseconds since the UNIX epoch; zero if not known. */
+  int64_t start_time_us;
+} fsid_spectrum;
+
+
+/** The result of a job; all pointers are owned by the result. */
+typedef struct fsid_result
+{
+  fsid_job_id job;
+
+  /** FSID_OK if the analysis succeeded, otherwise FSID_ERROR, and error_message is set. */
+  int32_t status;
+  const char *error_message;
+
+  /** GADRAS initialization and analysis return codes; negative values are errors. */
+  int32_t gadras_initialization_code;
+  int32_t gadras_analysis_code;
+
+  const char *drf;
+
+  /** The isotopes identified, e.g., "Cs137(H)+Ba133(F)", or "None". */
+  const char *isotopes;
+
+  float chi_sqr;
+  float alarm_basis_duration;
+  float stuff_of_interest;
+
+  /** Per-isotope results; each array has num_isotopes entries. */
+  uint32_t num_isotopes;
+  const char * const *isotope_names;
+  const char * const *isotope_types;
+  const float *isotope_count_rates;
+  const float *isotope_confidences;
+  const char * const *isotope_confidence_strs;
+
+  uint32_t num_warnings;
+  const char * const *warnings;
+
+  /** The result as JSON, in the same format as the REST API returns. */
+  const char *json;
+
+  /** Internal; do not use. */
+  void *internal;
+} fsid_result;
+
+
+/** Called with each result, from the analysis thread; the result is only valid until the
+ callback returns.
+
+ The callback should not block for long, as no other job (from any engine) is analyzed until it
+ returns; for the same reason it must not wait for another job (e.g., with #fsid_wait), and
+ must not call #fsid_engine_destroy, which refuses the call.  If a stored result is found for the
+ job (when embedded in a program that sets Analysis::QueueHooks::lookup), the callback may instead
+ be called from #fsid_submit, before it returns.
+ */
+typedef void (*fsid_result_callback)( const fsid_result *result, void *user_data );
+
+
+/** Returns a description of the last error on the calling thread; never NULL. */
+FSID_API const char *fsid_last_error( void );
+
+/** Returns the GADRAS version number (10000*major + 100*minor + revision), or a negative value if
+ no engine has been created.
+ */
+FSID_API int32_t fsid_gadras_version( void );
+
+/** Creates an engine.
+
+ The first engine created loads the GADRAS library (ignored if statically linked; NULL for the
+ default library name) and sets the GADRAS run directory (NULL for the default,
+ "gadras_isotope_id_run_directory"); later engines must pass the same values, or NULL.
+
+ Returns NULL on error; see #fsid_last_error.
+ */
+FSID_API fsid_engine *fsid_engine_create( const char *gadras_lib_path, const char *gadras_run_dir );
+
+/** Destroys the engine, after all its jobs have finished: jobs not yet started, or being analyzed
+ (at the next point the analysis can stop), are finished with an error, and their callbacks
+ called from the analysis thread as usual.  Results not yet polled are freed.
+
+ Returns FSID_OK, or FSID_INVALID_ARGUMENT, without destroying the engine, if called from a
+ #fsid_result_callback (which would deadlock, since the callback runs on the analysis thread).
+ */
+FSID_API int32_t fsid_engine_destroy( fsid_engine *engine );
+
+/** Selects the DRF (e.g., "Detective-EX") used for jobs submitted after this call; if no DRF is
+ selected, one is guessed from each jobs spectra.
+
+ Returns FSID_OK, or FSID_INVALID_ARGUMENT if the DRF is not available.
+ */
+FSID_API int32_t fsid_engine_select_drf( fsid_engine *engine, const char *drf );
+
+/** Submits a job; the spectra are copied, and checked, before this returns.
+
+ If callback is non-NULL, the result is given to it, otherwise it is kept until retrieved with
+ #fsid_poll or #fsid_wait.
+
+ Returns the job ID, or zero on error (e.g., an invalid energy calibration, or no DRF could be
+ determined); see #fsid_last_error.
+ */
+FSID_API fsid_job_id fsid_submit( fsid_engine *engine, int32_t analysis_type,
+                                  const fsid_spectrum *spectra, uint32_t num_spectra,
+                                  fsid_result_callback callback, void *user_data );
+
+/** Checks if a job submitted without a callback has finished.
+
+ Returns FSID_OK and sets result (which must be freed with #fsid_result_free) if it has,
+ FSID_PENDING if it hasnt, or FSID_NOT_FOUND.
+ */
+FSID_API int32_t fsid_poll( fsid_engine *engine, fsid_job_id job, fsid_result **result );
+
+/** Like #fsid_poll, but waits up to timeout_ms milliseconds (forever if negative) for the job. */
+FSID_API int32_t fsid_wait( fsid_engine *engine, fsid_job_id job, int32_t timeout_ms,
+                            fsid_result **result );
+
+/** Returns the number of jobs submitted to the engine that havent finished. */
+FSID_API uint32_t fsid_queue_length( fsid_engine *engine );
+
+/** Frees a result from #fsid_poll or #fsid_wait; NULL is ignored. */
+FSID_API void fsid_result_free( fsid_result *result );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //FullSpecCApi_h
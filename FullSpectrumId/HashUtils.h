@@ -0,0 +1,49 @@
+#ifndef HashUtils_h
+#define HashUtils_h
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+
+/** Hash functions shared by the result store and the upload archive. */
+namespace HashUtils
+{
+  /** MurmurHash64A: fast, and well distributed, but not collision resistant; only use it where the
+   input isnt chosen by someone who could gain from a collision (e.g., keys of our own results, or
+   checksums of records we wrote).
+   */
+  uint64_t murmur64( const char *data, const size_t len, const uint64_t seed );
+  
+  /** Returns the SHA-256 digest of the data, as 64 lowercase hex characters; use where the input
+   may be untrusted, like a user upload.
+   */
+  std::string sha256_hex( const char *data, const size_t len );
+}//namespace HashUtils
+
+#endif //HashUtils_h
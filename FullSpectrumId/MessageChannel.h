@@ -0,0 +1,115 @@
+#ifndef MessageChannel_h
+#define MessageChannel_h
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <chrono>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+/** Length-prefixed message framing over sockets and pipes, shared by the analysis zygote workers
+ (see AnalysisZygote.h), the analysis cluster (see AnalysisCluster.h), and the analysis broker (see
+ AnalysisBroker.h).
+
+ Each frame is a little-endian uint64 length, followed by that many bytes of message.
+
+ Only available on POSIX systems.
+ */
+namespace MessageChannel
+{
+  /** The largest message accepted; larger lengths are treated as a corrupt stream. */
+  const uint64_t sm_max_message_size = 1024ull*1024ull*1024ull;
+
+  /** Blocking write of a whole frame; returns false on error. */
+  bool write_frame( const int fd, const std::string &msg, const bool is_socket );
+
+  /** Blocking read of a whole frame; returns false on error, EOF, or an invalid length. */
+  bool read_frame( const int fd, std::string &msg );
+
+  void set_non_blocking( const int fd );
+
+  /** Returns the poll(2) timeout, in milliseconds, to wake up by the deadline, but after at most
+   max_ms.
+   */
+  int poll_timeout_ms( const std::chrono::steady_clock::time_point &deadline, const int max_ms );
+
+  /** Splits an address like "unix:/tmp/fullspec.sock", "tcp:0.0.0.0:9000", or "localhost:9000"
+   into either a socket path, or a host and port.
+
+   Throws exception if invalid.
+   */
+  void parse_address( const std::string &address, bool &is_unix, std::string &path,
+                      std::string &host, std::string &port );
+
+  /** Opens a socket listening on the address; a Unix socket left over from a previous run is
+   removed first.  Throws exception on error.
+   */
+  int listen_on( const std::string &address );
+
+  /** Connects to the address; returns -1 on failure.  Throws exception if the address is invalid. */
+  int connect_to( const std::string &address );
+
+
+  /** A non-blocking, framed, connection, for processes that service several connections from a
+   single thread using poll(2).
+
+   Takes ownership of the file descriptor, and makes it non-blocking.
+   */
+  struct Channel
+  {
+    int fd;
+    std::string in;
+    size_t in_pos;
+    std::string out;
+    size_t out_pos;
+
+    explicit Channel( const int socket_fd );
+    ~Channel();
+
+    Channel( const Channel & ) = delete;
+    Channel &operator=( const Channel & ) = delete;
+
+    /** Returns if there is queued output that hasnt been written yet. */
+    bool wants_write() const;
+
+    void queue_frame( const std::string &msg );
+
+    /** Reads everything currently available; returns false on EOF or error. */
+    bool read_available();
+
+    /** Writes as much of the pending output as possible; returns false on error. */
+    bool write_available();
+
+    /** Removes the next complete frame from the input, if there is one.
+
+     Throws exception if the next frame is longer than #sm_max_message_size.
+     */
+    bool pop_frame( std::string &msg );
+  };//struct Channel
+}//namespace MessageChannel
+
+#endif //MessageChannel_h
@@ -0,0 +1,60 @@
+#ifndef Metrics_h
+#define Metrics_h
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <string>
+#include <functional>
+
+#include <Wt/Json/Value.h>
+#include <Wt/Json/Object.h>
+
+/** A simple registry of run-time metrics, served as JSON from "api/v1/admin/metrics" (see
+ #RestResources::MetricsResource) when the "EnableMetrics" app config option is set.
+
+ Components that want to expose metrics register a source using #add_source; each source is
+ called whenever the metrics are requested, and its value placed in the returned JSON object under
+ the name of the source.
+ */
+namespace Metrics
+{
+  /** Registers a metrics source; if a source with the same name already exists, it is replaced.
+
+   The function may be called from any thread, so must be thread-safe.
+   */
+  void add_source( const std::string &name, std::function<Wt::Json::Value()> source );
+
+  /** Removes a previously added metrics source; does nothing if no source with that name. */
+  void remove_source( const std::string &name );
+
+  /** Returns the current values of all metrics sources.
+
+   Exceptions thrown by a source are caught, and the error message placed in the output instead.
+   */
+  Wt::Json::Object to_json();
+}//namespace Metrics
+
+#endif //Metrics_h
@@ -0,0 +1,112 @@
+#ifndef PerfCounters_h
+#define PerfCounters_h
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+#include "FullSpectrumId/EngineJson.h"
+
+/** Optional hardware performance counters (cycles, instructions, cache misses, and page faults)
+ around calls into the GADRAS library, aggregated per DRF and call type, to help see things like
+ which DRFs thrash the cache inside GADRAS.
+
+ Counters are read using the Linux perf_event_open(2) interface, for the calling thread only.
+ If the counters are not available (not Linux, running in a VM without a PMU,
+ /proc/sys/kernel/perf_event_paranoid too restrictive, etc.), the unavailable counters are reported
+ as null, and call counts and wall time are still recorded.
+
+ Enabled using the "EnableGadrasPerfCounters" app config option; results are exposed through
+ #Metrics under "gadrasPerfCounters".
+ */
+namespace PerfCounters
+{
+  /** The GADRAS calls counters are recorded for. */
+  enum class CallType : int
+  {
+    InitDrf,
+    StaticIsotopeID,
+    StreamingSearch,
+    SearchIsotopeID,
+    PortalIsotopeIDCInterface,
+    NumCallTypes
+  };//enum class CallType
+
+  const char *to_str( const CallType type );
+
+  /** Enables or disables recording counters.  When enabling, checks which counters are available,
+   and logs the ones that are not.
+   */
+  void set_enabled( const bool enable );
+
+  /** Returns if recording counters is enabled. */
+  bool enabled();
+
+  /** Accumulates counters for the lifetime of this object; does nothing if not enabled.
+
+   The counters are opened the first time they are used on each thread, and then kept open for the
+   life of the thread, so each call only costs a couple of read(2)s per counter.
+   */
+  class CallScope
+  {
+  public:
+    CallScope( const CallType type, const std::string &drf );
+    ~CallScope();
+
+    CallScope( const CallScope & ) = delete;
+    CallScope &operator=( const CallScope & ) = delete;
+
+    /** The number of counters recorded: cycles, instructions, cache misses, and page faults. */
+    static const size_t sm_num_counters = 4;
+
+  protected:
+    /** A raw read of a counter; the times are used to scale the value if the kernel had to
+     multiplex the counters.
+     */
+    struct Reading
+    {
+      uint64_t value;
+      uint64_t time_enabled;
+      uint64_t time_running;
+    };//struct Reading
+
+    const CallType m_type;
+    std::string m_drf;
+    bool m_active;
+    uint64_t m_start_ns;
+    Reading m_start[sm_num_counters];
+  };//class CallScope
+
+  /** Returns the accumulated counters as JSON, with an entry for each DRF and call type. */
+  EngineJson::Object to_json();
+
+  /** Clears the accumulated counters. */
+  void reset();
+}//namespace PerfCounters
+
+#endif //PerfCounters_h
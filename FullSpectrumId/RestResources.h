@@ -27,6 +27,10 @@
 
 #include "FullSpectrumId_config.h"
 
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
 #include <vector>
 #include <string>
 
@@ -73,10 +77,75 @@ public:
   
   virtual void handleRequest( const Wt::Http::Request &request, Wt::Http::Response &response );
   
+  /** Called by Wt when the client closes the connection; flags the requests analysis as cancelled
+   (see #Analysis::AnalysisInput::cancelled), so it is skipped if it hasnt been run yet.
+   */
+  virtual void handleAbort( const Wt::Http::Request &request );
+  
 protected:
   const std::vector<std::string> m_drfs;
+  
+  /** The cancelled flag of each request currently being handled. */
+  std::mutex m_active_mutex;
+  std::map<const Wt::Http::Request *,std::shared_ptr<std::atomic<bool>>> m_active;
 };//class InfoResource
 
+
+/** Returns the request tracing events (see Tracing.h) as Chrome trace JSON.
+
+ Only registered (at "api/v1/admin/trace") when the REST API and tracing are enabled.  If the
+ "clear" URL argument is "1" or "true", the returned events are removed from the buffers.
+ 
+ Like the other admin endpoints, only answers requests from the loopback interface that were not
+ forwarded by a reverse proxy, or that have the admin token in their "X-Admin-Token" header; others
+ get a 403 response.
+ */
+class TraceResource : public Wt::WResource
+{
+public:
+  /** @param admin_token The token that allows requests from other machines; empty to not allow them. */
+  TraceResource( const std::string &admin_token );
+  
+  virtual void handleRequest( const Wt::Http::Request &request, Wt::Http::Response &response );
+  
+protected:
+  const std::string m_admin_token;
+};//class TraceResource
+
+
+/** Returns the run-time metrics registered with #Metrics (see Metrics.h), along with the current
+ analysis queue length, as JSON.
+
+ Only registered (at "api/v1/admin/metrics") when the REST API is enabled, and the "EnableMetrics"
+ app config option is set.  Access is restricted the same as for #TraceResource.
+ */
+class MetricsResource : public Wt::WResource
+{
+public:
+  MetricsResource( const std::string &admin_token );
+  
+  virtual void handleRequest( const Wt::Http::Request &request, Wt::Http::Response &response );
+  
+protected:
+  const std::string m_admin_token;
+};//class MetricsResource
+
+/** Returns the stored analysis results (see ResultStore.h) for an instrument serial number, as JSON.
+
+ Only registered (at "api/v1/results/history") when the REST API is enabled, and the
+ "ResultStoreDir" app config option is set.  URL arguments are "serial" (required), "start" and
+ "end" (optional ISO 8601 times the earliest measurement in the spectrum file must be between), and
+ "limit" (maximum number of results, default 100); results are returned most recent first, e.g.:
+   curl "127.0.0.1:8080/api/v1/results/history?serial=12345&start=2021-06-01T00:00:00"
+ */
+class ResultHistoryResource : public Wt::WResource
+{
+public:
+  ResultHistoryResource();
+  
+  virtual void handleRequest( const Wt::Http::Request &request, Wt::Http::Response &response );
+};//class ResultHistoryResource
+
 }//namespace RestResources
 
 #endif //RestResources_h
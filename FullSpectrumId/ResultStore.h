@@ -0,0 +1,123 @@
+#ifndef ResultStore_h
+#define ResultStore_h
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <string>
+#include <cstdint>
+
+#include "FullSpectrumId/Analysis.h"
+#include "FullSpectrumId/EngineJson.h"
+
+
+/** A persistent, on-disk store of analysis results, so re-submitting the same spectrum file (a
+ duplicate upload, a re-query after the server restarted, etc) returns the earlier result instead of
+ re-analyzing, and so past results can be looked up by instrument serial number.
+
+ Results are keyed by a 128 bit hash of the input spectrum file (see
+ #AnalysisSerialization::write_spec), the DRF, the analysis type, and the GADRAS version number.
+ Only successful analyses are stored.
+
+ The store is a directory with two files:
+ - "results.log": an append-only log of results.  An 8 byte header "FSRLOG01" is followed by a
+   uint64 log ID (which changes when the log is compacted), and then one record per result: a
+   uint64 number of bytes in the record body, a uint64 hash of the body (to detect torn writes), and
+   the body, which is the key, the time stored, the start time of the earliest measurement, the
+   instrument serial number, the DRF, the analysis type, and the #AnalysisSerialization encoded
+   output.  All integers are little-endian.
+ - "results.idx": an open-addressing hash table from key to log offset, memory-mapped so a lookup
+   is a probe or two into the table plus a single read from the log.  It is in native byte order,
+   and records the log ID and size it covers; if these dont match the log (e.g., the server was
+   killed mid-write), or the file is missing, the index is rebuilt by scanning the log, and any
+   partially written record at the end of the log is truncated away.
+
+ When the log grows past #Options::max_bytes, it is compacted: results that were later re-stored
+ under the same key are dropped, as are the oldest results, until it is down to three quarters of
+ the budget.  The new log is written by the storing thread without holding the stores lock, so
+ lookups and other stores arent held up; only swapping it in is done under the lock.
+
+ Only supported on POSIX systems.
+ */
+namespace ResultStore
+{
+  struct Options
+  {
+    /** The directory to keep the store in; created if it doesnt exist. */
+    std::string directory;
+
+    /** The size the log is compacted to stay under; zero for no limit. */
+    uint64_t max_bytes = uint64_t(1024)*1024*1024;
+  };//struct Options
+
+
+  /** Opens (or creates) the store.
+
+   @param engine_version The analysis engine version (e.g., #Analysis::gadras_version_number());
+          results stored by other versions are not returned.
+
+   Throws exception if the store can not be opened or created, or is already open.
+   */
+  void open( const Options &options, const int32_t engine_version );
+
+  /** Closes the store; does nothing if not open. */
+  void close();
+
+  /** Returns if the store is open. */
+  bool is_open();
+
+  /** Looks up an earlier result for the input.
+
+   Returns true, and sets output, if a result was found; the output will have its analysis number
+   set from the input, and its spectrum file set to the inputs, unless the analysis changed it.
+   Returns false if the store isnt open, or there is no result.  Safe to call from any thread;
+   does not throw.
+
+   Sets the inputs #Analysis::AnalysisInput::result_key, so #store can use it instead of
+   serializing the spectrum file again.
+   */
+  bool lookup( Analysis::AnalysisInput &input, Analysis::AnalysisOutput &output );
+
+  /** Stores the result of analyzing the input; does nothing if the store isnt open, or the analysis
+   failed.
+
+   Safe to call from any thread.  Errors are logged, but not thrown.
+   */
+  void store( const Analysis::AnalysisInput &input, const Analysis::AnalysisOutput &output );
+
+  /** Returns the stored results for an instrument serial number, whose earliest measurement started
+   in [start_us, end_us] (microseconds since the UNIX epoch), most recent first.
+
+   Each entry has the "measurementStartTime" and "analysisTime" (ISO 8601), the "drf", and the
+   "result" (see #Analysis::AnalysisOutput::toJson).
+   */
+  EngineJson::Array history( const std::string &serial, const int64_t start_us, const int64_t end_us,
+                             const size_t max_results );
+
+  /** Returns the number of results, lookup hits and misses, log size, etc, as JSON. */
+  EngineJson::Object status_json();
+}//namespace ResultStore
+
+#endif //ResultStore_h
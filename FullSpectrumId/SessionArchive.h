@@ -0,0 +1,110 @@
+#ifndef SessionArchive_h
+#define SessionArchive_h
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <string>
+#include <cstddef>
+
+#include "FullSpectrumId/EngineJson.h"
+
+/** Writes the per-session detail logs, and archives user-uploaded spectrum files, from a background
+ thread, so GUI sessions dont wait on the disk (see ENABLE_SESSION_DETAIL_LOGGING, and
+ AnalysisGui::UserActionLogEntry).
+
+ Appended log text is collected for up to #Options::batch_seconds, and then each file is opened,
+ written, and (depending on #Options::fsync) synced once for the whole batch.
+
+ Uploads are stored by content: the file is named from the SHA-256 of its contents and its size,
+ and is zstd compressed, so a background spectrum uploaded by many sessions is only stored once.
+ When an upload has been archived, an <UploadArchived> entry, with the archived file name
+ (relative to #Options::upload_dir), is appended to the sessions log.
+ */
+namespace SessionArchive
+{
+  enum class FsyncPolicy
+  {
+    /** Leave it to the operating system to write files out. */
+    None,
+    
+    /** Sync each log file once per batch, and each archived upload before it is renamed into place. */
+    Batch
+  };//enum class FsyncPolicy
+  
+  /** Parses "none" or "batch"; throws std::exception otherwise. */
+  FsyncPolicy fsync_policy_from_str( const std::string &policy );
+  
+  struct Options
+  {
+    /** Directory archived uploads are stored in. */
+    std::string upload_dir;
+    
+    /** The zstd compression level of archived uploads (1 to 19). */
+    int compression_level = 9;
+    
+    /** How long appended log text is collected before being written. */
+    double batch_seconds = 1.0;
+    
+    FsyncPolicy fsync = FsyncPolicy::Batch;
+    
+    /** The most log text waiting to be written; text appended past this is dropped (and counted). */
+    size_t max_queued_bytes = 64*1024*1024;
+    
+    /** The most uploads waiting to be archived; further uploads arent archived. */
+    size_t max_queued_uploads = 256;
+  };//struct Options
+  
+  /** Starts the background writer; throws exception if the upload directory cant be created, or if
+   already started.
+   */
+  void start( const Options &options );
+  
+  /** Writes everything queued, and stops the background writer. */
+  void stop();
+  
+  /** Queues the text to be appended to the file.  If the writer isnt running, the text is written
+   before returning.
+   */
+  void append( const std::string &path, const std::string &text );
+  
+  /** Queues an uploaded file to be archived, and then deleted; the caller must have taken ownership
+   of the file (e.g., WFileUpload::stealSpooledFile), and must not use it after calling this.
+   
+   The <UploadArchived> entry appended to log_path when done will contain log_context (e.g., the
+   session upload number, as XML elements), and the archive status.
+   
+   Returns false, and deletes the file, if the writer isnt running or too many uploads are queued.
+   */
+  bool archive_upload( const std::string &file, const std::string &log_path,
+                       const std::string &log_context );
+  
+  /** Returns the queued, written, and dropped log text and uploads, and the number of duplicate
+   uploads and bytes saved by only storing them once, as JSON.
+   */
+  EngineJson::Object status_json();
+}//namespace SessionArchive
+
+#endif //SessionArchive_h
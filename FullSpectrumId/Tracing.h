@@ -0,0 +1,161 @@
+#ifndef Tracing_h
+#define Tracing_h
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+
+/** Lightweight per-request tracing, to see where the time of an analysis request goes.
+
+ Events are recorded into a fixed-size ring buffer for each thread, so recording never allocates
+ or contends on a lock with other threads; when the buffer is full the oldest events are
+ overwritten.  When tracing is disabled (the default), creating a #Span is just a check of an
+ atomic flag.
+
+ Events are tagged with a request ID, which is propagated on the current thread using
+ #RequestScope, and across the analysis queue using #Analysis::AnalysisInput::trace_id.
+
+ The recorded events can be retrieved as Chrome trace JSON (view using chrome://tracing, or
+ https://ui.perfetto.dev), using the "api/v1/admin/trace" endpoint (when enabled), or on POSIX
+ systems by sending the process SIGUSR1 (see #install_dump_signal_handler).
+
+ Event names and categories must be string literals (or otherwise outlive the process), as only
+ the pointers are stored.
+ */
+namespace Tracing
+{
+  namespace detail
+  {
+    extern std::atomic<bool> sm_enabled;
+  }
+
+  /** Returns if tracing is currently enabled. */
+  inline bool enabled()
+  {
+    return detail::sm_enabled.load( std::memory_order_relaxed );
+  }
+
+  /** Enables or disables recording events.  Already recorded events are kept. */
+  void set_enabled( const bool enable );
+
+  /** Sets the number of events kept for each thread; only affects threads that havent yet recorded
+   an event.  Default is 65536.
+
+   When a thread exits, its buffer is trimmed to the events it holds and kept, but the events kept
+   from all exited threads are limited to this same number, with the oldest threads dropped first.
+   */
+  void set_events_per_thread( const size_t num_events );
+
+  /** Returns a new, unique, request ID, or zero if tracing is not enabled. */
+  uint64_t new_request_id();
+
+  /** Returns the request ID set for the current thread by #RequestScope, or zero if none. */
+  uint64_t current_request_id();
+
+  /** Sets the request ID for the current thread, for the lifetime of this object. */
+  class RequestScope
+  {
+  public:
+    explicit RequestScope( const uint64_t request_id );
+    ~RequestScope();
+
+    RequestScope( const RequestScope & ) = delete;
+    RequestScope &operator=( const RequestScope & ) = delete;
+
+  protected:
+    const uint64_t m_previous_id;
+  };//class RequestScope
+
+
+  /** Records a "complete" event covering the lifetime of this object, tagged with the current
+   request ID.
+   */
+  class Span
+  {
+  public:
+    Span( const char *name, const char *category )
+      : m_name( name ), m_category( category ), m_start_ns( enabled() ? now_ns() : 0 )
+    {
+    }
+
+    ~Span()
+    {
+      if( m_start_ns )
+        finish();
+    }
+
+    Span( const Span & ) = delete;
+    Span &operator=( const Span & ) = delete;
+
+    static uint64_t now_ns();
+
+  protected:
+    void finish();
+
+    const char * const m_name;
+    const char * const m_category;
+    const uint64_t m_start_ns;
+  };//class Span
+
+
+  /** Marks the start of an asynchronous event (e.g., waiting in a queue), which may end on a
+   different thread; #async_end must be called with the same name, category, and request ID.
+   Does nothing if request_id is zero.
+   */
+  void async_begin( const char *name, const char *category, const uint64_t request_id );
+
+  /** Marks the end of an event started with #async_begin. */
+  void async_end( const char *name, const char *category, const uint64_t request_id );
+
+  /** Sets the name the current thread will be shown with in the trace. */
+  void set_thread_name( const char *name );
+
+  /** Returns the recorded events as Chrome trace JSON.
+
+   @param clear If true, the recorded events are removed.
+   */
+  std::string chrome_trace_json( const bool clear );
+
+  /** Writes #chrome_trace_json to a file.
+
+   Throws exception on error.
+   */
+  void write_chrome_trace( const std::string &filename, const bool clear );
+
+#ifndef _WIN32
+  /** Installs a SIGUSR1 handler that causes the trace to be written to the given file; a
+   background thread checks for the signal a few times a second, so the file is not written
+   from within the signal handler.
+
+   Since this starts a thread, it should be called after any worker processes are fork()ed.
+   */
+  void install_dump_signal_handler( const std::string &filename );
+#endif
+}//namespace Tracing
+
+#endif //Tracing_h
@@ -0,0 +1,178 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <boost/program_options.hpp>
+
+#include "SpecUtils/Filesystem.h"
+#include "SpecUtils/SerialToDetectorModel.h"
+
+#include "FullSpectrumId/Analysis.h"
+#include "FullSpectrumId/EngineLog.h"
+#include "FullSpectrumId/CommandLineAna.h"
+
+
+/* full-spec-cli: command-line analysis only, linking just the analysis engine (fullspec_engine),
+ and not Wt, so it doesnt load or initialize the web toolkit like "full-spec --mode=cl" does.
+
+ Takes the same analysis arguments as "full-spec --mode=cl" (see CommandLineAna::run_analysis),
+ plus the GADRAS and serial-to-model options that full-spec reads from its config file.
+ */
+
+using namespace std;
+
+namespace
+{
+  /** Looks for the file relative to the current directory, and then relative to the executable.
+
+   Returns if found, and updates filename to the path found.
+   */
+  bool locate( string &filename, const bool is_dir, const char *argv0 )
+  {
+    auto check_exists = [is_dir]( const string &name ) -> bool {
+      return is_dir ? SpecUtils::is_directory(name) : SpecUtils::is_file(name);
+    };//auto check_exists
+
+    if( check_exists(filename) || SpecUtils::is_absolute_path(filename) || !argv0 )
+      return check_exists(filename);
+
+    const string exe_path = SpecUtils::parent_path( argv0 );
+    if( exe_path.empty() || (exe_path == ".") )
+      return false;
+
+    const string trialpath = SpecUtils::append_path( exe_path, filename );
+    if( !check_exists(trialpath) )
+      return false;
+
+    filename = trialpath;
+    return true;
+  }//bool locate(...)
+}//namespace
+
+
+int main( int argc, char **argv )
+{
+  namespace po = boost::program_options;
+
+  string gadras_lib_path, gadras_run_dir, detserial;
+  bool verbose = false;
+
+  po::options_description options( "full-spec-cli options" );
+  options.add_options()
+  ( "GadrasRunDirectory", po::value<string>(&gadras_run_dir)->default_value( "gadras_isotope_id_run_directory" ),
+   "GADRAS app directory; contains necessary GADRAS files, and also a \"drfs\" directory with the detector response functions" )
+#if( !STATICALLY_LINK_TO_GADRAS )
+  ( "GadrasLibPath", po::value<string>(&gadras_lib_path),
+   "Path to the GADRAS shared library to load." )
+#endif
+  ( "DetectorSerialToModelCsv", po::value<string>(&detserial)->default_value( "config/OUO_detective_serial_to_model.csv" ),
+   "File of detective_serial_to_model.csv - for ORTEC Detective model identification" )
+  ( "verbose", po::bool_switch(&verbose), "Print the analysis engines log messages to stderr." )
+  ;
+
+  vector<string> ana_args;
+  try
+  {
+    const po::parsed_options parsed = po::command_line_parser( argc, argv )
+                                        .options( options ).allow_unregistered().run();
+    po::variables_map vm;
+    po::store( parsed, vm );
+    po::notify( vm );
+
+    ana_args = po::collect_unrecognized( parsed.options, po::include_positional );
+  }catch( std::exception &e )
+  {
+    cerr << "Error parsing arguments from command line: " << e.what() << endl;
+    return EXIT_FAILURE;
+  }//try / catch
+
+  if( argc <= 1 )
+  {
+    options.print( cout );
+    ana_args.push_back( "--help" );
+  }
+
+  if( verbose )
+  {
+    EngineLog::set_sink( []( const string &type, const string &message ){
+      cerr << "[" << type << "] " << message << endl;
+    } );
+  }else
+  {
+    EngineLog::set_sink( []( const string &type, const string &message ){
+      if( (type == "error") || (type == "fatal") )
+        cerr << "[" << type << "] " << message << endl;
+    } );
+  }//if( verbose ) / else
+
+#if( !STATICALLY_LINK_TO_GADRAS )
+#ifdef _WIN32
+  if( gadras_lib_path.empty() )
+    gadras_lib_path = "libgadrasiid.dll";
+#elif( defined(__APPLE__) )
+  if( gadras_lib_path.empty() )
+    gadras_lib_path = "libgadrasiid.dylib";
+#else
+  if( gadras_lib_path.empty() )
+    gadras_lib_path = "libgadrasiid.so";
+#endif
+
+#ifndef _WIN32
+  // Load the library by absolute path, so we dont depend on LD_LIBRARY_PATH, or load some other
+  //  library with the same name (see AppUtils::init_app_config).
+  if( locate( gadras_lib_path, false, argv[0] ) )
+    SpecUtils::make_canonical_path( gadras_lib_path );
+#endif
+
+  if( !Analysis::load_gadras_lib( gadras_lib_path ) )
+  {
+    cerr << "Fatal: couldn't load '" << gadras_lib_path << "'" << endl;
+    return EXIT_FAILURE;
+  }
+#endif  //if( !STATICALLY_LINK_TO_GADRAS )
+
+  if( !locate( gadras_run_dir, true, argv[0] ) )
+  {
+    cerr << "The GADRAS run directory '" << gadras_run_dir << "' could not be located." << endl;
+    return EXIT_FAILURE;
+  }
+
+  Analysis::set_gadras_app_dir( gadras_run_dir );
+
+  if( locate( detserial, false, argv[0] ) )
+    SerialToDetectorModel::set_detector_model_input_csv( detserial );
+
+  Analysis::start_analysis_thread();
+
+  const int rval = CommandLineAna::run_analysis( ana_args );
+
+  Analysis::stop_analysis_thread();
+
+  return rval;
+}//int main( int argc, char **argv )
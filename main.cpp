@@ -38,6 +38,10 @@
 
 #include "FullSpectrumId/Analysis.h"
 #include "FullSpectrumId/AppUtils.h"
+#include "FullSpectrumId/EngineLog.h"
+#include "FullSpectrumId/ResultStore.h"
+#include "FullSpectrumId/AnalysisBroker.h"
+#include "FullSpectrumId/AnalysisCluster.h"
 #include "FullSpectrumId/CommandLineAna.h"
 
 
@@ -60,6 +64,8 @@ int main( int argc, char **argv )
   
   Analysis::start_analysis_thread();
   
+  AppUtils::start_background_threads();
+  
   switch( use_mode )
   {
     case AppUtils::AppUseMode::Server:
@@ -76,6 +82,7 @@ int main( int argc, char **argv )
       }catch( std::exception &e )
       {
         Analysis::stop_analysis_thread();
+        EngineLog::stop_async();
         
         cerr << "\n\nFailed to start server: " << e.what() << endl << endl;
         
@@ -102,9 +109,27 @@ int main( int argc, char **argv )
       
       break;
     }//case AppUtils::AppUseMode::CommandLine:
+      
+      
+    case AppUtils::AppUseMode::Worker:
+    {
+      rval = AnalysisCluster::run_worker();
+      
+      break;
+    }//case AppUtils::AppUseMode::Worker:
+      
+      
+    case AppUtils::AppUseMode::Broker:
+    {
+      rval = AnalysisBroker::run_broker();
+      
+      break;
+    }//case AppUtils::AppUseMode::Broker:
   }//switch( use_mode )
       
   Analysis::stop_analysis_thread();
+  ResultStore::close();
+  EngineLog::stop_async();
   
   return rval;
 }//int main( int argc, char **argv )
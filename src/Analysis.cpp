@@ -22,25 +22,27 @@
  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <map>
 #include <mutex>
 #include <deque>
+#include <vector>
+#include <cassert>
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <thread>
 #include <fstream>
 #include <condition_variable>
 
-#include <Wt/WString.h>
-#include <Wt/WServer.h>
-#include <Wt/WLogger.h>
-#include <Wt/Json/Array.h>
-#include <Wt/Json/Value.h>
-#include <Wt/Json/Object.h>
-
 #include "SpecUtils/SpecFile.h"
 #include "SpecUtils/DateTime.h"
 #include "SpecUtils/StringAlgo.h"
 #include "SpecUtils/Filesystem.h"
 #include "FullSpectrumId/Analysis.h"
+#include "FullSpectrumId/Tracing.h"
+#include "FullSpectrumId/EngineLog.h"
+#include "FullSpectrumId/EngineJson.h"
+#include "FullSpectrumId/PerfCounters.h"
 #include "FullSpectrumId/EnergyCal.h"
 #include "SpecUtils/EnergyCalibration.h"
 
@@ -145,6 +147,27 @@ fctn_PortalIsotopeIDCInterface_t g_PortalIsotopeIDCInterface = nullptr;
 #endif  // STATICALLY_LINK_TO_GADRAS / else
 
 
+/** Calls a GADRAS function, recording a tracing span covering the call. */
+template<class Fcn, class... Args>
+auto traced_gadras_call( const char *name, Fcn fcn, Args&&... args ) -> decltype( fcn(std::forward<Args>(args)...) )
+{
+  Tracing::Span span( name, "gadras" );
+  return fcn( std::forward<Args>(args)... );
+}
+
+
+/** Calls a GADRAS function, recording a tracing span, and accumulating the hardware performance
+ counters (if enabled) for the call against the given DRF.
+ */
+template<class Fcn, class... Args>
+auto profiled_gadras_call( const PerfCounters::CallType type, const std::string &drf,
+                           Fcn fcn, Args&&... args ) -> decltype( fcn(std::forward<Args>(args)...) )
+{
+  PerfCounters::CallScope counters( type, drf );
+  return traced_gadras_call( PerfCounters::to_str(type), fcn, std::forward<Args>(args)... );
+}
+
+
 /** A helper function to extra make sure char arrays on the stack are null-terminated */
 template<size_t N>
 void null_terminate_static_str(char (&str)[N])
@@ -156,10 +179,354 @@ void null_terminate_static_str(char (&str)[N])
 std::mutex g_analysis_thread_mutex;
 std::unique_ptr<std::thread> g_analysis_thread;
 
+/** An input waiting in the analysis queue. */
+struct QueuedAnalysis
+{
+  Analysis::AnalysisInput input;
+  
+  /** From #Analysis::expected_cost. */
+  double cost = 0.0;
+  
+  Analysis::AnalysisLane lane = Analysis::AnalysisLane::Fast;
+  
+  /** When the input was posted, from SpecUtils::get_wall_time(). */
+  double queued_time = 0.0;
+};//struct QueuedAnalysis
+
+
+/** The queue for one lane.  Inputs are taken in start-time fair queueing order across clients (see
+ #Analysis::AnalysisInput::client): each client with queued inputs is tagged with the virtual time
+ its next input would start at if every client got its weighted share of the analysis thread, and
+ the client with the lowest tag goes next.  So a client with many queued inputs only delays other
+ clients by its share, and a client with twice the weight gets twice as many turns.  Each clients
+ inputs are taken shortest expected cost first (first come first served for equal costs), except
+ that an input passed over by #Analysis::LaneOptions::max_times_passed later, cheaper, inputs isnt
+ passed again, so a client steadily submitting cheap inputs cant starve its own expensive one.  Ties
+ between clients go to the cheaper input.
+ */
+class FairQueue
+{
+public:
+  void set_max_times_passed( const size_t max_times_passed )
+  {
+    m_max_times_passed = max_times_passed;
+  }
+  
+  void push( QueuedAnalysis &&item )
+  {
+    Flow &flow = m_flows[flow_key( item.input )];
+    
+    Entry entry;
+    entry.sequence = m_next_sequence++;
+    entry.item = std::move( item );
+    
+    // The new input may only go after the last input that has been passed over enough; the inputs
+    //  after that are still in cheapest first order.
+    auto first = begin(flow.entries);
+    for( auto iter = begin(flow.entries); iter != end(flow.entries); ++iter )
+    {
+      if( iter->times_passed >= m_max_times_passed )
+        first = iter + 1;
+    }
+    
+    const auto pos = std::upper_bound( first, end(flow.entries), entry, &cheaper );
+    for( auto iter = pos; iter != end(flow.entries); ++iter )
+      iter->times_passed += 1;
+    
+    flow.entries.insert( pos, std::move(entry) );
+    ++m_size;
+  }//void push( QueuedAnalysis &&item )
+  
+  /** Removes and returns the next input to analyze; the queue must not be empty. */
+  QueuedAnalysis pop()
+  {
+    assert( m_size );
+    
+    auto next = end(m_flows);
+    double next_start = 0.0;
+    for( auto iter = begin(m_flows); iter != end(m_flows); ++iter )
+    {
+      if( iter->second.entries.empty() )
+        continue;
+      
+      const double start = std::max( m_virtual_time, iter->second.last_finish_tag );
+      if( (next == end(m_flows))
+          || (start < next_start)
+          || ((start == next_start) && cheaper( iter->second.entries.front(), next->second.entries.front() )) )
+      {
+        next = iter;
+        next_start = start;
+      }
+    }//for( loop over flows )
+    
+    assert( next != end(m_flows) );
+    
+    Entry entry = std::move( next->second.entries.front() );
+    next->second.entries.pop_front();
+    --m_size;
+    
+    const double weight = (entry.item.input.client_weight > 0.0) ? entry.item.input.client_weight : 1.0;
+    m_virtual_time = next_start;
+    next->second.last_finish_tag = next_start + 1.0/weight;
+    
+    // Idle clients only need remembering while their last finish tag is ahead of virtual time.
+    for( auto iter = begin(m_flows); iter != end(m_flows); )
+    {
+      if( iter->second.entries.empty() && (iter->second.last_finish_tag <= m_virtual_time) )
+        iter = m_flows.erase( iter );
+      else
+        ++iter;
+    }//for( loop over flows )
+    
+    return std::move( entry.item );
+  }//QueuedAnalysis pop()
+  
+  bool empty() const
+  {
+    return !m_size;
+  }
+  
+  size_t size() const
+  {
+    return m_size;
+  }
+  
+  void add_lengths_by_client( std::map<std::string,size_t> &lengths ) const
+  {
+    for( const auto &flow : m_flows )
+    {
+      if( !flow.second.entries.empty() )
+        lengths[flow.first] += flow.second.entries.size();
+    }
+  }//add_lengths_by_client(...)
+  
+private:
+  struct Entry
+  {
+    uint64_t sequence = 0;
+    
+    /** The number of inputs put ahead of this one since it was queued. */
+    size_t times_passed = 0;
+    
+    QueuedAnalysis item;
+  };//struct Entry
+  
+  struct Flow
+  {
+    std::deque<Entry> entries;
+    double last_finish_tag = 0.0;
+  };//struct Flow
+  
+  static string flow_key( const Analysis::AnalysisInput &input )
+  {
+    if( !input.client.empty() || input.wt_app_id.empty() )
+      return input.client;
+    return "session:" + input.wt_app_id;
+  }
+  
+  static bool cheaper( const Entry &lhs, const Entry &rhs )
+  {
+    if( lhs.item.cost != rhs.item.cost )
+      return lhs.item.cost < rhs.item.cost;
+    return lhs.sequence < rhs.sequence;
+  }
+  
+  std::map<std::string,Flow> m_flows;
+  size_t m_max_times_passed = Analysis::LaneOptions().max_times_passed;
+  double m_virtual_time = 0.0;
+  uint64_t m_next_sequence = 0;
+  size_t m_size = 0;
+};//class FairQueue
+
+
+/** The analysis queue: a #FairQueue for each #Analysis::AnalysisLane, so quick analyses arent
+ stuck behind long ones.
+ 
+ The fast lane is taken first, except that after #Analysis::LaneOptions::fast_lane_burst fast
+ inputs in a row, a waiting slow input is taken, so the slow lane isnt starved.  Slow inputs are
+ also held back while #Analysis::LaneOptions::slow_lane_max_in_flight of them are dispatched (see
+ #Analysis::QueueHooks::dispatch) and not yet finished, which reserves the remaining concurrent
+ capacity for the fast lane.
+ 
+ Also keeps the latency of recent analyses, per lane.
+ */
+class LaneQueue
+{
+public:
+  void set_options( const Analysis::LaneOptions &options )
+  {
+    m_options = options;
+    for( FairQueue &lane : m_lanes )
+      lane.set_max_times_passed( options.max_times_passed );
+  }
+  
+  const Analysis::LaneOptions &options() const
+  {
+    return m_options;
+  }
+  
+  void push( QueuedAnalysis &&item )
+  {
+    m_lanes[lane_index(item.lane)].push( std::move(item) );
+  }
+  
+  /** Returns if there is an input #pop may take now. */
+  bool can_pop() const
+  {
+    return !m_lanes[0].empty() || slow_lane_ready();
+  }
+  
+  /** Removes and returns the next input to analyze; #can_pop must be true. */
+  QueuedAnalysis pop()
+  {
+    assert( can_pop() );
+    
+    const bool take_slow = slow_lane_ready()
+                           && (m_lanes[0].empty() || (m_fast_streak >= m_options.fast_lane_burst));
+    
+    if( take_slow )
+    {
+      m_fast_streak = 0;
+      return m_lanes[1].pop();
+    }
+    
+    m_fast_streak = m_lanes[1].empty() ? 0 : (m_fast_streak + 1);
+    return m_lanes[0].pop();
+  }//QueuedAnalysis pop()
+  
+  bool empty() const
+  {
+    return m_lanes[0].empty() && m_lanes[1].empty();
+  }
+  
+  size_t size() const
+  {
+    return m_lanes[0].size() + m_lanes[1].size();
+  }
+  
+  std::map<std::string,size_t> lengths_by_client() const
+  {
+    std::map<std::string,size_t> lengths;
+    for( const FairQueue &lane : m_lanes )
+      lane.add_lengths_by_client( lengths );
+    return lengths;
+  }//lengths_by_client()
+  
+  /** Records that an input was handed off to #Analysis::QueueHooks::dispatch. */
+  void dispatched( const Analysis::AnalysisLane lane )
+  {
+    m_stats[lane_index(lane)].in_flight += 1;
+  }
+  
+  /** Records an input handed to #dispatched has finished, or wasnt taken after all. */
+  void undispatched( const Analysis::AnalysisLane lane )
+  {
+    LaneStats &stats = m_stats[lane_index(lane)];
+    assert( stats.in_flight );
+    stats.in_flight -= 1;
+  }
+  
+  void record_latency( const QueuedAnalysis &item, const double start_time, const double end_time )
+  {
+    LaneStats &stats = m_stats[lane_index(item.lane)];
+    
+    const double latency = end_time - item.queued_time;
+    const double wait = start_time - item.queued_time;
+    
+    stats.completed += 1;
+    stats.total_seconds += latency;
+    stats.max_seconds = std::max( stats.max_seconds, latency );
+    
+    if( stats.recent_latencies.size() < sm_num_recent_latencies )
+    {
+      stats.recent_latencies.push_back( latency );
+      stats.recent_waits.push_back( wait );
+    }else
+    {
+      stats.recent_latencies[stats.next_recent] = latency;
+      stats.recent_waits[stats.next_recent] = wait;
+    }
+    stats.next_recent = (stats.next_recent + 1) % sm_num_recent_latencies;
+  }//void record_latency(...)
+  
+  EngineJson::Object status_json() const
+  {
+    EngineJson::Object json;
+    
+    for( const Analysis::AnalysisLane lane : { Analysis::AnalysisLane::Fast, Analysis::AnalysisLane::Slow } )
+    {
+      const LaneStats &stats = m_stats[lane_index(lane)];
+      
+      EngineJson::Object info;
+      info["queued"] = m_lanes[lane_index(lane)].size();
+      info["inFlight"] = stats.in_flight;
+      info["completed"] = stats.completed;
+      info["meanSeconds"] = stats.completed ? (stats.total_seconds / stats.completed) : 0.0;
+      info["p50Seconds"] = percentile( stats.recent_latencies, 0.50 );
+      info["p99Seconds"] = percentile( stats.recent_latencies, 0.99 );
+      info["maxSeconds"] = stats.max_seconds;
+      info["p50WaitSeconds"] = percentile( stats.recent_waits, 0.50 );
+      info["p99WaitSeconds"] = percentile( stats.recent_waits, 0.99 );
+      
+      json[Analysis::to_str(lane)] = std::move(info);
+    }//for( loop over lanes )
+    
+    return json;
+  }//EngineJson::Object status_json() const
+  
+private:
+  /** The number of recent latencies kept per lane for the percentiles. */
+  static const size_t sm_num_recent_latencies = 1024;
+  
+  struct LaneStats
+  {
+    size_t in_flight = 0;
+    size_t completed = 0;
+    double total_seconds = 0.0;
+    double max_seconds = 0.0;
+    vector<double> recent_latencies;
+    vector<double> recent_waits;
+    size_t next_recent = 0;
+  };//struct LaneStats
+  
+  static size_t lane_index( const Analysis::AnalysisLane lane )
+  {
+    return (lane == Analysis::AnalysisLane::Fast) ? 0 : 1;
+  }
+  
+  static double percentile( vector<double> values, const double fraction )
+  {
+    if( values.empty() )
+      return 0.0;
+    
+    const size_t index = std::min( values.size() - 1,
+                                   static_cast<size_t>( fraction*values.size() ) );
+    std::nth_element( begin(values), begin(values) + index, end(values) );
+    
+    return values[index];
+  }//double percentile(...)
+  
+  bool slow_lane_ready() const
+  {
+    return !m_lanes[1].empty()
+           && (!m_options.slow_lane_max_in_flight
+               || (m_stats[1].in_flight < m_options.slow_lane_max_in_flight));
+  }
+  
+  Analysis::LaneOptions m_options;
+  FairQueue m_lanes[2];
+  LaneStats m_stats[2];
+  size_t m_fast_streak = 0;
+};//class LaneQueue
+
+
 bool g_keep_analyzing = false;
 std::mutex g_ana_queue_mutex;
 std::condition_variable g_ana_queue_cv;
-std::deque<Analysis::AnalysisInput> g_simple_ana_queue;
+LaneQueue g_simple_ana_queue;
+
+// Set before the analysis thread starts, and then only read.
+Analysis::QueueHooks g_queue_hooks;
 
 
 //g_gad_mutex protects gadars and g_gad_drf and g_gad_nchannel, although right now, this isnt
@@ -191,6 +558,76 @@ int32_t g_num_detectors = -1;
 AutoGainAdjustType g_gad_cal_adjust = AutoGainAdjustType::None;
 
 
+/** Counts of how often we called RebinUsingK40 for simple analysis, versus skipped calling it
+ because EnergyCal::locate_reference_peak didnt find a significant K40 peak (but our other
+ criteria would have otherwise let us call it).
+ */
+std::atomic<size_t> g_k40_rebin_calls( 0 );
+std::atomic<size_t> g_k40_rebin_calls_avoided( 0 );
+
+
+/** Counts of analyses whose result was no longer wanted (see Analysis::is_abandoned); protected by
+ g_abandoned_mutex.
+ */
+std::mutex g_abandoned_mutex;
+size_t g_num_abandoned_skipped = 0;   //never started
+size_t g_num_abandoned_stopped = 0;   //stopped partway through
+size_t g_num_abandoned_finished = 0;  //finished, but the result wasnt wanted by then
+double g_abandoned_wasted_seconds = 0.0;
+
+
+/** Throws exception if the input has been abandoned, so we dont spend any more time on it. */
+void check_not_abandoned( const Analysis::AnalysisInput &input, const char *stage )
+{
+  if( !Analysis::is_abandoned( input ) )
+    return;
+  
+  {
+    std::lock_guard<std::mutex> lock( g_abandoned_mutex );
+    ++g_num_abandoned_stopped;
+  }
+  
+  EngineLog::log("info") << "Stopping analysis " << input.ana_number << " " << stage
+                         << "; its deadline passed, or the requester went away.";
+  
+  throw runtime_error( "Analysis stopped, as its deadline passed, or the requester went away." );
+}//void check_not_abandoned(...)
+
+
+/** Returns the isotopes found by a search analysis, formatted like "Cs137(H)+Co60(M)"; isotopes
+ with both high and medium confidence are only listed as high.
+ */
+string search_isotopes_str( const map<string,set<int>> &high_conf_isotopes,
+                            const map<string,set<int>> &medium_conf_isotopes )
+{
+  string isotopes;
+  for( const auto &iso : high_conf_isotopes )
+    isotopes += (isotopes.empty() ? "" : "+") + iso.first + "(H)";
+  
+  for( const auto &iso : medium_conf_isotopes )
+  {
+    if( !high_conf_isotopes.count(iso.first) )
+      isotopes += (isotopes.empty() ? "" : "+") + iso.first + "(M)";
+  }
+  
+  return isotopes;
+}//string search_isotopes_str(...)
+
+
+/** Adds the time spent analyzing an input to the wasted time, if its result isnt wanted anymore. */
+void record_if_abandoned( const Analysis::AnalysisInput &input,
+                          const Analysis::AnalysisOutput &result, const double seconds )
+{
+  if( !Analysis::is_abandoned( input ) )
+    return;
+  
+  std::lock_guard<std::mutex> lock( g_abandoned_mutex );
+  g_abandoned_wasted_seconds += seconds;
+  if( result.error_message.empty() )
+    ++g_num_abandoned_finished;
+}//void record_if_abandoned(...)
+
+
 std::string k40_fit_fail_reason( const int32_t rval )
 {
   switch( rval )
@@ -272,7 +709,7 @@ int32_t initialize_isotope_id_calibrated(const char* applicationFolder,
                                       const char* detectorName, int32_t numChannels )
 {
   assert( g_InitializeIsotopeIdCalibrated );
-  return g_InitializeIsotopeIdCalibrated( applicationFolder, detectorName, numChannels );
+  return profiled_gadras_call( PerfCounters::CallType::InitDrf, detectorName, g_InitializeIsotopeIdCalibrated, applicationFolder, detectorName, numChannels );
 }
 
 
@@ -282,7 +719,7 @@ int32_t static_isotope_id(float tl, float tt, float foregroundSpectrum[],
                         int neutronsForeground, int neutronsBackground, float* rateNotNorm)
 {
   assert( g_StaticIsotopeID );
-  return g_StaticIsotopeID( tl, tt, foregroundSpectrum, tlb, ttb, backgroundSpectrum,
+  return profiled_gadras_call( PerfCounters::CallType::StaticIsotopeID, g_gad_drf, g_StaticIsotopeID, tl, tt, foregroundSpectrum, tlb, ttb, backgroundSpectrum,
                             SOI, isotopeStr, rebinnedEnergyGroups,
                             neutronsForeground, neutronsBackground, rateNotNorm );
 }//static_isotope_id
@@ -292,14 +729,14 @@ int32_t static_isotope_id(float tl, float tt, float foregroundSpectrum[],
 void get_current_isotope_id_results(struct IsotopeIDResult *isotopeInfoOut)
 {
   assert( g_GetCurrentIsotopeIDResults );
-  g_GetCurrentIsotopeIDResults( isotopeInfoOut );
+  traced_gadras_call( "GetCurrentIsotopeIDResults", g_GetCurrentIsotopeIDResults, isotopeInfoOut );
 }//get_current_isotope_id_results(...)
 
 
 void clear_isotope_id_results()
 {
   assert( g_ClearIsotopeIDResults );
-  g_ClearIsotopeIDResults();
+  traced_gadras_call( "ClearIsotopeIDResults", g_ClearIsotopeIDResults );
 }//clear_isotope_id_results(...)
 
 
@@ -355,6 +792,8 @@ int32_t init_gadras_drf_raw( const std::string &drf, const int32_t nchannel,
     return 0;
   }
   
+  Tracing::Span span( "init_drf", "analysis" );
+  
   const char *calTag = "";
   switch( cal_type )
   {
@@ -364,7 +803,7 @@ int32_t init_gadras_drf_raw( const std::string &drf, const int32_t nchannel,
   }//switch( cal_type )
   
   assert( g_InitializeIsotopeIdRaw );
-  const int32_t rval = g_InitializeIsotopeIdRaw( g_gad_app_folder.c_str(), drf.c_str(), nchannel, num_detectors, calTag);
+  const int32_t rval = profiled_gadras_call( PerfCounters::CallType::InitDrf, drf, g_InitializeIsotopeIdRaw, g_gad_app_folder.c_str(), drf.c_str(), nchannel, num_detectors, calTag);
   
   if( rval == 0 )
   {
@@ -381,7 +820,7 @@ int32_t init_gadras_drf_raw( const std::string &drf, const int32_t nchannel,
     g_num_detectors = -1;
     g_gad_cal_adjust = AutoGainAdjustType::None;
     
-    Wt::log("error") << "Failed call to initialize_isotope_id_raw(\""
+    EngineLog::log("error") << "Failed call to initialize_isotope_id_raw(\""
            << g_gad_app_folder << "\", \"" << drf << "\", " << nchannel << " );";
   }
   
@@ -396,6 +835,8 @@ int32_t init_gadras_drf_calibrated( const std::string &drf, int32_t nchannel )
   if( (drf == g_gad_drf) && (nchannel == g_gad_nchannel) && (g_gad_calibrated == true) )
     return 0;
   
+  Tracing::Span span( "init_drf", "analysis" );
+  
   const int32_t rval = initialize_isotope_id_calibrated( g_gad_app_folder.c_str(), drf.c_str(), nchannel );
   
   if( rval == 0 )
@@ -409,7 +850,7 @@ int32_t init_gadras_drf_calibrated( const std::string &drf, int32_t nchannel )
     g_gad_nchannel = -1;
     g_gad_calibrated = false;
     
-    Wt::log("error") << "Failed call to initialize_isotope_id_calibrated(\""
+    EngineLog::log("error") << "Failed call to initialize_isotope_id_calibrated(\""
            << g_gad_app_folder << "\", \"" << drf << "\", " << nchannel << " );";
   }
   
@@ -418,7 +859,7 @@ int32_t init_gadras_drf_calibrated( const std::string &drf, int32_t nchannel )
 
 
 
-void do_simple_analysis( Analysis::AnalysisInput input )
+Analysis::AnalysisOutput do_simple_analysis( const Analysis::AnalysisInput &input )
 {
   std::lock_guard<std::mutex> ana_lock( g_gad_mutex );
  
@@ -480,6 +921,8 @@ void do_simple_analysis( Analysis::AnalysisInput input )
     if( nchannel < 32 || nchannel > 64*1024 )
       throw runtime_error( "Invalid number of channels (" + std::to_string(nchannel) + ")" );
     
+    check_not_abandoned( input, "before DRF initialization" );
+    
     const double start_drf_init_time = SpecUtils::get_wall_time();
     
     const int32_t init_code = init_gadras_drf_calibrated( drf_folder, static_cast<int32_t>(nchannel) );
@@ -532,6 +975,8 @@ void do_simple_analysis( Analysis::AnalysisInput input )
     // Make sure foreground and background have the same energy calibration.  We'll only do a
     //  comparison of coefficients and such if the EnergyCalibration objects themselves differ
     //  (which happens usually if foreground/background are from different files )
+    //  Calibrations are interned when files are parsed (see EnergyCal::intern_energy_cal), so
+    //  equal calibrations will usually be the same object.
     if( backcal && (forecal != backcal) )
     {
       if( (forecal->type() != backcal->type())
@@ -542,6 +987,9 @@ void do_simple_analysis( Analysis::AnalysisInput input )
         
         input_file->rebin_measurement( forecal, background );
       }
+    }else if( backcal )
+    {
+      EnergyCal::record_rebin_skipped();
     }//if( foreground->energy_calibration() != background->energy_calibration() )
     
     
@@ -585,34 +1033,61 @@ void do_simple_analysis( Analysis::AnalysisInput input )
       //Begin code block to calibrate using K40
       assert( g_RebinUsingK40 );
       const bool highres = (channel_energies.size() > 5000);
-      const double ncounts_region = background->gamma_integral( 1260, 1660 );
+      const float true_k40_energy = 1460.75f;
+      
+      // Locate the K40 peak ourselves (and integrate the 1260-1660 and 1000-3000 keV regions in
+      //  the same pass), so we can skip calling into GADRAS when there isnt a peak for it to find.
+      //  Energy resolution of ~3 keV for HPGe, and ~7% for NaI, is good enough for locating.
+      const EnergyCal::ReferencePeakScreen k40_screen
+                 = EnergyCal::locate_reference_peak( channel_energies, back_spectrum,
+                                                     1260.0, 1660.0, 1000.0, 3000.0,
+                                                     highres ? 3.0 : 0.07*true_k40_energy );
+      
+      const double ncounts_region = k40_screen.window_counts;
         
       // There is a test in the GADRAS code, that will change in the future, that scuttles our
       //  efforts often, so just skip the cases we know will faile
-      const double ncounts_above_1MeV = background->gamma_integral( 1000, 3000 );
+      const double ncounts_above_1MeV = k40_screen.wide_counts;
       
         // Threshold numbers are totally pulled out of error
         // TODO: better determine candidate numbers for recalibration
-      const bool try_to_adjust = ((back_livetime > 60) && (ncounts_region > (highres ? 200 : 400))
+      const bool candidate_to_adjust = ((back_livetime > 60) && (ncounts_region > (highres ? 200 : 400))
                                   && ( (forecal->type() == SpecUtils::EnergyCalType::FullRangeFraction)
                                       || (forecal->type() == SpecUtils::EnergyCalType::Polynomial)
                                       || (forecal->type() == SpecUtils::EnergyCalType::UnspecifiedUsingDefaultPolynomial)
                                       )
                                   && ((ncounts_above_1MeV / back_livetime) < 6)
                                   );
+      
+      // GADRAS will fail with a low K40 peak-to-background ratio (code 3), so we skip calling it
+      //  when our search ran and found no peak.  The 2 sigma cut has NOT been checked against the
+      //  GADRAS test; it is set low (spectra without a peak typically read 1 to 2 sigma), so we
+      //  only skip spectra that clearly have no peak.  If the search couldnt run (too few
+      //  channels in the window), we leave it to GADRAS, as before.
+      const bool found_k40_peak = (!k40_screen.searched || (k40_screen.significance >= 2.0));
+      const bool try_to_adjust = (candidate_to_adjust && found_k40_peak);
+      
+      if( candidate_to_adjust && !found_k40_peak )
+      {
+        ++g_k40_rebin_calls_avoided;
+        ENGINE_LOG("debug") << "Skipping RebinUsingK40 since K40 peak significance was only "
+                                << k40_screen.significance << " (" << g_k40_rebin_calls_avoided
+                                << " calls avoided, and " << g_k40_rebin_calls << " made, since startup)";
+      }
         
       if( try_to_adjust )
       {
-        const float true_k40_energy = 1460.75f;
+        ++g_k40_rebin_calls;
         
+        // The screen only decides whether to call GADRAS; we still give it the nominal energy.
         float centroid_K40 = true_k40_energy;
         vector<float> rebinned_spectrum( nchannel + 2, 0.0f );
         vector<float> spectrum = back_spectrum;
         vector<float> energies = channel_energies;
-        call_stat = g_RebinUsingK40( nchannel, back_livetime, &(energies[0]),
+        call_stat = traced_gadras_call( "RebinUsingK40", g_RebinUsingK40, nchannel, back_livetime, &(energies[0]),
                                        &(spectrum[0]), &(rebinned_spectrum[0]), &centroid_K40 );
         
-        Wt::log("debug") << "Calibration using K40 on background yielded rval=" << call_stat
+        ENGINE_LOG("debug") << "Calibration using K40 on background yielded rval=" << call_stat
                              << " and centroid " << centroid_K40 << " keV";
         
         if( call_stat == 1 )
@@ -647,18 +1122,21 @@ void do_simple_analysis( Analysis::AnalysisInput input )
             vector<float> coefs_uncert( forecal->coefficients().size(), 0.0f );
             const auto &devpairs = forecal->deviation_pairs();
             
-            auto newcal = make_shared<SpecUtils::EnergyCalibration>();
+            auto fitcal = make_shared<SpecUtils::EnergyCalibration>();
             
             if( forecal->type() == SpecUtils::EnergyCalType::FullRangeFraction )
             {
               EnergyCal::fit_energy_cal_frf( {peak}, fitfor, nchannel, devpairs, coefs, coefs_uncert );
-              newcal->set_full_range_fraction( nchannel, coefs, devpairs );
+              fitcal->set_full_range_fraction( nchannel, coefs, devpairs );
             }else
             {
               EnergyCal::fit_energy_cal_poly( {peak}, fitfor, nchannel, devpairs, coefs, coefs_uncert );
-              newcal->set_polynomial( nchannel, coefs, devpairs );
+              fitcal->set_polynomial( nchannel, coefs, devpairs );
             }
             
+            const shared_ptr<const SpecUtils::EnergyCalibration> newcal
+                                                        = EnergyCal::intern_energy_cal( fitcal );
+            
             // Set the energy calibrations in the SpecFile
             for( auto &m : input_file->measurements() )
             {
@@ -675,7 +1153,7 @@ void do_simple_analysis( Analysis::AnalysisInput input )
             assert( channel_energies.size() == newcal->channel_energies()->size() );
             channel_energies = *newcal->channel_energies();
         
-            Wt::log("debug") << "Energy calibration was updated based on K40 peak, moving channel "
+            ENGINE_LOG("debug") << "Energy calibration was updated based on K40 peak, moving channel "
                                  << peak.peakMeanBinNumber << " from " << peak.peakMean << " to "
                                  << peak.photopeakEnergy << " keV "
                                  << "(" << newcal->energy_for_channel(peak.peakMeanBinNumber) << ")";
@@ -686,7 +1164,7 @@ void do_simple_analysis( Analysis::AnalysisInput input )
             // I dont know what this excpetion might say, so dont display its content to the user
             result.analysis_warnings.push_back( "Performing energy recalibration hit an unexpected error, so was skipped." );
             
-            Wt::log("error") << "Caught exception setting new energy calibration"
+            EngineLog::log("error") << "Caught exception setting new energy calibration"
                                  << " for simple analysis: " << e.what();
           }//try / catch to fit for new gain
         }//if( we fit for K40 peak and will adjust energy cal )
@@ -694,7 +1172,7 @@ void do_simple_analysis( Analysis::AnalysisInput input )
       {
         result.analysis_warnings.push_back( "Skipped checking energy calibration - you may want to manually check the K40 peak is near 1460 keV." );
         
-        Wt::log("debug") << "Will not try to adjust energy calibration using the 1460 keV peak";
+        ENGINE_LOG("debug") << "Will not try to adjust energy calibration using the 1460 keV peak";
       }
       
       //End code block to calibrate using K40
@@ -705,7 +1183,7 @@ void do_simple_analysis( Analysis::AnalysisInput input )
     char *isotopeString = nullptr;
     float rateNotNorm = 0.0f, stuffOfInterest = 0.0f;
     
-    Wt::log("debug") << "Will call into StaticIsotopeID for wt session '" << input.wt_app_id << "'";
+    ENGINE_LOG("debug") << "Will call into StaticIsotopeID for wt session '" << input.wt_app_id << "'";
     
     call_stat = static_isotope_id( fore_livetime, fore_realtime, &(fore_spectrum[0]),
                                  back_livetime, back_realtime, &(back_spectrum[0]),
@@ -719,8 +1197,8 @@ void do_simple_analysis( Analysis::AnalysisInput input )
     
     const string isostr = (isotopeString ? (const char *)isotopeString : "");
 
-    Wt::log("debug") << "StaticIsotopeID returned code " << call_stat
-                     << " and isotope string '" << isostr.c_str() << "'";
+    ENGINE_LOG("debug") << "StaticIsotopeID returned code " << call_stat
+                            << " and isotope string '" << isostr.c_str() << "'";
     
 #ifndef _WIN32
     // Freeing isotopeString crashes on windows for some reason.
@@ -728,7 +1206,7 @@ void do_simple_analysis( Analysis::AnalysisInput input )
       free( isotopeString );
     isotopeString = nullptr;
     
-    Wt::log("debug") << "Have freed isotopeString";
+    ENGINE_LOG("debug") << "Have freed isotopeString";
 #endif
     
     if( call_stat < 0)
@@ -804,7 +1282,7 @@ void do_simple_analysis( Analysis::AnalysisInput input )
     }//if( call_stat >= 0)
     
     
-    Wt::log("debug") << "Finished with analysis: '" << isostr.c_str() << "'";
+    ENGINE_LOG("debug") << "Finished with analysis: '" << isostr.c_str() << "'";
     
     const double finished_time = SpecUtils::get_wall_time();
     
@@ -813,14 +1291,14 @@ void do_simple_analysis( Analysis::AnalysisInput input )
     const double setup_time = setup_finished_time - start_time;
     const double gadras_time = call_finished_time - setup_finished_time;
     
-    Wt::log("debug") << "Analysis took\n"
+    ENGINE_LOG("debug") << "Analysis took\n"
     << "\t\tSetup Time:    " << setup_time << "\n"
     << "\t\tDRF init Time: " << drf_init_time << "\n"
     << "\t\tAna Time:      " << gadras_time << "\n"
     << "\t\tTotal Time:    " << total_time << "\n"
     ;
     
-    Wt::log("info") << "Analysis took\n"
+    EngineLog::log("info") << "Analysis took\n"
          << "\t\tSetup Time: " << setup_time << "\n"
        //<< "\t\tDRF init Time: " << drf_init_time << "\n"
          << "\t\tAna Time:   " << gadras_time << "\n"
@@ -828,39 +1306,15 @@ void do_simple_analysis( Analysis::AnalysisInput input )
   }catch( std::exception &e )
   {
     result.error_message = e.what();
-    Wt::log("error") << "Analysis failed due to: " << e.what();
+    EngineLog::log("error") << "Analysis failed due to: " << e.what();
   }//try / catch
   
-  const string &wt_app_id = input.wt_app_id;
-  function<void(Analysis::AnalysisOutput)> callback = input.callback;
-  
-  if( callback )
-  {
-    auto server = Wt::WServer::instance();
-    if( server && !wt_app_id.empty() )
-    {
-      server->post( wt_app_id, [result,callback](){
-        callback( result );
-        wApp->triggerUpdate();
-      
-        Wt::log("debug") << "Update should have triggered to GUI";
-      } );
-    }else if( wt_app_id.empty() )
-    {
-      Wt::log("debug") << "wt_app_id is empty...";
-      
-      callback( result );
-    }else //if( !wt_app_id.empty() )
-    {
-      Wt::log("error") << "Error: got non empty Wt session ID ('" << wt_app_id << "'), but there is no"
-             << " WServer instance - not calling result callback!";
-    }
-  }//if( callback )
-}//void do_simple_analysis( Analysis::AnalysisInput input )
+  return result;
+}//Analysis::AnalysisOutput do_simple_analysis( const Analysis::AnalysisInput &input )
 
 
 
-void do_search_analysis( Analysis::AnalysisInput input )
+Analysis::AnalysisOutput do_search_analysis( const Analysis::AnalysisInput &input )
 {
   std::lock_guard<std::mutex> ana_lock( g_gad_mutex );
   
@@ -990,6 +1444,8 @@ void do_search_analysis( Analysis::AnalysisInput input )
     const size_t ndet = energy_cals.size();
     const bool use_raw_search = true; //(ndet > 1);
     
+    check_not_abandoned( input, "before DRF initialization" );
+    
     int32_t init_code;
     if( use_raw_search )
       init_code = init_gadras_drf_raw( drf_folder, nchannels, static_cast<int32_t>(ndet), AutoGainAdjustType::K40 );
@@ -1019,7 +1475,7 @@ void do_search_analysis( Analysis::AnalysisInput input )
         }
       }//for( const int sample : background_samples )
       
-      Wt::log("debug") << "Longest background was " << longest_background_rt << " seconds";
+      ENGINE_LOG("debug") << "Longest background was " << longest_background_rt << " seconds";
       
       if( longest_background_rt > 55.0f ) //55 seconds is arbitrary, but we just want something like a minute
       {
@@ -1038,11 +1494,11 @@ void do_search_analysis( Analysis::AnalysisInput input )
         {
           background_samples.clear();
           background_samples.insert( longest_background_sample );
-          Wt::log("debug") << "Setting background sample to only sample " << longest_background_rt
+          ENGINE_LOG("debug") << "Setting background sample to only sample " << longest_background_rt
           << " which had real time " << static_cast<double>(longest_background_rt);
         }else
         {
-          Wt::log("debug") << "Not setting background sample to only sample nmeas_back="
+          ENGINE_LOG("debug") << "Not setting background sample to only sample nmeas_back="
           << nmeas_back << " while ndet=" << ndet;
         }
       }
@@ -1092,9 +1548,9 @@ void do_search_analysis( Analysis::AnalysisInput input )
           vector<float> rebinned_spectrum( nchannels + 2, 0.0f );
           vector<float> spectrum = *h->gamma_counts();
           vector<float> energies = *h->channel_energies();
-          int32_t rval = g_RebinUsingK40( nchannels, h->live_time(), &(energies[0]),
+          int32_t rval = traced_gadras_call( "RebinUsingK40", g_RebinUsingK40, nchannels, h->live_time(), &(energies[0]),
                                          &(spectrum[0]), &(rebinned_spectrum[0]), &centroid_K40 );
-          Wt::log("debug") << "For detector '" << name << "', got rval=" << rval << ", and centroid_K40=" << centroid_K40;
+          ENGINE_LOG("debug") << "For detector '" << name << "', got rval=" << rval << ", and centroid_K40=" << centroid_K40;
           
           if( rval == 0 )
           {
@@ -1145,18 +1601,18 @@ void do_search_analysis( Analysis::AnalysisInput input )
               }
             }
             
-            Wt::log("debug") << "Energy calibration was updated based on K40 peak for detector '"
+            ENGINE_LOG("debug") << "Energy calibration was updated based on K40 peak for detector '"
             << name << "', moving channel "
             << peak.peakMeanBinNumber << " from " << peak.peakMean << " to "
             << peak.photopeakEnergy << " keV "
             << "(" << newcal->energy_for_channel(peak.peakMeanBinNumber) << ")";
           }else
           {
-            Wt::log("debug") << "Not warning user energy calibration failed for detector '" << name << "'.";
+            ENGINE_LOG("debug") << "Not warning user energy calibration failed for detector '" << name << "'.";
           }
         }catch( std::exception &e )
         {
-          Wt::log("error") << "Got exception recalibrating from background: " << e.what() ;
+          EngineLog::log("error") << "Got exception recalibrating from background: " << e.what() ;
         }
       }//for( const auto &name : input_file->detector_names() )
       
@@ -1169,6 +1625,11 @@ void do_search_analysis( Analysis::AnalysisInput input )
     
     // Now go through and get energy calibration to all have the same number of channels.
     //  Note that if a single detector, this will have no effect.
+    //
+    //  These calibrations are only used for their channel energies (to rebin to, and get the
+    //  upper energy passed to GADRAS), so for polynomial and FRF we'll compute the energies of
+    //  all channels in a batch, and define the calibration using the lower channel energies,
+    //  rather than having SpecUtils evaluate the equation one channel at a time.
     for( auto &nv : energy_cals )
     {
       auto oldcal = nv.second;
@@ -1183,7 +1644,11 @@ void do_search_analysis( Analysis::AnalysisInput input )
         case SpecUtils::EnergyCalType::Polynomial:
         case SpecUtils::EnergyCalType::UnspecifiedUsingDefaultPolynomial:
         {
-          newcal->set_polynomial( nchannels, oldcal->coefficients(), oldcal->deviation_pairs() );
+          vector<float> channel_energies
+                = EnergyCal::batch_lower_channel_energies( SpecUtils::EnergyCalType::Polynomial,
+                                                           oldcal->coefficients(), nchannels,
+                                                           oldcal->deviation_pairs() );
+          newcal->set_lower_channel_energy( nchannels, std::move(channel_energies) );
           break;
         }//case Polynomial
           
@@ -1192,7 +1657,11 @@ void do_search_analysis( Analysis::AnalysisInput input )
           const vector<float> polycoefs
               = SpecUtils::fullrangefraction_coef_to_polynomial( oldcal->coefficients(),
                                                                  oldcal->num_channels() );
-          newcal->set_polynomial( nchannels, polycoefs, oldcal->deviation_pairs() );
+          vector<float> channel_energies
+                = EnergyCal::batch_lower_channel_energies( SpecUtils::EnergyCalType::Polynomial,
+                                                           polycoefs, nchannels,
+                                                           oldcal->deviation_pairs() );
+          newcal->set_lower_channel_energy( nchannels, std::move(channel_energies) );
           break;
         }//case SpecUtils::EnergyCalType::FullRangeFraction:
           
@@ -1233,6 +1702,11 @@ void do_search_analysis( Analysis::AnalysisInput input )
       nv.second = newcal;
     }//for( auto &nv : energy_cals )
     
+    // Detectors with equal calibrations will now share calibration objects, so `fill_inputs`
+    //  can skip rebinning them.
+    for( auto &nv : energy_cals )
+      nv.second = EnergyCal::intern_energy_cal( nv.second );
+    
 
     // If we have multiple detectors (ex, a portal), we will use the "raw" function calls
     //  (InitializeIsotopeIdRaw and StreamingSearch).  These functions make us pass in channel
@@ -1315,7 +1789,7 @@ void do_search_analysis( Analysis::AnalysisInput input )
           for( const auto &s : samples_to_get )
             samplestr += (samplestr.empty() ? "" : ", ") + s;
           
-          Wt::log("debug") << "Missing samples {" << samplestr << "} for detector '" << name << "'";
+          ENGINE_LOG("debug") << "Missing samples {" << samplestr << "} for detector '" << name << "'";
           continue;
         }//if( this isnt a gamma spectrum ).
         
@@ -1333,6 +1807,9 @@ void do_search_analysis( Analysis::AnalysisInput input )
                                          *h->gamma_channel_contents(),
                                          energy_binning_of_summed,
                                          countsv_sum );
+        }else
+        {
+          EnergyCal::record_rebin_skipped();
         }
         
         if( h->energy_calibration() != cal )
@@ -1341,7 +1818,10 @@ void do_search_analysis( Analysis::AnalysisInput input )
                                          *h->gamma_channel_contents(),
                                          *cal->channel_energies(),
                                          countsv_indiv );
-        }//if( h->energy_calibration() != cal )
+        }else
+        {
+          EnergyCal::record_rebin_skipped();
+        }//if( h->energy_calibration() != cal ) / else
         
         assert( countsv_sum.size() == nchannels );
         assert( countsv_indiv.size() == nchannels );
@@ -1412,7 +1892,7 @@ void do_search_analysis( Analysis::AnalysisInput input )
     if( use_raw_search )
     {
       assert( g_StreamingSearch );
-      call_stat = g_StreamingSearch( &(live_times[0]), &(real_times[0]), &(spectrum_buffer[0]),
+      call_stat = profiled_gadras_call( PerfCounters::CallType::StreamingSearch, g_gad_drf, g_StreamingSearch, &(live_times[0]), &(real_times[0]), &(spectrum_buffer[0]),
                                      &stuff_of_interest, &isotope_string, &(energy_max[0]),
                                      AnalysisMode::INITIALIZE, &(det_stat[0]), neutrons,
                                      &rate_not_norm );
@@ -1426,17 +1906,17 @@ void do_search_analysis( Analysis::AnalysisInput input )
       }
       
       //For simple: StaticSearch does energy cal,
-      Wt::log("debug") << "Initialization call for StreamingSearch returned: "
+      ENGINE_LOG("debug") << "Initialization call for StreamingSearch returned: "
                            << stream_search_result_str(call_stat);
       
       // Now call in to actually use the background
-      call_stat = g_StreamingSearch( &(live_times[0]), &(real_times[0]), &(spectrum_buffer[0]),
+      call_stat = profiled_gadras_call( PerfCounters::CallType::StreamingSearch, g_gad_drf, g_StreamingSearch, &(live_times[0]), &(real_times[0]), &(spectrum_buffer[0]),
                                     &stuff_of_interest, &isotope_string, &(energy_max[0]),
                                     AnalysisMode::ANALYZE, &(det_stat[0]), neutrons,
                                     &rate_not_norm );
       
       //For simple: StaticSearch does energy cal,
-      Wt::log("debug") << "Background analysis call for StreamingSearch returned: "
+      ENGINE_LOG("debug") << "Background analysis call for StreamingSearch returned: "
                            << stream_search_result_str(call_stat);
       
       if( call_stat < 0 )
@@ -1449,13 +1929,13 @@ void do_search_analysis( Analysis::AnalysisInput input )
     {
       assert( ndet == 1 );
       assert( g_SearchIsotopeID );
-      call_stat = g_SearchIsotopeID( summed_live_time, summed_real_time, &(channel_counts_summed[0]),
+      call_stat = profiled_gadras_call( PerfCounters::CallType::SearchIsotopeID, g_gad_drf, g_SearchIsotopeID, summed_live_time, summed_real_time, &(channel_counts_summed[0]),
                                      &stuff_of_interest, &isotope_string, AnalysisMode::INITIALIZE,
                                      &(energy_binning_of_summed[0]), neutrons, &rate_not_norm );
        
       // TODO: Lee free()'s energy_binning_of_summed after each call to SearchIsotopeID - do we have to? Should we?
       
-      Wt::log("debug") << "Initialization call for SearchIsotopeID returned code " << call_stat;
+      ENGINE_LOG("debug") << "Initialization call for SearchIsotopeID returned code " << call_stat;
       
       if( call_stat < 0 )
       {
@@ -1465,11 +1945,11 @@ void do_search_analysis( Analysis::AnalysisInput input )
       }
       
       // Now call in to actually analyze the background
-      call_stat = g_SearchIsotopeID( summed_live_time, summed_real_time, &(channel_counts_summed[0]),
+      call_stat = profiled_gadras_call( PerfCounters::CallType::SearchIsotopeID, g_gad_drf, g_SearchIsotopeID, summed_live_time, summed_real_time, &(channel_counts_summed[0]),
                                     &stuff_of_interest, &isotope_string, AnalysisMode::ANALYZE,
                                     &(energy_binning_of_summed[0]), neutrons, &rate_not_norm );
       
-      Wt::log("debug") << "First analysis call (background) for SearchIsotopeID returned code " << call_stat;
+      ENGINE_LOG("debug") << "First analysis call (background) for SearchIsotopeID returned code " << call_stat;
       
       if( call_stat < 0 )
       {
@@ -1495,7 +1975,7 @@ void do_search_analysis( Analysis::AnalysisInput input )
         vector<float> lt_dummy( ndet, 0.0f ), rt_dummy( ndet, 0.0f );
         vector<int32_t> spectrum_dummy( ndet*nchannels, 0 ); //for raw search
         
-        call_stat = g_StreamingSearch( &(lt_dummy[0]), &(rt_dummy[0]), &(spectrum_dummy[0]),
+        call_stat = profiled_gadras_call( PerfCounters::CallType::StreamingSearch, g_gad_drf, g_StreamingSearch, &(lt_dummy[0]), &(rt_dummy[0]), &(spectrum_dummy[0]),
                                       &soi_dummy, &dummy_str, &(energy_max_dummy[0]),
                                       AnalysisMode::RESET, &(det_stat_dummy[0]), neutrons_nummy,
                                       &notnorm_dumy );
@@ -1504,21 +1984,27 @@ void do_search_analysis( Analysis::AnalysisInput input )
         vector<float> channel_counts_dummy( nchannels, 0.0f ); //for calibrated search
         vector<float> energy_binning_dummy( nchannels + 1 );
         
-        call_stat = g_SearchIsotopeID( summed_live_time, summed_real_time, &(channel_counts_dummy[0]),
+        call_stat = profiled_gadras_call( PerfCounters::CallType::SearchIsotopeID, g_gad_drf, g_SearchIsotopeID, summed_live_time, summed_real_time, &(channel_counts_dummy[0]),
                                       &soi_dummy, &dummy_str, AnalysisMode::RESET,
                                       &(energy_binning_dummy[0]), neutrons_nummy, &notnorm_dumy );
       }//if( use_raw_search ) / else
       
-      Wt::log("debug") << "Have RESET analysis with returned code " << call_stat;
+      ENGINE_LOG("debug") << "Have RESET analysis with returned code " << call_stat;
     } );
     
     
     
     vector<pair<float,set<int>>> real_time_and_samples;
     
+    // For reporting progress to the requester, if it wants it.
+    double last_progress_time = start_time;
+    size_t windows_since_progress = 0;
+    
     // Now loop over and analyze the data
     for( auto sample_iter = begin(sample_numbers); sample_iter != end(sample_numbers); ++sample_iter )
     {
+      check_not_abandoned( input, "between search windows" );
+      
       float real_time = 0.0f;
       set<int> samples;
       
@@ -1554,12 +2040,12 @@ void do_search_analysis( Analysis::AnalysisInput input )
       
       if( use_raw_search )
       {
-        call_stat = g_StreamingSearch( &(live_times[0]), &(real_times[0]), &(spectrum_buffer[0]),
+        call_stat = profiled_gadras_call( PerfCounters::CallType::StreamingSearch, g_gad_drf, g_StreamingSearch, &(live_times[0]), &(real_times[0]), &(spectrum_buffer[0]),
                                       &stuff_of_interest, &isotope_string, &(energy_max[0]),
                                       AnalysisMode::ANALYZE, &(det_stat[0]), neutrons,
                                       &rate_not_norm );
         if( call_stat < 0 )
-          Wt::log("debug") << "ANALYZE call to StreamingSearch returned: "
+          ENGINE_LOG("debug") << "ANALYZE call to StreamingSearch returned: "
                                << stream_search_result_str(call_stat);
         
         if( call_stat < 0 )
@@ -1569,14 +2055,14 @@ void do_search_analysis( Analysis::AnalysisInput input )
         }
       }else
       {
-        call_stat = g_SearchIsotopeID( summed_live_time, summed_real_time, &(channel_counts_summed[0]),
+        call_stat = profiled_gadras_call( PerfCounters::CallType::SearchIsotopeID, g_gad_drf, g_SearchIsotopeID, summed_live_time, summed_real_time, &(channel_counts_summed[0]),
                                       &stuff_of_interest, &isotope_string, AnalysisMode::ANALYZE,
                                       &(energy_binning_of_summed[0]), neutrons, &rate_not_norm );
         
         // TODO: Lee free()'s energy_binning_of_summed after each call to SearchIsotopeID - do we have to? Should we?
         
         if( call_stat < 0 )
-          Wt::log("debug") << "ANALYZE call for SearchIsotopeID returned code " << call_stat;
+          ENGINE_LOG("debug") << "ANALYZE call for SearchIsotopeID returned code " << call_stat;
         
         if( call_stat < 0 )
         {
@@ -1586,15 +2072,15 @@ void do_search_analysis( Analysis::AnalysisInput input )
       }//if( use_raw_search ) / else
       
       //if( isotope_string )
-      //  Wt::log("debug") << "Analysis call returned " << std::string(isotope_string);
+      //  ENGINE_LOG("debug") << "Analysis call returned " << std::string(isotope_string);
       //else
-      //  Wt::log("debug") << "Analysis call returned NULL";
+      //  ENGINE_LOG("debug") << "Analysis call returned NULL";
       
       // Lets get analysis results
       assert( g_GetCurrentIsotopeIDResults && g_ClearIsotopeIDResults );
       IsotopeIDResult id_result;
       
-      g_GetCurrentIsotopeIDResults( &id_result );
+      traced_gadras_call( "GetCurrentIsotopeIDResults", g_GetCurrentIsotopeIDResults, &id_result );
       
       // I dont know how to access if the current detector is low, medium, or high resolution,
       //  so to tell the ID confidence, we will parse the isotope_string, and use this, instead of
@@ -1608,7 +2094,7 @@ void do_search_analysis( Analysis::AnalysisInput input )
         else if( r.second == "F" )
           medium_conf_isotopes[r.first].insert( begin(samples), end(samples) );
         else if( (r.second != "L") && !(r.second=="" && r.first=="NONE") )
-          Wt::log("debug") << "Unknown confidence '" << r.second << "' from isostr='" << r.first << "'";
+          ENGINE_LOG("debug") << "Unknown confidence '" << r.second << "' from isostr='" << r.first << "'";
       }//for( const auto &r : iso_to_conf )
         
       if( id_result.nIsotopes > 0 )
@@ -1682,23 +2168,39 @@ void do_search_analysis( Analysis::AnalysisInput input )
       }//if( idResults.nIsotopes > 0 )
       
         
-      g_ClearIsotopeIDResults();
+      traced_gadras_call( "ClearIsotopeIDResults", g_ClearIsotopeIDResults );
       
       // Zero everything out
       zero_inputs();
+      
+      ++windows_since_progress;
+      if( input.progress && (std::next(sample_iter) != end(sample_numbers)) )
+      {
+        const double now = SpecUtils::get_wall_time();
+        const bool time_passed = ((input.progress_interval_seconds > 0.0)
+                                  && ((now - last_progress_time) >= input.progress_interval_seconds));
+        const bool windows_passed = ((input.progress_interval_windows > 0)
+                                   && (windows_since_progress >= input.progress_interval_windows));
+        
+        if( time_passed || windows_passed )
+        {
+          Analysis::AnalysisProgress progress;
+          progress.ana_number = input.ana_number;
+          progress.fraction_done = (std::distance( begin(sample_numbers), sample_iter ) + 1.0)
+                                   / sample_numbers.size();
+          progress.isotopes = search_isotopes_str( high_conf_isotopes, medium_conf_isotopes );
+          
+          Analysis::post_analysis_progress( input, progress );
+          
+          last_progress_time = now;
+          windows_since_progress = 0;
+        }//if( time_passed || windows_passed )
+      }//if( input.progress && not the last window )
     }//for( const int sample : sample_numbers )
     
     
     
-    result.isotopes = "";
-    for( const auto &iso : high_conf_isotopes )
-      result.isotopes += (result.isotopes.empty() ? "" : "+") + iso.first + "(H)";
-      
-    for( const auto &iso : medium_conf_isotopes )
-    {
-      if( !high_conf_isotopes.count(iso.first) )
-        result.isotopes += (result.isotopes.empty() ? "" : "+") + iso.first + "(M)";
-    }
+    result.isotopes = search_isotopes_str( high_conf_isotopes, medium_conf_isotopes );
     
     for( int i = 0; i < static_cast<int>(result.isotope_names.size()); ++i )
     {
@@ -1715,7 +2217,7 @@ void do_search_analysis( Analysis::AnalysisInput input )
         if( medium_conf_isotopes.count(name) )
           conf += "M";
         
-        Wt::log("debug") << "Got '" << name << "' with confidence " << conf << " and "
+        ENGINE_LOG("debug") << "Got '" << name << "' with confidence " << conf << " and "
                              << confidence << " that is of category " << result.isotope_types[i]
                              << " and count rate " << result.isotope_count_rates[i];
       }//end debug code
@@ -1724,7 +2226,7 @@ void do_search_analysis( Analysis::AnalysisInput input )
          && !medium_conf_isotopes.count(result.isotope_names[i])
          && (confidence < fairThreshold) )
       {
-        Wt::log("debug") << "Removing isotope " << result.isotope_names[i]
+        ENGINE_LOG("debug") << "Removing isotope " << result.isotope_names[i]
                              << " with confidence " << confidence << " from results, since it wasnt"
                              << " medium or high confidence";
         
@@ -1750,10 +2252,15 @@ void do_search_analysis( Analysis::AnalysisInput input )
                                           " calibration, pending implementation." );
     
     result.gadras_analysis_error = 0;
+    
+    const EnergyCal::EnergyCalInternStats cal_stats = EnergyCal::energy_cal_intern_stats();
+    ENGINE_LOG("debug") << "Energy calibration pool has merged " << cal_stats.num_merged << " of "
+                            << cal_stats.num_lookups << " calibrations, and skipped "
+                            << cal_stats.num_rebins_skipped << " rebins, since startup";
   }catch( std::exception &e )
   {
     result.error_message = e.what();
-    Wt::log("error") << "Analysis failed due to: " << e.what();
+    EngineLog::log("error") << "Analysis failed due to: " << e.what();
     
     
     // We may need to call StreamingSearch( ... AnalysisMode::RESET ... ) or
@@ -1762,36 +2269,12 @@ void do_search_analysis( Analysis::AnalysisInput input )
   }//try - catch do the analysis
 
   
-  const string &wt_app_id = input.wt_app_id;
-  function<void(Analysis::AnalysisOutput)> callback = input.callback;
-  
-  if( callback )
-  {
-    auto server = Wt::WServer::instance();
-    if( server && !wt_app_id.empty() )
-    {
-      server->post( wt_app_id, [result,callback](){
-        callback( result );
-        wApp->triggerUpdate();
-        
-        Wt::log("debug") << "Update should have triggered to GUI from search/portal analysis";
-      } );
-    }else if( wt_app_id.empty() )
-    {
-      Wt::log("debug") << "wt_app_id is empty from search/portal analysis...";
-      
-      callback( result );
-    }else //if( !wt_app_id.empty() )
-    {
-      Wt::log("error") << "Error: got non empty Wt session ID ('" << wt_app_id
-      << "'), but there is no WServer instance - not calling result callback for search/portal!";
-    }
-  }//if( callback )
-}//void do_search_analysis( Analysis::AnalysisInput input )
+  return result;
+}//Analysis::AnalysisOutput do_search_analysis( const Analysis::AnalysisInput &input )
 
 
 
-void do_portal_analysis( Analysis::AnalysisInput input )
+Analysis::AnalysisOutput do_portal_analysis( const Analysis::AnalysisInput &input )
 {
   std::lock_guard<std::mutex> ana_lock( g_gad_mutex );
   
@@ -1817,6 +2300,8 @@ void do_portal_analysis( Analysis::AnalysisInput input )
   
   try
   {
+    check_not_abandoned( input, "before DRF initialization" );
+    
     const double start_drf_init_time = SpecUtils::get_wall_time();
    
     int32_t nchannels_dummy = 0;
@@ -1836,13 +2321,13 @@ void do_portal_analysis( Analysis::AnalysisInput input )
     
     if( !SpecUtils::is_file( db_path ) )
     {
-      Wt::log("error") << "GADRAS database doesnt appear to exist at '" << db_path << "'";
+      EngineLog::log("error") << "GADRAS database doesnt appear to exist at '" << db_path << "'";
       throw runtime_error( "Issue finding database for analysis." );
     }
     
     if( !input_file )
     {
-      Wt::log("error") << "Somehow no input SpecFile was specified for RPM analysis";
+      EngineLog::log("error") << "Somehow no input SpecFile was specified for RPM analysis";
       throw runtime_error( "Issue with input file to analysis." );
     }
     
@@ -1856,14 +2341,14 @@ void do_portal_analysis( Analysis::AnalysisInput input )
     
       if( !tmp_pcf )
       {
-        Wt::log("error") << "Failed to open temporary file '" << ana_filename << "'.";
+        EngineLog::log("error") << "Failed to open temporary file '" << ana_filename << "'.";
         throw runtime_error( "Could not create temporary file for analysis." );
       }
       
       ana_tmp_pcf_path = ana_filename;
       if( !input_file->write_pcf( tmp_pcf ) )
       {
-        Wt::log("error") << "Failed to write PCF file to temp file '" << ana_filename << "'.";
+        EngineLog::log("error") << "Failed to write PCF file to temp file '" << ana_filename << "'.";
         throw runtime_error( "Error creating file for analysis." );
       }
     }// End write temporary PCF file for analysis
@@ -1931,7 +2416,7 @@ void do_portal_analysis( Analysis::AnalysisInput input )
     const double setup_finished_time = SpecUtils::get_wall_time();
     
     int writePlotFlag = 0; // don't try writing just yet
-    const int call_stat = g_PortalIsotopeIDCInterface( &(db_path[0]), &(ana_tmp_pcf_path[0]),
+    const int call_stat = profiled_gadras_call( PerfCounters::CallType::PortalIsotopeIDCInterface, drf_rel_path, g_PortalIsotopeIDCInterface, &(db_path[0]), &(ana_tmp_pcf_path[0]),
                                                   &portalIsotopeIDOptions,
                                                   writePlotFlag,
                                                   &portalPlotOptions,
@@ -1952,12 +2437,10 @@ void do_portal_analysis( Analysis::AnalysisInput input )
     
     const double call_finished_time = SpecUtils::get_wall_time();
     
-    printf("Isotope String: %s\n", ana_out.isotopeString);
-    
     const string isostr = ana_out.isotopeString;
     
-    Wt::log("debug") << "Portal analysis returned code " << call_stat
-                     << " and isotope string '" << isostr.c_str() << "'";
+    ENGINE_LOG("debug") << "Portal analysis returned code " << call_stat
+                            << " and isotope string '" << isostr.c_str() << "'";
     
     if( call_stat < 0)
       throw runtime_error( "An analysis error occurred or template database was not found." );
@@ -1977,7 +2460,7 @@ void do_portal_analysis( Analysis::AnalysisInput input )
       result.rate_not_norm = -1;
       result.alarm_basis_duration = -1;
       
-      cout << "\n\nPortal analysis quantities currently not used:\n"
+      ENGINE_LOG("debug") << "Portal analysis quantities currently not used:\n"
       "\tDateTime: " << ana_out.dateTime << "\n"
       "\tforegroundTotalTime=" << ana_out.foregroundTotalTime << "\n"
       "\tbackgroundTotalTime=" << ana_out.backgroundTotalTime << "\n"
@@ -1992,8 +2475,7 @@ void do_portal_analysis( Analysis::AnalysisInput input )
       "\teventType=" << ana_out.eventType << "\n"
       "\talarmColor=" << ana_out.alarmColor << "\n"
       "\talarmDescription=" << ana_out.alarmDescription << "\n"
-      "\tisotopeString=" << ana_out.isotopeString << "\n"
-      "\n\n" << endl;
+      "\tisotopeString=" << ana_out.isotopeString;
       
       
       const map<string,string> iso_to_conf = get_iso_to_conf( isostr.c_str() );
@@ -2022,7 +2504,7 @@ void do_portal_analysis( Analysis::AnalysisInput input )
     }//if( call_stat >= 0) / else
     
     
-    Wt::log("debug") << "Finished with analysis: '" << isostr.c_str() << "'";
+    ENGINE_LOG("debug") << "Finished with analysis: '" << isostr.c_str() << "'";
     
     const double finished_time = SpecUtils::get_wall_time();
     
@@ -2031,14 +2513,14 @@ void do_portal_analysis( Analysis::AnalysisInput input )
     const double setup_time = setup_finished_time - start_time;
     const double gadras_time = call_finished_time - setup_finished_time;
     
-    Wt::log("debug") << "Analysis took\n"
+    ENGINE_LOG("debug") << "Analysis took\n"
     << "\t\tSetup Time:    " << setup_time << "\n"
     << "\t\tDRF init Time: " << drf_init_time << "\n"
     << "\t\tAna Time:      " << gadras_time << "\n"
     << "\t\tTotal Time:    " << total_time << "\n"
     ;
     
-    Wt::log("info") << "Analysis took\n"
+    EngineLog::log("info") << "Analysis took\n"
     << "\t\tSetup Time: " << setup_time << "\n"
     //<< "\t\tDRF init Time: " << drf_init_time << "\n"
     << "\t\tAna Time:   " << gadras_time << "\n"
@@ -2046,96 +2528,196 @@ void do_portal_analysis( Analysis::AnalysisInput input )
   }catch( std::exception &e )
   {
     result.error_message = e.what();
-    Wt::log("error") << "Analysis failed due to: " << e.what();
+    EngineLog::log("error") << "Analysis failed due to: " << e.what();
   }
   
   if( !ana_tmp_pcf_path.empty() )
   {
     if( !SpecUtils::remove_file(ana_tmp_pcf_path) )
-      Wt::log("error") << "Failed to remove temporary RPM analysis PCF file '"
-                       << ana_tmp_pcf_path << "'";
+      EngineLog::log("error") << "Failed to remove temporary RPM analysis PCF file '"
+                              << ana_tmp_pcf_path << "'";
   }
   
   
-  const string &wt_app_id = input.wt_app_id;
-  function<void(Analysis::AnalysisOutput)> callback = input.callback;
-  
-  if( callback )
+  return result;
+}//Analysis::AnalysisOutput do_portal_analysis( const Analysis::AnalysisInput &input )
+
+
+
+/** Runs the analysis appropriate for the input, in the current process. */
+Analysis::AnalysisOutput analyze( const Analysis::AnalysisInput &input )
+{
+  switch( input.analysis_type )
   {
-    auto server = Wt::WServer::instance();
-    if( server && !wt_app_id.empty() )
+    case Analysis::AnalysisType::Simple:
     {
-      server->post( wt_app_id, [result,callback](){
-        callback( result );
-        wApp->triggerUpdate();
-        
-        Wt::log("debug") << "Update should have triggered to GUI";
-      } );
-    }else if( wt_app_id.empty() )
+      Tracing::Span span( "simple_analysis", "analysis" );
+      return do_simple_analysis( input );
+    }
+      
+    case Analysis::AnalysisType::Search:
     {
-      Wt::log("debug") << "wt_app_id is empty...";
+      Tracing::Span span( "search_analysis", "analysis" );
+      return do_search_analysis( input );
+    }
       
-      callback( result );
-    }else //if( !wt_app_id.empty() )
+    case Analysis::AnalysisType::Portal:
     {
-      Wt::log("error") << "Error: got non empty Wt session ID ('" << wt_app_id << "'), but there is no"
-                       << " WServer instance - not calling result callback!";
+      Tracing::Span span( "portal_analysis", "analysis" );
+      return do_portal_analysis( input );
     }
-  }//if( callback )
-}//void do_portal_analysis( Analysis::AnalysisInput input )
+  }//switch( input.analysis_type )
+  
+  Analysis::AnalysisOutput result;
+  result.ana_number = input.ana_number;
+  result.drf_used = input.drf_folder;
+  result.error_message = "Invalid analysis type";
+  
+  return result;
+}//Analysis::AnalysisOutput analyze( const Analysis::AnalysisInput &input )
+
 
 
 
 void do_analysis()
 {
+  Tracing::set_thread_name( "analysis" );
+  
   do
   {
-    vector<Analysis::AnalysisInput> ana_to_do;
+    QueuedAnalysis item;
     
     {
       std::unique_lock<std::mutex> queue_lock( g_ana_queue_mutex );
       
       if( !g_keep_analyzing && g_simple_ana_queue.empty() )
       {
-        Wt::log("info") << "Will stop analyzing";
+        EngineLog::log("info") << "Will stop analyzing";
         break;
       }
       
-      Wt::log("info") << "Will wait for next analysis";
-      g_ana_queue_cv.wait( queue_lock );
+      EngineLog::log("info") << "Will wait for next analysis";
+      // Inputs may have been posted while we were analyzing (e.g., from a result callback), so
+      //  only wait if there is nothing we can take.  Slow lane inputs may have to wait for
+      //  dispatched analyses to finish, even when stopping.
+      g_ana_queue_cv.wait( queue_lock, [](){
+        return g_simple_ana_queue.can_pop() || (!g_keep_analyzing && g_simple_ana_queue.empty());
+      } );
     
-      Wt::log("info") << "Received notification to do analysis";
+      EngineLog::log("info") << "Received notification to do analysis";
+      
+      // Woken up to stop; go back around to check if there is anything left.
+      if( !g_simple_ana_queue.can_pop() )
+        continue;
+      
+      // Take one input at a time, so inputs posted while analyzing get their fair turn.
+      item = g_simple_ana_queue.pop();
       
-      ana_to_do.insert( end(ana_to_do), begin(g_simple_ana_queue), end(g_simple_ana_queue) );
-      g_simple_ana_queue.clear();
+      EngineLog::log("info") << "Will do " << Analysis::to_str(item.lane) << " lane analysis; "
+                             << g_simple_ana_queue.size() << " analysis's still queued.";
     }
     
-    Wt::log("info") << "Will do " << ana_to_do.size() << " analysis's.";
+    const Analysis::AnalysisInput &input = item.input;
     
-    for( const Analysis::AnalysisInput &input : ana_to_do )
-    {
-      switch( input.analysis_type )
+    {// begin analyze input
+      Tracing::RequestScope trace_scope( input.trace_id );
+      Tracing::async_end( "queue_wait", "analysis", input.trace_id );
+      
+      // Dont spend any time on results that arent wanted anymore (e.g., the REST client timed out
+      //  while we were queued).
+      if( Analysis::is_abandoned( input ) )
       {
-        case Analysis::AnalysisType::Simple:
-          do_simple_analysis( input );
-          break;
+        {
+          std::lock_guard<std::mutex> lock( g_abandoned_mutex );
+          ++g_num_abandoned_skipped;
+        }
         
-        case Analysis::AnalysisType::Search:
-          do_search_analysis( input );
-          break;
+        EngineLog::log("info") << "Skipping analysis " << input.ana_number
+                               << "; its deadline passed, or the requester went away.";
+        
+        Analysis::AnalysisOutput result;
+        result.ana_number = input.ana_number;
+        result.drf_used = input.drf_folder;
+        result.error_message = "Analysis was not run, as its deadline passed, or the requester went"
+                               " away, while it was queued.";
+        Analysis::post_analysis_result( input, result );
+        continue;
+      }//if( Analysis::is_abandoned( input ) )
+      
+      const double start_time = SpecUtils::get_wall_time();
+      
+      // Let the application hand the analysis off (e.g., to a cluster worker); the result is
+      //  posted from whatever thread it finishes on.
+      if( g_queue_hooks.dispatch )
+      {
+        {
+          std::lock_guard<std::mutex> queue_lock( g_ana_queue_mutex );
+          g_simple_ana_queue.dispatched( item.lane );
+        }
+        
+        const auto queued = std::make_shared<QueuedAnalysis>( item );
+        const bool dispatched = g_queue_hooks.dispatch( input, [queued,start_time]( const Analysis::AnalysisOutput &result ){
+          const Analysis::AnalysisInput &input = queued->input;
+          const double end_time = SpecUtils::get_wall_time();
           
-        case Analysis::AnalysisType::Portal:
-          do_portal_analysis( input );
-          break;
-      }//switch( input.analysis_type )
-    }//for( const Analysis::AnalysisInput &input : ana_to_do )
+          {
+            std::lock_guard<std::mutex> queue_lock( g_ana_queue_mutex );
+            g_simple_ana_queue.undispatched( queued->lane );
+            g_simple_ana_queue.record_latency( *queued, start_time, end_time );
+          }
+          g_ana_queue_cv.notify_all();
+          
+          record_if_abandoned( input, result, end_time - start_time );
+          Analysis::post_analysis_result( input, result );
+          if( g_queue_hooks.on_result )
+            g_queue_hooks.on_result( input, result );
+        } );
+        
+        if( dispatched )
+          continue;
+        
+        std::lock_guard<std::mutex> queue_lock( g_ana_queue_mutex );
+        g_simple_ana_queue.undispatched( item.lane );
+      }//if( g_queue_hooks.dispatch )
+      
+      Analysis::AnalysisOutput result;
+      
+      bool ran = false;
+      if( g_queue_hooks.run )
+      {
+        try
+        {
+          ran = g_queue_hooks.run( input, result );
+        }catch( std::exception &e )
+        {
+          EngineLog::log("error") << "Failed to run analysis out of process (" << e.what()
+                                  << "); will analyze in this process.";
+          ran = false;
+        }//try / catch
+      }//if( g_queue_hooks.run )
+      
+      if( !ran )
+        result = analyze( input );
+      
+      const double end_time = SpecUtils::get_wall_time();
+      {
+        std::lock_guard<std::mutex> queue_lock( g_ana_queue_mutex );
+        g_simple_ana_queue.record_latency( item, start_time, end_time );
+      }
+      
+      record_if_abandoned( input, result, end_time - start_time );
+      
+      Analysis::post_analysis_result( input, result );
+      if( g_queue_hooks.on_result )
+        g_queue_hooks.on_result( input, result );
+    }// end analyze input
     
     {
       //cout << "Will check if we should keep analyzing..." << endl;
       std::lock_guard<std::mutex> queue_lock( g_ana_queue_mutex );
       if( !g_keep_analyzing && g_simple_ana_queue.empty() )
       {
-        Wt::log("info") << "Will stop analyzing";
+        EngineLog::log("info") << "Will stop analyzing";
         break;
       }
       //cout << "...will keep analyzing" << endl;
@@ -2144,7 +2726,7 @@ void do_analysis()
   
   g_ana_queue_cv.notify_all();
   
-  Wt::log("info") << "Have finished in do_analysis() - closing analysis thread.";
+  EngineLog::log("info") << "Have finished in do_analysis() - closing analysis thread.";
 }//void do_analysis()
 
 }//namespace
@@ -2213,8 +2795,8 @@ bool load_gadras_lib( const std::string lib_name )
       error_msg = "no error msg available.";
 #endif
     
-    Wt::log("error") << "Failed to load the dynamic library '" << lib_name << "', reason: "
-                     << error_msg;
+    EngineLog::log("error") << "Failed to load the dynamic library '" << lib_name << "', reason: "
+                            << error_msg;
     return false;
   }
 
@@ -2225,7 +2807,7 @@ bool load_gadras_lib( const std::string lib_name )
 #endif
   if( !g_gadrasversionnumber )
   {
-    Wt::log("error") << "could not locate the function 'gadrasversionnumber'";
+    EngineLog::log("error") << "could not locate the function 'gadrasversionnumber'";
     return false;
   }
   
@@ -2236,7 +2818,7 @@ bool load_gadras_lib( const std::string lib_name )
 #endif
   if( !g_InitializeIsotopeIdCalibrated )
   {
-    Wt::log("error") << "could not locate the function 'InitializeIsotopeIdCalibrated'";
+    EngineLog::log("error") << "could not locate the function 'InitializeIsotopeIdCalibrated'";
     return false;
   }
   
@@ -2247,7 +2829,7 @@ bool load_gadras_lib( const std::string lib_name )
 #endif
   if( !g_InitializeIsotopeIdRaw )
   {
-    Wt::log("error") << "could not locate the function 'InitializeIsotopeIdCalibrated'";
+    EngineLog::log("error") << "could not locate the function 'InitializeIsotopeIdCalibrated'";
     return false;
   }
   
@@ -2258,7 +2840,7 @@ bool load_gadras_lib( const std::string lib_name )
 #endif
   if( !g_StaticIsotopeID )
   {
-    Wt::log("error") << "could not locate the function 'StaticIsotopeID'";
+    EngineLog::log("error") << "could not locate the function 'StaticIsotopeID'";
     return false;
   }
 
@@ -2270,7 +2852,7 @@ bool load_gadras_lib( const std::string lib_name )
 #endif
   if( !g_StaticIsotopeID )
   {
-    Wt::log("error") << "could not locate the function 'SearchIsotopeID'";
+    EngineLog::log("error") << "could not locate the function 'SearchIsotopeID'";
     return false;
   }
 
@@ -2281,7 +2863,7 @@ bool load_gadras_lib( const std::string lib_name )
 #endif
   if( !g_StreamingSearch )
   {
-    Wt::log("error") << "could not locate the function 'StreamingSearch'";
+    EngineLog::log("error") << "could not locate the function 'StreamingSearch'";
     return false;
   }
   
@@ -2292,7 +2874,7 @@ bool load_gadras_lib( const std::string lib_name )
 #endif
   if( !g_GetCurrentIsotopeIDResults )
   {
-    Wt::log("error") << "could not locate the function 'GetCurrentIsotopeIDResults'";
+    EngineLog::log("error") << "could not locate the function 'GetCurrentIsotopeIDResults'";
     return false;
   }
 
@@ -2303,7 +2885,7 @@ bool load_gadras_lib( const std::string lib_name )
 #endif
   if( !g_ClearIsotopeIDResults )
   {
-    Wt::log("error") << "could not locate the function 'ClearIsotopeIDResults'";
+    EngineLog::log("error") << "could not locate the function 'ClearIsotopeIDResults'";
     return false;
   }
   
@@ -2316,7 +2898,7 @@ bool load_gadras_lib( const std::string lib_name )
 #endif
   if( !g_RebinUsingK40 )
   {
-    Wt::log("error") << "could not locate the function 'RebinUsingK40'";
+    EngineLog::log("error") << "could not locate the function 'RebinUsingK40'";
     return false;
   }
   
@@ -2328,12 +2910,12 @@ bool load_gadras_lib( const std::string lib_name )
 #endif
   if( !g_PortalIsotopeIDCInterface )
   {
-    Wt::log("error") << "could not locate the function 'PortalIsotopeIDCInterface'";
+    EngineLog::log("error") << "could not locate the function 'PortalIsotopeIDCInterface'";
     return false;
   }
 
   
-  Wt::log("info") << "Loaded '" << lib_name << "'";
+  EngineLog::log("info") << "Loaded '" << lib_name << "'";
   
   return true;
 }//bool load_gadras_lib( const std::String lib_name )
@@ -2532,13 +3114,43 @@ AnalysisOutput::AnalysisOutput()
 }
 
 
-Wt::Json::Object AnalysisOutput::toJson() const
+EngineJson::Object AnalysisOutput::toJson() const
 {
-  Wt::Json::Object resultjson;
+  Tracing::Span span( "result_to_json", "analysis" );
+  
+  EngineJson::Object resultjson;
   
   resultjson["analysisError"] = this->gadras_analysis_error;
   if( !this->error_message.empty() )
-    resultjson["errorMessage"] = Wt::WString::fromUTF8( this->error_message );
+    resultjson["errorMessage"] = this->error_message;
+  
+  if( !this->ensemble.empty() )
+  {
+    EngineJson::Array candidates;
+    for( const EnsembleCandidate &candidate : this->ensemble )
+    {
+      const bool failed = ((candidate.gadras_intialization_error < 0)
+                           || (candidate.gadras_analysis_error < 0));
+      
+      EngineJson::Object cand;
+      cand["drf"] = candidate.drf;
+      cand["chosen"] = candidate.chosen;
+      cand["code"] = failed ? 6 : 0;
+      if( !candidate.error_message.empty() )
+        cand["errorMessage"] = candidate.error_message;
+      if( !failed )
+      {
+        cand["isotopeString"] = candidate.isotopes;
+        cand["chi2"] = candidate.chi_sqr;
+      }
+      cand["waitSeconds"] = candidate.wait_seconds;
+      cand["seconds"] = candidate.wall_seconds;
+      
+      candidates.emplace_back( std::move(cand) );
+    }//for( const EnsembleCandidate &candidate : this->ensemble )
+    
+    resultjson["ensemble"] = std::move( candidates );
+  }//if( !this->ensemble.empty() )
   
   if( (this->gadras_intialization_error < 0) || (this->gadras_analysis_error < 0) )
   {
@@ -2555,19 +3167,20 @@ Wt::Json::Object AnalysisOutput::toJson() const
   
   if( !this->analysis_warnings.empty() )
   {
-    Wt::Json::Array &warnings = resultjson["analysisWarnings"] = Wt::Json::Array();
+    EngineJson::Array warnings;
     for( const string &s : this->analysis_warnings )
-      warnings.emplace_back( Wt::WString::fromUTF8(s) );
+      warnings.emplace_back( s );
+    resultjson["analysisWarnings"] = std::move( warnings );
   }//if( !this->analysis_warnings.empty() )
   
-  resultjson["drf"] = Wt::WString::fromUTF8( this->drf_used );
+  resultjson["drf"] = this->drf_used;
   resultjson["stuffOfInterest"] = this->stuff_of_interest;
   //this->rate_not_norm; //float
-  resultjson["isotopeString"] = Wt::WString::fromUTF8( this->isotopes );
+  resultjson["isotopeString"] = this->isotopes;
   resultjson["chi2"] = this->chi_sqr;
   resultjson["alarmBasisDuration"] = this->alarm_basis_duration;
   
-  Wt::Json::Array &isotopes = resultjson["isotopes"] = Wt::Json::Array();
+  EngineJson::Array isotopes;
   
   // All these isotope arrays should be the same size, but we'll be careful, just in case
   size_t num_isotopes = this->isotope_names.size();
@@ -2590,18 +3203,20 @@ Wt::Json::Object AnalysisOutput::toJson() const
     const float isotope_confidence = this->isotope_confidences[i];
     const string &isotope_confidence_str = this->isotope_confidence_strs[i];
     
-    isotopes.push_back( Wt::Json::Object() );
-    Wt::Json::Object &iso = isotopes.back();
-    
-    iso["name"] = Wt::WString::fromUTF8( isotope_name );
-    iso["type"] = Wt::WString::fromUTF8( isotope_type );
+    EngineJson::Object iso;
+    iso["name"] = isotope_name;
+    iso["type"] = isotope_type;
     iso["countRate"] = isotope_count_rate;
     iso["confidence"] = isotope_confidence;
-    iso["confidenceStr"] = Wt::WString::fromUTF8( isotope_confidence_str );
+    iso["confidenceStr"] = isotope_confidence_str;
+    
+    isotopes.emplace_back( std::move(iso) );
   }//for( size_t i = 0; i < num_isotopes; ++i )
   
+  resultjson["isotopes"] = std::move( isotopes );
+  
   return resultjson;
-}//Wt::Json::Object AnalysisOutput::toJson() const
+}//EngineJson::Object AnalysisOutput::toJson() const
 
 
 std::string AnalysisOutput::briefTxtSummary() const
@@ -2675,6 +3290,23 @@ std::string AnalysisOutput::fullTxtSummary() const
     append_line( buffer );
   }
   
+  if( !this->ensemble.empty() )
+  {
+    append_line( "Candidate DRFs:" );
+    
+    for( const EnsembleCandidate &candidate : this->ensemble )
+    {
+      const bool failed = ((candidate.gadras_intialization_error < 0)
+                           || (candidate.gadras_analysis_error < 0));
+      
+      snprintf( buffer, sizeof(buffer), "\t%c %-24s%-10.3f%-8.2fs %s",
+                (candidate.chosen ? '*' : ' '), candidate.drf.c_str(), candidate.chi_sqr,
+                candidate.wall_seconds,
+                (failed ? candidate.error_message.c_str() : candidate.isotopes.c_str()) );
+      append_line( buffer );
+    }//for( const EnsembleCandidate &candidate : this->ensemble )
+  }//if( !this->ensemble.empty() )
+  
   if( (this->gadras_intialization_error < 0) || (this->gadras_analysis_error < 0) )
     return answer;
   
@@ -2743,6 +3375,17 @@ std::string AnalysisOutput::fullTxtSummary() const
 }//std::string AnalysisOutput::fullTxtSummary() const
 
 
+void set_queue_hooks( const QueueHooks &hooks )
+{
+  std::lock_guard<std::mutex> lock( g_analysis_thread_mutex );
+  
+  if( g_analysis_thread )
+    throw runtime_error( "set_queue_hooks(): Analysis thread already running." );
+  
+  g_queue_hooks = hooks;
+}//void set_queue_hooks( const QueueHooks &hooks )
+
+
 void start_analysis_thread()
 {
   {
@@ -2750,56 +3393,80 @@ void start_analysis_thread()
     g_keep_analyzing = true;
   }
   
-  Wt::log("info") << "Will start analysis thread";
+  EngineLog::log("info") << "Will start analysis thread";
   std::lock_guard<std::mutex> lock( g_analysis_thread_mutex );
   
   if( g_analysis_thread )
     throw runtime_error( "start_analysis_thread(): Analysis thread already running." );
 
+  // Called before we start the analysis thread, so e.g., worker processes can be forked.
+  if( g_queue_hooks.on_start )
+    g_queue_hooks.on_start( &analyze );
+
   g_analysis_thread = make_unique<thread>( &do_analysis );
   
-  Wt::log("info") << "Have started analysis thread";
+  EngineLog::log("info") << "Have started analysis thread";
 }//void start_analysis_thread()
 
 
 void stop_analysis_thread()
 {
-  Wt::log("info") << "Will stop analysis thread";
+  EngineLog::log("info") << "Will stop analysis thread";
   
   std::lock_guard<std::mutex> lock( g_analysis_thread_mutex );
   
   if( !g_analysis_thread )
     throw runtime_error( "stop_analysis_thread(): No analysis thread running." );
   
-  Wt::log("debug") << "Set to keep analyzing to false";
+  ENGINE_LOG("debug") << "Set to keep analyzing to false";
   
   {
     std::lock_guard<std::mutex> queue_lock( g_ana_queue_mutex );
     g_keep_analyzing = false;
     
-    Wt::log("debug") << "Have set keep analyzing to false";
+    ENGINE_LOG("debug") << "Have set keep analyzing to false";
   }
   
   g_ana_queue_cv.notify_all();
   
-  Wt::log("debug") << "Have notified analysis thread to stop; will wait to finish up";
+  ENGINE_LOG("debug") << "Have notified analysis thread to stop; will wait to finish up";
   
   {
     std::unique_lock<std::mutex> queue_lock( g_ana_queue_mutex );
     g_ana_queue_cv.wait( queue_lock, [&]() { return g_simple_ana_queue.empty(); } );
   }
   
-  Wt::log("info") << "Analysis thread has finished";
+  EngineLog::log("info") << "Analysis thread has finished";
   
   g_analysis_thread->join();
   
+  if( g_queue_hooks.on_stop )
+    g_queue_hooks.on_stop();
+  
   g_analysis_thread.reset();
 }//void stop_analysis_thread()
 
 
 void post_analysis( const AnalysisInput &input )
 {
-  Wt::log("info") << "Will post analysis for session " << input.wt_app_id;
+  EngineLog::log("info") << "Will post analysis for session " << input.wt_app_id;
+  
+  QueuedAnalysis item;
+  item.input = input;
+  
+  if( g_queue_hooks.lookup )
+  {
+    AnalysisOutput stored_result;
+    if( g_queue_hooks.lookup( item.input, stored_result ) )
+    {
+      EngineLog::log("info") << "Using stored analysis result for session " << input.wt_app_id;
+      post_analysis_result( input, stored_result );
+      return;
+    }
+  }//if( g_queue_hooks.lookup )
+  
+  item.cost = expected_cost( input );
+  item.queued_time = SpecUtils::get_wall_time();
   
   {//begin lock on g_ana_queue_mutex
     std::lock_guard<std::mutex> lk( g_ana_queue_mutex );
@@ -2807,14 +3474,18 @@ void post_analysis( const AnalysisInput &input )
     if( !g_keep_analyzing )
       throw runtime_error( "post_analysis(): Analysis thread not currently running" );
     
-    g_simple_ana_queue.push_back( input );
+    item.lane = (item.cost <= g_simple_ana_queue.options().fast_lane_max_cost) ? AnalysisLane::Fast
+                                                                                : AnalysisLane::Slow;
+    g_simple_ana_queue.push( std::move(item) );
+    
+    Tracing::async_begin( "queue_wait", "analysis", input.trace_id );
   }//end lock on g_ana_queue_mutex
   
-  Wt::log("debug") << "Have posted analysis, and will notify";
+  ENGINE_LOG("debug") << "Have posted analysis, and will notify";
   
   g_ana_queue_cv.notify_all();
   
-  Wt::log("debug") << "Have notified analysis thread";
+  ENGINE_LOG("debug") << "Have notified analysis thread";
 }//void post_analysis( const AnalysisInput &input )
 
 
@@ -2824,4 +3495,135 @@ size_t analysis_queue_length()
   return g_simple_ana_queue.size();
 }
 
+
+std::map<std::string,size_t> analysis_queue_lengths_by_client()
+{
+  std::lock_guard<std::mutex> lk( g_ana_queue_mutex );
+  return g_simple_ana_queue.lengths_by_client();
+}
+
+
+const char *to_str( const AnalysisLane lane )
+{
+  switch( lane )
+  {
+    case AnalysisLane::Fast: return "fast";
+    case AnalysisLane::Slow: return "slow";
+  }
+  
+  return "";
+}//const char *to_str( const AnalysisLane lane )
+
+
+double expected_cost( const AnalysisInput &input )
+{
+  double cost = 0.0;
+  if( input.input )
+  {
+    for( const auto &meas : input.input->measurements() )
+    {
+      const auto &counts = meas ? meas->gamma_counts() : nullptr;
+      if( counts )
+        cost += counts->size() / 1024.0;
+    }
+  }//if( input.input )
+  
+  // Portal analyses also write a PCF file, and have more setup inside GADRAS.
+  if( input.analysis_type == AnalysisType::Portal )
+    cost += 16.0;
+  
+  return cost;
+}//double expected_cost( const AnalysisInput &input )
+
+
+void set_lane_options( const LaneOptions &options )
+{
+  {
+    std::lock_guard<std::mutex> lk( g_ana_queue_mutex );
+    g_simple_ana_queue.set_options( options );
+  }
+  
+  g_ana_queue_cv.notify_all();
+}//void set_lane_options( const LaneOptions &options )
+
+
+EngineJson::Object lane_status_json()
+{
+  std::lock_guard<std::mutex> lk( g_ana_queue_mutex );
+  return g_simple_ana_queue.status_json();
+}
+
+
+bool is_abandoned( const AnalysisInput &input )
+{
+  if( input.cancelled && input.cancelled->load() )
+    return true;
+  
+  return (input.deadline != std::chrono::steady_clock::time_point())
+         && (std::chrono::steady_clock::now() > input.deadline);
+}//bool is_abandoned( const AnalysisInput &input )
+
+
+EngineJson::Object abandoned_status_json()
+{
+  std::lock_guard<std::mutex> lock( g_abandoned_mutex );
+  
+  EngineJson::Object status;
+  status["skipped"] = g_num_abandoned_skipped;
+  status["stopped"] = g_num_abandoned_stopped;
+  status["finishedUnwanted"] = g_num_abandoned_finished;
+  status["wastedSeconds"] = g_abandoned_wasted_seconds;
+  
+  return status;
+}//EngineJson::Object abandoned_status_json()
+
+
+void post_analysis_result( const AnalysisInput &input, const AnalysisOutput &result )
+{
+  const string &wt_app_id = input.wt_app_id;
+  function<void(AnalysisOutput)> callback = input.callback;
+  
+  if( !callback )
+    return;
+  
+  if( g_queue_hooks.post_to_session && !wt_app_id.empty() )
+  {
+    g_queue_hooks.post_to_session( input, [result,callback](){ callback( result ); } );
+  }else if( wt_app_id.empty() )
+  {
+    ENGINE_LOG("debug") << "wt_app_id is empty...";
+    
+    callback( result );
+  }else //if( !wt_app_id.empty() )
+  {
+    EngineLog::log("error") << "Error: got non empty Wt session ID ('" << wt_app_id << "'), but there"
+                            << " is no way to post to sessions - not calling result callback!";
+  }
+}//void post_analysis_result(...)
+
+
+void post_analysis_progress( const AnalysisInput &input, const AnalysisProgress &progress )
+{
+  const function<void(const AnalysisProgress &)> callback = input.progress;
+  
+  if( !callback )
+    return;
+  
+  if( g_queue_hooks.post_to_session && !input.wt_app_id.empty() )
+  {
+    g_queue_hooks.post_to_session( input, [progress,callback](){ callback( progress ); } );
+  }else if( input.wt_app_id.empty() )
+  {
+    // A problem reporting progress shouldnt stop the analysis.
+    try
+    {
+      callback( progress );
+    }catch( std::exception &e )
+    {
+      EngineLog::log("error") << "Error reporting progress of analysis " << input.ana_number
+                              << ": " << e.what();
+    }
+  }//if( post to session ) / else
+}//void post_analysis_progress(...)
+
 }//namespace Analysis
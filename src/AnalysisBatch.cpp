@@ -0,0 +1,363 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cassert>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <condition_variable>
+
+#include "FullSpectrumId/EngineLog.h"
+#include "FullSpectrumId/AnalysisBatch.h"
+#include "FullSpectrumId/AnalysisFromFiles.h"
+
+using namespace std;
+
+namespace
+{
+  typedef std::chrono::steady_clock Clock;
+  
+  /** A group of inputs being analyzed. */
+  struct Batch
+  {
+    std::vector<Analysis::AnalysisInput> inputs;
+    std::function<void( std::vector<AnalysisBatch::Result> results )> done;
+    std::vector<AnalysisBatch::Result> results;
+    std::vector<Clock::time_point> queued_times;
+    std::vector<Clock::time_point> posted_times;
+    size_t num_done = 0;
+  };//struct Batch
+  
+  
+  /** One input of a batch. */
+  struct Job
+  {
+    std::shared_ptr<Batch> batch;
+    size_t index;
+  };//struct Job
+  
+  
+  std::mutex ns_mutex;
+  AnalysisBatch::Options ns_options;
+  
+  /** Jobs waiting for an in-flight slot, by client (see #client_key); each clients jobs are first
+   come first served.
+   */
+  std::map<std::string,std::deque<Job>> ns_waiting;
+  
+  /** The clients with waiting jobs, in the order they get the next free slot; a client goes to the
+   back after each turn, so one clients large batch doesnt hold up everyone elses.
+   */
+  std::deque<std::string> ns_turns;
+  size_t ns_num_waiting = 0;
+  size_t ns_in_flight = 0;
+  size_t ns_num_running = 0;
+  size_t ns_num_completed = 0;
+  
+  
+  double seconds_between( const Clock::time_point &start, const Clock::time_point &end )
+  {
+    return std::chrono::duration<double>(end - start).count();
+  }
+  
+  
+  void job_done( const Job &job, Analysis::AnalysisOutput output );
+  
+  
+  /** Who a job is for; the same grouping the analysis queue uses for fair queueing. */
+  string client_key( const Analysis::AnalysisInput &input )
+  {
+    if( !input.client.empty() || input.wt_app_id.empty() )
+      return input.client;
+    return "session:" + input.wt_app_id;
+  }
+  
+  
+  void post_job( const Job &job )
+  {
+    Batch &batch = *job.batch;
+    
+    // The result comes back to us, so it is always called from the analysis (or cluster) thread,
+    //  instead of being posted to a session that may have gone away.
+    Analysis::AnalysisInput input = batch.inputs[job.index];
+    input.wt_app_id.clear();
+    input.callback = [job]( Analysis::AnalysisOutput output ){
+      job_done( job, std::move(output) );
+    };
+    
+    {
+      std::lock_guard<std::mutex> lock( ns_mutex );
+      batch.posted_times[job.index] = Clock::now();
+    }
+    
+    try
+    {
+      Analysis::post_analysis( input );
+    }catch( std::exception &e )
+    {
+      EngineLog::log("error") << "Failed to post batch analysis: " << e.what();
+      
+      Analysis::AnalysisOutput output;
+      output.ana_number = input.ana_number;
+      output.drf_used = input.drf_folder;
+      output.error_message = e.what();
+      job_done( job, std::move(output) );
+    }//try / catch
+  }//void post_job( const Job &job )
+  
+  
+  /** Posts waiting jobs while there are in-flight slots available. */
+  void release_jobs()
+  {
+    vector<Job> to_post;
+    
+    {
+      std::lock_guard<std::mutex> lock( ns_mutex );
+      const size_t max_in_flight = std::max( ns_options.max_in_flight, size_t(1) );
+      while( !ns_turns.empty() && (ns_in_flight < max_in_flight) )
+      {
+        const string client = ns_turns.front();
+        ns_turns.pop_front();
+        
+        std::deque<Job> &jobs = ns_waiting[client];
+        assert( !jobs.empty() );
+        to_post.push_back( jobs.front() );
+        jobs.pop_front();
+        --ns_num_waiting;
+        ++ns_in_flight;
+        
+        if( jobs.empty() )
+          ns_waiting.erase( client );
+        else
+          ns_turns.push_back( client );
+      }//while( a client is waiting, and there is a free slot )
+    }
+    
+    for( const Job &job : to_post )
+      post_job( job );
+  }//void release_jobs()
+  
+  
+  void job_done( const Job &job, Analysis::AnalysisOutput output )
+  {
+    const shared_ptr<Batch> &batch = job.batch;
+    bool finished = false;
+    
+    {
+      std::lock_guard<std::mutex> lock( ns_mutex );
+      assert( ns_in_flight > 0 );
+      ns_in_flight -= (ns_in_flight > 0);
+      
+      AnalysisBatch::Result &result = batch->results[job.index];
+      result.output = std::move( output );
+      result.wait_seconds = seconds_between( batch->queued_times[job.index], batch->posted_times[job.index] );
+      result.wall_seconds = seconds_between( batch->posted_times[job.index], Clock::now() );
+      
+      finished = (++batch->num_done == batch->inputs.size());
+      if( finished )
+      {
+        --ns_num_running;
+        ++ns_num_completed;
+      }
+    }
+    
+    // Start the next job before finishing up, so the queue keeps moving
+    release_jobs();
+    
+    if( finished && batch->done )
+      batch->done( std::move(batch->results) );
+  }//void job_done(...)
+}//namespace
+
+
+namespace AnalysisBatch
+{
+
+void set_options( const Options &options )
+{
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  ns_options = options;
+}
+
+
+Options options()
+{
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  return ns_options;
+}
+
+
+void post( const std::vector<Analysis::AnalysisInput> &inputs,
+           std::function<void( std::vector<Result> results )> done )
+{
+  if( inputs.empty() )
+  {
+    if( done )
+      done( vector<Result>{} );
+    return;
+  }//if( inputs.empty() )
+  
+  auto batch = make_shared<Batch>();
+  batch->inputs = inputs;
+  batch->done = std::move( done );
+  batch->results.resize( inputs.size() );
+  batch->queued_times.resize( inputs.size(), Clock::now() );
+  batch->posted_times.resize( inputs.size() );
+  
+  EngineLog::log("info") << "Will analyze a batch of " << inputs.size() << " inputs";
+  
+  {
+    std::lock_guard<std::mutex> lock( ns_mutex );
+    ++ns_num_running;
+    for( size_t i = 0; i < inputs.size(); ++i )
+    {
+      const string client = client_key( inputs[i] );
+      std::deque<Job> &jobs = ns_waiting[client];
+      if( jobs.empty() )
+        ns_turns.push_back( client );
+      jobs.push_back( Job{ batch, i } );
+      ++ns_num_waiting;
+    }//for( size_t i = 0; i < inputs.size(); ++i )
+  }
+  
+  release_jobs();
+}//void post(...)
+
+
+std::vector<SampleResult> analyze_samples( const Analysis::AnalysisInput &base,
+                                           const std::vector<AnalysisFromFiles::SampleInput> &samples )
+{
+  const size_t max_samples = options().max_samples;
+  if( max_samples && (samples.size() > max_samples) )
+    throw runtime_error( "The spectrum file has " + std::to_string(samples.size())
+                         + " samples; at most " + std::to_string(max_samples)
+                         + " may be analyzed at once." );
+  
+  vector<SampleResult> answer( samples.size() );
+  
+  vector<size_t> sample_index;
+  vector<Analysis::AnalysisInput> inputs;
+  for( size_t i = 0; i < samples.size(); ++i )
+  {
+    const AnalysisFromFiles::SampleInput &sample = samples[i];
+    answer[i].sample_number = sample.sample_number;
+    
+    if( !sample.input )
+    {
+      answer[i].output.ana_number = base.ana_number;
+      answer[i].output.drf_used = base.drf_folder;
+      answer[i].output.error_message = sample.error;
+      continue;
+    }//if( !sample.input )
+    
+    Analysis::AnalysisInput input = base;
+    input.input = sample.input;
+    input.callback = nullptr;
+    input.progress = nullptr;
+    
+    sample_index.push_back( i );
+    inputs.push_back( std::move(input) );
+  }//for( size_t i = 0; i < samples.size(); ++i )
+  
+  std::mutex done_mutex;
+  std::condition_variable done_cv;
+  bool done = false;
+  vector<Result> results;
+  
+  // If all the results are looked up from the result store, done is called before post returns, so
+  //  we cant hold done_mutex while posting.
+  post( inputs, [&done_mutex,&done_cv,&done,&results]( vector<Result> batch_results ){
+    // Notify while holding the lock, since done_cv is destroyed as soon as we're waited on
+    std::lock_guard<std::mutex> lock( done_mutex );
+    results = std::move( batch_results );
+    done = true;
+    done_cv.notify_all();
+  } );
+  
+  {
+    std::unique_lock<std::mutex> lock( done_mutex );
+    done_cv.wait( lock, [&done](){ return done; } );
+  }
+  
+  assert( results.size() == sample_index.size() );
+  for( size_t i = 0; (i < results.size()) && (i < sample_index.size()); ++i )
+  {
+    answer[sample_index[i]].output = std::move( results[i].output );
+    answer[sample_index[i]].wall_seconds = results[i].wall_seconds;
+  }
+  
+  return answer;
+}//std::vector<SampleResult> analyze_samples(...)
+
+
+EngineJson::Object to_json( const std::vector<SampleResult> &results )
+{
+  size_t num_failed = 0;
+  EngineJson::Array samples;
+  for( const SampleResult &result : results )
+  {
+    const Analysis::AnalysisOutput &output = result.output;
+    num_failed += ((output.gadras_intialization_error < 0) || (output.gadras_analysis_error < 0));
+    
+    EngineJson::Object sample = output.toJson();
+    sample["sample"] = result.sample_number;
+    sample["seconds"] = result.wall_seconds;
+    samples.emplace_back( std::move(sample) );
+  }//for( const SampleResult &result : results )
+  
+  EngineJson::Object answer;
+  answer["code"] = 0;
+  answer["numSamples"] = results.size();
+  answer["numFailed"] = num_failed;
+  answer["samples"] = std::move( samples );
+  
+  return answer;
+}//EngineJson::Object to_json( const std::vector<SampleResult> &results )
+
+
+EngineJson::Object status_json()
+{
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  
+  EngineJson::Object status;
+  status["running"] = ns_num_running;
+  status["completed"] = ns_num_completed;
+  status["waiting"] = ns_num_waiting;
+  status["waitingClients"] = ns_waiting.size();
+  status["inFlight"] = ns_in_flight;
+  status["maxInFlight"] = ns_options.max_in_flight;
+  
+  return status;
+}//EngineJson::Object status_json()
+
+}//namespace AnalysisBatch
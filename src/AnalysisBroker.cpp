@@ -0,0 +1,975 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <condition_variable>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#endif
+
+#include <Wt/WLogger.h>
+
+#include "FullSpectrumId/MessageChannel.h"
+#include "FullSpectrumId/AnalysisBroker.h"
+#include "FullSpectrumId/AnalysisZygote.h"
+#include "FullSpectrumId/AnalysisSerialization.h"
+
+using namespace std;
+
+using AnalysisSerialization::Reader;
+using AnalysisSerialization::Writer;
+
+#ifndef _WIN32
+using MessageChannel::Channel;
+#endif
+
+
+namespace
+{
+  /** Incremented whenever the messages change; sessions with a different version are rejected. */
+  const uint32_t ns_protocol_version = 2;
+
+  /** The prefix of the shared memory object names sessions use; the broker wont open others. */
+  const char * const ns_shm_prefix = "/fsb-";
+
+  /** The types of messages; the first byte of each frame. */
+  enum MessageType : uint8_t
+  {
+    /** Session to broker, once on connecting: protocol version, process ID. */
+    HelloMessage = 1,
+
+    /** Session to broker: job ID, client, client weight, seconds until the deadline (negative for
+     none), shared memory object name, and its size in bytes.
+     */
+    SubmitMessage = 2,
+
+    /** Broker to session: job ID, success flag, then either the serialized
+     #Analysis::AnalysisOutput, or an error message.
+     */
+    ResultMessage = 3
+  };//enum MessageType
+
+
+  Analysis::AnalysisOutput error_output( const Analysis::AnalysisInput &input, const string &msg )
+  {
+    Analysis::AnalysisOutput result;
+    result.ana_number = input.ana_number;
+    result.drf_used = input.drf_folder;
+    result.error_message = msg;
+    return result;
+  }//error_output(...)
+
+
+  std::mutex ns_options_mutex;
+  AnalysisBroker::Options ns_options;
+
+
+#ifndef _WIN32
+  // Threads that run analyses concurrently in the broker; all protected by ns_run_mutex.
+  struct RunTask
+  {
+    Analysis::AnalysisInput input;
+    std::function<void(const Analysis::AnalysisOutput &)> done;
+  };//struct RunTask
+
+  std::mutex ns_run_mutex;
+  std::condition_variable ns_run_cv;
+  deque<RunTask> ns_run_queue;
+  size_t ns_run_busy = 0;
+  bool ns_run_stop = false;
+  vector<std::thread> ns_run_threads;
+
+
+  void run_thread_main()
+  {
+    std::unique_lock<std::mutex> lock( ns_run_mutex );
+
+    while( true )
+    {
+      ns_run_cv.wait( lock, [](){ return ns_run_stop || !ns_run_queue.empty(); } );
+      if( ns_run_queue.empty() )
+        return;
+
+      RunTask task = std::move( ns_run_queue.front() );
+      ns_run_queue.pop_front();
+      ns_run_busy += 1;
+      lock.unlock();
+
+      Analysis::AnalysisOutput output;
+      try
+      {
+        output = AnalysisZygote::run( task.input );
+      }catch( std::exception &e )
+      {
+        output = error_output( task.input, e.what() );
+      }
+
+      try
+      {
+        task.done( output );
+      }catch( std::exception &e )
+      {
+        Wt::log("error:app") << "Exception from analysis broker callback: " << e.what();
+      }
+
+      lock.lock();
+      ns_run_busy -= 1;
+      ns_run_cv.notify_all();
+    }//while( true )
+  }//void run_thread_main()
+
+
+  // Broker state; all protected by ns_mutex.
+  struct Session
+  {
+    unique_ptr<Channel> channel;
+    uint64_t id = 0;
+    int64_t pid = 0;
+    bool registered = false;
+
+    /** Set when the session disconnects, so its queued analyses are skipped. */
+    shared_ptr<std::atomic<bool>> gone;
+  };//struct Session
+
+  std::mutex ns_mutex;
+  std::atomic<bool> ns_stop_broker( false );
+  bool ns_broker_running = false;
+  int ns_wake_fds[2] = { -1, -1 };
+  uint64_t ns_next_session_id = 1;
+  vector<unique_ptr<Session>> ns_sessions;
+  /** Results to send, by session ID. */
+  vector<pair<uint64_t,string>> ns_outbox;
+  uint64_t ns_jobs_received = 0;
+  uint64_t ns_jobs_completed = 0;
+  uint64_t ns_jobs_rejected = 0;
+  uint64_t ns_results_undeliverable = 0;
+
+
+  void broker_signal_handler( int )
+  {
+    AnalysisBroker::stop_broker();
+  }
+
+
+  void wake_broker()
+  {
+    const char c = 0;
+    while( (write( ns_wake_fds[1], &c, 1 ) < 0) && (errno == EINTR) )
+    {
+    }
+  }//void wake_broker()
+
+
+  /** Reads, and removes, the shared memory object a session put a serialized input into. */
+  string read_shared_memory( const string &name, const uint64_t size )
+  {
+    if( (name.compare( 0, strlen(ns_shm_prefix), ns_shm_prefix ) != 0)
+        || (name.find( '/', 1 ) != string::npos) )
+      throw runtime_error( "invalid shared memory name '" + name + "'" );
+
+    if( (size == 0) || (size > MessageChannel::sm_max_message_size) )
+      throw runtime_error( "invalid shared memory size " + std::to_string(size) );
+
+    const int fd = shm_open( name.c_str(), O_RDONLY, 0 );
+    if( fd < 0 )
+      throw runtime_error( "failed to open shared memory '" + name + "': " + strerror(errno) );
+    shm_unlink( name.c_str() );
+
+    struct stat info;
+    if( (fstat( fd, &info ) != 0) || (static_cast<uint64_t>(info.st_size) < size) )
+    {
+      close( fd );
+      throw runtime_error( "shared memory '" + name + "' is smaller than expected" );
+    }
+
+    void *data = mmap( nullptr, static_cast<size_t>(size), PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( data == MAP_FAILED )
+      throw runtime_error( "failed to map shared memory '" + name + "': " + strerror(errno) );
+
+    const string answer( static_cast<const char *>(data), static_cast<size_t>(size) );
+    munmap( data, static_cast<size_t>(size) );
+
+    return answer;
+  }//string read_shared_memory(...)
+
+
+  /** Handles a message from a session, adding inputs to post to the analysis queue once ns_mutex
+   is unlocked.  Throws exception on protocol errors.  Must hold ns_mutex.
+   */
+  void handle_message( Session &session, const string &msg, vector<Analysis::AnalysisInput> &to_post )
+  {
+    Reader in( msg );
+    const uint8_t type = in.u8();
+
+    if( !session.registered && (type != HelloMessage) )
+      throw runtime_error( "expected hello message" );
+
+    switch( type )
+    {
+      case HelloMessage:
+      {
+        const uint32_t version = in.u32();
+        if( version != ns_protocol_version )
+          throw runtime_error( "protocol version " + std::to_string(version) + ", but we use "
+                               + std::to_string(ns_protocol_version) );
+        session.pid = static_cast<int64_t>( in.u64() );
+        session.registered = true;
+
+        Wt::log("info:app") << "Session process " << session.pid << " connected to analysis broker";
+        break;
+      }//case HelloMessage:
+
+      case SubmitMessage:
+      {
+        const uint64_t job_id = in.u64();
+        const string client = in.str();
+        const double weight = in.f64();
+        const double seconds_left = in.f64();
+        const string shm_name = in.str();
+        const uint64_t shm_size = in.u64();
+
+        ns_jobs_received += 1;
+
+        const uint64_t session_id = session.id;
+        auto reply = [session_id,job_id]( const bool success, const string &data ){
+          string msg;
+          Writer out( msg );
+          out.u8( ResultMessage );
+          out.u64( job_id );
+          out.u8( success ? 1 : 0 );
+          out.str( data );
+
+          {
+            std::lock_guard<std::mutex> lock( ns_mutex );
+            ns_outbox.push_back( make_pair( session_id, std::move(msg) ) );
+          }
+
+          wake_broker();
+        };//reply
+
+        Analysis::AnalysisInput input;
+        try
+        {
+          const string serialized_input = read_shared_memory( shm_name, shm_size );
+          Reader input_in( serialized_input );
+          input = AnalysisSerialization::read_input( input_in );
+          input_in.check_at_end();
+        }catch( std::exception &e )
+        {
+          // The session may have sent a bad input, but it is still a valid session.
+          ns_jobs_rejected += 1;
+
+          string msg;
+          Writer out( msg );
+          out.u8( ResultMessage );
+          out.u64( job_id );
+          out.u8( 0 );
+          out.str( string("Analysis broker could not read input: ") + e.what() );
+          ns_outbox.push_back( make_pair( session_id, std::move(msg) ) );
+          break;
+        }//try / catch
+
+        input.wt_app_id.clear();
+        input.client = client;
+        input.client_weight = weight;
+        input.cancelled = session.gone;
+        if( seconds_left >= 0.0 )
+          input.deadline = std::chrono::steady_clock::now()
+                           + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                                   std::chrono::duration<double>( seconds_left ) );
+
+        const std::shared_ptr<SpecUtils::SpecFile> spec = input.input;
+        input.callback = [reply,spec]( Analysis::AnalysisOutput output ){
+          {
+            std::lock_guard<std::mutex> lock( ns_mutex );
+            ns_jobs_completed += 1;
+          }
+
+          try
+          {
+            string serialized_output;
+            Writer output_out( serialized_output );
+            AnalysisSerialization::write_output( output_out, output, spec );
+            reply( true, serialized_output );
+          }catch( std::exception &e )
+          {
+            reply( false, e.what() );
+          }
+        };//input.callback
+
+        to_post.push_back( std::move(input) );
+        break;
+      }//case SubmitMessage:
+
+      default:
+        throw runtime_error( "unknown message type " + std::to_string(type) );
+    }//switch( type )
+  }//void handle_message(...)
+
+
+  /** Removes the session, so its queued analyses will be skipped; must hold ns_mutex. */
+  void drop_session( const size_t index, const string &reason )
+  {
+    Session &session = *ns_sessions[index];
+    session.gone->store( true );
+
+    if( session.registered )
+      Wt::log("info:app") << "Session process " << session.pid << " left analysis broker: " << reason;
+
+    ns_sessions.erase( begin(ns_sessions) + index );
+  }//void drop_session(...)
+
+
+  /** Moves results from the outbox to their sessions, dropping results whose session is gone;
+   must hold ns_mutex.
+   */
+  void deliver_results()
+  {
+    for( auto &result : ns_outbox )
+    {
+      bool delivered = false;
+      for( const auto &session : ns_sessions )
+      {
+        if( session->id == result.first )
+        {
+          session->channel->queue_frame( result.second );
+          delivered = true;
+          break;
+        }
+      }//for( const auto &session : ns_sessions )
+
+      if( !delivered )
+        ns_results_undeliverable += 1;
+    }//for( auto &result : ns_outbox )
+
+    ns_outbox.clear();
+  }//void deliver_results()
+
+
+  // Session process state; all protected by ns_client_mutex.
+  struct PendingJob
+  {
+    Analysis::AnalysisInput input;
+    std::function<void(const Analysis::AnalysisOutput &)> done;
+    string shm_name;
+  };//struct PendingJob
+
+  std::mutex ns_client_mutex;
+  int ns_client_fd = -1;
+  uint64_t ns_client_next_job_id = 1;
+  map<uint64_t,PendingJob> ns_client_pending;
+  unique_ptr<std::thread> ns_client_reader;
+  uint64_t ns_client_submitted = 0;
+  uint64_t ns_client_completed = 0;
+  uint64_t ns_client_failed = 0;
+  uint64_t ns_client_connect_failures = 0;
+
+
+  /** Reads results from the broker until the connection is lost, then fails the pending jobs. */
+  void client_reader_main( const int fd )
+  {
+    string msg;
+    while( MessageChannel::read_frame( fd, msg ) )
+    {
+      PendingJob job;
+      bool success = false;
+      string data;
+
+      try
+      {
+        Reader in( msg );
+        if( in.u8() != ResultMessage )
+          throw runtime_error( "unexpected message type" );
+
+        const uint64_t job_id = in.u64();
+        success = (in.u8() != 0);
+        data = in.str();
+
+        std::lock_guard<std::mutex> lock( ns_client_mutex );
+        const auto pos = ns_client_pending.find( job_id );
+        if( pos == end(ns_client_pending) )
+          throw runtime_error( "result for unknown job " + std::to_string(job_id) );
+        job = std::move( pos->second );
+        ns_client_pending.erase( pos );
+      }catch( std::exception &e )
+      {
+        Wt::log("error:app") << "Invalid message from analysis broker: " << e.what();
+        break;
+      }//try / catch
+
+      Analysis::AnalysisOutput result;
+      try
+      {
+        if( !success )
+          throw runtime_error( data );
+
+        Reader result_in( data );
+        result = AnalysisSerialization::read_output( result_in, job.input.input );
+        result_in.check_at_end();
+      }catch( std::exception &e )
+      {
+        result = error_output( job.input, e.what() );
+      }
+
+      {
+        std::lock_guard<std::mutex> lock( ns_client_mutex );
+        ns_client_completed += 1;
+        ns_client_failed += !result.error_message.empty();
+      }
+
+      job.done( result );
+    }//while( MessageChannel::read_frame( fd, msg ) )
+
+    map<uint64_t,PendingJob> orphaned;
+    {
+      std::lock_guard<std::mutex> lock( ns_client_mutex );
+      close( fd );
+      ns_client_fd = -1;
+      orphaned.swap( ns_client_pending );
+      ns_client_failed += orphaned.size();
+    }
+
+    if( !orphaned.empty() )
+      Wt::log("error:app") << "Lost connection to analysis broker with " << orphaned.size()
+                           << " analyses pending";
+
+    for( auto &job : orphaned )
+    {
+      shm_unlink( job.second.shm_name.c_str() ); //Fails harmlessly if the broker already read it
+      job.second.done( error_output( job.second.input, "Lost connection to the analysis broker" ) );
+    }
+  }//void client_reader_main( const int fd )
+
+
+  /** Connects to the broker if not already connected; must hold ns_client_mutex. */
+  bool client_connect( const string &socket_path )
+  {
+    if( ns_client_fd >= 0 )
+      return true;
+
+    // The reader from a previous connection has already given up the socket, and wont lock
+    //  ns_client_mutex again, so we can join it here.
+    if( ns_client_reader )
+    {
+      ns_client_reader->join();
+      ns_client_reader.reset();
+    }
+
+    const int fd = MessageChannel::connect_to( "unix:" + socket_path );
+    if( fd < 0 )
+    {
+      ns_client_connect_failures += 1;
+      return false;
+    }
+
+#if( defined(SO_NOSIGPIPE) )
+    const int one = 1;
+    setsockopt( fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one) );
+#endif
+
+    string msg;
+    Writer out( msg );
+    out.u8( HelloMessage );
+    out.u32( ns_protocol_version );
+    out.u64( static_cast<uint64_t>( getpid() ) );
+    if( !MessageChannel::write_frame( fd, msg, true ) )
+    {
+      close( fd );
+      ns_client_connect_failures += 1;
+      return false;
+    }
+
+    ns_client_fd = fd;
+    ns_client_reader = make_unique<std::thread>( &client_reader_main, fd );
+
+    Wt::log("info:app") << "Connected to analysis broker at '" << socket_path << "'";
+
+    return true;
+  }//bool client_connect( const string &socket_path )
+
+
+  /** Writes the serialized input to a new shared memory object. */
+  void write_shared_memory( const string &name, const string &data )
+  {
+    const int fd = shm_open( name.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR );
+    if( fd < 0 )
+      throw runtime_error( "failed to create shared memory '" + name + "': " + strerror(errno) );
+
+    void *mem = MAP_FAILED;
+    if( ftruncate( fd, static_cast<off_t>(data.size()) ) == 0 )
+      mem = mmap( nullptr, data.size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    const int error_num = errno;
+    close( fd );
+
+    if( mem == MAP_FAILED )
+    {
+      shm_unlink( name.c_str() );
+      throw runtime_error( "failed to size or map shared memory '" + name + "': " + strerror(error_num) );
+    }
+
+    memcpy( mem, data.data(), data.size() );
+    munmap( mem, data.size() );
+  }//void write_shared_memory(...)
+#endif //#ifndef _WIN32
+}//namespace
+
+
+namespace AnalysisBroker
+{
+
+void set_options( const Options &options )
+{
+  std::lock_guard<std::mutex> lock( ns_options_mutex );
+  ns_options = options;
+}
+
+
+Options options()
+{
+  std::lock_guard<std::mutex> lock( ns_options_mutex );
+  return ns_options;
+}
+
+
+bool is_client()
+{
+  std::lock_guard<std::mutex> lock( ns_options_mutex );
+  return !ns_options.is_broker && !ns_options.socket_path.empty();
+}
+
+
+int run_broker()
+{
+#ifdef _WIN32
+  Wt::log("error:app") << "The analysis broker is not supported on Windows";
+  return EXIT_FAILURE;
+#else
+  const Options opts = options();
+  if( opts.socket_path.empty() )
+  {
+    Wt::log("error:app") << "No analysis broker socket path specified";
+    return EXIT_FAILURE;
+  }
+
+  int listen_fd = -1;
+  try
+  {
+    listen_fd = MessageChannel::listen_on( "unix:" + opts.socket_path );
+  }catch( std::exception &e )
+  {
+    Wt::log("error:app") << "Failed to start analysis broker: " << e.what();
+    return EXIT_FAILURE;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock( ns_mutex );
+    if( pipe( ns_wake_fds ) != 0 )
+    {
+      close( listen_fd );
+      Wt::log("error:app") << "Failed to start analysis broker: could not create pipe";
+      return EXIT_FAILURE;
+    }
+
+    MessageChannel::set_non_blocking( listen_fd );
+    MessageChannel::set_non_blocking( ns_wake_fds[0] );
+    MessageChannel::set_non_blocking( ns_wake_fds[1] );
+    ns_broker_running = true;
+  }
+
+  ns_stop_broker = false;
+  auto old_int_handler = signal( SIGINT, &broker_signal_handler );
+  auto old_term_handler = signal( SIGTERM, &broker_signal_handler );
+  auto old_pipe_handler = signal( SIGPIPE, SIG_IGN );
+
+  Wt::log("info:app") << "Analysis broker listening on '" << opts.socket_path << "', running up to "
+                      << (AnalysisZygote::is_running() ? opts.max_concurrent : size_t(1))
+                      << " analyses at once";
+
+  vector<Analysis::AnalysisInput> to_post;
+
+  while( !ns_stop_broker )
+  {
+    vector<pollfd> fds;
+
+    {
+      std::lock_guard<std::mutex> lock( ns_mutex );
+      fds.push_back( { ns_wake_fds[0], POLLIN, 0 } );
+      fds.push_back( { listen_fd, POLLIN, 0 } );
+      for( const auto &session : ns_sessions )
+      {
+        const short events = POLLIN | (session->channel->wants_write() ? POLLOUT : 0);
+        fds.push_back( { session->channel->fd, events, 0 } );
+      }
+    }
+
+    // Signals may not interrupt poll, so dont wait too long to check ns_stop_broker
+    const int npoll = poll( &fds[0], fds.size(), 250 );
+    if( (npoll < 0) && (errno != EINTR) )
+    {
+      Wt::log("error:app") << "Analysis broker poll failed: " << strerror(errno);
+      std::this_thread::sleep_for( std::chrono::milliseconds(100) );
+      continue;
+    }
+
+    {//begin lock on ns_mutex
+      std::lock_guard<std::mutex> lock( ns_mutex );
+
+      if( (npoll > 0) && fds[0].revents )
+      {
+        char buffer[64];
+        while( read( ns_wake_fds[0], buffer, sizeof(buffer) ) > 0 )
+        {
+        }
+      }//if( woken up )
+
+      // Handle existing sessions before accepting new ones, so the pollfd indexes still line up;
+      //  go backwards since we may remove sessions.
+      for( size_t i = ns_sessions.size(); i > 0; --i )
+      {
+        Session &session = *ns_sessions[i-1];
+        const short revents = (npoll > 0) ? fds[i + 1].revents : 0;
+
+        if( (revents & POLLOUT) && !session.channel->write_available() )
+        {
+          drop_session( i - 1, "write failed" );
+          continue;
+        }
+
+        if( revents & (POLLIN | POLLHUP | POLLERR) )
+        {
+          const bool open = session.channel->read_available();
+
+          try
+          {
+            string msg;
+            while( session.channel->pop_frame( msg ) )
+              handle_message( session, msg, to_post );
+          }catch( std::exception &e )
+          {
+            drop_session( i - 1, string("invalid message, ") + e.what() );
+            continue;
+          }
+
+          if( !open )
+          {
+            drop_session( i - 1, "disconnected" );
+            continue;
+          }
+        }//if( readable )
+      }//for( loop over sessions )
+
+      if( (npoll > 0) && (fds[1].revents & POLLIN) )
+      {
+        while( true )
+        {
+          const int fd = accept( listen_fd, nullptr, nullptr );
+          if( fd < 0 )
+            break;
+
+#if( defined(SO_NOSIGPIPE) )
+          const int one = 1;
+          setsockopt( fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one) );
+#endif
+
+          unique_ptr<Session> session( new Session() );
+          session->channel.reset( new Channel( fd ) );
+          session->id = ns_next_session_id++;
+          session->gone = make_shared<std::atomic<bool>>( false );
+          ns_sessions.push_back( std::move(session) );
+        }//while( true )
+      }//if( new connections )
+
+      deliver_results();
+
+      // Start writing immediately, rather than waiting for the next poll
+      for( size_t i = ns_sessions.size(); i > 0; --i )
+      {
+        if( ns_sessions[i-1]->channel->wants_write() && !ns_sessions[i-1]->channel->write_available() )
+          drop_session( i - 1, "write failed" );
+      }
+    }//end lock on ns_mutex
+
+    // Posting may call the callback right away (e.g., a result-store hit), which locks ns_mutex.
+    for( const Analysis::AnalysisInput &input : to_post )
+      Analysis::post_analysis( input );
+    to_post.clear();
+  }//while( !ns_stop_broker )
+
+  signal( SIGINT, old_int_handler );
+  signal( SIGTERM, old_term_handler );
+  signal( SIGPIPE, old_pipe_handler );
+
+  {
+    std::lock_guard<std::mutex> lock( ns_mutex );
+    while( !ns_sessions.empty() )
+      drop_session( ns_sessions.size() - 1, "analysis broker stopping" );
+    ns_outbox.clear();
+
+    ns_broker_running = false;
+    close( listen_fd );
+    close( ns_wake_fds[0] );
+    close( ns_wake_fds[1] );
+    ns_wake_fds[0] = ns_wake_fds[1] = -1;
+  }
+
+  unlink( opts.socket_path.c_str() );
+
+  Wt::log("info:app") << "Analysis broker stopping";
+
+  return EXIT_SUCCESS;
+#endif
+}//int run_broker()
+
+
+void stop_broker()
+{
+#ifndef _WIN32
+  ns_stop_broker = true;
+#endif
+}
+
+
+bool run_concurrently( const Analysis::AnalysisInput &input,
+                       std::function<void(const Analysis::AnalysisOutput &)> done )
+{
+#ifdef _WIN32
+  return false;
+#else
+  const Options opts = options();
+  if( !opts.is_broker || !AnalysisZygote::is_running() )
+    return false;
+
+  const size_t max_concurrent = std::max( opts.max_concurrent, size_t(1) );
+
+  std::unique_lock<std::mutex> lock( ns_run_mutex );
+  if( ns_run_stop )
+    return false;
+
+  while( ns_run_threads.size() < max_concurrent )
+    ns_run_threads.emplace_back( &run_thread_main );
+
+  // Block the analysis thread, so analyses wait in the fair queue, instead of here
+  ns_run_cv.wait( lock, [max_concurrent](){
+    return ns_run_stop || ((ns_run_queue.size() + ns_run_busy) < max_concurrent);
+  } );
+
+  if( ns_run_stop )
+    return false;
+
+  RunTask task;
+  task.input = input;
+  task.done = std::move( done );
+  ns_run_queue.push_back( std::move(task) );
+  ns_run_cv.notify_all();
+
+  return true;
+#endif
+}//bool run_concurrently(...)
+
+
+void stop_run_threads()
+{
+#ifndef _WIN32
+  vector<std::thread> threads;
+
+  {
+    std::lock_guard<std::mutex> lock( ns_run_mutex );
+    ns_run_stop = true;
+    threads.swap( ns_run_threads );
+  }
+
+  ns_run_cv.notify_all();
+  for( std::thread &thread : threads )
+    thread.join();
+#endif
+}//void stop_run_threads()
+
+
+void submit( const Analysis::AnalysisInput &input,
+             std::function<void(const Analysis::AnalysisOutput &)> done )
+{
+#ifdef _WIN32
+  done( error_output( input, "The analysis broker is not supported on Windows" ) );
+#else
+  const Options opts = options();
+
+  string serialized_input;
+  try
+  {
+    Writer out( serialized_input );
+    AnalysisSerialization::write_input( out, input );
+  }catch( std::exception &e )
+  {
+    done( error_output( input, string("Failed to serialize analysis input: ") + e.what() ) );
+    return;
+  }
+
+  // Sessions without a REST client share by session, across all processes on the host.
+  string client = input.client;
+  if( client.empty() )
+    client = "session:" + std::to_string( getpid() ) + ":" + input.wt_app_id;
+
+  double seconds_left = -1.0;
+  if( input.deadline != std::chrono::steady_clock::time_point() )
+  {
+    const std::chrono::duration<double> left = input.deadline - std::chrono::steady_clock::now();
+    seconds_left = std::max( left.count(), 0.0 );
+  }
+
+  std::unique_lock<std::mutex> lock( ns_client_mutex );
+
+  const uint64_t job_id = ns_client_next_job_id++;
+  const string shm_name = ns_shm_prefix + std::to_string( getpid() ) + "-" + std::to_string( job_id );
+
+  string error_msg;
+  try
+  {
+    write_shared_memory( shm_name, serialized_input );
+
+    if( !client_connect( opts.socket_path ) )
+    {
+      shm_unlink( shm_name.c_str() );
+      throw runtime_error( "Could not connect to the analysis broker at '" + opts.socket_path + "'" );
+    }
+  }catch( std::exception &e )
+  {
+    error_msg = e.what();
+  }
+
+  if( error_msg.empty() )
+  {
+    string msg;
+    Writer out( msg );
+    out.u8( SubmitMessage );
+    out.u64( job_id );
+    out.str( client );
+    out.f64( input.client_weight );
+    out.f64( seconds_left );
+    out.str( shm_name );
+    out.u64( serialized_input.size() );
+
+    PendingJob &job = ns_client_pending[job_id];
+    job.input = input;
+    job.done = done;
+    job.shm_name = shm_name;
+
+    if( MessageChannel::write_frame( ns_client_fd, msg, true ) )
+    {
+      ns_client_submitted += 1;
+      return;
+    }
+
+    // The reader thread will notice the broken connection, and fail the other pending jobs.
+    ns_client_pending.erase( job_id );
+    shm_unlink( shm_name.c_str() );
+    shutdown( ns_client_fd, SHUT_RDWR );
+    error_msg = "Failed to send analysis to the analysis broker";
+  }//if( error_msg.empty() )
+
+  ns_client_failed += 1;
+  lock.unlock();
+
+  Wt::log("error:app") << error_msg;
+  done( error_output( input, error_msg ) );
+#endif
+}//void submit(...)
+
+
+void disconnect()
+{
+#ifndef _WIN32
+  unique_ptr<std::thread> reader;
+
+  {
+    std::lock_guard<std::mutex> lock( ns_client_mutex );
+    if( ns_client_fd >= 0 )
+      shutdown( ns_client_fd, SHUT_RDWR );
+    reader = std::move( ns_client_reader );
+  }
+
+  if( reader )
+    reader->join();
+#endif
+}//void disconnect()
+
+
+EngineJson::Object status_json()
+{
+  EngineJson::Object json;
+
+#ifndef _WIN32
+  if( options().is_broker )
+  {
+    {
+      std::lock_guard<std::mutex> lock( ns_mutex );
+      json["listening"] = ns_broker_running;
+      json["sessionsConnected"] = static_cast<long long>( ns_sessions.size() );
+      json["jobsReceived"] = static_cast<long long>( ns_jobs_received );
+      json["jobsCompleted"] = static_cast<long long>( ns_jobs_completed );
+      json["jobsRejected"] = static_cast<long long>( ns_jobs_rejected );
+      json["resultsUndeliverable"] = static_cast<long long>( ns_results_undeliverable );
+    }
+
+    std::lock_guard<std::mutex> lock( ns_run_mutex );
+    json["analysesRunning"] = static_cast<long long>( ns_run_busy );
+  }else
+  {
+    std::lock_guard<std::mutex> lock( ns_client_mutex );
+    json["connected"] = (ns_client_fd >= 0);
+    json["jobsSubmitted"] = static_cast<long long>( ns_client_submitted );
+    json["jobsCompleted"] = static_cast<long long>( ns_client_completed );
+    json["jobsFailed"] = static_cast<long long>( ns_client_failed );
+    json["jobsPending"] = static_cast<long long>( ns_client_pending.size() );
+    json["connectFailures"] = static_cast<long long>( ns_client_connect_failures );
+  }//if( options().is_broker ) / else
+#endif
+
+  return json;
+}//EngineJson::Object status_json()
+
+}//namespace AnalysisBroker
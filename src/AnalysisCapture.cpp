@@ -0,0 +1,375 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <condition_variable>
+
+#include <Wt/WLogger.h>
+
+#include "SpecUtils/SpecFile.h"
+
+#include "FullSpectrumId/AnalysisCapture.h"
+#include "FullSpectrumId/AnalysisSerialization.h"
+
+using namespace std;
+
+
+namespace
+{
+  using AnalysisSerialization::Writer;
+  using AnalysisSerialization::Reader;
+  using AnalysisSerialization::write_spec;
+  using AnalysisSerialization::read_spec;
+
+  const char ns_file_magic[8] = { 'F', 'S', 'A', 'C', 'A', 'P', '0', '1' };
+
+  /** Largest record we will read back; protects against allocating garbage sizes. */
+  const uint64_t ns_max_record_size = uint64_t(4)*1024*1024*1024;
+
+  /** Most serialized bytes we will queue for the writer thread; records past this are dropped
+   rather than blocking the submitting thread.
+   */
+  const size_t ns_max_queued_bytes = size_t(256)*1024*1024;
+
+  std::mutex ns_capture_mutex;
+  std::condition_variable ns_capture_cv;
+  std::ofstream ns_capture_file;
+  std::atomic<bool> ns_capturing( false );
+
+  // The remaining variables are protected by ns_capture_mutex.
+  //  The writer thread is started on the first captured request, rather than by #start_capture,
+  //  so it isnt running when the zygote master forks (start_capture is called during startup).
+  std::thread *ns_writer = nullptr;
+  bool ns_writer_stopping = false;
+  std::deque<std::string> ns_queue;
+  size_t ns_queued_bytes = 0;
+  size_t ns_num_dropped = 0;
+
+
+  uint64_t now_us()
+  {
+    const auto now = std::chrono::system_clock::now().time_since_epoch();
+    return static_cast<uint64_t>( std::chrono::duration_cast<std::chrono::microseconds>(now).count() );
+  }
+
+
+  /** Writes queued records to the capture file, flushing once per batch of records. */
+  void writer_main()
+  {
+    std::deque<std::string> records;
+
+    while( true )
+    {
+      bool stopping = false;
+      {// Begin lock on ns_capture_mutex
+        std::unique_lock<std::mutex> lock( ns_capture_mutex );
+        ns_capture_cv.wait( lock, [](){ return ns_writer_stopping || !ns_queue.empty(); } );
+
+        records.swap( ns_queue );
+        ns_queued_bytes = 0;
+        stopping = ns_writer_stopping;
+      }// End lock on ns_capture_mutex
+
+      // Only this thread writes to ns_capture_file while it is running, and #stop_capture joins
+      //  this thread before closing the file.
+      bool failed = false;
+      if( !records.empty() && ns_capture_file.is_open() )
+      {
+        for( const string &record : records )
+          ns_capture_file.write( record.data(), record.size() );
+        ns_capture_file.flush();
+        failed = !ns_capture_file;
+      }//if( we have records to write )
+      records.clear();
+
+      if( failed )
+      {
+        Wt::log("error:app") << "Error writing analysis capture file; will stop capturing.";
+
+        std::lock_guard<std::mutex> lock( ns_capture_mutex );
+        ns_capturing = false;
+        ns_queue.clear();
+        ns_queued_bytes = 0;
+        return;
+      }//if( failed )
+
+      if( stopping )
+        return;
+    }//while( true )
+  }//void writer_main()
+}//namespace
+
+
+namespace AnalysisCapture
+{
+
+Analysis::AnalysisInput CapturedRequest::to_analysis_input( const size_t ana_number ) const
+{
+  Analysis::AnalysisInput anainput;
+  anainput.ana_number = ana_number;
+  anainput.drf_folder = drf;
+  anainput.input_warnings = input_warnings;
+  anainput.analysis_type = analysis_type;
+  anainput.input = input;
+
+  return anainput;
+}//CapturedRequest::to_analysis_input(...)
+
+
+void start_capture( const std::string &filename )
+{
+  std::lock_guard<std::mutex> lock( ns_capture_mutex );
+
+  if( ns_capture_file.is_open() )
+    throw runtime_error( "Analysis capture already started" );
+
+  ns_capture_file.open( filename.c_str(), ios::out | ios::binary | ios::app );
+  if( !ns_capture_file )
+    throw runtime_error( "Could not open analysis capture file '" + filename + "'" );
+
+  // Each capture session gets its own header, so the reader can tell when a new capture started.
+  string header( ns_file_magic, sizeof(ns_file_magic) );
+  Writer( header ).u64( now_us() );
+  ns_capture_file.write( header.data(), header.size() );
+  ns_capture_file.flush();
+
+  if( !ns_capture_file )
+  {
+    ns_capture_file.close();
+    throw runtime_error( "Could not write to analysis capture file '" + filename + "'" );
+  }
+
+  ns_capturing = true;
+
+  Wt::log("info:app") << "Capturing analysis requests to '" << filename << "'";
+}//void start_capture( const std::string &filename )
+
+
+void stop_capture()
+{
+  std::thread *writer = nullptr;
+  {// Begin lock on ns_capture_mutex
+    std::lock_guard<std::mutex> lock( ns_capture_mutex );
+    ns_capturing = false;
+    writer = ns_writer;
+    ns_writer_stopping = true;
+  }// End lock on ns_capture_mutex
+
+  // The writer drains the queue before returning.
+  if( writer )
+  {
+    ns_capture_cv.notify_all();
+    writer->join();
+    delete writer;
+  }
+
+  std::lock_guard<std::mutex> lock( ns_capture_mutex );
+  ns_writer = nullptr;
+  ns_writer_stopping = false;
+  ns_queue.clear();
+  ns_queued_bytes = 0;
+
+  if( ns_num_dropped )
+    Wt::log("warning:app") << "Dropped " << ns_num_dropped << " analysis requests from the capture"
+                              " file, as they were submitted faster than they could be written.";
+  ns_num_dropped = 0;
+
+  if( ns_capture_file.is_open() )
+    ns_capture_file.close();
+}//void stop_capture()
+
+
+bool is_capturing()
+{
+  return ns_capturing;
+}
+
+
+void capture( const Analysis::AnalysisInput &input, const Submitter submitter )
+{
+  if( !ns_capturing )
+    return;
+
+  string record;
+  try
+  {
+    record = serialize_request( input, submitter, now_us() );
+  }catch( std::exception &e )
+  {
+    Wt::log("error:app") << "Failed to serialize analysis request for capture: " << e.what();
+    return;
+  }
+
+  string length_and_record;
+  length_and_record.reserve( 8 + record.size() );
+  Writer( length_and_record ).u64( record.size() );
+  length_and_record += record;
+  record = string();
+
+  {// Begin lock on ns_capture_mutex
+    std::lock_guard<std::mutex> lock( ns_capture_mutex );
+    if( !ns_capturing || ns_writer_stopping || !ns_capture_file.is_open() )
+      return;
+
+    if( (ns_queued_bytes + length_and_record.size()) > ns_max_queued_bytes )
+    {
+      if( ns_num_dropped++ == 0 )
+        Wt::log("warning:app") << "Analysis capture writer has fallen behind; dropping requests.";
+      return;
+    }
+
+    if( !ns_writer )
+      ns_writer = new std::thread( &writer_main );
+
+    ns_queued_bytes += length_and_record.size();
+    ns_queue.push_back( std::move(length_and_record) );
+  }// End lock on ns_capture_mutex
+
+  ns_capture_cv.notify_all();
+}//void capture(...)
+
+
+std::string serialize_request( const Analysis::AnalysisInput &input, const Submitter submitter,
+                               const uint64_t submit_time_us )
+{
+  if( !input.input )
+    throw runtime_error( "serialize_request: no input spectrum file" );
+
+  string record;
+  Writer out( record );
+
+  out.u64( submit_time_us );
+  out.u8( static_cast<uint8_t>( submitter ) );
+  out.u8( static_cast<uint8_t>( input.analysis_type ) );
+  out.str( input.drf_folder );
+
+  out.u32( static_cast<uint32_t>( input.input_warnings.size() ) );
+  for( const string &warning : input.input_warnings )
+    out.str( warning );
+
+  write_spec( out, *input.input );
+
+  return record;
+}//std::string serialize_request(...)
+
+
+CapturedRequest deserialize_request( const std::string &record )
+{
+  Reader in( record );
+
+  CapturedRequest request;
+  request.submit_time_us = in.u64();
+
+  const uint8_t submitter = in.u8();
+  if( submitter > static_cast<uint8_t>(Submitter::Other) )
+    throw runtime_error( "Invalid submitter in analysis capture record" );
+  request.submitter = static_cast<Submitter>( submitter );
+
+  const uint8_t type = in.u8();
+  if( type > static_cast<uint8_t>(Analysis::AnalysisType::Portal) )
+    throw runtime_error( "Invalid analysis type in analysis capture record" );
+  request.analysis_type = static_cast<Analysis::AnalysisType>( type );
+
+  request.drf = in.str();
+
+  const uint32_t nwarnings = in.u32();
+  for( uint32_t i = 0; i < nwarnings; ++i )
+    request.input_warnings.push_back( in.str() );
+
+  request.input = read_spec( in );
+
+  if( in.pos != record.size() )
+    throw runtime_error( "Unexpected trailing data in analysis capture record" );
+
+  return request;
+}//CapturedRequest deserialize_request( const std::string &record )
+
+
+CaptureReader::CaptureReader( const std::string &filename )
+  : m_input( filename.c_str(), ios::in | ios::binary ),
+    m_capture_start_us( 0 )
+{
+  if( !m_input )
+    throw runtime_error( "Could not open analysis capture file '" + filename + "'" );
+
+  string header( sizeof(ns_file_magic) + 8, '\0' );
+  if( !m_input.read( &header[0], header.size() )
+      || (memcmp( header.data(), ns_file_magic, sizeof(ns_file_magic) ) != 0) )
+    throw runtime_error( "'" + filename + "' is not an analysis capture file" );
+
+  Reader in( header );
+  in.pos = sizeof(ns_file_magic);
+  m_capture_start_us = in.u64();
+}//CaptureReader constructor
+
+
+uint64_t CaptureReader::capture_start_us() const
+{
+  return m_capture_start_us;
+}
+
+
+bool CaptureReader::next( CapturedRequest &request )
+{
+  while( true )
+  {
+    string length( 8, '\0' );
+    if( !m_input.read( &length[0], length.size() ) )
+      return false;
+
+    // If the capture was restarted, there will be a new header here; skip over it.
+    if( memcmp( length.data(), ns_file_magic, sizeof(ns_file_magic) ) == 0 )
+    {
+      string start( 8, '\0' );
+      if( !m_input.read( &start[0], start.size() ) )
+        return false;
+      continue;
+    }
+
+    const uint64_t record_size = Reader( length ).u64();
+    if( record_size > ns_max_record_size )
+      throw runtime_error( "Invalid record size in analysis capture file" );
+
+    string record( static_cast<size_t>(record_size), '\0' );
+    if( !m_input.read( &record[0], record.size() ) )
+      return false;
+
+    request = deserialize_request( record );
+    return true;
+  }//while( true )
+
+  return false;
+}//bool CaptureReader::next( CapturedRequest &request )
+
+}//namespace AnalysisCapture
@@ -0,0 +1,1126 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <set>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <random>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#include <Wt/WLogger.h>
+
+#include "SpecUtils/SpecFile.h"
+
+#include "FullSpectrumId/HashUtils.h"
+#include "FullSpectrumId/MessageChannel.h"
+#include "FullSpectrumId/AnalysisCluster.h"
+#include "FullSpectrumId/AnalysisSerialization.h"
+
+using namespace std;
+
+using AnalysisSerialization::Reader;
+using AnalysisSerialization::Writer;
+
+#ifndef _WIN32
+using MessageChannel::Channel;
+using MessageChannel::listen_on;
+using MessageChannel::connect_to;
+using MessageChannel::parse_address;
+using MessageChannel::poll_timeout_ms;
+#endif
+
+
+namespace
+{
+  /** Incremented whenever the messages change; workers with a different version are rejected. */
+  const uint32_t ns_protocol_version = 3;
+
+  /** The types of messages; the first byte of each frame. */
+  enum MessageType : uint8_t
+  {
+    /** Worker to coordinator, once it gets the challenge: protocol version, proof of the shared
+     secret (see #secret_proof), worker name, DRF names.
+     */
+    HelloMessage = 1,
+
+    /** Worker to coordinator: the worker is ready for its next job. */
+    PullMessage = 2,
+
+    /** Coordinator to worker: job ID, time left until the jobs deadline as of sending it (see
+     #AnalysisSerialization::write_deadline), then the serialized #Analysis::AnalysisInput.
+     */
+    JobMessage = 3,
+
+    /** Worker to coordinator: job ID, success flag, then either the serialized
+     #Analysis::AnalysisOutput, or an error message.
+     */
+    ResultMessage = 4,
+
+    /** Either direction; lets the other side know we are still alive. */
+    HeartbeatMessage = 5,
+
+    /** Coordinator to worker, once on accepting the connection: protocol version, random nonce. */
+    ChallengeMessage = 6
+  };//enum MessageType
+
+
+  typedef std::chrono::steady_clock::time_point TimePoint;
+
+
+  std::chrono::steady_clock::duration to_duration( const double seconds )
+  {
+    return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                                std::chrono::duration<double>( seconds ) );
+  }
+
+
+  /** Returns what a worker sends to show it knows the shared secret, without sending the secret. */
+  string secret_proof( const string &nonce, const string &secret )
+  {
+    const string data = nonce + ":" + secret;
+    return HashUtils::sha256_hex( data.data(), data.size() );
+  }
+
+
+  /** Compares the strings in a time that does not depend on where they first differ. */
+  bool constant_time_equal( const string &lhs, const string &rhs )
+  {
+    if( lhs.size() != rhs.size() )
+      return false;
+
+    unsigned char diff = 0;
+    for( size_t i = 0; i < lhs.size(); ++i )
+      diff |= static_cast<unsigned char>( lhs[i] ^ rhs[i] );
+    return (diff == 0);
+  }//bool constant_time_equal(...)
+
+
+  string random_nonce()
+  {
+    std::random_device rd;
+    string nonce;
+    for( size_t i = 0; i < 4; ++i )
+    {
+      char buffer[16];
+      snprintf( buffer, sizeof(buffer), "%08x", static_cast<unsigned int>( rd() ) );
+      nonce += buffer;
+    }
+    return nonce;
+  }//string random_nonce()
+
+
+  Analysis::AnalysisOutput error_output( const Analysis::AnalysisInput &input, const string &msg )
+  {
+    Analysis::AnalysisOutput result;
+    result.ana_number = input.ana_number;
+    result.drf_used = input.drf_folder;
+    result.error_message = msg;
+    return result;
+  }//error_output(...)
+
+
+  std::mutex ns_options_mutex;
+  AnalysisCluster::Options ns_options;
+
+
+#ifndef _WIN32
+  /** A job submitted to the coordinator. */
+  struct ClusterJob
+  {
+    uint64_t id = 0;
+    Analysis::AnalysisInput input;
+    string serialized_input;
+    std::function<void(const Analysis::AnalysisOutput &)> callback;
+
+    /** The number of times the job has been sent to a worker. */
+    size_t attempts = 0;
+
+    /** How long the job may run on a worker; see #AnalysisCluster::Options::job_timeout_base_seconds. */
+    double timeout_seconds = 0.0;
+
+    /** When we noticed no connected worker has this jobs DRF; only valid if #waiting_for_drf. */
+    TimePoint no_worker_since;
+    bool waiting_for_drf = false;
+  };//struct ClusterJob
+
+
+  /** A worker connection, as tracked by the coordinator. */
+  struct Worker
+  {
+    unique_ptr<Channel> channel;
+    string name;
+    set<string> drfs;
+    bool registered = false;
+    bool wants_job = false;
+    string last_drf;
+    shared_ptr<ClusterJob> job;
+
+    /** When the worker is dropped, if it hasnt finished #job by then. */
+    TimePoint job_limit;
+
+    /** The nonce sent to the worker, that its hello must prove the shared secret with. */
+    string challenge;
+    TimePoint last_heard;
+    TimePoint last_sent;
+    TimePoint connected;
+    uint64_t jobs_completed = 0;
+  };//struct Worker
+
+
+  // Coordinator state; all protected by ns_mutex.
+  std::mutex ns_mutex;
+  bool ns_coordinator_running = false;
+  bool ns_coordinator_stop = false;
+  uint64_t ns_next_job_id = 1;
+  deque<shared_ptr<ClusterJob>> ns_queue;
+  vector<unique_ptr<Worker>> ns_workers;
+  uint64_t ns_jobs_completed = 0;
+  uint64_t ns_jobs_failed = 0;
+  uint64_t ns_jobs_abandoned = 0;
+  uint64_t ns_jobs_reassigned = 0;
+  uint64_t ns_workers_lost = 0;
+  int ns_listen_fd = -1;
+  int ns_wake_fds[2] = { -1, -1 };
+  string ns_unix_socket_path;
+  std::unique_ptr<std::thread> ns_coordinator_thread;
+
+
+  /** A job that has finished, to have its callback called once ns_mutex is unlocked. */
+  typedef pair<shared_ptr<ClusterJob>,Analysis::AnalysisOutput> FinishedJob;
+
+
+  void wake_coordinator()
+  {
+    const char c = 0;
+    while( (write( ns_wake_fds[1], &c, 1 ) < 0) && (errno == EINTR) )
+    {
+    }
+  }//void wake_coordinator()
+
+
+  void queue_message( Worker &worker, const string &msg )
+  {
+    worker.channel->queue_frame( msg );
+    worker.last_sent = std::chrono::steady_clock::now();
+  }
+
+
+  /** Removes the worker, putting its job back on the queue, or failing it if it has been tried
+   too many times.  Must hold ns_mutex.
+   */
+  void drop_worker( const size_t index, const string &reason, const size_t max_attempts,
+                    vector<FinishedJob> &finished )
+  {
+    Worker &worker = *ns_workers[index];
+
+    Wt::log("warn:app") << "Dropping analysis worker '" << worker.name << "': " << reason;
+    ns_workers_lost += 1;
+
+    if( worker.job )
+    {
+      const shared_ptr<ClusterJob> job = worker.job;
+      if( job->attempts < max_attempts )
+      {
+        ns_queue.push_front( job );
+        ns_jobs_reassigned += 1;
+      }else
+      {
+        finished.push_back( FinishedJob( job, error_output( job->input,
+                            "The analysis worker was lost " + std::to_string(job->attempts)
+                            + " times while running this analysis (last time: " + reason + ")" ) ) );
+        ns_jobs_failed += 1;
+      }
+    }//if( worker.job )
+
+    ns_workers.erase( begin(ns_workers) + index );
+  }//void drop_worker(...)
+
+
+  /** Handles a message from a worker; throws exception on protocol errors.  Must hold ns_mutex. */
+  void handle_message( Worker &worker, const string &msg, const AnalysisCluster::Options &opts,
+                       vector<FinishedJob> &finished )
+  {
+    Reader in( msg );
+    const uint8_t type = in.u8();
+
+    if( !worker.registered && (type != HelloMessage) && (type != HeartbeatMessage) )
+      throw runtime_error( "expected hello message" );
+
+    switch( type )
+    {
+      case HelloMessage:
+      {
+        const uint32_t version = in.u32();
+        if( version != ns_protocol_version )
+          throw runtime_error( "protocol version " + std::to_string(version) + ", but we use "
+                               + std::to_string(ns_protocol_version) );
+
+        const string proof = in.str();
+        if( !opts.shared_secret.empty()
+            && !constant_time_equal( proof, secret_proof( worker.challenge, opts.shared_secret ) ) )
+          throw runtime_error( "wrong shared secret" );
+
+        worker.name = in.str();
+        const vector<string> drfs = in.strs();
+        worker.drfs.clear();
+        worker.drfs.insert( begin(drfs), end(drfs) );
+        worker.registered = true;
+
+        Wt::log("info:app") << "Analysis worker '" << worker.name << "' connected, with "
+                            << worker.drfs.size() << " DRFs";
+        break;
+      }//case HelloMessage:
+
+      case PullMessage:
+        worker.wants_job = true;
+        break;
+
+      case ResultMessage:
+      {
+        const uint64_t job_id = in.u64();
+        const bool success = (in.u8() != 0);
+        const string data = in.str();
+
+        if( !worker.job || (worker.job->id != job_id) )
+          throw runtime_error( "result for job " + std::to_string(job_id) + " it wasnt running" );
+
+        const shared_ptr<ClusterJob> job = worker.job;
+        worker.job.reset();
+        worker.last_drf = job->input.drf_folder;
+        worker.jobs_completed += 1;
+
+        Analysis::AnalysisOutput result;
+        try
+        {
+          if( !success )
+            throw runtime_error( data );
+
+          Reader result_in( data );
+          result = AnalysisSerialization::read_output( result_in, job->input.input );
+          result_in.check_at_end();
+          ns_jobs_completed += 1;
+        }catch( std::exception &e )
+        {
+          result = error_output( job->input, e.what() );
+          ns_jobs_failed += 1;
+        }//try / catch
+
+        finished.push_back( FinishedJob( job, result ) );
+        break;
+      }//case ResultMessage:
+
+      case HeartbeatMessage:
+        break;
+
+      default:
+        throw runtime_error( "unknown message type " + std::to_string(type) );
+    }//switch( type )
+  }//void handle_message(...)
+
+
+  /** Gives queued jobs to idle workers that have the DRF, preferring workers whose previous job
+   used the same DRF; must hold ns_mutex.
+   */
+  void assign_jobs( const AnalysisCluster::Options &opts, vector<FinishedJob> &finished )
+  {
+    const TimePoint now = std::chrono::steady_clock::now();
+
+    for( auto iter = begin(ns_queue); iter != end(ns_queue); )
+    {
+      const shared_ptr<ClusterJob> job = *iter;
+      const string &drf = job->input.drf_folder;
+
+      if( Analysis::is_abandoned( job->input ) )
+      {
+        finished.push_back( FinishedJob( job, error_output( job->input,
+                      "Analysis stopped, as its deadline passed, or the requester went away." ) ) );
+        ns_jobs_abandoned += 1;
+        iter = ns_queue.erase( iter );
+        continue;
+      }
+
+      bool any_has_drf = false;
+      Worker *best = nullptr;
+      for( const auto &worker : ns_workers )
+      {
+        if( !worker->registered || !worker->drfs.count(drf) )
+          continue;
+
+        any_has_drf = true;
+        if( !worker->wants_job || worker->job )
+          continue;
+
+        if( !best || ((worker->last_drf == drf) && (best->last_drf != drf)) )
+          best = worker.get();
+      }//for( const auto &worker : ns_workers )
+
+      if( any_has_drf )
+        job->waiting_for_drf = false;
+
+      if( !best )
+      {
+        if( !any_has_drf && !job->waiting_for_drf )
+        {
+          job->waiting_for_drf = true;
+          job->no_worker_since = now;
+        }
+
+        if( job->waiting_for_drf
+            && ((now - job->no_worker_since) > to_duration(opts.no_worker_timeout_seconds)) )
+        {
+          finished.push_back( FinishedJob( job, error_output( job->input,
+                                      "No analysis worker with DRF '" + drf + "' is available" ) ) );
+          ns_jobs_failed += 1;
+          iter = ns_queue.erase( iter );
+        }else
+        {
+          ++iter;
+        }
+
+        continue;
+      }//if( !best )
+
+      string msg;
+      Writer out( msg );
+      out.u8( JobMessage );
+      out.u64( job->id );
+      AnalysisSerialization::write_deadline( out, job->input.deadline );
+      out.str( job->serialized_input );
+      queue_message( *best, msg );
+
+      best->job = job;
+      best->wants_job = false;
+      job->attempts += 1;
+
+      // If the deadline passes first, give the worker a moment to report it stopped the analysis;
+      //  if it doesnt, the job is then dropped as abandoned, rather than tried again.
+      best->job_limit = now + to_duration( job->timeout_seconds );
+      if( job->input.deadline != TimePoint() )
+        best->job_limit = std::min( best->job_limit,
+                                    job->input.deadline + to_duration(opts.heartbeat_timeout_seconds) );
+
+      iter = ns_queue.erase( iter );
+    }//for( loop over queued jobs )
+  }//void assign_jobs(...)
+
+
+  void call_callbacks( vector<FinishedJob> &finished )
+  {
+    for( FinishedJob &job : finished )
+    {
+      try
+      {
+        job.first->callback( job.second );
+      }catch( std::exception &e )
+      {
+        Wt::log("error:app") << "Exception from analysis cluster callback: " << e.what();
+      }
+    }//for( FinishedJob &job : finished )
+
+    finished.clear();
+  }//void call_callbacks( vector<FinishedJob> &finished )
+
+
+  void coordinator_main()
+  {
+    const AnalysisCluster::Options opts = AnalysisCluster::options();
+    const auto heartbeat_interval = to_duration( opts.heartbeat_interval_seconds );
+    const auto heartbeat_timeout = to_duration( opts.heartbeat_timeout_seconds );
+
+    vector<FinishedJob> finished;
+
+    while( true )
+    {
+      vector<pollfd> fds;
+
+      {
+        std::lock_guard<std::mutex> lock( ns_mutex );
+        if( ns_coordinator_stop )
+          break;
+
+        fds.push_back( { ns_wake_fds[0], POLLIN, 0 } );
+        fds.push_back( { ns_listen_fd, POLLIN, 0 } );
+        for( const auto &worker : ns_workers )
+        {
+          const short events = POLLIN | (worker->channel->wants_write() ? POLLOUT : 0);
+          fds.push_back( { worker->channel->fd, events, 0 } );
+        }
+      }
+
+      const int timeout_ms = poll_timeout_ms( std::chrono::steady_clock::now() + heartbeat_interval / 2, 1000 );
+      const int npoll = poll( &fds[0], fds.size(), timeout_ms );
+      if( (npoll < 0) && (errno != EINTR) )
+      {
+        Wt::log("error:app") << "Analysis cluster coordinator poll failed: " << strerror(errno);
+        std::this_thread::sleep_for( std::chrono::milliseconds(100) );
+        continue;
+      }
+
+      {//begin lock on ns_mutex
+        std::lock_guard<std::mutex> lock( ns_mutex );
+        const TimePoint now = std::chrono::steady_clock::now();
+
+        if( (npoll > 0) && fds[0].revents )
+        {
+          char buffer[64];
+          while( read( ns_wake_fds[0], buffer, sizeof(buffer) ) > 0 )
+          {
+          }
+        }//if( woken up )
+
+        // Handle existing workers before accepting new ones, so the pollfd indexes still line up;
+        //  go backwards since we may remove workers.
+        for( size_t i = ns_workers.size(); i > 0; --i )
+        {
+          Worker &worker = *ns_workers[i-1];
+          const short revents = (npoll > 0) ? fds[i + 1].revents : 0;
+
+          if( (revents & POLLOUT) && !worker.channel->write_available() )
+          {
+            drop_worker( i - 1, "write failed", opts.max_attempts, finished );
+            continue;
+          }
+
+          if( revents & (POLLIN | POLLHUP | POLLERR) )
+          {
+            const bool open = worker.channel->read_available();
+
+            try
+            {
+              string msg;
+              while( worker.channel->pop_frame( msg ) )
+              {
+                worker.last_heard = now;
+                handle_message( worker, msg, opts, finished );
+              }
+            }catch( std::exception &e )
+            {
+              drop_worker( i - 1, string("invalid message, ") + e.what(), opts.max_attempts, finished );
+              continue;
+            }
+
+            if( !open )
+            {
+              drop_worker( i - 1, "disconnected", opts.max_attempts, finished );
+              continue;
+            }
+          }//if( readable )
+
+          if( (now - worker.last_heard) > heartbeat_timeout )
+          {
+            drop_worker( i - 1, "no heartbeat", opts.max_attempts, finished );
+            continue;
+          }
+
+          if( worker.job && (now > worker.job_limit) )
+          {
+            drop_worker( i - 1, "analysis ran past its time limit", opts.max_attempts, finished );
+            continue;
+          }
+
+          if( (now - worker.last_sent) > heartbeat_interval )
+          {
+            string msg;
+            Writer( msg ).u8( HeartbeatMessage );
+            queue_message( worker, msg );
+          }
+        }//for( loop over workers )
+
+        if( (npoll > 0) && (fds[1].revents & POLLIN) )
+        {
+          while( true )
+          {
+            const int fd = accept( ns_listen_fd, nullptr, nullptr );
+            if( fd < 0 )
+              break;
+
+            const int one = 1;
+            setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) ); //fails harmlessly for Unix sockets
+#if( defined(SO_NOSIGPIPE) )
+            setsockopt( fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one) );
+#endif
+
+            unique_ptr<Worker> worker( new Worker() );
+            worker->channel.reset( new Channel( fd ) );
+            worker->name = "(unregistered connection)";
+            worker->last_heard = worker->last_sent = worker->connected = now;
+            worker->challenge = random_nonce();
+
+            string msg;
+            Writer out( msg );
+            out.u8( ChallengeMessage );
+            out.u32( ns_protocol_version );
+            out.str( worker->challenge );
+            queue_message( *worker, msg );
+
+            ns_workers.push_back( std::move(worker) );
+          }//while( true )
+        }//if( new connections )
+
+        assign_jobs( opts, finished );
+
+        // Start writing immediately, rather than waiting for the next poll
+        for( size_t i = ns_workers.size(); i > 0; --i )
+        {
+          if( ns_workers[i-1]->channel->wants_write() && !ns_workers[i-1]->channel->write_available() )
+            drop_worker( i - 1, "write failed", opts.max_attempts, finished );
+        }
+      }//end lock on ns_mutex
+
+      call_callbacks( finished );
+    }//while( true )
+
+    // We are stopping; fail everything
+    {
+      std::lock_guard<std::mutex> lock( ns_mutex );
+      for( const shared_ptr<ClusterJob> &job : ns_queue )
+        finished.push_back( FinishedJob( job, error_output( job->input, "The analysis server is stopping" ) ) );
+      ns_queue.clear();
+
+      for( const auto &worker : ns_workers )
+      {
+        if( worker->job )
+          finished.push_back( FinishedJob( worker->job,
+                                           error_output( worker->job->input, "The analysis server is stopping" ) ) );
+      }
+      ns_workers.clear();
+    }
+
+    call_callbacks( finished );
+  }//void coordinator_main()
+
+
+  std::atomic<bool> ns_stop_worker( false );
+
+  void worker_signal_handler( int )
+  {
+    AnalysisCluster::stop_worker();
+  }
+
+
+  string default_worker_name()
+  {
+    char hostname[256] = { '\0' };
+    if( gethostname( hostname, sizeof(hostname) - 1 ) != 0 )
+      strcpy( hostname, "unknown" );
+    return string(hostname) + ":" + std::to_string( getpid() );
+  }//string default_worker_name()
+
+
+  /** Result of running a job on the worker; set from the analysis thread. */
+  struct WorkerJob
+  {
+    uint64_t id = 0;
+    std::shared_ptr<SpecUtils::SpecFile> spec;
+    std::future<Analysis::AnalysisOutput> result;
+  };//struct WorkerJob
+
+
+  /** Services one connection to the coordinator, until it is lost, or we are asked to stop. */
+  void worker_session( const int fd, const AnalysisCluster::Options &opts, const string &name )
+  {
+    const auto heartbeat_interval = to_duration( opts.heartbeat_interval_seconds );
+    const auto heartbeat_timeout = to_duration( opts.heartbeat_timeout_seconds );
+
+    Channel channel( fd );
+    TimePoint last_heard = std::chrono::steady_clock::now(), last_sent = last_heard;
+
+    auto send = [&]( const string &msg ){
+      channel.queue_frame( msg );
+      last_sent = std::chrono::steady_clock::now();
+    };
+
+    // We say hello once the coordinator sends its challenge.
+    bool said_hello = false;
+    unique_ptr<WorkerJob> job;
+
+    while( !ns_stop_worker || job )
+    {
+      pollfd pfd = { channel.fd, static_cast<short>(POLLIN | (channel.wants_write() ? POLLOUT : 0)), 0 };
+      const int npoll = poll( &pfd, 1, job ? 50 : 250 );
+      if( (npoll < 0) && (errno != EINTR) )
+        return;
+
+      const TimePoint now = std::chrono::steady_clock::now();
+
+      if( (npoll > 0) && (pfd.revents & POLLOUT) && !channel.write_available() )
+      {
+        Wt::log("warn:app") << "Failed writing to analysis coordinator";
+        return;
+      }
+
+      if( (npoll > 0) && (pfd.revents & (POLLIN | POLLHUP | POLLERR)) )
+      {
+        const bool open = channel.read_available();
+
+        try
+        {
+          string msg;
+          while( channel.pop_frame( msg ) )
+          {
+            last_heard = now;
+
+            Reader in( msg );
+            const uint8_t type = in.u8();
+            if( type == HeartbeatMessage )
+              continue;
+
+            if( type == ChallengeMessage )
+            {
+              if( said_hello )
+                throw runtime_error( "received a second challenge" );
+
+              const uint32_t version = in.u32();
+              if( version != ns_protocol_version )
+                throw runtime_error( "coordinator uses protocol version " + std::to_string(version)
+                                     + ", but we use " + std::to_string(ns_protocol_version) );
+
+              const string nonce = in.str();
+
+              string hello;
+              Writer out( hello );
+              out.u8( HelloMessage );
+              out.u32( ns_protocol_version );
+              out.str( secret_proof( nonce, opts.shared_secret ) );
+              out.str( name );
+              out.strs( Analysis::available_drfs() );
+              send( hello );
+
+              hello.clear();
+              Writer( hello ).u8( PullMessage );
+              send( hello );
+
+              said_hello = true;
+              continue;
+            }//if( type == ChallengeMessage )
+
+            if( !said_hello )
+              throw runtime_error( "expected challenge message" );
+
+            if( type != JobMessage )
+              throw runtime_error( "unexpected message type " + std::to_string(type) );
+
+            if( job )
+              throw runtime_error( "received a job while still running the previous one" );
+
+            job.reset( new WorkerJob() );
+            job->id = in.u64();
+            const TimePoint deadline = AnalysisSerialization::read_deadline( in );
+            const string serialized_input = in.str();
+
+            auto promise = make_shared<std::promise<Analysis::AnalysisOutput>>();
+            job->result = promise->get_future();
+
+            try
+            {
+              Reader input_in( serialized_input );
+              Analysis::AnalysisInput input = AnalysisSerialization::read_input( input_in );
+              input_in.check_at_end();
+
+              // The input was serialized when submitted, so use the deadline as of being sent.
+              input.deadline = deadline;
+              job->spec = input.input;
+              input.wt_app_id.clear();
+              input.callback = [promise]( Analysis::AnalysisOutput output ){
+                promise->set_value( std::move(output) );
+              };
+
+              Analysis::post_analysis( input );
+            }catch( std::exception & )
+            {
+              promise->set_exception( std::current_exception() );
+            }
+          }//while( channel.pop_frame( msg ) )
+        }catch( std::exception &e )
+        {
+          Wt::log("error:app") << "Invalid message from analysis coordinator: " << e.what();
+          return;
+        }//try / catch
+
+        if( !open )
+        {
+          Wt::log("warn:app") << "Lost connection to analysis coordinator";
+          return;
+        }
+      }//if( readable )
+
+      if( job && (job->result.wait_for( std::chrono::seconds(0) ) == std::future_status::ready) )
+      {
+        string msg;
+        Writer out( msg );
+        out.u8( ResultMessage );
+        out.u64( job->id );
+
+        try
+        {
+          const Analysis::AnalysisOutput output = job->result.get();
+
+          string serialized_output;
+          Writer output_out( serialized_output );
+          AnalysisSerialization::write_output( output_out, output, job->spec );
+
+          out.u8( 1 );
+          out.str( serialized_output );
+        }catch( std::exception &e )
+        {
+          out.u8( 0 );
+          out.str( e.what() );
+        }
+
+        send( msg );
+        job.reset();
+
+        if( !ns_stop_worker )
+        {
+          msg.clear();
+          Writer( msg ).u8( PullMessage );
+          send( msg );
+        }
+      }//if( job finished )
+
+      if( (now - last_heard) > heartbeat_timeout )
+      {
+        Wt::log("warn:app") << "No heartbeat from analysis coordinator; will reconnect";
+        return;
+      }
+
+      if( (now - last_sent) > heartbeat_interval )
+      {
+        string msg;
+        Writer( msg ).u8( HeartbeatMessage );
+        send( msg );
+      }
+
+      if( channel.wants_write() && !channel.write_available() )
+      {
+        Wt::log("warn:app") << "Failed writing to analysis coordinator";
+        return;
+      }
+    }//while( !ns_stop_worker || job )
+
+    // Give our last result a moment to get out.
+    const TimePoint flush_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while( channel.wants_write() && (std::chrono::steady_clock::now() < flush_deadline) )
+    {
+      pollfd pfd = { channel.fd, POLLOUT, 0 };
+      if( (poll( &pfd, 1, poll_timeout_ms( flush_deadline, 100 ) ) > 0) && !channel.write_available() )
+        break;
+    }
+  }//void worker_session(...)
+#endif //#ifndef _WIN32
+}//namespace
+
+
+namespace AnalysisCluster
+{
+
+void set_options( const Options &options )
+{
+  std::lock_guard<std::mutex> lock( ns_options_mutex );
+  ns_options = options;
+}
+
+
+Options options()
+{
+  std::lock_guard<std::mutex> lock( ns_options_mutex );
+  return ns_options;
+}
+
+
+void start_coordinator()
+{
+#ifdef _WIN32
+  throw runtime_error( "The analysis cluster coordinator is not supported on Windows" );
+#else
+  const Options opts = options();
+
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  if( ns_coordinator_thread )
+    throw runtime_error( "AnalysisCluster::start_coordinator(): already started" );
+
+  const int listen_fd = listen_on( opts.listen_address );
+
+  if( pipe( ns_wake_fds ) != 0 )
+  {
+    close( listen_fd );
+    throw runtime_error( "AnalysisCluster::start_coordinator(): failed to create pipe" );
+  }
+
+  MessageChannel::set_non_blocking( listen_fd );
+  MessageChannel::set_non_blocking( ns_wake_fds[0] );
+  MessageChannel::set_non_blocking( ns_wake_fds[1] );
+
+  bool is_unix;
+  string path, host, port;
+  parse_address( opts.listen_address, is_unix, path, host, port );
+  ns_unix_socket_path = is_unix ? path : string();
+
+  ns_listen_fd = listen_fd;
+  ns_coordinator_stop = false;
+  ns_coordinator_running = true;
+  ns_coordinator_thread = make_unique<std::thread>( &coordinator_main );
+
+  Wt::log("info:app") << "Analysis cluster coordinator listening on '" << opts.listen_address << "'";
+  if( !is_unix && opts.shared_secret.empty() )
+    Wt::log("warn:app") << "Analysis cluster coordinator has no shared secret, so any machine that can"
+                           " connect to '" << opts.listen_address << "' can take analyses";
+#endif
+}//void start_coordinator()
+
+
+void stop_coordinator()
+{
+#ifndef _WIN32
+  std::unique_ptr<std::thread> coordinator;
+
+  {
+    std::lock_guard<std::mutex> lock( ns_mutex );
+    if( !ns_coordinator_thread )
+      return;
+
+    ns_coordinator_stop = true;
+    coordinator = std::move( ns_coordinator_thread );
+  }
+
+  wake_coordinator();
+  coordinator->join();
+
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  ns_coordinator_running = false;
+  close( ns_listen_fd );
+  close( ns_wake_fds[0] );
+  close( ns_wake_fds[1] );
+  ns_listen_fd = ns_wake_fds[0] = ns_wake_fds[1] = -1;
+
+  if( !ns_unix_socket_path.empty() )
+    unlink( ns_unix_socket_path.c_str() );
+  ns_unix_socket_path.clear();
+
+  Wt::log("info:app") << "Stopped analysis cluster coordinator";
+#endif
+}//void stop_coordinator()
+
+
+bool can_run( const std::string &drf )
+{
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  if( !ns_coordinator_running || ns_coordinator_stop )
+    return false;
+
+  for( const auto &worker : ns_workers )
+  {
+    if( worker->registered && worker->drfs.count(drf) )
+      return true;
+  }
+
+  return false;
+}//bool can_run( const std::string &drf )
+
+
+void submit( const Analysis::AnalysisInput &input,
+             std::function<void(const Analysis::AnalysisOutput &)> callback )
+{
+#ifdef _WIN32
+  callback( error_output( input, "The analysis cluster is not supported on Windows" ) );
+#else
+  auto job = make_shared<ClusterJob>();
+  job->input = input;
+  job->callback = std::move( callback );
+
+  try
+  {
+    Writer out( job->serialized_input );
+    AnalysisSerialization::write_input( out, input );
+  }catch( std::exception &e )
+  {
+    job->callback( error_output( input, string("Failed to serialize analysis input: ") + e.what() ) );
+    return;
+  }
+
+  const Options opts = options();
+  double nsamples = 0.0;
+  for( const auto &meas : input.input->measurements() )
+  {
+    const auto &counts = meas ? meas->gamma_counts() : nullptr;
+    if( counts )
+      nsamples += counts->size() / 1024.0;
+  }
+  job->timeout_seconds = opts.job_timeout_base_seconds + opts.job_timeout_per_sample_seconds * nsamples;
+
+  {
+    std::unique_lock<std::mutex> lock( ns_mutex );
+    if( !ns_coordinator_running || ns_coordinator_stop )
+    {
+      lock.unlock();
+      job->callback( error_output( input, "The analysis cluster coordinator is not running" ) );
+      return;
+    }
+
+    job->id = ns_next_job_id++;
+    ns_queue.push_back( job );
+  }
+
+  wake_coordinator();
+#endif
+}//void submit(...)
+
+
+EngineJson::Object status_json()
+{
+  EngineJson::Object json;
+
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  json["running"] = ns_coordinator_running;
+  json["jobsQueued"] = static_cast<long long>( ns_queue.size() );
+  json["jobsCompleted"] = static_cast<long long>( ns_jobs_completed );
+  json["jobsFailed"] = static_cast<long long>( ns_jobs_failed );
+  json["jobsAbandoned"] = static_cast<long long>( ns_jobs_abandoned );
+  json["jobsReassigned"] = static_cast<long long>( ns_jobs_reassigned );
+  json["workersLost"] = static_cast<long long>( ns_workers_lost );
+
+  EngineJson::Array workers;
+  for( const auto &worker : ns_workers )
+  {
+    if( !worker->registered )
+      continue;
+
+    EngineJson::Object info;
+    info["name"] = worker->name;
+    info["numDrfs"] = static_cast<int>( worker->drfs.size() );
+    info["lastDrf"] = worker->last_drf;
+    info["busy"] = static_cast<bool>( worker->job );
+    info["jobsCompleted"] = static_cast<long long>( worker->jobs_completed );
+    workers.emplace_back( std::move(info) );
+  }//for( const auto &worker : ns_workers )
+  json["workers"] = std::move( workers );
+
+  return json;
+}//EngineJson::Object status_json()
+
+
+int run_worker()
+{
+#ifdef _WIN32
+  Wt::log("error:app") << "Analysis cluster worker mode is not supported on Windows";
+  return EXIT_FAILURE;
+#else
+  const Options opts = options();
+  if( opts.coordinator_address.empty() )
+  {
+    Wt::log("error:app") << "No analysis coordinator address specified";
+    return EXIT_FAILURE;
+  }
+
+  const string name = opts.worker_name.empty() ? default_worker_name() : opts.worker_name;
+
+  ns_stop_worker = false;
+  auto old_int_handler = signal( SIGINT, &worker_signal_handler );
+  auto old_term_handler = signal( SIGTERM, &worker_signal_handler );
+  auto old_pipe_handler = signal( SIGPIPE, SIG_IGN );
+
+  Wt::log("info:app") << "Analysis worker '" << name << "' will connect to '"
+                      << opts.coordinator_address << "'";
+
+  int rval = EXIT_SUCCESS;
+  bool logged_connect_failure = false;
+
+  while( !ns_stop_worker )
+  {
+    int fd = -1;
+    try
+    {
+      fd = connect_to( opts.coordinator_address );
+    }catch( std::exception &e )
+    {
+      Wt::log("error:app") << e.what();
+      rval = EXIT_FAILURE;
+      break;
+    }
+
+    if( fd < 0 )
+    {
+      if( !logged_connect_failure )
+        Wt::log("warn:app") << "Could not connect to analysis coordinator; will keep trying";
+      logged_connect_failure = true;
+
+      for( int i = 0; (i < 20) && !ns_stop_worker; ++i )
+        std::this_thread::sleep_for( std::chrono::milliseconds(100) );
+      continue;
+    }//if( fd < 0 )
+
+    logged_connect_failure = false;
+    Wt::log("info:app") << "Connected to analysis coordinator";
+
+    worker_session( fd, opts, name );
+
+    // Dont reconnect right away, in case the coordinator is rejecting us (e.g., wrong secret).
+    for( int i = 0; (i < 20) && !ns_stop_worker; ++i )
+      std::this_thread::sleep_for( std::chrono::milliseconds(100) );
+  }//while( !ns_stop_worker )
+
+  signal( SIGINT, old_int_handler );
+  signal( SIGTERM, old_term_handler );
+  signal( SIGPIPE, old_pipe_handler );
+
+  Wt::log("info:app") << "Analysis worker stopping";
+
+  return rval;
+#endif
+}//int run_worker()
+
+
+void stop_worker()
+{
+#ifndef _WIN32
+  ns_stop_worker = true;
+#endif
+}
+
+}//namespace AnalysisCluster
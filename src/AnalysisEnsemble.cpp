@@ -0,0 +1,402 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <set>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <cassert>
+#include <algorithm>
+#include <stdexcept>
+
+#include "SpecUtils/SpecFile.h"
+#include "SpecUtils/StringAlgo.h"
+
+#include "FullSpectrumId/EngineLog.h"
+#include "FullSpectrumId/AnalysisBatch.h"
+#include "FullSpectrumId/AnalysisEnsemble.h"
+
+using namespace std;
+
+namespace
+{
+  /** Detector materials, used to keep candidate DRFs to ones that could plausibly match the data. */
+  enum class Material { NaI, LaBr, CeBr, CZT, HPGe, Unknown };
+  
+  
+  std::mutex ns_mutex;
+  AnalysisEnsemble::Options ns_options;
+  
+  
+  Material drf_material( const string &name )
+  {
+    using SpecUtils::icontains;
+    
+    if( icontains(name, "LaBr") )
+      return Material::LaBr;
+    if( icontains(name, "CeBr") )
+      return Material::CeBr;
+    if( icontains(name, "CZT") || icontains(name, "CdZnTe")
+       || icontains(name, "Raider") || icontains(name, "Interceptor") )
+      return Material::CZT;
+    if( icontains(name, "HPGe") || icontains(name, "Detective") || icontains(name, "Falcon") )
+      return Material::HPGe;
+    
+    return Material::Unknown;
+  }//Material drf_material( const string &name )
+  
+  
+  /** The material of the detector, from the strings in the file, or Material::Unknown. */
+  Material spectrum_material( const shared_ptr<SpecUtils::SpecFile> &spec, const string &guess )
+  {
+    if( !guess.empty() )
+    {
+      const Material guess_material = drf_material( guess );
+      return (guess_material == Material::Unknown) ? Material::NaI : guess_material;
+    }
+    
+    Material material = drf_material( spec->instrument_model() );
+    if( material == Material::Unknown )
+      material = drf_material( spec->manufacturer() );
+    if( material == Material::Unknown )
+    {
+      for( const auto &meas : spec->measurements() )
+      {
+        if( meas && (meas->num_gamma_channels() > 7) )
+        {
+          const Material det_material = drf_material( meas->detector_type() );
+          if( det_material != Material::Unknown )
+            return det_material;
+          break;
+        }
+      }//for( const auto &meas : spec->measurements() )
+    }//if( we havent found the material yet )
+    
+    return material;
+  }//Material spectrum_material(...)
+  
+  
+  /** Returns if a DRF of the given material is plausible for the data. */
+  bool material_allowed( const Material spec_material, const Material drf_mat, const size_t nchannel )
+  {
+    // DRFs whose name doesnt say otherwise are taken as NaI
+    const Material mat = (drf_mat == Material::Unknown) ? Material::NaI : drf_mat;
+    
+    if( spec_material != Material::Unknown )
+      return (mat == spec_material);
+    
+    // Without anything better to go on, HPGe data has many more channels than scintillator data.
+    if( nchannel > 4096 )
+      return (mat == Material::HPGe);
+    if( nchannel <= 2048 )
+      return (mat != Material::HPGe);
+    return true;
+  }//bool material_allowed(...)
+  
+  
+  /** Returns the part of a DRF name before the first dash or space (e.g., "IdentiFINDER" for
+   "IdentiFINDER-NG"), which is usually the same for DRFs of the same product line.
+   */
+  string drf_family( const string &drf )
+  {
+    return drf.substr( 0, drf.find_first_of( "- _" ) );
+  }
+  
+  
+  /** Returns the sorted isotope names of a result, so results can be compared for agreement. */
+  string isotopes_key( const Analysis::AnalysisOutput &output )
+  {
+    vector<string> names = output.isotope_names;
+    std::sort( begin(names), end(names) );
+    
+    string key;
+    for( const string &name : names )
+      key += name + ";";
+    return key;
+  }//string isotopes_key(...)
+  
+  
+  bool succeeded( const Analysis::AnalysisOutput &output )
+  {
+    return (output.gadras_intialization_error >= 0) && (output.gadras_analysis_error >= 0);
+  }
+  
+  
+  /** Returns the index of the result to use; see the AnalysisEnsemble namespace documentation. */
+  size_t choose_result( const vector<AnalysisBatch::Result> &results, const float chi2_tolerance )
+  {
+    vector<Analysis::AnalysisOutput> outputs;
+    for( const AnalysisBatch::Result &result : results )
+      outputs.push_back( result.output );
+    
+    float best_chi2 = -1.0f;
+    for( const Analysis::AnalysisOutput &output : outputs )
+    {
+      if( succeeded(output) && (output.chi_sqr >= 0.0f)
+         && ((best_chi2 < 0.0f) || (output.chi_sqr < best_chi2)) )
+        best_chi2 = output.chi_sqr;
+    }//for( loop over outputs )
+    
+    vector<string> keys( outputs.size() );
+    for( size_t i = 0; i < outputs.size(); ++i )
+      keys[i] = isotopes_key( outputs[i] );
+    
+    size_t best_index = outputs.size(), best_agreement = 0;
+    for( size_t i = 0; i < outputs.size(); ++i )
+    {
+      const Analysis::AnalysisOutput &output = outputs[i];
+      if( !succeeded(output) )
+        continue;
+      
+      // If any result has a chi2, only consider the results close to the best one
+      if( (best_chi2 >= 0.0f)
+         && ((output.chi_sqr < 0.0f) || (output.chi_sqr > std::max(chi2_tolerance,1.0f)*best_chi2)) )
+        continue;
+      
+      size_t agreement = 0;
+      for( size_t j = 0; j < outputs.size(); ++j )
+        agreement += ((j != i) && succeeded(outputs[j]) && (keys[j] == keys[i]));
+      
+      if( (best_index == outputs.size())
+         || (agreement > best_agreement)
+         || ((agreement == best_agreement) && (output.chi_sqr < outputs[best_index].chi_sqr)) )
+      {
+        best_index = i;
+        best_agreement = agreement;
+      }
+    }//for( size_t i = 0; i < outputs.size(); ++i )
+    
+    // If nothing succeeded, give back the error from the most likely DRF
+    return (best_index == outputs.size()) ? 0 : best_index;
+  }//size_t choose_result(...)
+  
+  
+  void finish_ensemble( const Analysis::AnalysisInput &input, const vector<string> &drfs,
+                        const vector<AnalysisBatch::Result> &results, const float chi2_tolerance )
+  {
+    assert( results.size() == drfs.size() );
+    
+    const size_t chosen = choose_result( results, chi2_tolerance );
+    
+    Analysis::AnalysisOutput result = results[chosen].output;
+    result.ana_number = input.ana_number;
+    
+    size_t num_succeeded = 0;
+    for( size_t i = 0; i < drfs.size(); ++i )
+    {
+      const Analysis::AnalysisOutput &output = results[i].output;
+      num_succeeded += succeeded( output );
+      
+      Analysis::EnsembleCandidate candidate;
+      candidate.drf = drfs[i];
+      candidate.chosen = (i == chosen);
+      candidate.gadras_intialization_error = output.gadras_intialization_error;
+      candidate.gadras_analysis_error = output.gadras_analysis_error;
+      candidate.error_message = output.error_message;
+      candidate.chi_sqr = output.chi_sqr;
+      candidate.isotopes = output.isotopes;
+      candidate.wait_seconds = results[i].wait_seconds;
+      candidate.wall_seconds = results[i].wall_seconds;
+      result.ensemble.push_back( std::move(candidate) );
+    }//for( loop over candidates )
+    
+    if( num_succeeded )
+    {
+      result.analysis_warnings.push_back( "The DRF '" + drfs[chosen] + "' was chosen out of "
+                                          + std::to_string(drfs.size()) + " candidates." );
+    }else
+    {
+      result.error_message = "Analysis failed with all " + std::to_string(drfs.size())
+                             + " candidate DRFs"
+                             + (result.error_message.empty() ? string(".") : ("; " + result.error_message));
+    }//if( num_succeeded ) / else
+    
+    EngineLog::log("info") << "DRF ensemble for analysis " << input.ana_number << " chose '"
+                           << drfs[chosen] << "' (" << num_succeeded << " of "
+                           << drfs.size() << " candidates succeeded)";
+    
+    Analysis::post_analysis_result( input, result );
+  }//void finish_ensemble(...)
+}//namespace
+
+
+namespace AnalysisEnsemble
+{
+
+void set_options( const Options &options )
+{
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  ns_options = options;
+}
+
+
+Options options()
+{
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  return ns_options;
+}
+
+
+bool is_ensemble_request( const std::string &drf )
+{
+  return SpecUtils::iequals_ascii( drf, "ensemble" ) || SpecUtils::istarts_with( drf, "ensemble:" );
+}
+
+
+bool is_generic_drf( const std::string &drf )
+{
+  static const std::regex size_re( "[0-9](\\.[0-9]+)?\\s*[xX]\\s*[0-9]" );
+  
+  return SpecUtils::icontains( drf, "generic" ) || std::regex_search( drf, size_re );
+}//bool is_generic_drf( const std::string &drf )
+
+
+bool should_use_ensemble( const std::string &auto_drf )
+{
+  return options().on_auto_failure && (auto_drf.empty() || is_generic_drf(auto_drf));
+}
+
+
+std::vector<std::string> candidate_drfs( const std::shared_ptr<SpecUtils::SpecFile> &spec,
+                                         const std::string &drf )
+{
+  const size_t max_candidates = std::max( options().max_candidates, size_t(1) );
+  const vector<string> available = Analysis::available_drfs();
+  
+  vector<string> answer;
+  
+  if( SpecUtils::istarts_with( drf, "ensemble:" ) )
+  {
+    vector<string> requested;
+    SpecUtils::split( requested, drf.substr(9), "," );
+    
+    for( string name : requested )
+    {
+      SpecUtils::trim( name );
+      if( name.empty() )
+        continue;
+      
+      const auto pos = std::find_if( begin(available), end(available), [&name]( const string &d ){
+        return SpecUtils::iequals_ascii( d, name );
+      } );
+      
+      if( pos == end(available) )
+        throw runtime_error( "DRF '" + name + "' is not available." );
+      
+      if( std::find( begin(answer), end(answer), *pos ) == end(answer) )
+        answer.push_back( *pos );
+    }//for( string name : requested )
+    
+    if( answer.size() > max_candidates )
+      throw runtime_error( "At most " + std::to_string(max_candidates)
+                           + " DRFs may be used in an ensemble." );
+  }else
+  {
+    if( !spec )
+      throw runtime_error( "No spectrum file to choose DRFs for." );
+    
+    const string guess = Analysis::get_drf_name( spec );
+    const Material spec_mat = spectrum_material( spec, guess );
+    const string guess_family = drf_family( guess );
+    const size_t nchannel = spec->num_gamma_channels();
+    
+    // The strings to look for words of the DRF names in
+    string description = spec->instrument_model() + " " + spec->manufacturer();
+    for( const auto &meas : spec->measurements() )
+    {
+      if( meas && (meas->num_gamma_channels() > 7) )
+      {
+        description += " " + meas->detector_type();
+        break;
+      }
+    }//for( const auto &meas : spec->measurements() )
+    
+    vector<pair<int,string>> scored;
+    for( const string &name : available )
+    {
+      if( !material_allowed( spec_mat, drf_material(name), nchannel ) )
+        continue;
+      
+      int score = 0;
+      if( name == guess )
+        score += 1000;
+      if( !guess_family.empty() && SpecUtils::iequals_ascii( drf_family(name), guess_family ) )
+        score += 100;
+      
+      vector<string> words;
+      SpecUtils::split( words, name, " -_()" );
+      for( const string &word : words )
+        score += 10 * ((word.size() > 1) && SpecUtils::icontains( description, word ));
+      
+      // Generic DRFs make good fallbacks when nothing else matches
+      score += is_generic_drf( name );
+      
+      scored.emplace_back( score, name );
+    }//for( const string &name : available )
+    
+    std::stable_sort( begin(scored), end(scored), []( const pair<int,string> &lhs, const pair<int,string> &rhs ){
+      return lhs.first > rhs.first;
+    } );
+    
+    for( size_t i = 0; (i < scored.size()) && (answer.size() < max_candidates); ++i )
+      answer.push_back( scored[i].second );
+  }//if( explicit list of DRFs ) / else
+  
+  if( answer.empty() )
+    throw runtime_error( "Could not find any candidate detector response functions." );
+  
+  return answer;
+}//std::vector<std::string> candidate_drfs(...)
+
+
+void post_analysis( const Analysis::AnalysisInput &input, const std::vector<std::string> &drfs )
+{
+  if( drfs.empty() )
+    throw runtime_error( "AnalysisEnsemble::post_analysis: no DRFs specified." );
+  
+  EngineLog::log("info") << "Will analyze " << drfs.size() << " candidate DRFs for session "
+                         << input.wt_app_id;
+  
+  vector<Analysis::AnalysisInput> inputs;
+  for( const string &drf : drfs )
+  {
+    Analysis::AnalysisInput candidate = input;
+    candidate.drf_folder = drf;
+    candidate.progress = nullptr;  //progress of several candidates would be interleaved
+    inputs.push_back( std::move(candidate) );
+  }
+  
+  const float chi2_tolerance = options().chi2_tolerance;
+  
+  AnalysisBatch::post( inputs, [input,drfs,chi2_tolerance]( vector<AnalysisBatch::Result> results ){
+    finish_ensemble( input, drfs, results, chi2_tolerance );
+  } );
+}//void post_analysis(...)
+
+}//namespace AnalysisEnsemble
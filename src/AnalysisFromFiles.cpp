@@ -26,14 +26,15 @@
 #include <thread>
 #include <condition_variable>
 
-#include <Wt/WLogger.h>
-
 #include "SpecUtils/SpecFile.h"
 #include "SpecUtils/DateTime.h"
 #include "SpecUtils/StringAlgo.h"
 #include "SpecUtils/Filesystem.h"
 #include "SpecUtils/EnergyCalibration.h"
 
+#include "FullSpectrumId/Tracing.h"
+#include "FullSpectrumId/EngineLog.h"
+#include "FullSpectrumId/EnergyCal.h"
 #include "FullSpectrumId/AnalysisFromFiles.h"
 
 using namespace std;
@@ -46,6 +47,111 @@ const char * const ns_foreground_names[] = {
 const char * const ns_background_names[] = {
   "back", "bkg"
 };
+
+
+void check_use_derived( const shared_ptr<SpecUtils::SpecFile> &f )
+{
+  // TODO: need to match logic of AnalysisGui::checkInputState() state of when and how to use derived data.
+  if( AnalysisFromFiles::potentially_analyze_derived_data( f ) )
+  {
+    set<shared_ptr<const SpecUtils::Measurement>> derived_foregrounds, derived_backgrounds;
+    AnalysisFromFiles::get_derived_measurements( f, derived_foregrounds, derived_backgrounds );
+    
+    if( !derived_foregrounds.empty() )
+    {
+      vector<shared_ptr<const SpecUtils::Measurement>> meas_to_remove;
+      for( const auto &m : f->measurements() )
+      {
+        if( !derived_foregrounds.count(m) && !derived_backgrounds.count(m) )
+          meas_to_remove.push_back( m );
+      }
+      
+      f->remove_measurements( meas_to_remove );
+    }//if( !foreground.empty() )
+  }//if( potentially_analyze_derived_data( f ) )
+}//void check_use_derived(...)
+
+
+void filter_types_out( const shared_ptr<SpecUtils::SpecFile> &f, const vector<SpecUtils::SourceType> &unwanted )
+{
+  vector<shared_ptr<const SpecUtils::Measurement> > meas_to_remove;
+  for( const auto m : f->measurements() )
+  {
+    if( std::find(begin(unwanted),end(unwanted),m->source_type()) != end(unwanted) )
+      meas_to_remove.push_back( m );
+  }
+  f->remove_measurements( meas_to_remove );
+}//void filter_types_out(...)
+
+
+/** Makes sure number of foreground and background channels are consistent, and if there are multiple detectors for each
+ sample, will sum them together to leave a single SpecUtils::Measurement per sample.
+ */
+void clean_up_simple_final_file( const shared_ptr<SpecUtils::SpecFile> &f )
+{
+  assert( f->sample_numbers().size() == 2 );
+  size_t nchannel = 0;
+  for( const auto &m : f->measurements() )
+  {
+    const size_t nchan = m->num_gamma_channels();
+    if( nchannel && nchan && (nchannel != nchan) )
+      throw runtime_error( "Inconsistent number of channels" );
+    nchannel = nchan;
+  }
+  
+  if( f->num_measurements() == 2 )
+  {
+    // Foreground and background may have come from different files, so make sure they share
+    //  calibration objects if they can.
+    EnergyCal::intern_energy_cals( *f );
+    return;
+  }
+  
+  vector<shared_ptr<SpecUtils::Measurement>> summed;
+  const vector<string> &det_names = f->detector_names();
+  for( const int sample : f->sample_numbers() )
+  {
+    shared_ptr<SpecUtils::Measurement> m;
+    
+    try
+    {
+      m = f->sum_measurements( {sample}, det_names, nullptr );
+    }catch( std::exception & )
+    {
+      throw runtime_error( "Couldnt determine energy calibration to use for summing multiple detectors data together." );
+    }
+    
+    // Lets make sure sample and SourceType are set for the summed measurement (older version
+    //  of SpecUtils dont do this in SpecFile::sum_measurements).
+    m->set_sample_number( sample );
+    
+    for( const auto &sm : f->sample_measurements(sample) )
+    {
+      const SpecUtils::SourceType st = sm->source_type();
+      if( st == SpecUtils::SourceType::Foreground || st == SpecUtils::SourceType::Background )
+      {
+        m->set_source_type( st );
+        break;
+      }
+    }//for( const auto &sm : f->sample_measurements(sample) )
+    
+    summed.push_back( m );
+  }//for( const int sample : f->sample_numbers() )
+  
+  assert( summed.size() == 2 );
+  if( summed.size() != 2 )
+    throw runtime_error( "Logic error summing detectors measurements together." );
+  
+  // Remove all the old measurements, and then add in our summed ones.
+  for( const auto &m : f->measurements() )
+    f->remove_measurement( m, false );
+  
+  for( const auto &m : summed )
+    f->add_measurement( m, false );
+  f->cleanup_after_load();
+  
+  EnergyCal::intern_energy_cals( *f );
+}//void clean_up_simple_final_file(...)
 }//namespace
 
 
@@ -55,6 +161,8 @@ namespace AnalysisFromFiles
 std::shared_ptr<SpecUtils::SpecFile> parse_file( const std::string &filepath,
                                                  const std::string &fname )
 {
+  Tracing::Span span( "parse_file", "input" );
+  
   string extension = fname;
   const size_t period_pos = extension.find_last_of( '.' );
   if( period_pos != string::npos )
@@ -95,6 +203,11 @@ std::shared_ptr<SpecUtils::SpecFile> parse_file( const std::string &filepath,
   if( !loaded )
     spec.reset();
   
+  // Share calibration objects with any other files that have the same calibration, so we can
+  //  avoid rebinning between them later on.
+  if( spec )
+    EnergyCal::intern_energy_cals( *spec );
+  
   /*
    if( spec && spec->contains_derived_data() && spec->contains_non_derived_data() )
    {
@@ -141,7 +254,7 @@ void filter_energy_cal_variants( std::shared_ptr<SpecUtils::SpecFile> spec )
     if( SpecUtils::icontains( str, "Lin") )
     {
       prefered_variant = str;
-      Wt::log("debug:app") << "Selecting energy cal variant '" << str
+      ENGINE_LOG("debug:app") << "Selecting energy cal variant '" << str
       << "' based on if containing 'Lin'";
       
       spec->keep_energy_cal_variant( prefered_variant );
@@ -187,7 +300,7 @@ void filter_energy_cal_variants( std::shared_ptr<SpecUtils::SpecFile> spec )
   
   if( !prefered_variant.empty() )
   {
-    Wt::log("debug:app") << "Selecting energy cal variant '" << prefered_variant
+    ENGINE_LOG("debug:app") << "Selecting energy cal variant '" << prefered_variant
     << "' based on its name having the highest energy listed";
     spec->keep_energy_cal_variant( prefered_variant );
     return;
@@ -262,7 +375,7 @@ void filter_energy_cal_variants( std::shared_ptr<SpecUtils::SpecFile> spec )
       assert( maxchannels_index < variants.size() );
       assert( maxchannels_index < cal_variants_vec.size() );
       
-      Wt::log("debug:app") << "Selecting energy cal variant '"
+      ENGINE_LOG("debug:app") << "Selecting energy cal variant '"
       << cal_variants_vec[maxchannels_index]
       << "' based on number of channels";
       
@@ -274,7 +387,7 @@ void filter_energy_cal_variants( std::shared_ptr<SpecUtils::SpecFile> spec )
     assert( maxchannels_index < variants.size() );
     assert( maxchannels_index < cal_variants_vec.size() );
     
-    Wt::log("debug:app") << "Selecting energy cal variant '"
+    ENGINE_LOG("debug:app") << "Selecting energy cal variant '"
     << cal_variants_vec[max_upper_energy_index]
     << "' based on max energy (or maybe what just came first)";
     
@@ -283,14 +396,14 @@ void filter_energy_cal_variants( std::shared_ptr<SpecUtils::SpecFile> spec )
   }catch( std::exception &e )
   {
     //Probably shouldnt ever happen.
-    Wt::log("error:app") << "Caught exception deciding on energy cal variant: " << e.what();
+    EngineLog::log("error:app") << "Caught exception deciding on energy cal variant: " << e.what();
     
     throw runtime_error( "Multiple energy calibration ranges or types were found"
                         " and there was an error selecting which one to use."
                         "  Please use a tool like InterSpec or Cambio to fix." );
   }//try / catch to choose an energy calibration variant )
   
-  Wt::log("error:app") << "Got to the end of filterEnergyCalVariant(...) function, which shouldnt have happened";
+  EngineLog::log("error:app") << "Got to the end of filterEnergyCalVariant(...) function, which shouldnt have happened";
   throw runtime_error( "Logic error in filterEnergyCalVariant" );
 }//void filter_energy_cal_variants( std::shared_ptr<SpecUtils::SpecFile> spec );
 
@@ -299,6 +412,8 @@ void filter_energy_cal_variants( std::shared_ptr<SpecUtils::SpecFile> spec )
 shared_ptr<SpecUtils::SpecFile> create_input( const std::tuple<SpecClassType,string,string> &input1,
                                                   boost::optional<tuple<SpecClassType,string,string>> input2 )
 {
+  Tracing::Span span( "create_input", "input" );
+  
   auto parse_specfile = []( boost::optional<tuple<SpecClassType,string,string>> input ) -> shared_ptr<SpecUtils::SpecFile> {
     if( !input )
       return nullptr;
@@ -325,39 +440,6 @@ shared_ptr<SpecUtils::SpecFile> create_input( const std::tuple<SpecClassType,str
   if( !file1 )
     throw runtime_error( "Invalid logic." );
   
-  auto check_use_derived = []( shared_ptr<SpecUtils::SpecFile> &f ) {
-    
-    // TODO: need to match logic of AnalysisGui::checkInputState() state of when and how to use derived data.
-    if( potentially_analyze_derived_data( f ) )
-    {
-      set<shared_ptr<const SpecUtils::Measurement>> derived_foregrounds, derived_backgrounds;
-      get_derived_measurements( f, derived_foregrounds, derived_backgrounds );
-      
-      if( !derived_foregrounds.empty() )
-      {
-        vector<shared_ptr<const SpecUtils::Measurement>> meas_to_remove;
-        for( const auto &m : f->measurements() )
-        {
-          if( !derived_foregrounds.count(m) && !derived_backgrounds.count(m) )
-            meas_to_remove.push_back( m );
-        }
-        
-        f->remove_measurements( meas_to_remove );
-      }//if( !foreground.empty() )
-    }//if( potentially_analyze_derived_data( f ) )
-  };//check_use_derived
-  
-  
-  auto filter_types_out = []( shared_ptr<SpecUtils::SpecFile> &f, vector<SpecUtils::SourceType> unwanted ) {
-    vector<shared_ptr<const SpecUtils::Measurement> > meas_to_remove;
-    for( const auto m : f->measurements() )
-    {
-      if( std::find(begin(unwanted),end(unwanted),m->source_type()) != end(unwanted) )
-        meas_to_remove.push_back( m );
-    }
-    f->remove_measurements( meas_to_remove );
-  };//filter_types_out
-  
   if( file1 )
   {
     filter_energy_cal_variants( file1 );
@@ -373,68 +455,6 @@ shared_ptr<SpecUtils::SpecFile> create_input( const std::tuple<SpecClassType,str
   }
   
   
-  /** Makes sure number of foreground and background channels are consistent, and if there are multiple detectors for each
-   sample, will sum them together to leave a single SpecUtils::Measurement per sample.
-   */
-  auto clean_up_simple_final_file = []( shared_ptr<SpecUtils::SpecFile> &f ) {
-    
-    assert( f->sample_numbers().size() == 2 );
-    size_t nchannel = 0;
-    for( const auto &m : f->measurements() )
-    {
-      const size_t nchan = m->num_gamma_channels();
-      if( nchannel && nchan && (nchannel != nchan) )
-        throw runtime_error( "Inconsistent number of channels" );
-      nchannel = nchan;
-    }
-    
-    if( f->num_measurements() == 2 )
-      return;
-    
-    vector<shared_ptr<SpecUtils::Measurement>> summed;
-    const vector<string> &det_names = f->detector_names();
-    for( const int sample : f->sample_numbers() )
-    {
-      shared_ptr<SpecUtils::Measurement> m;
-      
-      try
-      {
-        m = f->sum_measurements( {sample}, det_names, nullptr );
-      }catch( std::exception & )
-      {
-        throw runtime_error( "Couldnt determine energy calibration to use for summing multiple detectors data together." );
-      }
-      
-      // Lets make sure sample and SourceType are set for the summed measurement (older version
-      //  of SpecUtils dont do this in SpecFile::sum_measurements).
-      m->set_sample_number( sample );
-      
-      for( const auto &sm : f->sample_measurements(sample) )
-      {
-        const SpecUtils::SourceType st = sm->source_type();
-        if( st == SpecUtils::SourceType::Foreground || st == SpecUtils::SourceType::Background )
-        {
-          m->set_source_type( st );
-          break;
-        }
-      }//for( const auto &sm : f->sample_measurements(sample) )
-      
-      summed.push_back( m );
-    }//for( const int sample : f->sample_numbers() )
-    
-    assert( summed.size() == 2 );
-    if( summed.size() != 2 )
-      throw runtime_error( "Logic error summing detectors measurements together." );
-    
-    // Remove all the old measurements, and then add in our summed ones.
-    for( const auto &m : f->measurements() )
-      f->remove_measurement( m, false );
-    
-    for( const auto &m : summed )
-      f->add_measurement( m, false );
-    f->cleanup_after_load();
-  };//clean_up_simple_final_file
-  
   if( !file2 )
   {
     if( file1->passthrough() )
@@ -658,7 +678,7 @@ shared_ptr<SpecUtils::SpecFile> create_input( const std::tuple<SpecClassType,str
   
   // Lets filter out measurement types we dont want.  We will prefer foreground marked measurements,
   //  then non-marked measurements, then background marked measurements.
-  auto filter_source_types = [filter_types_out,source_types]( shared_ptr<SpecUtils::SpecFile> &f ){
+  auto filter_source_types = [source_types]( shared_ptr<SpecUtils::SpecFile> &f ){
     set<SpecUtils::SourceType> src_types = source_types( f );
     assert( !src_types.count(SpecUtils::SourceType::IntrinsicActivity) );
     assert( !src_types.count(SpecUtils::SourceType::Calibration) );
@@ -810,6 +830,150 @@ shared_ptr<SpecUtils::SpecFile> create_input( const std::tuple<SpecClassType,str
 }//create_input(...)
 
 
+std::vector<SampleInput> create_sample_inputs( const std::tuple<SpecClassType,std::string,std::string> &input1,
+                                               boost::optional<std::tuple<SpecClassType,std::string,std::string>> input2 )
+{
+  Tracing::Span span( "create_sample_inputs", "input" );
+  
+  if( input2 && (get<1>(*input2) == get<1>(input1)) )
+    input2 = boost::none;
+  
+  shared_ptr<SpecUtils::SpecFile> file1 = parse_file( get<1>(input1), get<2>(input1) );
+  if( !file1 )
+    throw runtime_error( "Failed to parse spectrum file." );
+  
+  shared_ptr<SpecUtils::SpecFile> file2;
+  if( input2 )
+  {
+    file2 = parse_file( get<1>(*input2), get<2>(*input2) );
+    if( !file2 )
+      throw runtime_error( "Failed to parse spectrum file." );
+  }//if( input2 )
+  
+  for( const shared_ptr<SpecUtils::SpecFile> &f : { file1, file2 } )
+  {
+    if( !f )
+      continue;
+    
+    filter_energy_cal_variants( f );
+    check_use_derived( f );
+    filter_types_out( f, {SpecUtils::SourceType::IntrinsicActivity, SpecUtils::SourceType::Calibration} );
+  }//for( loop over files )
+  
+  // Make file1 the one with the foreground samples; if neither file was labeled, the one with more
+  //  samples is taken as the foreground.
+  if( file2 )
+  {
+    const SpecClassType type1 = get<0>(input1);
+    const SpecClassType type2 = get<0>(*input2);
+    
+    if( (type1 == SpecClassType::ForegroundAndBackground)
+       || (type2 == SpecClassType::ForegroundAndBackground) )
+      throw runtime_error( "A spectrum file was specified as foreground and background,"
+                           " but more than one spectrum file specified." );
+    
+    if( (type1 == SpecClassType::Background) || (type1 == SpecClassType::SuspectBackground)
+       || (type2 == SpecClassType::Foreground) || (type2 == SpecClassType::SuspectForeground)
+       || ((type1 == SpecClassType::Unknown) && (type2 == SpecClassType::Unknown)
+           && (file2->sample_numbers().size() > file1->sample_numbers().size())) )
+    {
+      std::swap( file1, file2 );
+    }
+  }//if( file2 )
+  
+  // Returns the samples with gamma data, split by if they are marked as background or not.
+  auto gamma_samples = []( const shared_ptr<SpecUtils::SpecFile> &f, set<int> &backgrounds, set<int> &others ){
+    for( const int sample : f->sample_numbers() )
+    {
+      bool has_gamma = false, back = false;
+      for( const auto &m : f->sample_measurements(sample) )
+      {
+        has_gamma |= (m->num_gamma_channels() > 7);
+        back |= (m->source_type() == SpecUtils::SourceType::Background);
+      }
+      
+      if( has_gamma )
+        (back ? backgrounds : others).insert( sample );
+    }//for( const int sample : f->sample_numbers() )
+  };//gamma_samples(...)
+  
+  set<int> background_samples, foreground_samples;
+  gamma_samples( file1, background_samples, foreground_samples );
+  
+  if( foreground_samples.empty() )
+    throw runtime_error( "No foreground samples in spectrum file." );
+  
+  // The uploaded background file must have a single background; otherwise each foreground is
+  //  paired with the closest preceding background sample in its own file.
+  int uploaded_back_sample = 0;
+  if( file2 )
+  {
+    set<int> marked, others;
+    gamma_samples( file2, marked, others );
+    
+    const set<int> &candidates = marked.empty() ? others : marked;
+    if( candidates.size() != 1 )
+      throw runtime_error( "Could not unambiguously select sample in background spectrum file." );
+    uploaded_back_sample = *begin(candidates);
+  }else if( background_samples.empty() )
+  {
+    throw runtime_error( "No background provided" );
+  }//if( file2 ) / else
+  
+  // Each samples input is copied from this, so they all keep the instrument information, without
+  //  copying the measurements of the other samples.
+  SpecUtils::SpecFile meas_free( *file1 );
+  const vector<shared_ptr<const SpecUtils::Measurement>> all_meas = meas_free.measurements();
+  meas_free.remove_measurements( all_meas );
+  
+  vector<SampleInput> answer;
+  for( const int fore_sample : foreground_samples )
+  {
+    SampleInput sample;
+    sample.sample_number = fore_sample;
+    
+    try
+    {
+      const SpecUtils::SpecFile &back_file = file2 ? *file2 : *file1;
+      int back_sample = uploaded_back_sample;
+      if( !file2 )
+      {
+        auto pos = background_samples.lower_bound( fore_sample );
+        back_sample = (pos == begin(background_samples)) ? *pos : *std::prev(pos);
+      }
+      
+      auto f = make_shared<SpecUtils::SpecFile>( meas_free );
+      for( const auto &m : file1->sample_measurements(fore_sample) )
+      {
+        auto fore = make_shared<SpecUtils::Measurement>( *m );
+        fore->set_source_type( SpecUtils::SourceType::Foreground );
+        f->add_measurement( fore, false );
+      }
+      
+      for( const auto &m : back_file.sample_measurements(back_sample) )
+      {
+        auto back = make_shared<SpecUtils::Measurement>( *m );
+        back->set_source_type( SpecUtils::SourceType::Background );
+        back->set_sample_number( fore_sample + 1 );
+        f->add_measurement( back, false );
+      }
+      
+      f->cleanup_after_load();
+      clean_up_simple_final_file( f );
+      
+      sample.input = f;
+    }catch( std::exception &e )
+    {
+      sample.error = e.what();
+    }//try / catch
+    
+    answer.push_back( std::move(sample) );
+  }//for( const int fore_sample : foreground_samples )
+  
+  return answer;
+}//create_sample_inputs(...)
+
+
 
 
 bool maybe_foreground_from_filename( const std::string &name )
@@ -902,12 +1066,12 @@ void get_derived_measurements( shared_ptr<const SpecUtils::SpecFile> spec,
     if( background.empty() )
       throw runtime_error( "No background in derived data" );
     
-    Wt::log("debug:app") << "Use derived data from foreground for analysis";
+    ENGINE_LOG("debug:app") << "Use derived data from foreground for analysis";
   }catch( std::exception &e )
   {
     foreground.clear();
     background.clear();
-    Wt::log("debug:app") << "Couldnt use derived data: " << e.what();
+    ENGINE_LOG("debug:app") << "Couldnt use derived data: " << e.what();
   }//try / catch to get derived data spectra to use
 }//get_derived_measurements
 
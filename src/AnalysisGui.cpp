@@ -22,6 +22,7 @@
  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <cmath>
 #include <fstream>
 
 #include <Wt/Utils.h>
@@ -30,7 +31,6 @@
 #include <Wt/WTime.h>
 #include <Wt/WLabel.h>
 #include <Wt/WServer.h>
-#include <Wt/WLogger.h>
 #include <Wt/WComboBox.h>
 #include <Wt/WIOService.h>
 #include <Wt/WWidgetItem.h>
@@ -45,14 +45,19 @@
 
 //#include <boost/algorithm/hex.hpp>
 //#include <boost/uuid/detail/md5.hpp>
-#include <boost/filesystem.hpp>
 
 #include "SpecUtils/SpecFile.h"
 #include "SpecUtils/StringAlgo.h"
 #include "SpecUtils/Filesystem.h"
 
 #include "FullSpectrumId/Analysis.h"
+#include "FullSpectrumId/Tracing.h"
+#include "FullSpectrumId/EngineLog.h"
+#if( ENABLE_SESSION_DETAIL_LOGGING )
+#include "FullSpectrumId/SessionArchive.h"
+#endif
 #include "FullSpectrumId/AnalysisGui.h"
+#include "FullSpectrumId/AnalysisCapture.h"
 #include "FullSpectrumId/D3TimeChart.h"
 #include "FullSpectrumId/SimpleDialog.h"
 #include "FullSpectrumId/SampleSelect.h"
@@ -335,18 +340,14 @@ AnalysisGui::UserActionLogEntry::~UserActionLogEntry()
   (*this) << "</" << m_tag << ">\n";
   
   const string content = str();
-  Wt::log("info:app") << "\n" << content;
+  EngineLog::log("info:app") << "\n" << content;
 
 #if( ENABLE_SESSION_DETAIL_LOGGING )
   if( m_dir.empty() )
     return;
 
-  const string logname = SpecUtils::append_path(m_dir, "user_action_log.xml");
-  ofstream dolog( logname.c_str(), ios::out | ios::binary | ios::app );
-  if( dolog )
-    dolog << content;
-  else
-    Wt::log("error:app") << "Failed to open '" << logname << "' for writing.";
+  // Written from a background thread, so the session doesnt wait on the disk.
+  SessionArchive::append( SpecUtils::append_path(m_dir, "user_action_log.xml"), content );
 #endif
 }//~UserActionLogEntry()
 
@@ -385,14 +386,14 @@ bool AnalysisGui::check_session_data_dir()
   {
     m_data_base_dir = m_data_dir = "";
     m_save_spectrum_files = false;
-    Wt::log("error:app") << "Could not create user data directory ('" << final_dir << "'); will"
+    EngineLog::log("error:app") << "Could not create user data directory ('" << final_dir << "'); will"
     << " not log information in detail or store uploaded spectrum files";
   }else
   {
     m_data_dir = final_dir;
-    Wt::log("info:app") << "Will log session information in directory: '" << m_data_dir << "'";
+    EngineLog::log("info:app") << "Will log session information in directory: '" << m_data_dir << "'";
     if( m_save_spectrum_files )
-      Wt::log("info:app") << "Will save user-uploaded files into directory: '" << m_data_dir << "'";
+      EngineLog::log("info:app") << "Will save user-uploaded files into directory: '" << m_data_dir << "'";
   }
   
   return !m_data_dir.empty();
@@ -653,7 +654,7 @@ void AnalysisGui::fileUploaded( const SpecUploadType type )
   assert( upload );
   if( !upload )
   {
-    Wt::log("error:app") << "Somehow failed to identify upload - how could background upload be null?";
+    EngineLog::log("error:app") << "Somehow failed to identify upload - how could background upload be null?";
     return;
   }
   
@@ -703,7 +704,7 @@ void AnalysisGui::fileUploaded( const SpecUploadType type )
   const WString client_name = upload->clientFileName();
   
   //const string md5_hash = file_content_md5_hash( spool_name );
-  Wt::log("info:app") << "File (" << typeName.toUTF8() << ") uploaded for app session '"
+  EngineLog::log("info:app") << "File (" << typeName.toUTF8() << ") uploaded for app session '"
   << session_id << "' to '" << spool_name << "' that has"
   << " a client file name of '" << client_name << "'";
   //" and hash md5(" << md5_hash << ")";
@@ -738,7 +739,7 @@ void AnalysisGui::fileUploadWorker( const SpecUploadType type, SimpleDialog *dia
   WApplication::UpdateLock lock( app );
   
   if( !lock ) {
-    Wt::log("error:app") << "Unable to get an UpdateLock on app";
+    EngineLog::log("error:app") << "Unable to get an UpdateLock on app";
     return;
   }
   
@@ -749,7 +750,7 @@ void AnalysisGui::fileUploadWorker( const SpecUploadType type, SimpleDialog *dia
   assert( upload );
   if( !upload )
   {
-    Wt::log("error:app") << "Somehow failed to identify upload (2) - how could background upload be null?";
+    EngineLog::log("error:app") << "Somehow failed to identify upload (2) - how could background upload be null?";
     return;
   }
   
@@ -787,6 +788,10 @@ void AnalysisGui::fileUploadWorker( const SpecUploadType type, SimpleDialog *dia
   
 #if( ENABLE_SESSION_DETAIL_LOGGING )
   const bool too_much_data = (m_numBytesUploaded > 10*1024*1024);
+  
+  // If set, the upload is handed to SessionArchive, once we are done parsing it.
+  bool archive_upload = false;
+  string archive_context;
 #endif
   
   if( valid_save_dir )
@@ -837,28 +842,14 @@ void AnalysisGui::fileUploadWorker( const SpecUploadType type, SimpleDialog *dia
       logentry << "\t<ArchivedStatus>SessionFileSizeLimitExceeded</ArchivedStatus>\n";
     }else
     {
-      const string ext = SpecUtils::file_extension( client_clean_name );
-      
-      const string save_to_name = "user_upload_" + std::to_string(m_uploadedFileNumber)
-                                  + (isForeground ? "_foreground" : "_background")
-                                  + ((ext.size() < 6) ? ext : string());
-      
-      const string save_to_path = SpecUtils::append_path( m_data_dir, save_to_name );
+      // The file is compressed and stored by its content (so identical files, e.g., a common
+      //  background, are stored once) from a background thread; an <UploadArchived> entry with
+      //  the same SessionUploadNumber records the archived file name.
+      logentry << "\t<ArchivedStatus>Queued</ArchivedStatus>\n";
       
-      boost::system::error_code ec;
-      boost::filesystem::copy( spool_name, save_to_path, ec );
-      
-      if( ec )
-      {
-        logentry << "\t<ArchivedStatus>UnableToCopyFile</ArchivedStatus>\n";
-        Wt::log("error:app") << "Unable to copy user upload from '" << spool_name << "' to '"
-        << save_to_path << "': " << ec.message();
-      }else
-      {
-        logentry << "\t<ArchivedStatus>Success</ArchivedStatus>\n";
-      }
-      
-      logentry << "\t<RawFileName>" << save_to_name << "</RawFileName>\n";
+      archive_upload = true;
+      archive_context = "\t<SessionUploadNumber>" + std::to_string(m_uploadedFileNumber)
+                        + "</SessionUploadNumber>\n";
     }//if( dont save ) / else ( dont save another reason ) / else ( save )
 #else
     logentry << "\t<ArchivedStatus>SpecFileSavingCompileTimeDisabled</ArchivedStatus>\n";
@@ -868,6 +859,19 @@ void AnalysisGui::fileUploadWorker( const SpecUploadType type, SimpleDialog *dia
   
   auto spec = parseFile( upload );
   
+#if( ENABLE_SESSION_DETAIL_LOGGING )
+  if( archive_upload )
+  {
+    // We take the spool file from Wt, so it isnt deleted before it is archived; SessionArchive
+    //  deletes it when done.
+    upload->stealSpooledFile();
+    
+    const string logname = SpecUtils::append_path( m_data_dir, "user_action_log.xml" );
+    if( !SessionArchive::archive_upload( spool_name, logname, archive_context ) )
+      logentry << "\t<ArchiveQueueStatus>Rejected</ArchiveQueueStatus>\n";
+  }//if( archive_upload )
+#endif
+  
 
   if( spec )
   {
@@ -1025,7 +1029,7 @@ void AnalysisGui::uploadToLarge( const int64_t fileSize, const SpecUploadType ty
     }//if( progressBar )
   }else
   {
-    Wt::log("error:app") << "Somehow failed to identify upload ofr too large of upload - how upload be null?";
+    EngineLog::log("error:app") << "Somehow failed to identify upload ofr too large of upload - how upload be null?";
     return;
   }
 #endif
@@ -1215,11 +1219,11 @@ void AnalysisGui::checkInputState()
     if( !backgroundSamples.empty() && (foregroundSamples.size() >= 3) )
     {
       is_portal_data = true;
-      Wt::log("debug:app") << "Treating foreground file as RPM data";
+      EngineLog::log("debug:app") << "Treating foreground file as RPM data";
     }else
     {
       is_search_data = true;
-      Wt::log("debug:app") << "Treating foreground file as search data";
+      EngineLog::log("debug:app") << "Treating foreground file as search data";
     }
   }//if( m_foreground->passthrough() )
   
@@ -1325,7 +1329,7 @@ void AnalysisGui::checkInputState()
         {
           foreground.clear();
           background.clear();
-          Wt::log("debug:app") << "Couldnt use non-derived data: " << e.what();
+          EngineLog::log("debug:app") << "Couldnt use non-derived data: " << e.what();
         }//try / catch use non-derived data
       }//if( background.empty() && foreground.empty() )
     }//if( potentially_use_derived_data && !is_search_data && !is_portal_data )
@@ -1473,7 +1477,7 @@ void AnalysisGui::checkInputState()
       return spec->sum_measurements( {sample}, spec->detector_names(), nullptr );
     }catch( std::exception &e )
     {
-      Wt::log("error:app") << "Caught exception summing selected data sample (0): " << e.what();
+      EngineLog::log("error:app") << "Caught exception summing selected data sample (0): " << e.what();
     }
     
     return nullptr;
@@ -1524,7 +1528,7 @@ void AnalysisGui::checkInputState()
         selectedForeground = get_meas_for_sample( foreSample, m_foreground );
       }catch( std::exception &e )
       {
-        Wt::log("error:app") << "Caught exception getting foreground sample number from foreground select: " << e.what();
+        EngineLog::log("error:app") << "Caught exception getting foreground sample number from foreground select: " << e.what();
       }
     }
     
@@ -1548,7 +1552,7 @@ void AnalysisGui::checkInputState()
           selectedBackground = get_meas_for_sample( backSample, m_foreground );
         }catch( std::exception &e )
         {
-          Wt::log("error:app") << "Caught exception getting background sample number from foreground select: " << e.what();
+          EngineLog::log("error:app") << "Caught exception getting background sample number from foreground select: " << e.what();
         }
       }//
       
@@ -1611,7 +1615,7 @@ void AnalysisGui::checkInputState()
           }
         }catch( std::exception &e )
         {
-          Wt::log("error:app") << "Caught exception getting background sample number from background select: " << e.what();
+          EngineLog::log("error:app") << "Caught exception getting background sample number from background select: " << e.what();
         }
       }//if( m_backSelectBackSample )
     }//if( !m_background ) / else
@@ -1700,6 +1704,7 @@ void AnalysisGui::checkInputState()
   anainput.wt_app_id = wApp->sessionId();
   anainput.ana_number = m_ana_number;
   anainput.drf_folder = m_drfSelector->currentText().toUTF8();
+  anainput.trace_id = Tracing::new_request_id();
   
   if( isSimpleAna )
   {
@@ -1859,7 +1864,7 @@ void AnalysisGui::checkInputState()
     {
       anafore.reset();
       anaback.reset();
-      Wt::log("error:app") << "Caught exception summing search/portal data for display: " << e.what();
+      EngineLog::log("error:app") << "Caught exception summing search/portal data for display: " << e.what();
     }//try / catch.
     
     
@@ -1909,6 +1914,16 @@ void AnalysisGui::checkInputState()
     anaResultCallback( anainput, result );
   };
   
+  // Search and portal analyses can take a while, so let the user see what has been found so far;
+  //  each update is posted to this session, so updates are limited to about one a second.
+  if( anainput.analysis_type != Analysis::AnalysisType::Simple )
+  {
+    anainput.progress = [this]( const Analysis::AnalysisProgress &progress ){
+      anaProgressCallback( progress );
+    };
+    anainput.progress_interval_seconds = 1.0;
+  }//if( not a simple analysis )
+  
 // TODO: could save the file we are sending to analysis as N42 file, but then we would want to make
 //       sure its unique - i.e., if user changes DRF 50 times, we dont want 50 duplicate files.
 //#if( ENABLE_SESSION_DETAIL_LOGGING )
@@ -1918,6 +1933,8 @@ void AnalysisGui::checkInputState()
 //  }
 //#endif
   
+  AnalysisCapture::capture( anainput, AnalysisCapture::Submitter::Gui );
+  
   if( wApp->environment().javaScript() )
   {
     Analysis::post_analysis( anainput );
@@ -1929,8 +1946,10 @@ void AnalysisGui::checkInputState()
     std::condition_variable ana_cv;
     Analysis::AnalysisOutput result;
 
-    // Clear out the WApp ID so the callback wont be posted into this sessions main thread.
+    // Clear out the WApp ID so the callback wont be posted into this sessions main thread; there
+    //  is no way to show progress until we return, either.
     anainput.wt_app_id = "";
+    anainput.progress = nullptr;
     anainput.callback = [&ana_mutex,&ana_cv,&result]( Analysis::AnalysisOutput output ){
       {
         std::unique_lock<std::mutex> lock( ana_mutex );
@@ -1983,9 +2002,33 @@ void AnalysisGui::sampleNumberToUseChanged()
 }//void sampleNumberToUseChanged()
 
 
+void AnalysisGui::anaProgressCallback( const Analysis::AnalysisProgress &progress )
+{
+  // Ignore updates for an analysis the user has since replaced.
+  if( progress.ana_number != m_ana_number )
+    return;
+  
+  const int percent = static_cast<int>( std::round( 100.0 * progress.fraction_done ) );
+  
+  WString txt;
+  if( progress.isotopes.empty() )
+    txt = WString::tr("analyzing-progress-none").arg( percent );
+  else
+    txt = WString::tr("analyzing-progress").arg( percent ).arg( progress.isotopes );
+  
+  if( m_instructions->isHidden() )
+    m_instructions->show();
+  if( m_instructions->text() != txt )
+    m_instructions->setText( txt );
+}//void anaProgressCallback(...)
+
+
 void AnalysisGui::anaResultCallback( const Analysis::AnalysisInput &input,
                                      const Analysis::AnalysisOutput &output )
 {
+  Tracing::RequestScope trace_scope( input.trace_id );
+  Tracing::Span span( "display_results", "gui" );
+  
   m_foregroundUpload->enable();
   m_backgroundUploadStack->enable();
   m_drfSelector->enable();
@@ -2103,7 +2146,7 @@ void AnalysisGui::anaResultCallback( const Analysis::AnalysisInput &input,
           anaback = output.spec_file->sum_measurements( backgroundSamples, output.spec_file->detector_names(), nullptr );
         }catch( std::exception &e )
         {
-          Wt::log("error:app") << "Unexpected exception summing foreground/background measurements: " << e.what();
+          EngineLog::log("error:app") << "Unexpected exception summing foreground/background measurements: " << e.what();
         }
       }//if( two measurements ) / else
       
@@ -2124,13 +2167,13 @@ void AnalysisGui::anaResultCallback( const Analysis::AnalysisInput &input,
   m_analysisWarning->setText( WString::fromUTF8( warningHtml ) );
   
   
-  //Wt::log("debug:app") << 
+  //EngineLog::log("debug:app") << 
   
   WStringStream rslttxt;
   rslttxt << "<div>\n";
   rslttxt << "<div class=\"ResultLabel\">" << WString::tr("id-result-label").toUTF8() << ":</div>";
   
-  cout << "output.chi_sqr=" << output.chi_sqr << endl;
+  EngineLog::log("debug:app") << "output.chi_sqr=" << output.chi_sqr;
   if( (output.chi_sqr > 0.0001f) && (output.isotope_names.size() > 0) )
   {
     char buffer[64] = { '\0' };
@@ -2180,7 +2223,7 @@ void AnalysisGui::anaResultCallback( const Analysis::AnalysisInput &input,
       else if( conf == "L" )
         conf = "Low";
       else
-        Wt::log("debug:app") << "Unknown confidence '" << conf << "' for nuclide " << iso;
+        EngineLog::log("debug:app") << "Unknown confidence '" << conf << "' for nuclide " << iso;
       
       char buffer[64] = { '\0' };
       if( count_rate < std::numeric_limits<float>::epsilon() )  //FLT_EPSILON is usually 1.19209e-07
@@ -2222,7 +2265,7 @@ void AnalysisGui::anaResultCallback( const Analysis::AnalysisInput &input,
       else if( conf == "L" )
         conf = "Low";
       else
-        Wt::log("debug:app") << "Unknown confidence '" << conf << "' from isostr='" << isostr << "'";
+        EngineLog::log("debug:app") << "Unknown confidence '" << conf << "' from isostr='" << isostr << "'";
         
       rslttxt << "<tr><td>" << Wt::Utils::htmlEncode(iso) << "</td><td>"
               << Wt::Utils::htmlEncode(conf) << "</td></tr>";
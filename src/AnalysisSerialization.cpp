@@ -0,0 +1,629 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <map>
+#include <cmath>
+#include <chrono>
+#include <limits>
+#include <vector>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "SpecUtils/SpecFile.h"
+#include "SpecUtils/EnergyCalibration.h"
+
+#include "FullSpectrumId/AnalysisSerialization.h"
+
+using namespace std;
+
+
+namespace
+{
+  using AnalysisSerialization::Writer;
+  using AnalysisSerialization::Reader;
+
+
+  /** A Measurement we can mark as derived data; SpecUtils only sets this flag when parsing files. */
+  class DerivedMeasurement : public SpecUtils::Measurement
+  {
+  public:
+    void set_derived_data_properties( const uint32_t properties )
+    {
+      derived_data_properties_ = properties;
+    }
+  };//class DerivedMeasurement
+
+
+  const boost::posix_time::ptime ns_epoch( boost::gregorian::date(1970,1,1) );
+
+  int64_t to_epoch_us( const boost::posix_time::ptime &t )
+  {
+    if( t.is_special() )
+      return std::numeric_limits<int64_t>::min();
+    return (t - ns_epoch).total_microseconds();
+  }
+
+  boost::posix_time::ptime from_epoch_us( const int64_t us )
+  {
+    if( us == std::numeric_limits<int64_t>::min() )
+      return boost::posix_time::ptime();
+    return ns_epoch + boost::posix_time::microseconds( us );
+  }
+
+
+  /** Gamma counts are stored as varints if all are non-negative integers, otherwise as floats. */
+  void write_counts( Writer &out, const vector<float> &counts )
+  {
+    bool all_integer = true;
+    for( size_t i = 0; all_integer && (i < counts.size()); ++i )
+    {
+      const float val = counts[i];
+      all_integer = (val >= 0.0f) && (val < 4294967296.0f) && (std::floor(val) == val);
+    }
+
+    out.u8( all_integer ? 1 : 0 );
+    if( !all_integer )
+    {
+      out.floats( counts );
+      return;
+    }
+
+    out.u32( static_cast<uint32_t>( counts.size() ) );
+    for( const float val : counts )
+      out.varint( static_cast<uint64_t>(val) );
+  }//write_counts(...)
+
+
+  vector<float> read_counts( Reader &in )
+  {
+    const uint8_t encoding = in.u8();
+    if( encoding == 0 )
+      return in.floats();
+
+    if( encoding != 1 )
+      throw runtime_error( "Invalid gamma counts encoding in serialized analysis data" );
+
+    const uint32_t len = in.u32();
+    in.need( len ); // each value takes at least one byte
+    vector<float> counts( len );
+    for( float &val : counts )
+      val = static_cast<float>( in.varint() );
+
+    return counts;
+  }//read_counts(...)
+}//namespace
+
+
+namespace AnalysisSerialization
+{
+
+Writer::Writer( std::string &buf )
+  : buffer( buf )
+{
+}
+
+
+void Writer::u8( const uint8_t val )
+{
+  buffer.push_back( static_cast<char>(val) );
+}
+
+
+void Writer::u32( const uint32_t val )
+{
+  for( size_t i = 0; i < 4; ++i )
+    buffer.push_back( static_cast<char>( (val >> (8*i)) & 0xFF ) );
+}
+
+
+void Writer::u64( const uint64_t val )
+{
+  for( size_t i = 0; i < 8; ++i )
+    buffer.push_back( static_cast<char>( (val >> (8*i)) & 0xFF ) );
+}
+
+
+void Writer::i32( const int32_t val )
+{
+  u32( static_cast<uint32_t>(val) );
+}
+
+
+void Writer::i64( const int64_t val )
+{
+  u64( static_cast<uint64_t>(val) );
+}
+
+
+void Writer::f32( const float val )
+{
+  uint32_t bits;
+  static_assert( sizeof(bits) == sizeof(val), "Unexpected float size" );
+  memcpy( &bits, &val, sizeof(bits) );
+  u32( bits );
+}
+
+
+void Writer::f64( const double val )
+{
+  uint64_t bits;
+  static_assert( sizeof(bits) == sizeof(val), "Unexpected double size" );
+  memcpy( &bits, &val, sizeof(bits) );
+  u64( bits );
+}
+
+
+void Writer::varint( uint64_t val )
+{
+  while( val >= 0x80 )
+  {
+    buffer.push_back( static_cast<char>( (val & 0x7F) | 0x80 ) );
+    val >>= 7;
+  }
+  buffer.push_back( static_cast<char>(val) );
+}
+
+
+void Writer::str( const std::string &val )
+{
+  u32( static_cast<uint32_t>( val.size() ) );
+  buffer.append( val );
+}
+
+
+void Writer::floats( const std::vector<float> &vals )
+{
+  u32( static_cast<uint32_t>( vals.size() ) );
+  for( const float val : vals )
+    f32( val );
+}
+
+
+void Writer::strs( const std::vector<std::string> &vals )
+{
+  u32( static_cast<uint32_t>( vals.size() ) );
+  for( const string &val : vals )
+    str( val );
+}
+
+
+Reader::Reader( const std::string &buf )
+  : buffer( buf ),
+    pos( 0 )
+{
+}
+
+
+void Reader::need( const uint64_t nbytes ) const
+{
+  if( nbytes > (buffer.size() - pos) )
+    throw runtime_error( "Serialized analysis data is truncated" );
+}
+
+
+void Reader::check_at_end() const
+{
+  if( pos != buffer.size() )
+    throw runtime_error( "Unexpected trailing data in serialized analysis data" );
+}
+
+
+uint8_t Reader::u8()
+{
+  need( 1 );
+  return static_cast<uint8_t>( buffer[pos++] );
+}
+
+
+uint32_t Reader::u32()
+{
+  need( 4 );
+  uint32_t val = 0;
+  for( size_t i = 0; i < 4; ++i )
+    val |= static_cast<uint32_t>( static_cast<uint8_t>(buffer[pos++]) ) << (8*i);
+  return val;
+}
+
+
+uint64_t Reader::u64()
+{
+  need( 8 );
+  uint64_t val = 0;
+  for( size_t i = 0; i < 8; ++i )
+    val |= static_cast<uint64_t>( static_cast<uint8_t>(buffer[pos++]) ) << (8*i);
+  return val;
+}
+
+
+int32_t Reader::i32()
+{
+  return static_cast<int32_t>( u32() );
+}
+
+
+int64_t Reader::i64()
+{
+  return static_cast<int64_t>( u64() );
+}
+
+
+float Reader::f32()
+{
+  const uint32_t bits = u32();
+  float val;
+  memcpy( &val, &bits, sizeof(val) );
+  return val;
+}
+
+
+double Reader::f64()
+{
+  const uint64_t bits = u64();
+  double val;
+  memcpy( &val, &bits, sizeof(val) );
+  return val;
+}
+
+
+uint64_t Reader::varint()
+{
+  uint64_t val = 0;
+  for( unsigned int shift = 0; shift < 64; shift += 7 )
+  {
+    const uint8_t byte = u8();
+    val |= static_cast<uint64_t>(byte & 0x7F) << shift;
+    if( !(byte & 0x80) )
+      return val;
+  }
+  throw runtime_error( "Invalid variable length integer in serialized analysis data" );
+}
+
+
+std::string Reader::str()
+{
+  const uint32_t len = u32();
+  need( len );
+  string val = buffer.substr( pos, len );
+  pos += len;
+  return val;
+}
+
+
+std::vector<float> Reader::floats()
+{
+  const uint32_t len = u32();
+  need( 4*uint64_t(len) );
+  vector<float> vals( len );
+  for( float &val : vals )
+    val = f32();
+  return vals;
+}
+
+
+std::vector<std::string> Reader::strs()
+{
+  const uint32_t len = u32();
+  need( 4*uint64_t(len) ); // each string takes at least 4 bytes
+  vector<string> vals( len );
+  for( string &val : vals )
+    val = str();
+  return vals;
+}
+
+
+void write_spec( Writer &out, const SpecUtils::SpecFile &spec )
+{
+  out.str( spec.instrument_model() );
+  out.str( spec.manufacturer() );
+  out.str( spec.instrument_id() );
+  out.i32( static_cast<int32_t>( spec.detector_type() ) );
+
+  const vector<shared_ptr<const SpecUtils::Measurement>> &meass = spec.measurements();
+
+  // Energy calibrations are usually shared between many measurements, so write each only once.
+  map<const SpecUtils::EnergyCalibration *,uint32_t> cal_indexes;
+  vector<shared_ptr<const SpecUtils::EnergyCalibration>> cals;
+  for( const auto &m : meass )
+  {
+    const shared_ptr<const SpecUtils::EnergyCalibration> cal = m->energy_calibration();
+    if( cal && cal->valid() && !cal_indexes.count(cal.get()) )
+    {
+      cal_indexes[cal.get()] = static_cast<uint32_t>( cals.size() );
+      cals.push_back( cal );
+    }
+  }//for( const auto &m : meass )
+
+  out.u32( static_cast<uint32_t>( cals.size() ) );
+  for( const auto &cal : cals )
+  {
+    out.u8( static_cast<uint8_t>( cal->type() ) );
+    out.u32( static_cast<uint32_t>( cal->num_channels() ) );
+    if( cal->type() == SpecUtils::EnergyCalType::LowerChannelEdge )
+      out.floats( *cal->channel_energies() );
+    else
+      out.floats( cal->coefficients() );
+
+    const vector<pair<float,float>> &dev_pairs = cal->deviation_pairs();
+    out.u32( static_cast<uint32_t>( dev_pairs.size() ) );
+    for( const auto &dev : dev_pairs )
+    {
+      out.f32( dev.first );
+      out.f32( dev.second );
+    }
+  }//for( const auto &cal : cals )
+
+  out.u32( static_cast<uint32_t>( meass.size() ) );
+  for( const auto &m : meass )
+  {
+    out.i32( m->sample_number() );
+    out.str( m->detector_name() );
+    out.str( m->title() );
+    out.u8( static_cast<uint8_t>( m->source_type() ) );
+    out.u8( static_cast<uint8_t>( m->occupied() ) );
+    out.u32( m->derived_data_properties() );
+    out.f32( m->live_time() );
+    out.f32( m->real_time() );
+    out.i64( to_epoch_us( m->start_time() ) );
+
+    const shared_ptr<const SpecUtils::EnergyCalibration> cal = m->energy_calibration();
+    const auto cal_pos = cal_indexes.find( cal.get() );
+    out.i32( (cal_pos == end(cal_indexes)) ? -1 : static_cast<int32_t>(cal_pos->second) );
+
+    const shared_ptr<const vector<float>> &counts = m->gamma_counts();
+    write_counts( out, counts ? *counts : vector<float>{} );
+
+    out.u8( m->contained_neutron() ? 1 : 0 );
+    out.floats( m->neutron_counts() );
+  }//for( const auto &m : meass )
+}//void write_spec(...)
+
+
+std::shared_ptr<SpecUtils::SpecFile> read_spec( Reader &in )
+{
+  auto spec = make_shared<SpecUtils::SpecFile>();
+
+  const string model = in.str();
+  const string manufacturer = in.str();
+  const string instrument_id = in.str();
+  const int32_t det_type = in.i32();
+
+  const uint32_t ncals = in.u32();
+  vector<shared_ptr<const SpecUtils::EnergyCalibration>> cals;
+  for( uint32_t i = 0; i < ncals; ++i )
+  {
+    const auto type = static_cast<SpecUtils::EnergyCalType>( in.u8() );
+    const uint32_t nchannel = in.u32();
+    vector<float> coefs = in.floats();
+    vector<pair<float,float>> dev_pairs( in.u32() );
+    for( auto &dev : dev_pairs )
+    {
+      dev.first = in.f32();
+      dev.second = in.f32();
+    }
+
+    auto cal = make_shared<SpecUtils::EnergyCalibration>();
+    switch( type )
+    {
+      case SpecUtils::EnergyCalType::Polynomial:
+        cal->set_polynomial( nchannel, coefs, dev_pairs );
+        break;
+
+      case SpecUtils::EnergyCalType::UnspecifiedUsingDefaultPolynomial:
+        cal->set_default_polynomial( nchannel, coefs, dev_pairs );
+        break;
+
+      case SpecUtils::EnergyCalType::FullRangeFraction:
+        cal->set_full_range_fraction( nchannel, coefs, dev_pairs );
+        break;
+
+      case SpecUtils::EnergyCalType::LowerChannelEdge:
+        cal->set_lower_channel_energy( nchannel, std::move(coefs) );
+        break;
+
+      case SpecUtils::EnergyCalType::InvalidEquationType:
+      default:
+        throw runtime_error( "Invalid energy calibration type in serialized analysis data" );
+    }//switch( type )
+
+    cals.push_back( cal );
+  }//for( uint32_t i = 0; i < ncals; ++i )
+
+  const uint32_t nmeas = in.u32();
+  for( uint32_t i = 0; i < nmeas; ++i )
+  {
+    auto m = make_shared<DerivedMeasurement>();
+
+    m->set_sample_number( in.i32() );
+    m->set_detector_name( in.str() );
+    m->set_title( in.str() );
+    m->set_source_type( static_cast<SpecUtils::SourceType>( in.u8() ) );
+    m->set_occupancy_status( static_cast<SpecUtils::OccupancyStatus>( in.u8() ) );
+    m->set_derived_data_properties( in.u32() );
+    const float live_time = in.f32();
+    const float real_time = in.f32();
+    m->set_start_time( from_epoch_us( in.i64() ) );
+
+    const int32_t cal_index = in.i32();
+    if( (cal_index < -1) || (cal_index >= static_cast<int32_t>(cals.size())) )
+      throw runtime_error( "Invalid energy calibration index in serialized analysis data" );
+
+    auto counts = make_shared<vector<float>>( read_counts( in ) );
+    m->set_gamma_counts( counts, live_time, real_time );
+    if( (cal_index >= 0) && (cals[cal_index]->num_channels() == counts->size()) )
+      m->set_energy_calibration( cals[cal_index] );
+
+    const bool contained_neutron = (in.u8() != 0);
+    const vector<float> neutron_counts = in.floats();
+    if( contained_neutron )
+      m->set_neutron_counts( neutron_counts );
+
+    spec->add_measurement( m, false );
+  }//for( uint32_t i = 0; i < nmeas; ++i )
+
+  spec->set_instrument_model( model );
+  spec->set_manufacturer( manufacturer );
+  spec->set_instrument_id( instrument_id );
+  spec->set_detector_type( static_cast<SpecUtils::DetectorType>( det_type ) );
+
+  spec->cleanup_after_load( SpecUtils::SpecFile::DontChangeOrReorderSamples );
+
+  return spec;
+}//std::shared_ptr<SpecUtils::SpecFile> read_spec( Reader &in )
+
+
+void write_deadline( Writer &out, const std::chrono::steady_clock::time_point &deadline )
+{
+  // Sent as the seconds left, since the reader may be on another host, with its own steady clock;
+  //  negative means no deadline.
+  double seconds_left = -1.0;
+  if( deadline != chrono::steady_clock::time_point() )
+  {
+    const chrono::duration<double> left = deadline - chrono::steady_clock::now();
+    seconds_left = std::max( left.count(), 0.0 );
+  }
+
+  out.f64( seconds_left );
+}//void write_deadline(...)
+
+
+std::chrono::steady_clock::time_point read_deadline( Reader &in )
+{
+  const double seconds_left = in.f64();
+  if( !(seconds_left >= 0.0) )
+    return chrono::steady_clock::time_point();
+
+  return chrono::steady_clock::now()
+         + chrono::duration_cast<chrono::steady_clock::duration>( chrono::duration<double>(seconds_left) );
+}//std::chrono::steady_clock::time_point read_deadline( Reader &in )
+
+
+void write_input( Writer &out, const Analysis::AnalysisInput &input )
+{
+  if( !input.input )
+    throw runtime_error( "write_input: no input spectrum file" );
+
+  out.u64( input.ana_number );
+  out.u8( static_cast<uint8_t>( input.analysis_type ) );
+  out.str( input.drf_folder );
+  out.strs( input.input_warnings );
+  out.u64( input.trace_id );
+  write_deadline( out, input.deadline );
+  write_spec( out, *input.input );
+}//void write_input( Writer &out, const Analysis::AnalysisInput &input )
+
+
+Analysis::AnalysisInput read_input( Reader &in )
+{
+  Analysis::AnalysisInput input;
+  input.ana_number = static_cast<size_t>( in.u64() );
+
+  const uint8_t type = in.u8();
+  if( type > static_cast<uint8_t>(Analysis::AnalysisType::Portal) )
+    throw runtime_error( "Invalid analysis type in serialized analysis data" );
+  input.analysis_type = static_cast<Analysis::AnalysisType>( type );
+
+  input.drf_folder = in.str();
+  input.input_warnings = in.strs();
+  input.trace_id = in.u64();
+  input.deadline = read_deadline( in );
+  input.input = read_spec( in );
+
+  return input;
+}//Analysis::AnalysisInput read_input( Reader &in )
+
+
+void write_output( Writer &out, const Analysis::AnalysisOutput &output,
+                   const std::shared_ptr<const SpecUtils::SpecFile> &input_spec )
+{
+  out.u64( output.ana_number );
+  out.str( output.drf_used );
+  out.i32( output.gadras_intialization_error );
+  out.i32( output.gadras_analysis_error );
+  out.str( output.error_message );
+  out.strs( output.analysis_warnings );
+  out.f32( output.stuff_of_interest );
+  out.f32( output.rate_not_norm );
+  out.str( output.isotopes );
+  out.f32( output.chi_sqr );
+  out.f32( output.alarm_basis_duration );
+  out.strs( output.isotope_names );
+  out.strs( output.isotope_types );
+  out.floats( output.isotope_count_rates );
+  out.floats( output.isotope_confidences );
+  out.strs( output.isotope_confidence_strs );
+
+  // 0: no spectrum file, 1: same as the input, 2: spectrum file follows
+  if( !output.spec_file )
+  {
+    out.u8( 0 );
+  }else if( output.spec_file == input_spec )
+  {
+    out.u8( 1 );
+  }else
+  {
+    out.u8( 2 );
+    write_spec( out, *output.spec_file );
+  }
+}//void write_output(...)
+
+
+Analysis::AnalysisOutput read_output( Reader &in, const std::shared_ptr<SpecUtils::SpecFile> &input_spec )
+{
+  Analysis::AnalysisOutput output;
+  output.ana_number = static_cast<size_t>( in.u64() );
+  output.drf_used = in.str();
+  output.gadras_intialization_error = in.i32();
+  output.gadras_analysis_error = in.i32();
+  output.error_message = in.str();
+  output.analysis_warnings = in.strs();
+  output.stuff_of_interest = in.f32();
+  output.rate_not_norm = in.f32();
+  output.isotopes = in.str();
+  output.chi_sqr = in.f32();
+  output.alarm_basis_duration = in.f32();
+  output.isotope_names = in.strs();
+  output.isotope_types = in.strs();
+  output.isotope_count_rates = in.floats();
+  output.isotope_confidences = in.floats();
+  output.isotope_confidence_strs = in.strs();
+
+  const uint8_t spec_flag = in.u8();
+  switch( spec_flag )
+  {
+    case 0: break;
+    case 1: output.spec_file = input_spec; break;
+    case 2: output.spec_file = read_spec( in ); break;
+    default:
+      throw runtime_error( "Invalid spectrum file flag in serialized analysis data" );
+  }//switch( spec_flag )
+
+  return output;
+}//Analysis::AnalysisOutput read_output(...)
+
+}//namespace AnalysisSerialization
@@ -0,0 +1,1095 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <map>
+#include <set>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <condition_variable>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#endif
+
+#if( defined(__linux__) )
+#include <sys/prctl.h>
+#endif
+
+#include <Wt/WLogger.h>
+
+#include "SpecUtils/SpecFile.h"
+
+#include "FullSpectrumId/EngineLog.h"
+#include "FullSpectrumId/AnalysisZygote.h"
+#include "FullSpectrumId/MessageChannel.h"
+#include "FullSpectrumId/AnalysisSerialization.h"
+
+using namespace std;
+
+using AnalysisSerialization::Reader;
+using AnalysisSerialization::Writer;
+
+#ifndef _WIN32
+using MessageChannel::Channel;
+using MessageChannel::read_frame;
+using MessageChannel::write_frame;
+using MessageChannel::poll_timeout_ms;
+#endif
+
+
+namespace
+{
+  /** The types of messages sent between the processes; each message is a frame consisting of a
+   uint64 length, followed by the message, whose first byte is its type.
+   */
+  enum MessageType : uint8_t
+  {
+    /** Server to master, and master to zygote: job ID, watchdog timeout in seconds, key (server to
+     master only), then the serialized #Analysis::AnalysisInput.
+     */
+    JobMessage = 1,
+
+    /** Back from the worker: job ID, #JobStatus, then either the serialized
+     #Analysis::AnalysisOutput, or an error message.
+     */
+    ResultMessage = 2,
+
+    /** Master to server: the current #Stats. */
+    StatsMessage = 3,
+
+    /** Zygote to master: job ID; sent when the zygote starts running the job, which is when the
+     master starts the jobs watchdog deadline.  A cold zygote runs its first job itself, and doesnt
+     read the jobs queued behind it until it finishes, so they shouldnt be timed from when queued.
+     */
+    JobStartedMessage = 4
+  };//enum MessageType
+
+
+  /** How a job ended; sent in each #ResultMessage. */
+  enum JobStatus : uint8_t
+  {
+    JobSucceeded = 0,
+
+    /** The analysis threw an exception. */
+    JobFailed = 1,
+
+    /** The process running the job crashed. */
+    JobCrashed = 2,
+
+    /** The job ran past its watchdog timeout, and the process running it was killed. */
+    JobTimedOut = 3
+  };//enum JobStatus
+
+
+  /** Counters kept by the master process, and sent to the server whenever they change. */
+  struct Stats
+  {
+    uint64_t zygotes_running = 0;
+    uint64_t zygotes_started = 0;
+    uint64_t zygotes_stopped = 0;
+    uint64_t zygote_crashes = 0;
+    uint64_t zygote_hangs = 0;
+    uint64_t zygote_restarts = 0;
+    uint64_t jobs_completed = 0;
+    uint64_t jobs_failed = 0;
+    uint64_t jobs_crashed = 0;
+    uint64_t jobs_timed_out = 0;
+
+    bool operator==( const Stats &rhs ) const
+    {
+      return (zygotes_running == rhs.zygotes_running)
+             && (zygotes_started == rhs.zygotes_started)
+             && (zygotes_stopped == rhs.zygotes_stopped)
+             && (zygote_crashes == rhs.zygote_crashes)
+             && (zygote_hangs == rhs.zygote_hangs)
+             && (zygote_restarts == rhs.zygote_restarts)
+             && (jobs_completed == rhs.jobs_completed)
+             && (jobs_failed == rhs.jobs_failed)
+             && (jobs_crashed == rhs.jobs_crashed)
+             && (jobs_timed_out == rhs.jobs_timed_out);
+    }
+
+    void write( Writer &out ) const
+    {
+      for( const uint64_t val : { zygotes_running, zygotes_started, zygotes_stopped, zygote_crashes,
+                                  zygote_hangs, zygote_restarts, jobs_completed, jobs_failed,
+                                  jobs_crashed, jobs_timed_out } )
+        out.u64( val );
+    }
+
+    void read( Reader &in )
+    {
+      for( uint64_t *val : { &zygotes_running, &zygotes_started, &zygotes_stopped, &zygote_crashes,
+                             &zygote_hangs, &zygote_restarts, &jobs_completed, &jobs_failed,
+                             &jobs_crashed, &jobs_timed_out } )
+        *val = in.u64();
+    }
+  };//struct Stats
+
+
+  std::mutex ns_options_mutex;
+  AnalysisZygote::Options ns_options;
+
+
+  string result_message( const uint64_t job_id, const JobStatus status, const string &data )
+  {
+    string msg;
+    Writer out( msg );
+    out.u8( ResultMessage );
+    out.u64( job_id );
+    out.u8( status );
+    out.str( data );
+    return msg;
+  }//result_message(...)
+
+
+  string started_message( const uint64_t job_id )
+  {
+    string msg;
+    Writer out( msg );
+    out.u8( JobStartedMessage );
+    out.u64( job_id );
+    return msg;
+  }//started_message(...)
+
+
+#ifndef _WIN32
+  /** Makes the current process get killed if its parent exits, where supported. */
+  void die_with_parent()
+  {
+#if( defined(__linux__) )
+    prctl( PR_SET_PDEATHSIG, SIGKILL );
+#endif
+  }
+
+
+  string exit_status_str( const int status )
+  {
+    if( WIFSIGNALED(status) )
+    {
+      const int sig = WTERMSIG(status);
+      const char *name = strsignal( sig );
+      return "killed by signal " + std::to_string(sig) + (name ? (" (" + string(name) + ")") : string());
+    }
+
+    if( WIFEXITED(status) )
+      return "exited with code " + std::to_string( WEXITSTATUS(status) );
+
+    return "exited with status " + std::to_string( status );
+  }//exit_status_str(...)
+
+
+  /** Runs a job in the current process, returning the #ResultMessage to send back.
+
+   @param initialized If non-null, set to whether GADRAS was successfully initialized for the job.
+   */
+  string run_job( const uint64_t job_id, const string &serialized_input,
+                  AnalysisZygote::AnalyzeFcn analyze, bool *initialized )
+  {
+    if( initialized )
+      *initialized = false;
+
+    try
+    {
+      Reader in( serialized_input );
+      const Analysis::AnalysisInput input = AnalysisSerialization::read_input( in );
+      in.check_at_end();
+
+      const Analysis::AnalysisOutput output = analyze( input );
+      if( initialized )
+        *initialized = ((output.gadras_intialization_error == 0) && output.error_message.empty());
+
+      string serialized_output;
+      Writer out( serialized_output );
+      AnalysisSerialization::write_output( out, output, input.input );
+
+      return result_message( job_id, JobSucceeded, serialized_output );
+    }catch( std::exception &e )
+    {
+      return result_message( job_id, JobFailed, e.what() );
+    }
+  }//string run_job(...)
+
+
+  typedef std::chrono::steady_clock::time_point TimePoint;
+
+
+  TimePoint deadline_after( const double seconds )
+  {
+    const double max_seconds = 365.0*24.0*3600.0;
+    const std::chrono::duration<double> timeout( std::min( std::max( seconds, 0.0 ), max_seconds ) );
+    return std::chrono::steady_clock::now()
+           + std::chrono::duration_cast<std::chrono::steady_clock::duration>( timeout );
+  }//TimePoint deadline_after( const double seconds )
+
+
+  /** A job being run in a child of a zygote. */
+  struct ChildJob
+  {
+    uint64_t job_id;
+    pid_t pid;
+    unique_ptr<Channel> result;
+    TimePoint deadline;
+  };//struct ChildJob
+
+
+  /** The main loop of a zygote process; never returns. */
+  void zygote_main( const int master_fd, AnalysisZygote::AnalyzeFcn analyze, const string &key )
+  {
+    die_with_parent();
+
+    Channel master( master_fd );
+    vector<ChildJob> jobs;
+    bool warm = false;
+
+    while( true )
+    {
+      vector<pollfd> fds;
+      fds.push_back( { master.fd, static_cast<short>(POLLIN | (master.wants_write() ? POLLOUT : 0)), 0 } );
+      int timeout_ms = -1;
+      for( const ChildJob &job : jobs )
+      {
+        fds.push_back( { job.result->fd, POLLIN, 0 } );
+        const int job_timeout_ms = poll_timeout_ms( job.deadline, 60*1000 );
+        timeout_ms = (timeout_ms < 0) ? job_timeout_ms : std::min( timeout_ms, job_timeout_ms );
+      }
+
+      const int npoll = poll( &fds[0], fds.size(), timeout_ms );
+      if( npoll < 0 )
+      {
+        if( errno == EINTR )
+          continue;
+        _exit( EXIT_FAILURE );
+      }
+
+      // Check on the running jobs first, since they may finish up in the process of checking.
+      const TimePoint now = std::chrono::steady_clock::now();
+      for( size_t i = 0; i < jobs.size(); ++i )
+      {
+        const short revents = (npoll > 0) ? fds[i + 1].revents : 0;
+        ChildJob &job = jobs[i];
+
+        if( !revents && (now >= job.deadline) )
+        {
+          // The watchdog: GADRAS is stuck in a loop, or is just taking way too long.
+          kill( job.pid, SIGKILL );
+          while( (waitpid( job.pid, nullptr, 0 ) < 0) && (errno == EINTR) )
+          {
+          }
+
+          Wt::log("error:app") << "Analysis process for '" << key << "' timed out; killed it";
+          master.queue_frame( result_message( job.job_id, JobTimedOut,
+                                 "The analysis took longer than the time allowed for it, and was stopped" ) );
+          job.pid = -1;
+          continue;
+        }//if( job has timed out )
+
+        if( !revents || job.result->read_available() )
+          continue;
+
+        // EOF; the child has either sent its result and exited, or crashed.
+        int status = 0;
+        while( (waitpid( job.pid, &status, 0 ) < 0) && (errno == EINTR) )
+        {
+        }
+
+        string msg;
+        if( WIFEXITED(status) && (WEXITSTATUS(status) == 0) && job.result->pop_frame( msg ) )
+        {
+          master.queue_frame( msg );
+        }else
+        {
+          Wt::log("error:app") << "Analysis process for '" << key << "' " << exit_status_str(status);
+          master.queue_frame( result_message( job.job_id, JobCrashed,
+                                 "The analysis process " + exit_status_str(status) ) );
+        }
+
+        job.pid = -1;
+      }//for( loop over running jobs )
+
+      jobs.erase( std::remove_if( begin(jobs), end(jobs), []( const ChildJob &job ){
+        return job.pid < 0;
+      } ), end(jobs) );
+
+      if( (npoll > 0) && (fds[0].revents & POLLOUT) )
+      {
+        if( !master.write_available() )
+          _exit( EXIT_FAILURE );
+      }
+
+      if( (npoll <= 0) || !(fds[0].revents & (POLLIN | POLLHUP | POLLERR)) )
+        continue;
+
+      if( !master.read_available() )
+      {
+        // The master has closed the connection; stop any running jobs and exit.
+        for( const ChildJob &job : jobs )
+        {
+          kill( job.pid, SIGKILL );
+          waitpid( job.pid, nullptr, 0 );
+        }
+        _exit( EXIT_SUCCESS );
+      }//if( master closed connection )
+
+      string msg;
+      while( master.pop_frame( msg ) )
+      {
+        Reader in( msg );
+        if( in.u8() != JobMessage )
+          continue;
+
+        const uint64_t job_id = in.u64();
+        const double timeout = in.f64();
+        const string serialized_input = in.str();
+
+        if( !warm )
+        {
+          // Run the first job ourselves, to get GADRAS into a warm state to fork from; the master
+          //  enforces the timeout for this job, by killing this whole process, so make sure it knows
+          //  the job has started before we block running it.
+          master.queue_frame( started_message( job_id ) );
+          while( master.wants_write() )
+          {
+            pollfd wfd = { master.fd, POLLOUT, 0 };
+            if( (poll( &wfd, 1, -1 ) < 0) && (errno != EINTR) )
+              _exit( EXIT_FAILURE );
+            if( (wfd.revents & POLLOUT) && !master.write_available() )
+              _exit( EXIT_FAILURE );
+            if( wfd.revents & (POLLHUP | POLLERR) )
+              _exit( EXIT_SUCCESS );
+          }//while( master.wants_write() )
+
+          master.queue_frame( run_job( job_id, serialized_input, analyze, &warm ) );
+          continue;
+        }//if( !warm )
+
+        int result_fds[2];
+        if( socketpair( AF_UNIX, SOCK_STREAM, 0, result_fds ) != 0 )
+        {
+          master.queue_frame( result_message( job_id, JobFailed, "Failed to create socket for analysis process" ) );
+          continue;
+        }
+
+        const pid_t pid = fork();
+        if( pid < 0 )
+        {
+          close( result_fds[0] );
+          close( result_fds[1] );
+          master.queue_frame( result_message( job_id, JobFailed, "Failed to fork analysis process" ) );
+          continue;
+        }
+
+        if( pid == 0 )
+        {
+          // The job process
+          close( result_fds[0] );
+          close( master.fd );
+          for( const ChildJob &job : jobs )
+            close( job.result->fd );
+          die_with_parent();
+
+          const string result = run_job( job_id, serialized_input, analyze, nullptr );
+          const bool wrote = write_frame( result_fds[1], result, true );
+          _exit( wrote ? EXIT_SUCCESS : EXIT_FAILURE );
+        }//if( pid == 0 )
+
+        close( result_fds[1] );
+        jobs.push_back( ChildJob{ job_id, pid, make_unique<Channel>( result_fds[0] ), deadline_after( timeout ) } );
+        master.queue_frame( started_message( job_id ) );
+      }//while( master.pop_frame( msg ) )
+    }//while( true )
+  }//void zygote_main(...)
+
+
+  /** A job sent to a zygote, as tracked by the master process. */
+  struct ZygoteJob
+  {
+    uint64_t job_id;
+    double timeout;
+
+    /** Set when the zygote reports it has started the job; until then, the job has no deadline. */
+    bool started;
+    TimePoint deadline;
+  };//struct ZygoteJob
+
+
+  /** A zygote, as tracked by the master process. */
+  struct Zygote
+  {
+    string key;
+    pid_t pid;
+    unique_ptr<Channel> channel;
+    vector<ZygoteJob> jobs;
+    TimePoint last_used;
+  };//struct Zygote
+
+
+  /** Why the master is stopping a zygote. */
+  enum class StopReason
+  {
+    Idle,
+    Crashed,
+
+    /** A job has gone past its deadline (plus #ns_hang_grace_seconds) without the zygote sending a
+     result; either GADRAS is stuck in the zygote's own first job, or the zygote itself is stuck.
+     */
+    Hung
+  };//enum class StopReason
+
+
+  /** How long past a jobs deadline the master waits for the zygote to report the timeout itself. */
+  const double ns_hang_grace_seconds = 5.0;
+
+
+  /** The main loop of the master process; never returns. */
+  void master_main( const int server_fd, AnalysisZygote::AnalyzeFcn analyze,
+                    const AnalysisZygote::Options options )
+  {
+    die_with_parent();
+
+    // Let the server decide when we should exit.
+    signal( SIGINT, SIG_IGN );
+    signal( SIGPIPE, SIG_IGN );
+
+    Channel server( server_fd );
+    vector<unique_ptr<Zygote>> zygotes;
+    Stats stats, sent_stats;
+
+    const auto idle_timeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                 std::chrono::duration<double>( options.idle_timeout_seconds ) );
+    const auto hang_grace = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                 std::chrono::duration<double>( ns_hang_grace_seconds ) );
+
+    // Keys whose zygote crashed or hung; the next zygote started for one of them is a restart.
+    set<string> failed_keys;
+
+    auto stop_zygote = [&]( const size_t index, const StopReason reason ){
+      Zygote &zygote = *zygotes[index];
+
+      if( reason != StopReason::Crashed )
+        kill( zygote.pid, (reason == StopReason::Hung) ? SIGKILL : SIGTERM );
+
+      int status = 0;
+      while( (waitpid( zygote.pid, &status, 0 ) < 0) && (errno == EINTR) )
+      {
+      }
+
+      switch( reason )
+      {
+        case StopReason::Idle:
+          stats.zygotes_stopped += 1;
+          break;
+
+        case StopReason::Crashed:
+          stats.zygote_crashes += 1;
+          failed_keys.insert( zygote.key );
+          Wt::log("error:app") << "Analysis zygote for '" << zygote.key << "' " << exit_status_str(status);
+
+          for( const auto &job : zygote.jobs )
+          {
+            server.queue_frame( result_message( job.job_id, JobCrashed,
+                                  "The analysis zygote process " + exit_status_str(status) ) );
+            stats.jobs_crashed += 1;
+          }
+          break;
+
+        case StopReason::Hung:
+        {
+          stats.zygote_hangs += 1;
+          failed_keys.insert( zygote.key );
+          Wt::log("error:app") << "Analysis zygote for '" << zygote.key << "' is not responding; killed it";
+
+          const TimePoint now = std::chrono::steady_clock::now();
+          for( const auto &job : zygote.jobs )
+          {
+            if( job.started && (now >= job.deadline) )
+            {
+              server.queue_frame( result_message( job.job_id, JobTimedOut,
+                                    "The analysis took longer than the time allowed for it, and was stopped" ) );
+              stats.jobs_timed_out += 1;
+            }else
+            {
+              server.queue_frame( result_message( job.job_id, JobCrashed,
+                                    "The analysis was stopped because another analysis in the same worker hung" ) );
+              stats.jobs_crashed += 1;
+            }
+          }//for( const auto &job : zygote.jobs )
+          break;
+        }//case StopReason::Hung:
+      }//switch( reason )
+
+      zygotes.erase( begin(zygotes) + index );
+    };//stop_zygote(...)
+
+
+    auto start_zygote = [&]( const string &key ) -> Zygote * {
+      // Make room by stopping the least recently used idle zygote
+      while( zygotes.size() >= std::max( size_t(1), options.max_zygotes ) )
+      {
+        size_t lru = zygotes.size();
+        for( size_t i = 0; i < zygotes.size(); ++i )
+        {
+          if( zygotes[i]->jobs.empty()
+              && ((lru == zygotes.size()) || (zygotes[i]->last_used < zygotes[lru]->last_used)) )
+            lru = i;
+        }
+
+        if( lru == zygotes.size() )
+          break; //All zygotes are busy; we'll go over the limit for a bit
+
+        stop_zygote( lru, StopReason::Idle );
+      }//while( too many zygotes )
+
+      int fds[2];
+      if( socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) != 0 )
+        return nullptr;
+
+      const pid_t pid = fork();
+      if( pid < 0 )
+      {
+        close( fds[0] );
+        close( fds[1] );
+        return nullptr;
+      }
+
+      if( pid == 0 )
+      {
+        close( fds[0] );
+        close( server.fd );
+        for( const auto &zygote : zygotes )
+          close( zygote->channel->fd );
+
+        zygote_main( fds[1], analyze, key );
+      }//if( pid == 0 )
+
+      close( fds[1] );
+
+      unique_ptr<Zygote> zygote( new Zygote{ key, pid, make_unique<Channel>( fds[0] ), {},
+                                             std::chrono::steady_clock::now() } );
+      zygotes.push_back( std::move(zygote) );
+      stats.zygotes_started += 1;
+      if( failed_keys.erase( key ) )
+        stats.zygote_restarts += 1;
+
+      Wt::log("info:app") << "Started analysis zygote for '" << key << "'";
+
+      return zygotes.back().get();
+    };//start_zygote(...)
+
+
+    while( true )
+    {
+      stats.zygotes_running = zygotes.size();
+      if( !(stats == sent_stats) )
+      {
+        string msg;
+        Writer out( msg );
+        out.u8( StatsMessage );
+        stats.write( out );
+        server.queue_frame( msg );
+        sent_stats = stats;
+      }//if( stats changed )
+
+      vector<pollfd> fds;
+      fds.push_back( { server.fd, static_cast<short>(POLLIN | (server.wants_write() ? POLLOUT : 0)), 0 } );
+      int timeout_ms = 1000;
+      for( const auto &zygote : zygotes )
+      {
+        const short events = POLLIN | (zygote->channel->wants_write() ? POLLOUT : 0);
+        fds.push_back( { zygote->channel->fd, events, 0 } );
+        for( const auto &job : zygote->jobs )
+        {
+          if( job.started )
+            timeout_ms = std::min( timeout_ms, poll_timeout_ms( job.deadline + hang_grace, 1000 ) );
+        }
+      }
+
+      const int npoll = poll( &fds[0], fds.size(), timeout_ms );
+      if( npoll < 0 && errno != EINTR )
+        _exit( EXIT_FAILURE );
+
+      // Handle output from, and writing to, zygotes; go backwards since we may remove zygotes
+      for( size_t i = zygotes.size(); i > 0; --i )
+      {
+        const short revents = (npoll > 0) ? fds[i].revents : 0;
+        Zygote &zygote = *zygotes[i-1];
+
+        if( (revents & POLLOUT) && !zygote.channel->write_available() )
+        {
+          stop_zygote( i - 1, StopReason::Crashed );
+          continue;
+        }
+
+        if( !(revents & (POLLIN | POLLHUP | POLLERR)) )
+          continue;
+
+        const bool open = zygote.channel->read_available();
+
+        string msg;
+        while( zygote.channel->pop_frame( msg ) )
+        {
+          Reader in( msg );
+          const uint8_t type = in.u8();
+
+          if( type == JobStartedMessage )
+          {
+            const uint64_t job_id = in.u64();
+            for( ZygoteJob &job : zygote.jobs )
+            {
+              if( (job.job_id == job_id) && !job.started )
+              {
+                job.started = true;
+                job.deadline = deadline_after( job.timeout );
+              }
+            }//for( ZygoteJob &job : zygote.jobs )
+            continue;
+          }//if( type == JobStartedMessage )
+
+          if( type != ResultMessage )
+            continue;
+
+          const uint64_t job_id = in.u64();
+          zygote.jobs.erase( std::remove_if( begin(zygote.jobs), end(zygote.jobs),
+            [job_id]( const ZygoteJob &job ){ return job.job_id == job_id; } ), end(zygote.jobs) );
+          zygote.last_used = std::chrono::steady_clock::now();
+
+          switch( in.u8() )
+          {
+            case JobSucceeded: stats.jobs_completed += 1; break;
+            case JobCrashed:   stats.jobs_crashed += 1;   break;
+            case JobTimedOut:  stats.jobs_timed_out += 1; break;
+            default:           stats.jobs_failed += 1;    break;
+          }//switch( job status )
+
+          server.queue_frame( msg );
+        }//while( zygote.channel->pop_frame( msg ) )
+
+        if( !open )
+          stop_zygote( i - 1, StopReason::Crashed );
+      }//for( loop over zygotes )
+
+      // Kill zygotes that have a job well past its deadline, and stop zygotes that havent been used
+      //  in a while.
+      const auto now = std::chrono::steady_clock::now();
+      for( size_t i = zygotes.size(); i > 0; --i )
+      {
+        const Zygote &zygote = *zygotes[i-1];
+
+        bool hung = false;
+        for( const auto &job : zygote.jobs )
+          hung = hung || (job.started && (now >= (job.deadline + hang_grace)));
+
+        if( hung )
+        {
+          stop_zygote( i - 1, StopReason::Hung );
+        }else if( zygote.jobs.empty() && ((now - zygote.last_used) > idle_timeout) )
+        {
+          Wt::log("info:app") << "Stopping idle analysis zygote for '" << zygote.key << "'";
+          stop_zygote( i - 1, StopReason::Idle );
+        }
+      }//for( loop over zygotes )
+
+      if( (npoll <= 0) || !fds[0].revents )
+        continue;
+
+      if( (fds[0].revents & POLLOUT) && !server.write_available() )
+        break;
+
+      if( !(fds[0].revents & (POLLIN | POLLHUP | POLLERR)) )
+        continue;
+
+      const bool server_open = server.read_available();
+
+      string msg;
+      while( server.pop_frame( msg ) )
+      {
+        Reader in( msg );
+        if( in.u8() != JobMessage )
+          continue;
+
+        const uint64_t job_id = in.u64();
+        const double timeout = in.f64();
+        const string key = in.str();
+        const string serialized_input = in.str();
+
+        Zygote *zygote = nullptr;
+        for( const auto &z : zygotes )
+        {
+          if( z->key == key )
+            zygote = z.get();
+        }
+
+        if( !zygote )
+          zygote = start_zygote( key );
+
+        if( !zygote )
+        {
+          server.queue_frame( result_message( job_id, JobFailed, "Failed to start analysis zygote process" ) );
+          continue;
+        }
+
+        string job_msg;
+        Writer out( job_msg );
+        out.u8( JobMessage );
+        out.u64( job_id );
+        out.f64( timeout );
+        out.str( serialized_input );
+
+        zygote->channel->queue_frame( job_msg );
+        zygote->jobs.push_back( ZygoteJob{ job_id, timeout, false, TimePoint() } );
+        zygote->last_used = std::chrono::steady_clock::now();
+      }//while( server.pop_frame( msg ) )
+
+      if( !server_open )
+        break;
+    }//while( true )
+
+    // The server has closed its end, or we had an error; stop everything and exit.
+    while( !zygotes.empty() )
+      stop_zygote( zygotes.size() - 1, StopReason::Idle );
+
+    _exit( EXIT_SUCCESS );
+  }//void master_main(...)
+
+
+  /** A job submitted by #AnalysisZygote::run, waiting on its result. */
+  struct PendingJob
+  {
+    bool done = false;
+    JobStatus status = JobFailed;
+    string data;
+  };//struct PendingJob
+
+
+  std::mutex ns_mutex;
+  std::condition_variable ns_cv;
+  bool ns_running = false;
+  pid_t ns_master_pid = -1;
+  int ns_master_fd = -1;
+  uint64_t ns_next_job_id = 1;
+  map<uint64_t,shared_ptr<PendingJob>> ns_pending;
+  Stats ns_stats;
+  std::unique_ptr<std::thread> ns_reader_thread;
+
+  /** Protects writing to #ns_master_fd, so we dont hold #ns_mutex while writing large jobs. */
+  std::mutex ns_write_mutex;
+
+
+  /** Reads results from the master process, until it closes the connection. */
+  void read_results( const int master_fd )
+  {
+    string msg;
+    while( read_frame( master_fd, msg ) )
+    {
+      try
+      {
+        Reader in( msg );
+        const uint8_t type = in.u8();
+
+        if( type == StatsMessage )
+        {
+          Stats stats;
+          stats.read( in );
+
+          std::lock_guard<std::mutex> lock( ns_mutex );
+          ns_stats = stats;
+          continue;
+        }//if( type == StatsMessage )
+
+        if( type != ResultMessage )
+          continue;
+
+        const uint64_t job_id = in.u64();
+        const JobStatus status = static_cast<JobStatus>( in.u8() );
+        string data = in.str();
+
+        {
+          std::lock_guard<std::mutex> lock( ns_mutex );
+          const auto pos = ns_pending.find( job_id );
+          if( pos != end(ns_pending) )
+          {
+            pos->second->done = true;
+            pos->second->status = status;
+            pos->second->data = std::move( data );
+          }
+        }
+
+        ns_cv.notify_all();
+      }catch( std::exception &e )
+      {
+        Wt::log("error:app") << "Invalid message from analysis zygote master: " << e.what();
+      }
+    }//while( read_frame( master_fd, msg ) )
+
+    {
+      std::lock_guard<std::mutex> lock( ns_mutex );
+      if( ns_running )
+        Wt::log("error:app") << "Analysis zygote master process exited unexpectedly";
+      ns_running = false;
+    }
+
+    ns_cv.notify_all();
+  }//void read_results( const int master_fd )
+#endif //#ifndef _WIN32
+}//namespace
+
+
+namespace AnalysisZygote
+{
+
+void set_options( const Options &options )
+{
+  std::lock_guard<std::mutex> lock( ns_options_mutex );
+  ns_options = options;
+}
+
+
+Options options()
+{
+  std::lock_guard<std::mutex> lock( ns_options_mutex );
+  return ns_options;
+}
+
+
+void start( AnalyzeFcn analyze )
+{
+#ifdef _WIN32
+  throw runtime_error( "Analysis zygote workers are not supported on Windows" );
+#else
+  const Options opts = options();
+
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  if( ns_running || ns_reader_thread )
+    throw runtime_error( "AnalysisZygote::start(): already started" );
+
+  int fds[2];
+  if( socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) != 0 )
+    throw runtime_error( "AnalysisZygote::start(): failed to create socket pair" );
+
+#if( defined(SO_NOSIGPIPE) )
+  const int one = 1;
+  setsockopt( fds[0], SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one) );
+#endif
+
+  const pid_t pid = fork();
+  if( pid < 0 )
+  {
+    close( fds[0] );
+    close( fds[1] );
+    throw runtime_error( "AnalysisZygote::start(): failed to fork master process" );
+  }
+
+  if( pid == 0 )
+  {
+    close( fds[0] );
+    EngineLog::after_fork_in_child();
+    master_main( fds[1], analyze, opts );
+  }
+
+  close( fds[1] );
+
+  ns_master_pid = pid;
+  ns_master_fd = fds[0];
+  ns_running = true;
+  ns_stats = Stats();
+  ns_reader_thread = make_unique<std::thread>( &read_results, ns_master_fd );
+
+  Wt::log("info:app") << "Started analysis zygote master process " << pid;
+#endif
+}//void start( AnalyzeFcn analyze )
+
+
+void stop()
+{
+#ifndef _WIN32
+  std::unique_ptr<std::thread> reader;
+  pid_t pid = -1;
+  int fd = -1;
+
+  {
+    std::lock_guard<std::mutex> lock( ns_mutex );
+    if( !ns_reader_thread )
+      return;
+
+    ns_running = false;
+    reader = std::move( ns_reader_thread );
+    pid = ns_master_pid;
+    fd = ns_master_fd;
+    ns_master_pid = -1;
+    ns_master_fd = -1;
+  }
+
+  // The master exits when we close our end; the reader thread will then see EOF.
+  shutdown( fd, SHUT_RDWR );
+  reader->join();
+  close( fd );
+
+  while( (waitpid( pid, nullptr, 0 ) < 0) && (errno == EINTR) )
+  {
+  }
+
+  ns_cv.notify_all();
+
+  Wt::log("info:app") << "Stopped analysis zygote master process";
+#endif
+}//void stop()
+
+
+bool is_running()
+{
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  return ns_running;
+}
+
+
+double timeout_seconds( const SpecUtils::SpecFile &spec )
+{
+  const Options opts = options();
+
+  double nsamples = 0.0;
+  for( const auto &meas : spec.measurements() )
+  {
+    const auto &counts = meas ? meas->gamma_counts() : nullptr;
+    if( counts )
+      nsamples += counts->size() / 1024.0;
+  }
+
+  return opts.timeout_base_seconds + opts.timeout_per_sample_seconds * nsamples;
+}//double timeout_seconds( const SpecUtils::SpecFile &spec )
+
+
+Analysis::AnalysisOutput run( const Analysis::AnalysisInput &input )
+{
+#ifdef _WIN32
+  throw runtime_error( "Analysis zygote workers are not supported on Windows" );
+#else
+  if( !input.input )
+    throw runtime_error( "AnalysisZygote::run(): no input spectrum file" );
+
+  // The zygote is chosen by everything that goes into initializing GADRAS.
+  const string key = input.drf_folder
+                     + "/" + std::to_string( static_cast<int>(input.analysis_type) )
+                     + "/" + std::to_string( input.input->num_gamma_channels() );
+
+  const double timeout = timeout_seconds( *input.input );
+
+  auto job = make_shared<PendingJob>();
+  uint64_t job_id = 0;
+  int fd = -1;
+
+  {
+    std::lock_guard<std::mutex> lock( ns_mutex );
+    if( !ns_running )
+      throw runtime_error( "Analysis zygote master process is not running" );
+
+    job_id = ns_next_job_id++;
+    fd = ns_master_fd;
+    ns_pending[job_id] = job;
+  }
+
+  string msg;
+  Writer out( msg );
+  out.u8( JobMessage );
+  out.u64( job_id );
+  out.f64( timeout );
+  out.str( key );
+
+  string serialized_input;
+  Writer input_out( serialized_input );
+  AnalysisSerialization::write_input( input_out, input );
+  out.str( serialized_input );
+
+  bool sent = false;
+  {
+    std::lock_guard<std::mutex> lock( ns_write_mutex );
+    sent = write_frame( fd, msg, true );
+  }
+
+  std::unique_lock<std::mutex> lock( ns_mutex );
+  if( sent )
+    ns_cv.wait( lock, [&job](){ return job->done || !ns_running; } );
+  ns_pending.erase( job_id );
+
+  if( !job->done )
+    throw runtime_error( "Analysis zygote master process exited before the analysis finished" );
+
+  if( job->status != JobSucceeded )
+  {
+    Analysis::AnalysisOutput result;
+    result.ana_number = input.ana_number;
+    result.drf_used = input.drf_folder;
+    result.error_message = job->data;
+    return result;
+  }//if( !job->success )
+
+  Reader in( job->data );
+  Analysis::AnalysisOutput result = AnalysisSerialization::read_output( in, input.input );
+  in.check_at_end();
+
+  return result;
+#endif
+}//Analysis::AnalysisOutput run( const Analysis::AnalysisInput &input )
+
+
+EngineJson::Object status_json()
+{
+  EngineJson::Object json;
+
+#ifndef _WIN32
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  json["running"] = ns_running;
+  json["zygotesRunning"] = static_cast<long long>( ns_stats.zygotes_running );
+  json["zygotesStarted"] = static_cast<long long>( ns_stats.zygotes_started );
+  json["zygotesStopped"] = static_cast<long long>( ns_stats.zygotes_stopped );
+  json["zygoteCrashes"] = static_cast<long long>( ns_stats.zygote_crashes );
+  json["zygoteHangs"] = static_cast<long long>( ns_stats.zygote_hangs );
+  json["zygoteRestarts"] = static_cast<long long>( ns_stats.zygote_restarts );
+  json["jobsCompleted"] = static_cast<long long>( ns_stats.jobs_completed );
+  json["jobsFailed"] = static_cast<long long>( ns_stats.jobs_failed );
+  json["jobsCrashed"] = static_cast<long long>( ns_stats.jobs_crashed );
+  json["jobsTimedOut"] = static_cast<long long>( ns_stats.jobs_timed_out );
+  json["jobsPending"] = static_cast<long long>( ns_pending.size() );
+#else
+  json["running"] = false;
+#endif
+
+  return json;
+}//EngineJson::Object status_json()
+
+}//namespace AnalysisZygote
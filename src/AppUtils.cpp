@@ -45,6 +45,9 @@
 
 #include <Wt/WServer.h>
 #include <Wt/WLogger.h>
+#include <Wt/Json/Value.h>
+#include <Wt/Json/Parser.h>
+#include <Wt/WApplication.h>
 
 #include "SpecUtils/SerialToDetectorModel.h"
 
@@ -52,9 +55,25 @@
 #include "SpecUtils/StringAlgo.h"
 
 #include "FullSpectrumId/Analysis.h"
+#include "FullSpectrumId/Tracing.h"
+#include "FullSpectrumId/Metrics.h"
 #include "FullSpectrumId/AppUtils.h"
+#include "FullSpectrumId/EngineLog.h"
+#include "FullSpectrumId/EngineJson.h"
+#include "FullSpectrumId/PerfCounters.h"
+#include "FullSpectrumId/AnalysisZygote.h"
+#include "FullSpectrumId/AnalysisBroker.h"
+#include "FullSpectrumId/AnalysisCluster.h"
+#include "FullSpectrumId/AnalysisBatch.h"
+#include "FullSpectrumId/AnalysisCapture.h"
+#include "FullSpectrumId/AnalysisEnsemble.h"
+#include "FullSpectrumId/ResultStore.h"
+#include "FullSpectrumId/ClientLimits.h"
 #include "FullSpectrumId/RestResources.h"
 #include "FullSpectrumId/FullSpectrumApp.h"
+#if( ENABLE_SESSION_DETAIL_LOGGING )
+#include "FullSpectrumId/SessionArchive.h"
+#endif
 
 
 using namespace std;
@@ -66,6 +85,14 @@ namespace
 
 std::mutex ns_optionsmutex;
 bool ns_enable_rest_api = false;
+bool ns_enable_metrics = false;
+std::string ns_admin_token;
+size_t ns_log_queue_size = 0;
+std::string ns_trace_dump_file;
+#if( ENABLE_SESSION_DETAIL_LOGGING )
+bool ns_start_session_archive = false;
+SessionArchive::Options ns_session_archive_options;
+#endif
 
 
 /* A Mutex to protect the rest of the variables in this namespace.
@@ -85,7 +112,144 @@ std::string sm_url_served_on = "";
 std::shared_ptr<WServer> ns_server;
 std::unique_ptr<RestResources::InfoResource> ns_rest_info;
 std::unique_ptr<RestResources::AnalysisResource> ns_rest_ana;
+std::unique_ptr<RestResources::TraceResource> ns_rest_trace;
+std::unique_ptr<RestResources::MetricsResource> ns_rest_metrics;
+std::unique_ptr<RestResources::ResultHistoryResource> ns_rest_history;
+
+
+/** Forwards the analysis engines log messages to the Wt log. */
+void forward_engine_log( const std::string &type, const std::string &message )
+{
+  Wt::log( type ) << message;
+}
+
+
+/** Converts JSON from the analysis engine, to Wt JSON (e.g., for Metrics). */
+Wt::Json::Value to_wt_json( const EngineJson::Value &value )
+{
+  Wt::Json::Value answer;
+  Wt::Json::parse( EngineJson::serialize( value ), answer );
+  return answer;
+}
+
 
+/** Connects the analysis queue to the parts of the app the analysis engine doesnt know about:
+ zygote and cluster workers, the result store, and posting results to GUI sessions.
+ */
+void set_analysis_queue_hooks()
+{
+  Analysis::QueueHooks hooks;
+  
+  hooks.on_start = []( Analysis::AnalyzeFcn analyze ){
+    // Fork the zygote master before we start any threads of our own; the ones init_app_config
+    //  configures are started afterwards, by AppUtils::start_background_threads().
+    if( AnalysisZygote::options().enabled )
+    {
+      try
+      {
+        AnalysisZygote::start( analyze );
+      }catch( std::exception &e )
+      {
+        Wt::log("error") << "Failed to start analysis zygote workers, will analyze in-process: " << e.what();
+      }
+    }//if( AnalysisZygote::options().enabled )
+    
+    if( !AnalysisCluster::options().listen_address.empty() )
+    {
+      try
+      {
+        AnalysisCluster::start_coordinator();
+      }catch( std::exception &e )
+      {
+        Wt::log("error") << "Failed to start analysis cluster coordinator: " << e.what();
+      }
+    }//if( we should coordinate cluster workers )
+  };//hooks.on_start
+  
+  hooks.on_stop = [](){
+    AnalysisBroker::disconnect();
+    AnalysisBroker::stop_run_threads();
+    AnalysisCluster::stop_coordinator();
+    AnalysisZygote::stop();
+  };//hooks.on_stop
+  
+  hooks.lookup = []( Analysis::AnalysisInput &input, Analysis::AnalysisOutput &output ) -> bool {
+    if( !ResultStore::is_open() )
+      return false;
+    
+    Tracing::Span span( "result_store_lookup", "analysis" );
+    return ResultStore::lookup( input, output );
+  };//hooks.lookup
+  
+  // Hand the analysis off to the host-wide broker if this is a session process using one, or else
+  //  to a cluster worker if one has the DRF, or else, in the broker, to one of its threads running
+  //  zygote workers; the result is posted from the thread that gets it.
+  hooks.dispatch = []( const Analysis::AnalysisInput &input,
+                       std::function<void( const Analysis::AnalysisOutput & )> done ) -> bool {
+    if( AnalysisBroker::is_client() )
+    {
+      const uint64_t trace_id = input.trace_id;
+      Tracing::async_begin( "broker_analysis", "analysis", trace_id );
+      AnalysisBroker::submit( input, [trace_id,done]( const Analysis::AnalysisOutput &result ){
+        Tracing::async_end( "broker_analysis", "analysis", trace_id );
+        done( result );
+      } );
+      
+      return true;
+    }//if( AnalysisBroker::is_client() )
+    
+    if( !AnalysisCluster::can_run( input.drf_folder ) )
+      return AnalysisBroker::run_concurrently( input, done );
+    
+    const uint64_t trace_id = input.trace_id;
+    Tracing::async_begin( "cluster_analysis", "analysis", trace_id );
+    AnalysisCluster::submit( input, [trace_id,done]( const Analysis::AnalysisOutput &result ){
+      Tracing::async_end( "cluster_analysis", "analysis", trace_id );
+      done( result );
+    } );
+    
+    return true;
+  };//hooks.dispatch
+  
+  hooks.run = []( const Analysis::AnalysisInput &input, Analysis::AnalysisOutput &output ) -> bool {
+    if( !AnalysisZygote::is_running() )
+      return false;
+    
+    Tracing::Span span( "zygote_analysis", "analysis" );
+    output = AnalysisZygote::run( input );
+    return true;
+  };//hooks.run
+  
+  hooks.on_result = []( const Analysis::AnalysisInput &input, const Analysis::AnalysisOutput &output ){
+    ResultStore::store( input, output );
+  };//hooks.on_result
+  
+  hooks.post_to_session = []( const Analysis::AnalysisInput &input, std::function<void()> callback ){
+    WServer *server = WServer::instance();
+    if( !server )
+    {
+      Wt::log("error") << "Error: got non empty Wt session ID ('" << input.wt_app_id << "'), but there"
+                       << " is no WServer instance - not calling result callback!";
+      return;
+    }//if( !server )
+    
+    const uint64_t trace_id = input.trace_id;
+    Tracing::async_begin( "post_to_session", "gui", trace_id );
+    
+    server->post( input.wt_app_id, [callback,trace_id](){
+      Tracing::RequestScope trace_scope( trace_id );
+      Tracing::async_end( "post_to_session", "gui", trace_id );
+      Tracing::Span span( "result_callback", "gui" );
+      
+      callback();
+      wApp->triggerUpdate();
+      
+      Wt::log("debug") << "Update should have triggered to GUI";
+    } );
+  };//hooks.post_to_session
+  
+  Analysis::set_queue_hooks( hooks );
+}//void set_analysis_queue_hooks()
 
 }// namespace
 
@@ -97,6 +261,7 @@ tuple<AppUseMode,vector<string>> init_app_config( const int argc, char **argv )
 {
   namespace po = boost::program_options;
   
+  EngineLog::set_sink( &forward_engine_log );
   
   vector<string> args_for_app;
   
@@ -122,9 +287,13 @@ tuple<AppUseMode,vector<string>> init_app_config( const int argc, char **argv )
   cmdline_ana_options.add_options()
   ( "foreground,f", po::value<string>(&fore_path), "Foreground spectrum file to analyze.")
   ( "background,b", po::value<string>(&back_path), "Background spectrum file to analyze.")
-  ( "drf,d", po::value<string>(&drf), "The detector response function to use.")
+  ( "drf,d", po::value<string>(&drf), "The detector response function to use; 'auto' (the default)"
+   " to determine it from the file, or 'ensemble' (or 'ensemble:' followed by a comma-separated"
+   " list of DRFs) to analyze with several candidate DRFs and report the best fitting result.")
   ( "out-format", po::value<string>(), "Format of command-line mode analysis output; can be 'brief', 'standard' (default if not specified), 'json'" )
   ( "drfs", "Show the available DRFs, and exit.  Can be combined with --out-format=json.")
+  ( "all-samples", "Analyze every foreground sample of a multi-record file, each paired with the"
+   " background file, or else the files own background, and report the result for each sample." )
   //TODO: add in output format shortcuts of --brief-output, --json-output --standard--output
   //TODO: add in --cl-options
   ;
@@ -132,12 +301,24 @@ tuple<AppUseMode,vector<string>> init_app_config( const int argc, char **argv )
   
   // Declare options allowed both on command line and in config file
 #if( ENABLE_SESSION_DETAIL_LOGGING )
-  string datadir;
+  string datadir, upload_archive_dir, session_log_fsync;
   bool save_uploaded_files = false;
+  int upload_compression_level;
+  double session_log_batch_seconds;
 #endif
   
-  bool enable_rest_api, command_line = false;
-  string detserial, gadras_run_dir, gadras_lib_path, execution_mode;
+  bool enable_rest_api, enable_tracing, enable_metrics, enable_perf_counters, use_zygotes, command_line = false;
+  bool ensemble_on_auto_failure;
+  size_t max_zygotes, result_store_max_mb, ensemble_max_drfs, batch_max_in_flight, max_samples;
+  size_t client_max_pending, broker_max_concurrent, fast_lane_reserved, log_queue_size;
+  string log_level;
+  double fast_lane_max_cost;
+  double zygote_idle_timeout, worker_timeout_base, worker_timeout_per_sample;
+  double cluster_job_timeout_base, cluster_job_timeout_per_sample;
+  double client_rate_limit, client_rate_burst;
+  string api_key_header, api_keys, admin_token;
+  string detserial, gadras_run_dir, gadras_lib_path, execution_mode, capture_file, trace_file;
+  string cluster_listen, cluster_secret, coordinator, worker_name, result_store_dir, broker_socket;
   
   po::options_description cmdline_or_file_options("Application execution options");
   cmdline_or_file_options.add_options()
@@ -146,6 +327,16 @@ tuple<AppUseMode,vector<string>> init_app_config( const int argc, char **argv )
    "Directory to save user data too." )
   ( "SaveUploadedFiles", po::value<bool>(&save_uploaded_files),
    "Whether to save uploaded files" )
+  ( "UploadArchiveDir", po::value<string>(&upload_archive_dir),
+   "Directory uploaded files are archived to; each distinct file is stored once, zstd compressed."
+   "  Defaults to the 'uploads' sub-directory of DataDir." )
+  ( "UploadCompressionLevel", po::value<int>(&upload_compression_level)->default_value(9),
+   "The zstd compression level (1 to 19) of archived uploads." )
+  ( "SessionLogBatchSeconds", po::value<double>(&session_log_batch_seconds)->default_value(1.0),
+   "How long session log entries are collected, before being written to disk together." )
+  ( "SessionLogFsync", po::value<string>(&session_log_fsync)->default_value("batch"),
+   "Either \"batch\", to sync the session logs to disk after each batch is written, and archived"
+   " uploads before they are put in place, or \"none\", to leave it to the operating system." )
 #endif
   ( "DetectorSerialToModelCsv", po::value<string>(&detserial)->default_value( "config/OUO_detective_serial_to_model.csv" ),
    "File of detective_serial_to_model.csv - for ORTEC Detective model identification" )
@@ -157,18 +348,126 @@ tuple<AppUseMode,vector<string>> init_app_config( const int argc, char **argv )
 #endif
   ( "EnableRestApi", po::value<bool>(&enable_rest_api)->default_value(false),
    "Enable rest API for analysis (e.g., POST'ing to /api/v1/analysis)" )
+  ( "AnalysisCaptureFile", po::value<string>(&capture_file),
+   "If specified, every analysis request submitted through the GUI or REST API is appended to"
+   " this file, so it can later be replayed using full-spec-replay." )
+  ( "ResultStoreDir", po::value<string>(&result_store_dir),
+   "If specified, successful analysis results are stored in this directory, and re-submitting the"
+   " same spectrum file with the same DRF returns the stored result instead of re-analyzing;"
+   " stored results can be looked up by instrument serial number at /api/v1/results/history."
+   "  Not available on Windows." )
+  ( "ResultStoreMaxMB", po::value<size_t>(&result_store_max_mb)->default_value(1024),
+   "Size, in megabytes, the result store is kept under by dropping the oldest results; 0 for no limit." )
+  ( "EnsembleOnAutoFailure", po::value<bool>(&ensemble_on_auto_failure)->default_value(true),
+   "When the DRF to use can not be determined from the spectrum file (or only a generic DRF would"
+   " be used), analyze with several candidate DRFs and use the best fitting result, instead of"
+   " failing.  An ensemble can also be requested by specifying a DRF of 'ensemble'." )
+  ( "EnsembleMaxDrfs", po::value<size_t>(&ensemble_max_drfs)->default_value(4),
+   "The maximum number of candidate DRFs an input is analyzed with." )
+  ( "BatchMaxInFlight", po::value<size_t>(&batch_max_in_flight)->default_value(4),
+   "The maximum number of analyses from DRF ensembles and all-samples requests in the analysis"
+   " queue at once; the rest wait so other analyses are not starved." )
+  ( "MaxSamplesPerFile", po::value<size_t>(&max_samples)->default_value(256),
+   "The maximum number of samples analyzed from a single file by an all-samples request; 0 for no"
+   " limit." )
+  ( "ApiKeyHeader", po::value<string>(&api_key_header)->default_value("X-API-Key"),
+   "The request header REST API clients may send their API key in." )
+  ( "ApiKeys", po::value<string>(&api_keys),
+   "Comma-separated list of accepted REST API keys, each optionally followed by '=' and its weight"
+   " (e.g., 'abc123=2,def456'); a client with twice the weight gets twice the share of analysis"
+   " time when the queue is busy.  Clients without an accepted key are identified by address, and"
+   " have a weight of 1." )
+  ( "ClientRateLimit", po::value<double>(&client_rate_limit)->default_value(0.0),
+   "The sustained number of REST API analysis requests per second allowed from each client; 0 for"
+   " no limit.  Requests over the limit get a 429 response." )
+  ( "ClientRateBurst", po::value<double>(&client_rate_burst)->default_value(10.0),
+   "The number of REST API analysis requests a client may make at once, when ClientRateLimit is"
+   " non-zero." )
+  ( "ClientMaxPending", po::value<size_t>(&client_max_pending)->default_value(10),
+   "The maximum number of REST API analysis requests from a single client being analyzed at once;"
+   " 0 for no limit." )
+  ( "EnableTracing", po::value<bool>(&enable_tracing)->default_value(false),
+   "Record per-request tracing events; retrieve them as Chrome trace JSON from /api/v1/admin/trace"
+   " (when EnableRestApi is true), or (not on Windows) by sending the process SIGUSR1, which writes"
+   " them to TraceFile." )
+  ( "TraceFile", po::value<string>(&trace_file)->default_value("fullspec_trace.json"),
+   "File the request trace is written to when the process receives SIGUSR1." )
+  ( "EnableMetrics", po::value<bool>(&enable_metrics)->default_value(false),
+   "Serve run-time metrics (analysis queue length, GADRAS performance counters, etc) as JSON from"
+   " /api/v1/admin/metrics, when EnableRestApi is true" )
+  ( "AdminToken", po::value<string>(&admin_token),
+   "The /api/v1/admin endpoints only answer requests made directly from this machine, unless they"
+   " have this token in their X-Admin-Token header." )
+  ( "EnableGadrasPerfCounters", po::value<bool>(&enable_perf_counters)->default_value(false),
+   "Record CPU cycles, instructions, cache misses, and page faults for each call into GADRAS,"
+   " aggregated per DRF and call type, and include them in the metrics.  Linux only; the"
+   " hardware counters may require lowering /proc/sys/kernel/perf_event_paranoid." )
+  ( "UseZygoteWorkers", po::value<bool>(&use_zygotes)->default_value(false),
+   "Run each analysis in a process forked from a worker that already has GADRAS initialized for"
+   " the DRF, instead of in the server process; a crash in GADRAS then only fails that analysis."
+   "  Not available on Windows." )
+  ( "MaxZygotes", po::value<size_t>(&max_zygotes)->default_value(4),
+   "The maximum number of DRF-initialized worker processes to keep when UseZygoteWorkers is true." )
+  ( "ZygoteIdleTimeout", po::value<double>(&zygote_idle_timeout)->default_value(1800.0),
+   "Seconds after which an unused DRF-initialized worker process is stopped." )
+  ( "WorkerTimeoutBase", po::value<double>(&worker_timeout_base)->default_value(60.0),
+   "When UseZygoteWorkers is true, the seconds an analysis may run before its worker process is"
+   " killed and an error returned, not counting the WorkerTimeoutPerSample allowance." )
+  ( "WorkerTimeoutPerSample", po::value<double>(&worker_timeout_per_sample)->default_value(0.5),
+   "Additional seconds an analysis may run, for each 1024 channels of each measurement in the input." )
+  ( "ClusterListen", po::value<string>(&cluster_listen),
+   "Address to accept analysis workers on (e.g., 'tcp:0.0.0.0:9310' or 'unix:/tmp/fullspec.sock');"
+   " analyses for DRFs a connected worker has are then sent to the workers.  Spectra are not"
+   " encrypted, so only listen where trusted machines can connect, and set ClusterSecret." )
+  ( "ClusterSecret", po::value<string>(&cluster_secret),
+   "A secret that analysis workers must know to be given analyses; set the same value for the"
+   " server and its workers.  Best set in the app config file, rather than on the command line." )
+  ( "ClusterJobTimeoutBase", po::value<double>(&cluster_job_timeout_base)->default_value(300.0),
+   "The seconds an analysis may run on a cluster worker, not counting the"
+   " ClusterJobTimeoutPerSample allowance, before the worker is dropped and the analysis given to"
+   " another worker." )
+  ( "ClusterJobTimeoutPerSample", po::value<double>(&cluster_job_timeout_per_sample)->default_value(2.0),
+   "Additional seconds an analysis may run on a cluster worker, for each 1024 channels of each"
+   " measurement in the input." )
+  ( "Coordinator", po::value<string>(&coordinator),
+   "In worker mode, the address of the server to pull analyses from (e.g., 'tcp:host:9310')." )
+  ( "WorkerName", po::value<string>(&worker_name),
+   "In worker mode, the name to report to the coordinator; defaults to 'hostname:pid'." )
+  ( "AnalysisBroker", po::value<string>(&broker_socket),
+   "Unix-domain socket of the host-wide analysis broker (e.g., '/tmp/fullspec-broker.sock')."
+   "  In broker mode, the socket to listen on; in web-server mode, analyses are sent to the broker"
+   " instead of being ran in this process, which is useful when each session has its own process." )
+  ( "BrokerMaxConcurrent", po::value<size_t>(&broker_max_concurrent)->default_value(2),
+   "In broker mode, the maximum number of analyses to run at once; more than one requires"
+   " UseZygoteWorkers." )
+  ( "FastLaneMaxCost", po::value<double>(&fast_lane_max_cost)->default_value(16.0),
+   "Analyses whose input has at most this many channels in total, in units of 1024 channels"
+   " (portal analyses count an extra 16), go in the fast lane of the analysis queue, ahead of"
+   " longer analyses." )
+  ( "FastLaneReservedSlots", po::value<size_t>(&fast_lane_reserved)->default_value(1),
+   "In broker mode, the number of the BrokerMaxConcurrent analyses that slow lane analyses can"
+   " not use, so fast lane analyses dont wait for them." )
+  ( "LogLevel", po::value<string>(&log_level)->default_value("info"),
+   "The lowest level of analysis and REST API messages logged: 'debug', 'info', 'warning', or"
+   " 'error'.  Messages below this level arent formatted at all." )
+  ( "LogQueueSize", po::value<size_t>(&log_queue_size)->default_value(8192),
+   "Except in command-line mode, log messages are written by a background thread, with room for"
+   " this many messages waiting; when it is full, messages other than errors are dropped.  0 to"
+   " write messages from the thread that logs them." )
 #if( FOR_WEB_DEPLOYMENT )
   ( "mode", po::value<string>(&execution_mode)->default_value("web-server"),
-    "Execution mode, can be 'command-line' (or equivalently 'cl'), 'web-server' (or equivalently 'web' or 'server')" )
+    "Execution mode, can be 'command-line' (or equivalently 'cl'), 'web-server' (or equivalently 'web' or 'server'), 'worker', or 'broker'" )
 #else
   ( "mode,m", po::value<string>(&execution_mode)->default_value("command-line"),
-   "Execution mode, can be 'command-line' (or equivalently 'cl'), 'web-server' (or equivalently 'web' or 'server')" )
+   "Execution mode, can be 'command-line' (or equivalently 'cl'), 'web-server' (or equivalently 'web' or 'server'), 'worker', or 'broker'" )
 #endif
   ( "command-line", "Equivalent of specifying --mode=command-line" )
   ( "cl", "Equivalent of specifying --mode=command-line" )
   ( "web-server", "Equivalent of specifying --mode=web-server" )
   ( "server", "Equivalent of specifying --mode=web-server" )
   ( "web", "Equivalent of specifying --mode=web-server" )
+  ( "worker", "Equivalent of specifying --mode=worker; analyzes spectra for the server given by 'Coordinator'" )
+  ( "broker", "Equivalent of specifying --mode=broker; analyzes spectra for web-server processes on this host, see 'AnalysisBroker'" )
   ;
   
   // Now define values you can supply on the command line or in the appconfig file to pass onto
@@ -208,6 +507,10 @@ tuple<AppUseMode,vector<string>> init_app_config( const int argc, char **argv )
 #if( !ENABLE_SESSION_DETAIL_LOGGING )
   ("DataDir",po::value<string>())
   ("SaveUploadedFiles",po::value<string>())
+  ("UploadArchiveDir",po::value<string>())
+  ("UploadCompressionLevel",po::value<string>())
+  ("SessionLogBatchSeconds",po::value<string>())
+  ("SessionLogFsync",po::value<string>())
 #endif
   ;
   
@@ -320,15 +623,19 @@ tuple<AppUseMode,vector<string>> init_app_config( const int argc, char **argv )
   
   // Begin deciding if we are being ran in server mode, or command line mode
   //  The logic is a bit tortured since the user can specify either
-  //  --mode={command-line|cl|web-server|server|web},
-  //  or --{command-line|cl|web-server|server|web}
+  //  --mode={command-line|cl|web-server|server|web|worker|broker},
+  //  or --{command-line|cl|web-server|server|web|worker|broker}
   const string possible_cl_txt[] = { "command-line", "cl" };
   const string possible_server_txt[] = { "web-server", "web", "server" };
+  const string possible_worker_txt[] = { "worker" };
+  const string possible_broker_txt[] = { "broker" };
   
   bool cl_mode = std::count( begin(possible_cl_txt), end(possible_cl_txt), execution_mode );
   bool server_mode = std::count( begin(possible_server_txt), end(possible_server_txt), execution_mode );
+  bool worker_mode = std::count( begin(possible_worker_txt), end(possible_worker_txt), execution_mode );
+  bool broker_mode = std::count( begin(possible_broker_txt), end(possible_broker_txt), execution_mode );
   string mode_shortcut;
-  bool cl_shortcut = false, server_shortcut = false;
+  bool cl_shortcut = false, server_shortcut = false, worker_shortcut = false, broker_shortcut = false;
   for( const auto &s : possible_cl_txt )
   {
     if( config_vm.count(s) )
@@ -347,9 +654,27 @@ tuple<AppUseMode,vector<string>> init_app_config( const int argc, char **argv )
     }
   }
   
-  if( cl_shortcut && server_shortcut )
+  for( const auto &s : possible_worker_txt )
+  {
+    if( config_vm.count(s) )
+    {
+      mode_shortcut = ("--" + s) + (mode_shortcut.size() ? " " : "") + mode_shortcut;
+      worker_shortcut = true;
+    }
+  }
+  
+  for( const auto &s : possible_broker_txt )
+  {
+    if( config_vm.count(s) )
+    {
+      mode_shortcut = ("--" + s) + (mode_shortcut.size() ? " " : "") + mode_shortcut;
+      broker_shortcut = true;
+    }
+  }
+  
+  if( (cl_shortcut + server_shortcut + worker_shortcut + broker_shortcut) > 1 )
   {
-    cerr << "You cannot specify to use both command line and web-server mode (error in specifying '"
+    cerr << "You can only specify one of command line, web-server, worker, or broker mode (error in specifying '"
          << mode_shortcut << "')" << endl;
     exit( EXIT_FAILURE );
   }
@@ -357,41 +682,51 @@ tuple<AppUseMode,vector<string>> init_app_config( const int argc, char **argv )
   
   if( cl_only_config_vm.count("mode") && !cl_only_config_vm["mode"].defaulted() )
   {
-    if( !cl_mode && !server_mode )
+    if( !cl_mode && !server_mode && !worker_mode && !broker_mode )
     {
       cerr << "Invalid 'mode' argument specified ('" << execution_mode << "'); must be one of:\n\t";
       for( const auto &i : possible_cl_txt  )
         cerr << i << ", ";
       for( const auto &i : possible_server_txt  )
         cerr << i << ", ";
+      for( const auto &i : possible_worker_txt  )
+        cerr << i << ", ";
+      for( const auto &i : possible_broker_txt  )
+        cerr << i << ", ";
       cerr << endl;
       exit( EXIT_FAILURE );
     }//if( an invalid mode was specified )
     
-    if( (cl_mode && server_shortcut) || (server_mode && cl_shortcut) )
+    if( (cl_mode && (server_shortcut || worker_shortcut || broker_shortcut))
+        || (server_mode && (cl_shortcut || worker_shortcut || broker_shortcut))
+        || (worker_mode && (cl_shortcut || server_shortcut || broker_shortcut))
+        || (broker_mode && (cl_shortcut || server_shortcut || worker_shortcut)) )
     {
       cerr << "Option 'mode' was specified as '" << execution_mode << "', but '" << mode_shortcut
           << "' was also specified" << endl;
       exit( EXIT_FAILURE );
     }
-  }else if( cl_shortcut || server_shortcut )
+  }else if( cl_shortcut || server_shortcut || worker_shortcut || broker_shortcut )
   {
     cl_mode = cl_shortcut;
     server_mode = server_shortcut;
+    worker_mode = worker_shortcut;
+    broker_mode = broker_shortcut;
   }//if( config_vm.count("mode") )
   
 
-  if( cl_mode == server_mode )
+  if( (cl_mode + server_mode + worker_mode + broker_mode) != 1 )
   {
     cerr << "You may specify '--mode' (or equiv '-m') to only be one of: 'command-line', 'cl',"
-    << " 'web-server', 'web', 'server'.  You specified '" << execution_mode << "'" << endl;
+    << " 'web-server', 'web', 'server', 'worker', 'broker'.  You specified '" << execution_mode << "'" << endl;
     exit( EXIT_FAILURE );
-  }//if( cl_mode == server )
+  }//if( (cl_mode + server_mode + worker_mode + broker_mode) != 1 )
   // End deciding if we are being ran in server mode, or command line mode
   
   if( cl_vm.count("help") || (cl_mode && (argc <= 1)) )
   {
-    const char * const this_mode = (cl_mode ? "command-line" : "web-server");
+    const char * const this_mode = (cl_mode ? "command-line"
+                                             : (worker_mode ? "worker" : (broker_mode ? "broker" : "web-server")));
     const char * const other_mode = (cl_mode ? "web-server" : "command-line");
     
     cout << "FullSpectrumID: Lee Harding and Will Johnson, Sandia National Laboratories.\n"
@@ -463,14 +798,37 @@ tuple<AppUseMode,vector<string>> init_app_config( const int argc, char **argv )
   
   
   
-  if( server_mode
+  if( (server_mode || worker_mode || broker_mode)
      && (!fore_path.empty() || !back_path.empty() || !drf.empty()
-          || config_vm.count("out-format") || config_vm.count("drfs") ) )
+          || config_vm.count("out-format") || config_vm.count("drfs")
+          || config_vm.count("all-samples") ) )
+  {
+    cerr << "You can not specify 'foreground', 'background', 'drf', 'drfs', 'all-samples', or 'out-format' when"
+         << " execution mode is '" << (server_mode ? "web-server" : (worker_mode ? "worker" : "broker"))
+         << "'" << endl;
+    exit( EXIT_FAILURE );
+  }//if( server, worker, or broker mode, but specified a command line options )
+  
+  if( worker_mode && coordinator.empty() )
+  {
+    cerr << "You must specify the 'Coordinator' address in worker mode" << endl;
+    exit( EXIT_FAILURE );
+  }
+  
+  if( broker_mode && broker_socket.empty() )
+  {
+    cerr << "You must specify the 'AnalysisBroker' socket path in broker mode" << endl;
+    exit( EXIT_FAILURE );
+  }
+  
+  // Session processes using a broker dont analyze anything themselves.
+  const bool use_broker = server_mode && !broker_socket.empty();
+  if( use_broker && (use_zygotes || !cluster_listen.empty() || !result_store_dir.empty()) )
   {
-    cerr << "You can not specify 'foreground', 'background', 'drf', 'drfs', or 'out-format' when"
-         << " execution mode is 'web-server'" << endl;
+    cerr << "'UseZygoteWorkers', 'ClusterListen', and 'ResultStoreDir' can not be used together with"
+         << " 'AnalysisBroker' in web-server mode; set them for the broker instead" << endl;
     exit( EXIT_FAILURE );
-  }//if( server mode, but specified a command line options )
+  }
   
   
   if( cl_mode )
@@ -658,6 +1016,31 @@ tuple<AppUseMode,vector<string>> init_app_config( const int argc, char **argv )
       
       FullSpectrumApp::set_data_directory( datadir, save_uploaded_files );
       
+      SessionArchive::Options archive_options;
+      archive_options.upload_dir = upload_archive_dir.empty()
+                                     ? SpecUtils::append_path( datadir, "uploads" )
+                                     : upload_archive_dir;
+      archive_options.compression_level = upload_compression_level;
+      archive_options.batch_seconds = session_log_batch_seconds;
+      
+      try
+      {
+        archive_options.fsync = SessionArchive::fsync_policy_from_str( session_log_fsync );
+      }catch( std::exception &e )
+      {
+        cerr << "Fatal: invalid session log options: " << e.what() << endl;
+        exit( EXIT_FAILURE );
+      }
+      
+      // The archive writer is a thread, so is started by start_background_threads().
+      {// begin lock on ns_optionsmutex
+        std::lock_guard<std::mutex> lock( ns_optionsmutex );
+        ns_start_session_archive = true;
+        ns_session_archive_options = archive_options;
+      }// end lock on ns_optionsmutex
+      
+      Metrics::add_source( "sessionArchive", [](){ return to_wt_json( SessionArchive::status_json() ); } );
+      
       Wt::log("debug:app") << "Will save user-uploaded files in base-directory '" << datadir << "'";
     }else
     {
@@ -693,12 +1076,220 @@ tuple<AppUseMode,vector<string>> init_app_config( const int argc, char **argv )
     ns_enable_rest_api = enable_rest_api;
   }
   
-  const AppUseMode mode = server_mode ? AppUseMode::Server : AppUseMode::CommandLine;
+  if( server_mode && !capture_file.empty() )
+  {
+    try
+    {
+      AnalysisCapture::start_capture( capture_file );
+    }catch( std::exception &e )
+    {
+      cerr << "Fatal: " << e.what() << endl;
+      exit( EXIT_FAILURE );
+    }
+  }//if( we should capture analysis requests )
+  
+  if( (server_mode || broker_mode) && !result_store_dir.empty() )
+  {
+    ResultStore::Options store_options;
+    store_options.directory = result_store_dir;
+    store_options.max_bytes = static_cast<uint64_t>(result_store_max_mb) * 1024 * 1024;
+    
+    try
+    {
+      ResultStore::open( store_options, Analysis::gadras_version_number() );
+    }catch( std::exception &e )
+    {
+      cerr << "Fatal: " << e.what() << endl;
+      exit( EXIT_FAILURE );
+    }
+    
+    Metrics::add_source( "resultStore", [](){ return to_wt_json( ResultStore::status_json() ); } );
+  }//if( we should store analysis results )
+  
+  {
+    AnalysisEnsemble::Options ensemble_options;
+    ensemble_options.on_auto_failure = ensemble_on_auto_failure;
+    ensemble_options.max_candidates = ensemble_max_drfs;
+    AnalysisEnsemble::set_options( ensemble_options );
+    
+    AnalysisBatch::Options batch_options;
+    batch_options.max_in_flight = batch_max_in_flight;
+    batch_options.max_samples = max_samples;
+    AnalysisBatch::set_options( batch_options );
+    
+    if( server_mode )
+      Metrics::add_source( "batches", [](){ return to_wt_json( AnalysisBatch::status_json() ); } );
+  }
+  
+  if( server_mode )
+  {
+    ClientLimits::Options client_options;
+    client_options.api_key_header = api_key_header;
+    client_options.rate_per_second = client_rate_limit;
+    client_options.burst = client_rate_burst;
+    client_options.max_pending = client_max_pending;
+    
+    try
+    {
+      client_options.api_keys = ClientLimits::parse_api_keys( api_keys );
+    }catch( std::exception &e )
+    {
+      cerr << "Fatal: invalid ApiKeys: " << e.what() << endl;
+      exit( EXIT_FAILURE );
+    }
+    
+    ClientLimits::set_options( client_options );
+    
+    Metrics::add_source( "clients", [](){ return to_wt_json( ClientLimits::status_json() ); } );
+    Metrics::add_source( "abandoned", [](){ return to_wt_json( Analysis::abandoned_status_json() ); } );
+  }//if( server_mode )
+  
+  try
+  {
+    EngineLog::set_level( EngineLog::level_from_str( log_level ) );
+  }catch( std::exception &e )
+  {
+    cerr << "Fatal: invalid LogLevel: " << e.what() << endl;
+    exit( EXIT_FAILURE );
+  }
+  
+  {
+    std::lock_guard<std::mutex> lock( ns_optionsmutex );
+    ns_log_queue_size = cl_mode ? size_t(0) : log_queue_size;
+  }
+  
+  if( server_mode || worker_mode || broker_mode )
+    Metrics::add_source( "log", [](){ return to_wt_json( EngineLog::status_json() ); } );
+  
+  if( server_mode && enable_tracing )
+  {
+    Tracing::set_enabled( true );
+    
+    // The SIGUSR1 handler starts a thread, so is installed by start_background_threads().
+    std::lock_guard<std::mutex> lock( ns_optionsmutex );
+    ns_trace_dump_file = trace_file;
+  }//if( server_mode && enable_tracing )
+  
+  if( server_mode && enable_perf_counters )
+  {
+    PerfCounters::set_enabled( true );
+    Metrics::add_source( "gadrasPerfCounters", [](){ return to_wt_json( PerfCounters::to_json() ); } );
+  }//if( server_mode && enable_perf_counters )
+  
+  if( (server_mode || worker_mode || broker_mode) && use_zygotes )
+  {
+    AnalysisZygote::Options zygote_options;
+    zygote_options.enabled = true;
+    zygote_options.max_zygotes = max_zygotes;
+    zygote_options.idle_timeout_seconds = zygote_idle_timeout;
+    zygote_options.timeout_base_seconds = worker_timeout_base;
+    zygote_options.timeout_per_sample_seconds = worker_timeout_per_sample;
+    AnalysisZygote::set_options( zygote_options );
+    
+    Metrics::add_source( "zygotes", [](){ return to_wt_json( AnalysisZygote::status_json() ); } );
+  }//if( (server_mode || worker_mode || broker_mode) && use_zygotes )
+  
+  if( ((server_mode || broker_mode) && !cluster_listen.empty()) || worker_mode )
+  {
+    AnalysisCluster::Options cluster_options;
+    cluster_options.listen_address = worker_mode ? string() : cluster_listen;
+    cluster_options.coordinator_address = coordinator;
+    cluster_options.worker_name = worker_name;
+    cluster_options.job_timeout_base_seconds = cluster_job_timeout_base;
+    cluster_options.job_timeout_per_sample_seconds = cluster_job_timeout_per_sample;
+    cluster_options.shared_secret = cluster_secret;
+    AnalysisCluster::set_options( cluster_options );
+    
+    if( server_mode )
+      Metrics::add_source( "cluster", [](){ return to_wt_json( AnalysisCluster::status_json() ); } );
+  }//if( server coordinates workers, or this is a worker )
+  
+  if( use_broker || broker_mode )
+  {
+    AnalysisBroker::Options broker_options;
+    broker_options.socket_path = broker_socket;
+    broker_options.is_broker = broker_mode;
+    broker_options.max_concurrent = broker_max_concurrent;
+    AnalysisBroker::set_options( broker_options );
+    
+    if( server_mode )
+      Metrics::add_source( "broker", [](){ return to_wt_json( AnalysisBroker::status_json() ); } );
+  }//if( server uses a broker, or this is the broker )
+  
+  {
+    Analysis::LaneOptions lane_options;
+    lane_options.fast_lane_max_cost = fast_lane_max_cost;
+    
+    // Only the broker runs several analyses at once from this process (see
+    //  AnalysisBroker::run_concurrently), so thats where slots can be kept for the fast lane.
+    if( broker_mode && use_zygotes && (broker_max_concurrent > fast_lane_reserved) )
+      lane_options.slow_lane_max_in_flight = broker_max_concurrent - fast_lane_reserved;
+    
+    Analysis::set_lane_options( lane_options );
+    
+    if( server_mode )
+      Metrics::add_source( "lanes", [](){ return to_wt_json( Analysis::lane_status_json() ); } );
+  }
+  
+  if( server_mode )
+  {
+    std::lock_guard<std::mutex> lock( ns_optionsmutex );
+    ns_enable_metrics = enable_metrics;
+    ns_admin_token = admin_token;
+  }
+  
+  set_analysis_queue_hooks();
+  
+  const AppUseMode mode = server_mode ? AppUseMode::Server
+                                      : (worker_mode ? AppUseMode::Worker
+                                                     : (broker_mode ? AppUseMode::Broker : AppUseMode::CommandLine));
   
   return make_tuple( mode, args_for_app );
 }//init_app_config(...)
 
 
+void start_background_threads()
+{
+  size_t queue_size = 0;
+  string trace_dump_file;
+#if( ENABLE_SESSION_DETAIL_LOGGING )
+  bool start_archive = false;
+  SessionArchive::Options archive_options;
+#endif
+  {
+    std::lock_guard<std::mutex> lock( ns_optionsmutex );
+    queue_size = ns_log_queue_size;
+    trace_dump_file = ns_trace_dump_file;
+#if( ENABLE_SESSION_DETAIL_LOGGING )
+    start_archive = ns_start_session_archive;
+    archive_options = ns_session_archive_options;
+#endif
+  }
+  
+  if( queue_size )
+    EngineLog::start_async( queue_size );
+  
+#if( ENABLE_SESSION_DETAIL_LOGGING )
+  if( start_archive )
+  {
+    try
+    {
+      SessionArchive::start( archive_options );
+    }catch( std::exception &e )
+    {
+      cerr << "Fatal: failed to start session log and upload archive writer: " << e.what() << endl;
+      exit( EXIT_FAILURE );
+    }
+  }//if( start_archive )
+#endif
+  
+#ifndef _WIN32
+  if( !trace_dump_file.empty() )
+    Tracing::install_dump_signal_handler( trace_dump_file );
+#endif
+}//void start_background_threads()
+
+
 /** Starts the web-server.
  
  Will throw exception on error.
@@ -711,10 +1302,13 @@ void start_server( const std::string &applicationPath, const std::vector<std::st
   // Note: that if we use isapi or fcgi connectors, this code is not correct, and shoudl use
   //  Wt::WRun(...)
   
-  bool enable_rest_api = false;
+  bool enable_rest_api = false, enable_metrics = false;
+  string admin_token;
   {// begin lock on ns_optionsmutex
     std::lock_guard<std::mutex> lock( ns_optionsmutex );
     enable_rest_api = ns_enable_rest_api;
+    enable_metrics = ns_enable_metrics;
+    admin_token = ns_admin_token;
   }// end lock on ns_optionsmutex
   
   
@@ -747,6 +1341,15 @@ void start_server( const std::string &applicationPath, const std::vector<std::st
         ns_rest_info = make_unique<RestResources::InfoResource>();
         ns_rest_ana = make_unique<RestResources::AnalysisResource>();
       }//if( enable_rest_api )
+      
+      if( enable_rest_api && Tracing::enabled() )
+        ns_rest_trace = make_unique<RestResources::TraceResource>( admin_token );
+      
+      if( enable_rest_api && enable_metrics )
+        ns_rest_metrics = make_unique<RestResources::MetricsResource>( admin_token );
+      
+      if( enable_rest_api && ResultStore::is_open() )
+        ns_rest_history = make_unique<RestResources::ResultHistoryResource>();
     }catch( std::exception &e )
     {
       cerr << "\nfatal, std::exception setting up REST resources: " << e.what() << endl;
@@ -755,6 +1358,9 @@ void start_server( const std::string &applicationPath, const std::vector<std::st
       ns_server.reset();
       ns_rest_info.reset();
       ns_rest_ana.reset();
+      ns_rest_trace.reset();
+      ns_rest_metrics.reset();
+      ns_rest_history.reset();
       
       throw runtime_error( "fatal, std::exception setting up REST resources: " + string(e.what()) );
     }// try / catch setup REST resources
@@ -780,6 +1386,15 @@ void start_server( const std::string &applicationPath, const std::vector<std::st
       if( enable_rest_api && ns_rest_ana )
         ns_server->addResource( ns_rest_ana.get(), "api/v1/analysis" );
       
+      if( ns_rest_trace )
+        ns_server->addResource( ns_rest_trace.get(), "api/v1/admin/trace" );
+      
+      if( ns_rest_metrics )
+        ns_server->addResource( ns_rest_metrics.get(), "api/v1/admin/metrics" );
+      
+      if( ns_rest_history )
+        ns_server->addResource( ns_rest_history.get(), "api/v1/results/history" );
+      
       
       // TODO: maybe add privacy, license, and use instructions information to static REST API endpoints
       
@@ -824,6 +1439,9 @@ void start_server( const std::string &applicationPath, const std::vector<std::st
       ns_server.reset();
       ns_rest_info.reset();
       ns_rest_ana.reset();
+      ns_rest_trace.reset();
+      ns_rest_metrics.reset();
+      ns_rest_history.reset();
       sm_port_served_on = -1;
       sm_url_served_on = "";
       
@@ -836,6 +1454,9 @@ void start_server( const std::string &applicationPath, const std::vector<std::st
       ns_server.reset();
       ns_rest_info.reset();
       ns_rest_ana.reset();
+      ns_rest_trace.reset();
+      ns_rest_metrics.reset();
+      ns_rest_history.reset();
       sm_port_served_on = -1;
       sm_url_served_on = "";
       
@@ -848,6 +1469,9 @@ void start_server( const std::string &applicationPath, const std::vector<std::st
       ns_server.reset();
       ns_rest_info.reset();
       ns_rest_ana.reset();
+      ns_rest_trace.reset();
+      ns_rest_metrics.reset();
+      ns_rest_history.reset();
       sm_port_served_on = -1;
       sm_url_served_on = "";
       
@@ -868,9 +1492,20 @@ void kill_server()
     std::cerr << "About to stop server" << std::endl;
     ns_server->stop();
     
+#if( ENABLE_SESSION_DETAIL_LOGGING )
+    // Sessions are gone, so write out what they logged, and finish archiving their uploads.
+    SessionArchive::stop();
+#endif
+    
+    // No more requests can come in, so write out any captured requests still queued.
+    AnalysisCapture::stop_capture();
+    
     ns_server.reset();
     ns_rest_info.reset();
     ns_rest_ana.reset();
+    ns_rest_trace.reset();
+    ns_rest_metrics.reset();
+    ns_rest_history.reset();
     sm_port_served_on = -1;
     sm_url_served_on = "";
     
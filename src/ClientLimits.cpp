@@ -0,0 +1,381 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <map>
+#include <cmath>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+
+#include "SpecUtils/StringAlgo.h"
+
+#include "FullSpectrumId/Analysis.h"
+#include "FullSpectrumId/ClientLimits.h"
+
+using namespace std;
+
+namespace
+{
+  typedef std::chrono::steady_clock Clock;
+  
+  /** The number of recent latencies kept per client for the percentiles. */
+  const size_t ns_num_latencies = 128;
+  
+  /** Clients with nothing pending, that havent been seen in this long, are forgotten. */
+  const double ns_forget_seconds = 600.0;
+  
+  struct ClientState
+  {
+    double weight = 1.0;
+    double tokens = 0.0;
+    Clock::time_point last_refill;
+    Clock::time_point last_seen;
+    
+    size_t pending = 0;
+    size_t requests = 0;
+    size_t rate_limited = 0;
+    size_t too_many_pending = 0;
+    size_t completed = 0;
+    double total_seconds = 0.0;
+    double max_seconds = 0.0;
+    std::deque<double> recent_seconds;
+  };//struct ClientState
+  
+  
+  std::mutex ns_mutex;
+  ClientLimits::Options ns_options;
+  std::map<std::string,ClientState> ns_clients;
+  Clock::time_point ns_last_forget;
+  
+  
+  double seconds_between( const Clock::time_point &start, const Clock::time_point &end )
+  {
+    return std::chrono::duration<double>(end - start).count();
+  }
+  
+  
+  /** Adds the tokens earned since the last refill; ns_mutex must be held. */
+  void refill( ClientState &state, const Clock::time_point &now )
+  {
+    const double burst = std::max( ns_options.burst, 1.0 );
+    const double elapsed = seconds_between( state.last_refill, now );
+    state.tokens = std::min( burst, state.tokens + elapsed*ns_options.rate_per_second );
+    state.last_refill = now;
+  }//void refill(...)
+  
+  
+  /** Forgets idle clients, at most once a minute, so the map doesnt grow with every address ever
+   seen; ns_mutex must be held.
+   */
+  void forget_idle_clients( const Clock::time_point &now )
+  {
+    if( seconds_between( ns_last_forget, now ) < 60.0 )
+      return;
+    
+    ns_last_forget = now;
+    
+    for( auto iter = begin(ns_clients); iter != end(ns_clients); )
+    {
+      const ClientState &state = iter->second;
+      if( !state.pending && (seconds_between( state.last_seen, now ) > ns_forget_seconds) )
+        iter = ns_clients.erase( iter );
+      else
+        ++iter;
+    }
+  }//void forget_idle_clients(...)
+  
+  
+  /** Returns the client ID to show in the metrics; API keys are cut down to their first few
+   characters, and a hash of the rest, so the metrics dont give them away.
+   */
+  string display_name( const string &client )
+  {
+    if( !SpecUtils::starts_with( client, "key:" ) )
+      return client;
+    
+    const string key = client.substr( 4 );
+    const size_t hash = std::hash<string>()( key ) & 0xffff;
+    char hashstr[8];
+    snprintf( hashstr, sizeof(hashstr), "%04x", static_cast<unsigned int>(hash) );
+    
+    return "key:" + key.substr( 0, 4 ) + "..." + hashstr;
+  }//string display_name( const string &client )
+  
+  
+  double percentile( vector<double> values, const double fraction )
+  {
+    if( values.empty() )
+      return 0.0;
+    
+    const size_t index = std::min( values.size() - 1,
+                                   static_cast<size_t>( fraction*values.size() ) );
+    std::nth_element( begin(values), begin(values) + index, end(values) );
+    
+    return values[index];
+  }//double percentile(...)
+}//namespace
+
+
+namespace ClientLimits
+{
+
+void set_options( const Options &options )
+{
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  ns_options = options;
+  
+  // Weights of clients we already know may have changed.
+  for( auto &client : ns_clients )
+  {
+    client.second.weight = 1.0;
+    if( SpecUtils::starts_with( client.first, "key:" ) )
+    {
+      const auto key_iter = ns_options.api_keys.find( client.first.substr(4) );
+      if( key_iter != end(ns_options.api_keys) )
+        client.second.weight = key_iter->second;
+    }
+  }//for( loop over known clients )
+}//void set_options( const Options &options )
+
+
+Options options()
+{
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  return ns_options;
+}
+
+
+std::map<std::string,double> parse_api_keys( const std::string &spec )
+{
+  std::map<std::string,double> keys;
+  
+  vector<string> fields;
+  SpecUtils::split( fields, spec, "," );
+  
+  for( string field : fields )
+  {
+    SpecUtils::trim( field );
+    if( field.empty() )
+      continue;
+    
+    double weight = 1.0;
+    const size_t eq_pos = field.rfind( '=' );
+    if( eq_pos != string::npos )
+    {
+      string weightstr = field.substr( eq_pos + 1 );
+      SpecUtils::trim( weightstr );
+      field = field.substr( 0, eq_pos );
+      SpecUtils::trim( field );
+      
+      char *end_ptr = nullptr;
+      weight = strtod( weightstr.c_str(), &end_ptr );
+      if( weightstr.empty() || (*end_ptr != '\0') || !(weight > 0.0) || std::isinf(weight) )
+        throw runtime_error( "Invalid weight '" + weightstr + "' for API key" );
+    }//if( a weight was given )
+    
+    if( field.empty() )
+      throw runtime_error( "Empty API key in '" + spec + "'" );
+    
+    keys[field] = weight;
+  }//for( string field : fields )
+  
+  return keys;
+}//std::map<std::string,double> parse_api_keys( const std::string &spec )
+
+
+std::string client_id( const std::string &api_key, const std::string &address )
+{
+  if( !api_key.empty() )
+  {
+    std::lock_guard<std::mutex> lock( ns_mutex );
+    if( ns_options.api_keys.count( api_key ) )
+      return "key:" + api_key;
+  }//if( !api_key.empty() )
+  
+  return "addr:" + address;
+}//std::string client_id(...)
+
+
+Ticket::Ticket( const std::string &client, const double weight )
+  : m_client( client ),
+    m_weight( weight ),
+    m_start( Clock::now() )
+{
+}
+
+
+Ticket::~Ticket()
+{
+  const Clock::time_point now = Clock::now();
+  const double seconds = seconds_between( m_start, now );
+  
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  
+  ClientState &state = ns_clients[m_client];
+  state.pending -= std::min( state.pending, size_t(1) );
+  state.last_seen = now;
+  state.completed += 1;
+  state.total_seconds += seconds;
+  state.max_seconds = std::max( state.max_seconds, seconds );
+  state.recent_seconds.push_back( seconds );
+  while( state.recent_seconds.size() > ns_num_latencies )
+    state.recent_seconds.pop_front();
+}//Ticket::~Ticket()
+
+
+const std::string &Ticket::client() const
+{
+  return m_client;
+}
+
+
+double Ticket::weight() const
+{
+  return m_weight;
+}
+
+
+std::unique_ptr<Ticket> admit( const std::string &client, Rejection &rejection,
+                               double &retry_after_seconds )
+{
+  rejection = Rejection::None;
+  retry_after_seconds = 0.0;
+  
+  const Clock::time_point now = Clock::now();
+  
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  
+  forget_idle_clients( now );
+  
+  auto iter = ns_clients.find( client );
+  if( iter == end(ns_clients) )
+  {
+    ClientState state;
+    state.tokens = std::max( ns_options.burst, 1.0 );
+    state.last_refill = now;
+    
+    if( SpecUtils::starts_with( client, "key:" ) )
+    {
+      const auto key_iter = ns_options.api_keys.find( client.substr(4) );
+      if( key_iter != end(ns_options.api_keys) )
+        state.weight = key_iter->second;
+    }
+    
+    iter = ns_clients.emplace( client, std::move(state) ).first;
+  }//if( we havent seen this client recently )
+  
+  ClientState &state = iter->second;
+  state.last_seen = now;
+  state.requests += 1;
+  
+  if( ns_options.max_pending && (state.pending >= ns_options.max_pending) )
+  {
+    state.too_many_pending += 1;
+    rejection = Rejection::TooManyPending;
+    retry_after_seconds = 5.0;
+    return nullptr;
+  }//if( client has too many requests pending )
+  
+  if( ns_options.rate_per_second > 0.0 )
+  {
+    refill( state, now );
+    
+    if( state.tokens < 1.0 )
+    {
+      state.rate_limited += 1;
+      rejection = Rejection::RateLimited;
+      retry_after_seconds = (1.0 - state.tokens) / ns_options.rate_per_second;
+      return nullptr;
+    }//if( client is out of tokens )
+    
+    state.tokens -= 1.0;
+  }//if( requests are rate limited )
+  
+  state.pending += 1;
+  
+  return std::unique_ptr<Ticket>( new Ticket( client, state.weight ) );
+}//std::unique_ptr<Ticket> admit(...)
+
+
+EngineJson::Object status_json()
+{
+  // Get the queue lengths before locking ns_mutex, so we never hold both locks.
+  const std::map<std::string,size_t> queued = Analysis::analysis_queue_lengths_by_client();
+  const Clock::time_point now = Clock::now();
+  
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  
+  EngineJson::Array clients;
+  for( auto &client : ns_clients )
+  {
+    ClientState &state = client.second;
+    if( ns_options.rate_per_second > 0.0 )
+      refill( state, now );
+    
+    const auto queued_iter = queued.find( client.first );
+    const vector<double> recent( begin(state.recent_seconds), end(state.recent_seconds) );
+    
+    EngineJson::Object latency;
+    latency["count"] = state.completed;
+    latency["meanSeconds"] = state.completed ? (state.total_seconds / state.completed) : 0.0;
+    latency["p50Seconds"] = percentile( recent, 0.50 );
+    latency["p95Seconds"] = percentile( recent, 0.95 );
+    latency["maxSeconds"] = state.max_seconds;
+    
+    EngineJson::Object entry;
+    entry["client"] = display_name( client.first );
+    entry["weight"] = state.weight;
+    entry["requests"] = state.requests;
+    entry["rateLimited"] = state.rate_limited;
+    entry["tooManyPending"] = state.too_many_pending;
+    entry["pending"] = state.pending;
+    entry["queued"] = (queued_iter == end(queued)) ? size_t(0) : queued_iter->second;
+    if( ns_options.rate_per_second > 0.0 )
+      entry["tokens"] = state.tokens;
+    entry["latency"] = std::move(latency);
+    
+    clients.push_back( std::move(entry) );
+  }//for( loop over clients )
+  
+  EngineJson::Object status;
+  status["ratePerSecond"] = ns_options.rate_per_second;
+  status["burst"] = ns_options.burst;
+  status["maxPending"] = ns_options.max_pending;
+  status["clients"] = std::move(clients);
+  
+  return status;
+}//EngineJson::Object status_json()
+
+}//namespace ClientLimits
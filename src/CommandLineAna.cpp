@@ -28,17 +28,11 @@
 #include <string>
 #include <vector>
 #include <fstream>
+#include <stdexcept>
 #include <condition_variable>
 
-#include <Wt/Json/Array.h>
-#include <Wt/Json/Value.h>
-#include <Wt/Json/Object.h>
-#include <Wt/Json/Serializer.h>
-
 #include <boost/program_options.hpp>
 
-#include <Wt/WLogger.h>
-
 #include "SpecUtils/SerialToDetectorModel.h"
 
 #include "SpecUtils/SpecFile.h"
@@ -46,13 +40,14 @@
 #include "SpecUtils/StringAlgo.h"
 
 #include "FullSpectrumId/Analysis.h"
-#include "FullSpectrumId/AppUtils.h"
+#include "FullSpectrumId/EngineJson.h"
+#include "FullSpectrumId/AnalysisBatch.h"
 #include "FullSpectrumId/CommandLineAna.h"
+#include "FullSpectrumId/AnalysisEnsemble.h"
 #include "FullSpectrumId/AnalysisFromFiles.h"
 
 
 using namespace std;
-using namespace Wt;
 
 namespace CommandLineAna
 {
@@ -69,10 +64,14 @@ int run_analysis( vector<string> args )
   ( "background,b", po::value<string>(&back_path), "Background spectrum file to analyze; if specified will not start webserver.")
   ( "spectrum-file", po::value<std::vector<std::string>>()->multitoken()->zero_tokens()->composing(),
    "Spectrum files...will guess first is foreground and second specified is background, but countrates..." )
-  ( "drf,d", po::value<string>(&drf), "The detector response function to use.")
+  ( "drf,d", po::value<string>(&drf), "The detector response function to use; 'auto' (the default)"
+   " to determine it from the file, or 'ensemble' (or 'ensemble:' followed by a comma-separated"
+   " list of DRFs) to analyze with several candidate DRFs and report the best fitting result.")
   ( "out-format", po::value<string>(&output)->default_value("standard"),
    "Format command-line mode analysis of output; can be 'brief', 'standard' (default if not specified), 'json'" )
   ( "drfs", "Show the available DRFs, and exit.  Can be combined with --out-format=json.")
+  ( "all-samples", "Analyze every foreground sample of a multi-record file, each paired with the"
+   " background file, or else the files own background, and report the result for each sample." )
   ( "help,h", "produce help message" )
   ;
   
@@ -241,20 +240,42 @@ int run_analysis( vector<string> args )
   }//if( !fore_path.empty() ) / else
   
   
+  const bool all_samples = cl_vm.count("all-samples");
+  vector<AnalysisFromFiles::SampleInput> samples;
   shared_ptr<SpecUtils::SpecFile> inputspec;
   
   try
   {
-    inputspec = AnalysisFromFiles::create_input( input1, input2 );
+    if( all_samples )
+    {
+      samples = AnalysisFromFiles::create_sample_inputs( input1, input2 );
+      
+      // The first sample that could be prepared is used to determine the DRF.
+      for( const AnalysisFromFiles::SampleInput &sample : samples )
+      {
+        if( sample.input )
+        {
+          inputspec = sample.input;
+          break;
+        }
+      }//for( const AnalysisFromFiles::SampleInput &sample : samples )
+      
+      if( !inputspec )
+        throw runtime_error( samples.empty() ? string("No foreground samples in spectrum file.")
+                                             : samples.front().error );
+    }else
+    {
+      inputspec = AnalysisFromFiles::create_input( input1, input2 );
+    }
   }catch( std::exception &e )
   {
     if( SpecUtils::iequals_ascii(output, "json") )
     {
-      Json::Object returnjson;
+      EngineJson::Object returnjson;
       returnjson["code"] = 3;
-      returnjson["message"] = WString::fromUTF8(e.what());
+      returnjson["message"] = e.what();
       
-      cout << Json::serialize(returnjson) << endl;
+      cout << EngineJson::serialize(returnjson) << endl;
     }else
     {
       cerr << "Error formatting input to analysis: " << e.what() << endl;
@@ -267,16 +288,40 @@ int run_analysis( vector<string> args )
   
   
   
+  // If the DRF cant be determined (or only a generic one would be used), try several of them.
+  vector<string> ensemble_drfs;
+  
   if( drf.empty() || SpecUtils::iequals_ascii(drf,"auto") )
   {
     drf = Analysis::get_drf_name( inputspec );
     
-    if( drf.empty() )
+    if( AnalysisEnsemble::should_use_ensemble( drf ) )
+    {
+      try
+      {
+        ensemble_drfs = AnalysisEnsemble::candidate_drfs( inputspec, "auto" );
+      }catch( std::exception &e )
+      {
+        cerr << "Could not choose candidate DRFs: " << e.what() << endl;
+      }
+    }//if( AnalysisEnsemble::should_use_ensemble( drf ) )
+    
+    if( drf.empty() && ensemble_drfs.empty() )
     {
       cerr << "Could not determine detection system type from the spectrum files - please specify"
            << " the detector response function to use via the 'drf' option." << endl;
       return EXIT_FAILURE;
     }
+  }else if( AnalysisEnsemble::is_ensemble_request( drf ) )
+  {
+    try
+    {
+      ensemble_drfs = AnalysisEnsemble::candidate_drfs( inputspec, drf );
+    }catch( std::exception &e )
+    {
+      cerr << e.what() << endl;
+      return EXIT_FAILURE;
+    }
   }else
   {
     bool found = false;
@@ -302,6 +347,49 @@ int run_analysis( vector<string> args )
   }//if( !drf.empty() && !SpecUtils::iequals_ascii(drf,"auto") )
   
   
+  if( all_samples )
+  {
+    if( drf.empty() || AnalysisEnsemble::is_ensemble_request(drf) )
+    {
+      cerr << "DRF ensembles are not supported with --all-samples; please specify the detector"
+           << " response function to use via the 'drf' option." << endl;
+      return EXIT_FAILURE;
+    }
+    
+    Analysis::AnalysisInput base;
+    base.ana_number = 0;
+    base.drf_folder = drf;
+    base.analysis_type = Analysis::AnalysisType::Simple;
+    
+    vector<AnalysisBatch::SampleResult> results;
+    try
+    {
+      results = AnalysisBatch::analyze_samples( base, samples );
+    }catch( std::exception &e )
+    {
+      cerr << e.what() << endl;
+      return EXIT_FAILURE;
+    }
+    
+    bool any_failed = false;
+    for( const AnalysisBatch::SampleResult &result : results )
+    {
+      const Analysis::AnalysisOutput &out = result.output;
+      any_failed |= ((out.gadras_intialization_error < 0) || (out.gadras_analysis_error < 0));
+      
+      if( SpecUtils::iequals_ascii(output, "brief") )
+        cout << "Sample " << result.sample_number << ": " << out.briefTxtSummary() << endl;
+      else if( SpecUtils::iequals_ascii(output, "standard") )
+        cout << "Sample " << result.sample_number << ":\n" << out.fullTxtSummary() << "\n" << endl;
+    }//for( const AnalysisBatch::SampleResult &result : results )
+    
+    if( SpecUtils::iequals_ascii(output, "json") )
+      cout << EngineJson::serialize( AnalysisBatch::to_json(results) ) << endl;
+    
+    return any_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+  }//if( all_samples )
+  
+  
   Analysis::AnalysisInput anainput;
   anainput.ana_number = 0;//
   //anainput.wt_app_id = "";
@@ -322,20 +410,28 @@ int run_analysis( vector<string> args )
   std::mutex ana_mutex;
   std::condition_variable ana_cv;
   Analysis::AnalysisOutput result;
+  bool ana_done = false;
   
-  anainput.callback = [&ana_mutex,&ana_cv,&result]( Analysis::AnalysisOutput output ){
+  anainput.callback = [&ana_mutex,&ana_cv,&result,&ana_done]( Analysis::AnalysisOutput output ){
     {
       std::unique_lock<std::mutex> lock( ana_mutex );
       result = output;
+      ana_done = true;
     }
     ana_cv.notify_all();
   };// inputspec.callback definition
   
-  {// begin lock on ana_mutex
+  {// begin wait for analysis
+    // An ensemble whose candidates all fail to be queued calls the callback before
+    //  post_analysis returns, so we cant hold ana_mutex while posting.
+    if( ensemble_drfs.empty() )
+      Analysis::post_analysis( anainput );
+    else
+      AnalysisEnsemble::post_analysis( anainput, ensemble_drfs );
+    
     std::unique_lock<std::mutex> lock( ana_mutex );
-    Analysis::post_analysis( anainput );
-    ana_cv.wait( lock );
-  }// end lock on ana_mutex
+    ana_cv.wait( lock, [&ana_done](){ return ana_done; } );
+  }// end wait for analysis
   
   
   // once we're here, the analysis should be done.
@@ -347,7 +443,7 @@ int run_analysis( vector<string> args )
     cout << result.fullTxtSummary() << endl;
   }else if( SpecUtils::iequals_ascii(output, "json") )
   {
-    cout << Json::serialize(result.toJson()) << endl;
+    cout << EngineJson::serialize(result.toJson()) << endl;
   }else
   {
     assert( 0 );
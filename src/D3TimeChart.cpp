@@ -188,11 +188,19 @@ void D3TimeChart::setData( std::shared_ptr<const SpecUtils::SpecFile> data )
 
 void D3TimeChart::setDataToClient()
 {
-  if( !m_spec )
-  {
-    doJavaScript( m_jsgraph +  ".setData( null );" );
-    return;
-  }//if( !m_spec )
+  const string data = timeDataJson( m_spec, m_gammaLineColor, m_neutronLineColor, m_occLineColor );
+  
+  doJavaScript( m_jsgraph + ".setData( " + (data.empty() ? string("null") : data) + " );" );
+}//void setDataToClient()
+
+
+std::string D3TimeChart::timeDataJson( std::shared_ptr<const SpecUtils::SpecFile> spec,
+                                       const Wt::WColor &gammaLineColor,
+                                       const Wt::WColor &neutronLineColor,
+                                       const Wt::WColor &occLineColor )
+{
+  if( !spec )
+    return "";
   
   /** Description of JSON format sent to client JS charting
    {
@@ -302,8 +310,8 @@ void D3TimeChart::setDataToClient()
   map<string,bool> hasGamma, hasNuetron;
   map<string,vector<double>> gammaCounts, neutronCounts, liveTimes;  //maps from detector name to counts
   
-  const set<int> &sample_numbers = m_spec->sample_numbers();
-  const vector<string> &detNames = m_spec->detector_names();
+  const set<int> &sample_numbers = spec->sample_numbers();
+  const vector<string> &detNames = spec->detector_names();
 
   // A hack for FullSpectrum.  We'll make sure background doesnt take up too much space.
   double backgroundTime = 0.0, totalTime = 0.0;
@@ -313,7 +321,7 @@ void D3TimeChart::setDataToClient()
     SpecUtils::SourceType sourcetype = SpecUtils::SourceType::Unknown;
     for( const string &detName : detNames )
     {
-      const auto m = m_spec->measurement( sample_num, detName );
+      const auto m = spec->measurement( sample_num, detName );
       if( !m )
         continue;
       realTime = std::max( realTime, m->real_time() );
@@ -343,7 +351,7 @@ void D3TimeChart::setDataToClient()
     
     for( const string &detName : detNames )
     {
-      const auto m = m_spec->measurement( sample_num, detName );
+      const auto m = spec->measurement( sample_num, detName );
       
       if( !m )
       {
@@ -389,7 +397,7 @@ void D3TimeChart::setDataToClient()
         std::get<1>(coords) = m->latitude();
         std::get<2>(coords) = m->position_time();
       }
-    }//for( const string &name : m_spec->detector_names() )
+    }//for( const string &name : spec->detector_names() )
     
     // FullSpectrum specific hack
     // Make sure the background wont take up more than 20% of the timeline.
@@ -456,10 +464,7 @@ void D3TimeChart::setDataToClient()
   }
   
   if( !numSamples )
-  {
-    doJavaScript( m_jsgraph +  ".setData( null );" );
-    return;
-  }//if( !numSamples )
+    return "";
   
   const char jssep[] = { '[', ',' };
   
@@ -484,7 +489,7 @@ void D3TimeChart::setDataToClient()
   
   
   WStringStream js;
-  js << m_jsgraph <<  ".setData( {\n";
+  js << "{\n";
   
   js << "\t\"realTimes\": ";
   printNumberArray( js, realTimes );
@@ -549,7 +554,7 @@ void D3TimeChart::setDataToClient()
       //For now we'll just make all detector lines the same color (if we are even doing multiple lines)
       js << string(nwrote++ ? "," : ",\n\t\"gammaCounts\": [" )
          << "\n\t\t{\"detName\": \"" << detName << "\", \"color\": \""
-         << (m_gammaLineColor.isDefault() ? string("#cfced2") :  m_gammaLineColor.cssText())
+         << (gammaLineColor.isDefault() ? string("#cfced2") :  gammaLineColor.cssText())
          << "\", \"counts\": ";
       
       const auto &counts = gammaCounts[detName];
@@ -575,7 +580,7 @@ void D3TimeChart::setDataToClient()
       //For now we'll just make all detector lines the same color (if we are even doing multiple lines)
       js << string(nwrote++ ? "," : ",\n\t\"neutronCounts\": [" ) << "\n\t\t{\"detName\": \""
          << detName << "\", \"color\": \""
-         << (m_neutronLineColor.isDefault() ? string("rgb(0,128,0)") :  m_neutronLineColor.cssText())
+         << (neutronLineColor.isDefault() ? string("rgb(0,128,0)") :  neutronLineColor.cssText())
          << "\", \"counts\": ";
 
       const auto &counts = neutronCounts[detName];
@@ -597,7 +602,7 @@ void D3TimeChart::setDataToClient()
     if( haveAnyGamma )
     {
       js << ",\n\t\"gammaCounts\": [{\"detName\": \"\", \"color\": \""
-         << (m_gammaLineColor.isDefault() ? string("#cfced2") :  m_gammaLineColor.cssText())
+         << (gammaLineColor.isDefault() ? string("#cfced2") :  gammaLineColor.cssText())
          << "\",\n\t\t\"counts\": [";
       
       for( size_t i = 0; i < numSamples; ++i )
@@ -663,7 +668,7 @@ void D3TimeChart::setDataToClient()
     if( haveAnyNeutron )
     {
       js << ",\n\t\"neutronCounts\": [{\"detName\": \"\", \"color\": \""
-         << (m_neutronLineColor.isDefault() ? string("#cfced2") :  m_neutronLineColor.cssText())
+         << (neutronLineColor.isDefault() ? string("#cfced2") :  neutronLineColor.cssText())
          << "\", \"counts\": [";
       
       vector<double> neutronLiveTimes( numSamples, std::numeric_limits<double>::quiet_NaN() );
@@ -698,7 +703,7 @@ void D3TimeChart::setDataToClient()
     }//if( haveAnyNeutron )
   }//if( plotDetectorsSeperate ) / else
   
-  auto occRanges = sampleNumberRangesWithOccupancyStatus( SpecUtils::OccupancyStatus::Occupied, m_spec );
+  auto occRanges = sampleNumberRangesWithOccupancyStatus( SpecUtils::OccupancyStatus::Occupied, spec );
   if( occRanges.size() )
   {
     js << ",\n\t\"occupancies\": [";
@@ -708,18 +713,18 @@ void D3TimeChart::setDataToClient()
          << "{ startSample: " << occRanges[i].first
          << ", endSample: " << occRanges[i].second
          << ", color: \""
-         << (m_occLineColor.isDefault() ? string("rgb(128,128,128)") :  m_occLineColor.cssText())
+         << (occLineColor.isDefault() ? string("rgb(128,128,128)") :  occLineColor.cssText())
          << "\" }";
     }//for( size_t i = 0; i < occRanges.size(); ++i )
     js << "\n\t]";
   }//if( occRanges.size() )
   
-  js << "\n\t} );";
+  js << "\n\t}";
   
   //cout << "\n\nWill set time data with JSON=" + js.str() + "\n\n" << endl;
 
-  doJavaScript( js.str() );
-}//void setDataToClient()
+  return js.str();
+}//std::string timeDataJson(...)
 
 
 void D3TimeChart::setHighlightedIntervals( const std::set<int> &sample_numbers,
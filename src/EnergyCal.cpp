@@ -26,14 +26,19 @@
 
 #include <map>
 #include <set>
+#include <array>
 #include <deque>
+#include <mutex>
+#include <atomic>
 #include <limits>
 #include <vector>
 #include <numeric>
 #include <cassert>
 #include <sstream>
 #include <iostream>
+#include <algorithm>
 #include <stdexcept>
+#include <unordered_map>
 
 #define BOOST_UBLAS_TYPE_CHECK 0
 #include <boost/numeric/ublas/lu.hpp>
@@ -332,6 +337,501 @@ double fit_from_channel_energies_imp( const size_t ncoeffs, const vector<float>
   return avrgdiffs / nenergies;
 }//fit_from_channel_energies_imp
 
+
+/** Polynomial basis term, as a functor so the fixed-size fits below get it inlined, rather than
+ calling through a std::function for every matrix element.
+ */
+struct PolyBasis
+{
+  static inline double eval( const size_t order, const double channel, const size_t nchannel )
+  {
+    double answer = 1.0;
+    for( size_t i = 0; i < order; ++i )
+      answer *= channel;
+    return answer;
+  }
+};//struct PolyBasis
+
+
+/** Full range fraction basis term; see #frf_coef_fcn. */
+struct FrfBasis
+{
+  static inline double eval( const size_t order, const double channel, const size_t nchannel )
+  {
+    const double x = channel / nchannel;
+    if( order == 4 )
+      return 1.0 / (1.0 + 60.0*x);
+
+    double answer = 1.0;
+    for( size_t i = 0; i < order; ++i )
+      answer *= x;
+    return answer;
+  }
+};//struct FrfBasis
+
+
+/** Checks the inputs to the energy calibration fits, throwing exception with same messages as
+ #fit_energy_cal_imp if there is a problem.
+
+ @returns the number of parameters being fit for.
+ */
+size_t check_fit_energy_cal_input( const std::vector<EnergyCal::RecalPeakInfo> &peakinfos,
+                                   const std::vector<bool> &fitfor,
+                                   const std::vector<float> &coefs )
+{
+  const size_t npeaks = peakinfos.size();
+  const size_t nparsfit = static_cast<size_t>( std::count(begin(fitfor),end(fitfor),true) );
+
+  if( npeaks < 1 )
+    throw runtime_error( "Must have at least one peak" );
+
+  if( nparsfit < 1 )
+    throw runtime_error( "Must fit for at least one coefficient" );
+
+  if( nparsfit > npeaks )
+    throw runtime_error( "Must have at least as many peaks as coefficients fitting for" );
+
+  if( (nparsfit != fitfor.size()) && (coefs.size() != fitfor.size()) )
+    throw runtime_error( "You must supply input coefficient when any of the coefficients are fixed" );
+
+  return nparsfit;
+}//check_fit_energy_cal_input(...)
+
+
+/** Solves the NxN symmetric positive-definite system alpha*a = beta using a Cholesky
+ decomposition, and also computes the diagonal of alpha^-1 (i.e., the parameter variances).
+
+ To keep things well conditioned, even for polynomial terms like channel^3 with 64k channels, the
+ system is first scaled so the diagonal of alpha is unity (i.e., Jacobi preconditioning), and then
+ the answer is scaled back.
+
+ @returns false if the matrix is not positive definite (e.g., degenerate peaks), in which case the
+          caller should fall back to the general LU based solution.
+ */
+template<size_t N>
+bool cholesky_solve( const double (&alpha)[N][N], const double (&beta)[N],
+                     double (&a)[N], double (&variance)[N] )
+{
+  double scale[N];
+  for( size_t i = 0; i < N; ++i )
+  {
+    if( !(alpha[i][i] > 0.0) || std::isinf(alpha[i][i]) )
+      return false;
+    scale[i] = 1.0 / std::sqrt( alpha[i][i] );
+  }
+
+  // Decompose scaled alpha into L*L^T, with L lower triangular
+  double L[N][N] = {};
+  for( size_t j = 0; j < N; ++j )
+  {
+    double diag = alpha[j][j]*scale[j]*scale[j];
+    for( size_t k = 0; k < j; ++k )
+      diag -= L[j][k]*L[j][k];
+
+    if( !(diag > std::numeric_limits<double>::epsilon()) )
+      return false;
+
+    L[j][j] = std::sqrt( diag );
+
+    for( size_t i = j + 1; i < N; ++i )
+    {
+      double val = alpha[i][j]*scale[i]*scale[j];
+      for( size_t k = 0; k < j; ++k )
+        val -= L[i][k]*L[j][k];
+      L[i][j] = val / L[j][j];
+    }
+  }//for( size_t j = 0; j < N; ++j )
+
+  // Forward substitution for L*y = scaled beta
+  double y[N];
+  for( size_t i = 0; i < N; ++i )
+  {
+    double val = beta[i]*scale[i];
+    for( size_t k = 0; k < i; ++k )
+      val -= L[i][k]*y[k];
+    y[i] = val / L[i][i];
+  }
+
+  // Back substitution for L^T*z = y, and then un-scale
+  for( size_t ii = N; ii > 0; --ii )
+  {
+    const size_t i = ii - 1;
+    double val = y[i];
+    for( size_t k = i + 1; k < N; ++k )
+      val -= L[k][i]*a[k];
+    a[i] = val / L[i][i];
+  }
+
+  // Invert L, so (L*L^T)^-1 = Linv^T * Linv, who's diagonal is the column sums of Linv squared
+  double Linv[N][N] = {};
+  for( size_t j = 0; j < N; ++j )
+  {
+    Linv[j][j] = 1.0 / L[j][j];
+    for( size_t i = j + 1; i < N; ++i )
+    {
+      double val = 0.0;
+      for( size_t k = j; k < i; ++k )
+        val -= L[i][k]*Linv[k][j];
+      Linv[i][j] = val / L[i][i];
+    }
+  }//for( size_t j = 0; j < N; ++j )
+
+  for( size_t i = 0; i < N; ++i )
+  {
+    double var = 0.0;
+    for( size_t k = i; k < N; ++k )
+      var += Linv[k][i]*Linv[k][i];
+
+    a[i] *= scale[i];
+    variance[i] = var*scale[i]*scale[i];
+  }
+
+  return true;
+}//cholesky_solve(...)
+
+
+/** Same computation as #fit_energy_cal_imp, but for a compile-time known number of fit parameters
+ (the energy calibrations we fit for are 1 to 4 parameters), so we can accumulate the normal
+ equations directly into stack arrays, with inlined basis functions, and solve with Cholesky rather
+ than building dynamically sized ublas matrices and doing a general inverse.
+
+ Input is assumed to have already been checked by #check_fit_energy_cal_input.
+
+ @returns false if the system couldnt be solved, in which case 'coefs' and 'coefs_uncert' are not
+          modified, and the general solution should be used.
+ */
+template<size_t N, class Basis>
+bool fit_energy_cal_fixed( const std::vector<EnergyCal::RecalPeakInfo> &peakinfos,
+                           const std::vector<bool> &fitfor,
+                           const size_t nchannels,
+                           const std::vector<std::pair<float,float>> &dev_pairs,
+                           std::vector<float> &coefs,
+                           std::vector<float> &coefs_uncert,
+                           double &chi2 )
+{
+  const size_t npeaks = peakinfos.size();
+  const size_t ncoefs = fitfor.size();
+
+  assert( static_cast<size_t>(std::count(begin(fitfor),end(fitfor),true)) == N );
+
+  double alpha[N][N] = {}, beta[N] = {};
+
+  for( size_t row = 0; row < npeaks; ++row )
+  {
+    // Keep same float precision as fit_energy_cal_imp so answers are equivalent
+    const float mean_bin = static_cast<float>( peakinfos[row].peakMeanBinNumber );
+    const float true_energy = static_cast<float>( peakinfos[row].photopeakEnergy );
+    const float energy_uncert = static_cast<float>( true_energy * peakinfos[row].peakMeanUncert
+                                                  / std::max(peakinfos[row].peakMean,1.0) );
+    const double data_y_uncert = fabs( energy_uncert );
+
+    double data_y = true_energy;
+    data_y -= SpecUtils::correction_due_to_dev_pairs( true_energy, dev_pairs );
+
+    double A_row[N];
+    for( size_t col = 0, coef_index = 0; coef_index < ncoefs; ++coef_index )
+    {
+      const double basis = Basis::eval( coef_index, mean_bin, nchannels );
+      if( fitfor[coef_index] )
+        A_row[col++] = basis / data_y_uncert;
+      else
+        data_y -= coefs[coef_index] * basis;
+    }//for( loop over coefficients )
+
+    const double b = data_y / data_y_uncert;
+
+    for( size_t i = 0; i < N; ++i )
+    {
+      beta[i] += A_row[i] * b;
+      for( size_t j = 0; j <= i; ++j )
+        alpha[i][j] += A_row[i] * A_row[j];
+    }
+  }//for( size_t row = 0; row < npeaks; ++row )
+
+  for( size_t i = 0; i < N; ++i )
+    for( size_t j = i + 1; j < N; ++j )
+      alpha[i][j] = alpha[j][i];
+
+  double a[N], variance[N];
+  if( !cholesky_solve<N>( alpha, beta, a, variance ) )
+    return false;
+
+  coefs.resize( ncoefs, 0.0 );
+  coefs_uncert.resize( ncoefs, 0.0 );
+
+  for( size_t col = 0, coef_index = 0; coef_index < ncoefs; ++coef_index )
+  {
+    if( fitfor[coef_index] )
+    {
+      coefs[coef_index] = static_cast<float>( a[col] );
+      coefs_uncert[coef_index] = static_cast<float>( std::sqrt( variance[col] ) );
+      ++col;
+    }else
+    {
+      coefs_uncert[coef_index] = 0.0;
+    }
+  }//for( loop over coefficients )
+
+  chi2 = 0.0;
+  for( size_t row = 0; row < npeaks; ++row )
+  {
+    const float mean_bin = static_cast<float>( peakinfos[row].peakMeanBinNumber );
+    const float true_energy = static_cast<float>( peakinfos[row].photopeakEnergy );
+    const float energy_uncert = static_cast<float>( true_energy * peakinfos[row].peakMeanUncert
+                                                  / std::max(peakinfos[row].peakMean,1.0) );
+    double y_pred = 0.0;
+    for( size_t i = 0; i < ncoefs; ++i )
+      y_pred += coefs[i] * Basis::eval( i, mean_bin, nchannels );
+    y_pred += SpecUtils::deviation_pair_correction( y_pred, dev_pairs );
+
+    const double resid = (y_pred - true_energy) / energy_uncert;
+    chi2 += resid*resid;
+  }//for( size_t row = 0; row < npeaks; ++row )
+
+  return true;
+}//fit_energy_cal_fixed(...)
+
+
+/** Dispatches to #fit_energy_cal_fixed when fitting for four or fewer parameters, falling back to
+ #fit_energy_cal_imp for larger systems, or if the Cholesky decomposition fails.
+ */
+template<class Basis>
+double fit_energy_cal_dispatch( const std::vector<EnergyCal::RecalPeakInfo> &peakinfos,
+                                const std::vector<bool> &fitfor,
+                                const size_t nchannels,
+                                const std::vector<std::pair<float,float>> &dev_pairs,
+                                std::vector<float> &coefs,
+                                std::vector<float> &coefs_uncert,
+                                std::function<double(size_t,double,size_t)> coeffcn )
+{
+  const size_t nparsfit = check_fit_energy_cal_input( peakinfos, fitfor, coefs );
+
+#if( PERFORM_DEVELOPER_CHECKS )
+  const vector<float> orig_coefs = coefs;
+#endif
+
+  bool fit_fixed = false;
+  double chi2 = 0.0;
+
+  switch( nparsfit )
+  {
+    case 1:
+      fit_fixed = fit_energy_cal_fixed<1,Basis>( peakinfos, fitfor, nchannels, dev_pairs, coefs, coefs_uncert, chi2 );
+      break;
+    case 2:
+      fit_fixed = fit_energy_cal_fixed<2,Basis>( peakinfos, fitfor, nchannels, dev_pairs, coefs, coefs_uncert, chi2 );
+      break;
+    case 3:
+      fit_fixed = fit_energy_cal_fixed<3,Basis>( peakinfos, fitfor, nchannels, dev_pairs, coefs, coefs_uncert, chi2 );
+      break;
+    case 4:
+      fit_fixed = fit_energy_cal_fixed<4,Basis>( peakinfos, fitfor, nchannels, dev_pairs, coefs, coefs_uncert, chi2 );
+      break;
+    default:
+      break;
+  }//switch( nparsfit )
+
+  if( !fit_fixed )
+    return fit_energy_cal_imp( peakinfos, fitfor, nchannels, dev_pairs, coefs, coefs_uncert, coeffcn );
+
+#if( PERFORM_DEVELOPER_CHECKS )
+  // Make sure the fixed-size solution agrees with the general solution
+  try
+  {
+    vector<float> check_coefs = orig_coefs, check_uncerts;
+    const double check_chi2 = fit_energy_cal_imp( peakinfos, fitfor, nchannels, dev_pairs,
+                                                  check_coefs, check_uncerts, coeffcn );
+
+    const auto too_different = []( const double lhs, const double rhs, const double tol ) -> bool {
+      const double diff = fabs( lhs - rhs );
+      return (diff > 1.0E-4*std::max(fabs(lhs),fabs(rhs))) && (diff > tol);
+    };
+
+    // Poorly constrained coefficients (e.g., an offset of 0.005 +- 150 keV) can legitimately
+    //  differ between the two solutions, so we only compare them to within a fraction of their
+    //  uncertainty; we also only care if the fixed-size solution has a worse chi2.
+    bool mismatch = (chi2 > (check_chi2 + 1.0E-3*check_chi2 + 1.0E-3));
+    for( size_t i = 0; i < coefs.size(); ++i )
+      mismatch |= (too_different( coefs[i], check_coefs[i], 1.0E-3*check_uncerts[i] + 1.0E-9 )
+                   || too_different( coefs_uncert[i], check_uncerts[i], 1.0E-9 ));
+
+    if( mismatch )
+    {
+      char buffer[256];
+      snprintf( buffer, sizeof(buffer), "Fixed size energy calibration fit with %i parameters"
+               " gave different answer than general fit (chi2 %f vs %f)",
+               static_cast<int>(nparsfit), chi2, check_chi2 );
+      log_developer_error( __func__, buffer );
+    }
+  }catch( std::exception &e )
+  {
+    log_developer_error( __func__, (string("General fit failed where fixed-size succeeded: ") + e.what()).c_str() );
+  }//try / catch
+#endif
+
+  return chi2;
+}//fit_energy_cal_dispatch(...)
+
+
+/** The deviation pair correction, as a function of (uncorrected) energy, represented as a cubic
+ for each interval between deviation pairs, so it can be applied to many channels without
+ evaluating the deviation pair spline for each one.
+ */
+struct DevPairCubics
+{
+  /** The lower energy of each interval. */
+  vector<double> lower_energies;
+  /** One over the width of each interval. */
+  vector<double> inv_widths;
+  /** For each interval, the correction is c[0] + t*(c[1] + t*(c[2] + t*c[3])), where
+   t = (energy - lower_energy) / width.
+   */
+  vector<array<double,4>> coefs;
+};//struct DevPairCubics
+
+
+/** Creates the cubic representation of the deviation pair correction over the energy range
+ [min_energy, max_energy], by evaluating #SpecUtils::deviation_pair_correction at four points in
+ each interval between deviation pairs.
+
+ The correction is checked at a few other points in each interval, and if it isnt described to
+ within a small fraction of a keV (i.e., its not actually piecewise cubic over the range), false is
+ returned and the caller should evaluate the correction for every channel instead.
+ */
+bool make_dev_pair_cubics( const vector<pair<float,float>> &dev_pairs,
+                           const double min_energy, const double max_energy,
+                           DevPairCubics &answer )
+{
+  answer = DevPairCubics{};
+
+  if( IsNan(min_energy) || IsNan(max_energy) || IsInf(min_energy) || IsInf(max_energy) )
+    return false;
+
+  vector<double> knots;
+  knots.push_back( min_energy );
+  for( const auto &dp : dev_pairs )
+  {
+    if( (dp.first > min_energy) && (dp.first < max_energy) )
+      knots.push_back( dp.first );
+  }
+  knots.push_back( max_energy );
+
+  std::sort( begin(knots), end(knots) );
+  knots.erase( std::unique( begin(knots), end(knots) ), end(knots) );
+
+  if( knots.size() < 2 )
+    knots.push_back( min_energy + 1.0 );
+
+  const double t1 = 1.0/3.0, t2 = 2.0/3.0;
+
+  for( size_t i = 0; (i + 1) < knots.size(); ++i )
+  {
+    const double lower = knots[i];
+    const double width = knots[i+1] - knots[i];
+    const auto correction = [&]( const double t ) -> double {
+      return SpecUtils::deviation_pair_correction( lower + t*width, dev_pairs );
+    };
+
+    // Newton divided differences for nodes at t = {0, 1/3, 2/3, 1}, then convert to monomials.
+    const double f0 = correction( 0.0 ), f1 = correction( t1 );
+    const double f2 = correction( t2 ), f3 = correction( 1.0 );
+    const double d01 = (f1 - f0) / t1, d12 = (f2 - f1) / (t2 - t1), d23 = (f3 - f2) / (1.0 - t2);
+    const double d012 = (d12 - d01) / t2, d123 = (d23 - d12) / (1.0 - t1);
+    const double d0123 = (d123 - d012) / 1.0;
+
+    array<double,4> c;
+    c[0] = f0;
+    c[1] = d01 - d012*t1 + d0123*t1*t2;
+    c[2] = d012 - d0123*(t1 + t2);
+    c[3] = d0123;
+
+    for( const double t : {1.0/6.0, 0.5, 5.0/6.0} )
+    {
+      const double exact = correction( t );
+      const double approx = c[0] + t*(c[1] + t*(c[2] + t*c[3]));
+      if( IsNan(approx) || (fabs(exact - approx) > std::max(0.001, 1.0E-5*fabs(exact))) )
+        return false;
+    }
+
+    answer.lower_energies.push_back( lower );
+    answer.inv_widths.push_back( 1.0 / width );
+    answer.coefs.push_back( c );
+  }//for( loop over intervals )
+
+  return true;
+}//make_dev_pair_cubics(...)
+
+
+/** The pool of calibrations for #EnergyCal::intern_energy_cal, keyed by #energy_cal_hash. */
+std::mutex ns_intern_mutex;
+std::unordered_multimap<size_t,std::weak_ptr<const SpecUtils::EnergyCalibration>> ns_intern_pool;
+/** The calibrations in #ns_intern_pool, keyed by address, so a calibration that is already pooled
+ is found without hashing it (an address may be reused once the calibration is gone, so the
+ weak_ptr must still point to the same object).
+ */
+std::unordered_map<const SpecUtils::EnergyCalibration *,std::weak_ptr<const SpecUtils::EnergyCalibration>> ns_intern_pooled_ptrs;
+size_t ns_intern_inserts_since_purge = 0;
+
+std::atomic<size_t> ns_intern_lookups( 0 );
+std::atomic<size_t> ns_intern_merged( 0 );
+std::atomic<size_t> ns_rebins_skipped( 0 );
+
+
+template<class T>
+void hash_combine( size_t &seed, const T &value )
+{
+  seed ^= std::hash<T>()(value) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+}
+
+
+size_t energy_cal_hash( const SpecUtils::EnergyCalibration &cal )
+{
+  size_t seed = 0;
+  hash_combine( seed, static_cast<int>(cal.type()) );
+  hash_combine( seed, cal.num_channels() );
+
+  if( cal.type() == SpecUtils::EnergyCalType::LowerChannelEdge )
+  {
+    if( cal.channel_energies() )
+    {
+      for( const float energy : *cal.channel_energies() )
+        hash_combine( seed, energy );
+    }
+  }else
+  {
+    for( const float coef : cal.coefficients() )
+      hash_combine( seed, coef );
+  }
+
+  for( const auto &dp : cal.deviation_pairs() )
+  {
+    hash_combine( seed, dp.first );
+    hash_combine( seed, dp.second );
+  }
+
+  return seed;
+}//energy_cal_hash(...)
+
+
+bool energy_cals_equal( const SpecUtils::EnergyCalibration &lhs,
+                        const SpecUtils::EnergyCalibration &rhs )
+{
+  if( (lhs.type() != rhs.type())
+     || (lhs.num_channels() != rhs.num_channels())
+     || (lhs.deviation_pairs() != rhs.deviation_pairs()) )
+    return false;
+
+  if( lhs.type() != SpecUtils::EnergyCalType::LowerChannelEdge )
+    return (lhs.coefficients() == rhs.coefficients());
+
+  const auto &lhs_energies = lhs.channel_energies();
+  const auto &rhs_energies = rhs.channel_energies();
+  if( !lhs_energies || !rhs_energies )
+    return (lhs_energies == rhs_energies);
+
+  return (*lhs_energies == *rhs_energies);
+}//energy_cals_equal(...)
+
 }//namespace
 
 
@@ -345,7 +845,7 @@ double EnergyCal::fit_energy_cal_frf( const std::vector<EnergyCal::RecalPeakInfo
                                       std::vector<float> &coefs,
                                       std::vector<float> &uncert )
 {
-  return fit_energy_cal_imp( peaks, fitfor, nchannels, dev_pairs, coefs, uncert, &frf_coef_fcn );
+  return fit_energy_cal_dispatch<FrfBasis>( peaks, fitfor, nchannels, dev_pairs, coefs, uncert, &frf_coef_fcn );
 }
 
 
@@ -356,10 +856,23 @@ double EnergyCal::fit_energy_cal_poly( const std::vector<EnergyCal::RecalPeakInf
                             vector<float> &coefs,
                             vector<float> &uncert )
 {
-  return fit_energy_cal_imp( peaks, fitfor, nchannels, dev_pairs, coefs, uncert, &poly_coef_fcn );
+  return fit_energy_cal_dispatch<PolyBasis>( peaks, fitfor, nchannels, dev_pairs, coefs, uncert, &poly_coef_fcn );
 }//double fit_energy_cal_poly(...)
 
 
+double EnergyCal::fit_energy_cal_general( const bool is_frf,
+                                          const std::vector<EnergyCal::RecalPeakInfo> &peaks,
+                                          const std::vector<bool> &fitfor,
+                                          const size_t nchannels,
+                                          const std::vector<std::pair<float,float>> &dev_pairs,
+                                          std::vector<float> &coefs,
+                                          std::vector<float> &uncert )
+{
+  return fit_energy_cal_imp( peaks, fitfor, nchannels, dev_pairs, coefs, uncert,
+                             (is_frf ? &frf_coef_fcn : &poly_coef_fcn) );
+}//double fit_energy_cal_general(...)
+
+
 double EnergyCal::fit_poly_from_channel_energies( const size_t ncoeffs,
                                              const std::vector<float> &channel_energies,
                                              std::vector<float> &coefs )
@@ -381,6 +894,416 @@ double EnergyCal::fit_full_range_fraction_from_channel_energies( const size_t nc
 }//fit_full_range_fraction_from_channel_energies(...)
 
 
+void EnergyCal::evaluate_channel_energies( const SpecUtils::EnergyCalType type,
+                                           const std::vector<float> &coefs,
+                                           const size_t nchannel,
+                                           const std::vector<std::pair<float,float>> &dev_pairs,
+                                           const std::vector<double> &channels,
+                                           std::vector<float> &energies )
+{
+  using namespace SpecUtils;
+
+  const size_t npoints = channels.size();
+  vector<double> values( npoints, 0.0 );
+  double * const vals = values.data();
+
+  // We'll evaluate the equations using Horner's method, looping over all the channels for each
+  //  coefficient, which gives simple loops over contiguous arrays the compiler can vectorize.
+  switch( type )
+  {
+    case EnergyCalType::Polynomial:
+    case EnergyCalType::UnspecifiedUsingDefaultPolynomial:
+    {
+      const double * const x = channels.data();
+      for( size_t order = coefs.size(); order > 0; --order )
+      {
+        const double c = coefs[order - 1];
+        for( size_t i = 0; i < npoints; ++i )
+          vals[i] = vals[i]*x[i] + c;
+      }
+      break;
+    }//case Polynomial
+
+    case EnergyCalType::FullRangeFraction:
+    {
+      if( nchannel < 1 )
+        throw runtime_error( "evaluate_channel_energies: full range fraction must have at least one channel" );
+
+      const double inv_nchannel = 1.0 / static_cast<double>( nchannel );
+      vector<double> fractions( npoints );
+      double * const x = fractions.data();
+      for( size_t i = 0; i < npoints; ++i )
+        x[i] = channels[i] * inv_nchannel;
+
+      for( size_t order = std::min( coefs.size(), size_t(4) ); order > 0; --order )
+      {
+        const double c = coefs[order - 1];
+        for( size_t i = 0; i < npoints; ++i )
+          vals[i] = vals[i]*x[i] + c;
+      }
+
+      if( coefs.size() > 4 )
+      {
+        const double c = coefs[4];
+        for( size_t i = 0; i < npoints; ++i )
+          vals[i] += c / (1.0 + 60.0*x[i]);
+      }
+      break;
+    }//case FullRangeFraction
+
+    case EnergyCalType::LowerChannelEdge:
+    case EnergyCalType::InvalidEquationType:
+      throw runtime_error( "evaluate_channel_energies: invalid energy calibration type" );
+  }//switch( type )
+
+  energies.resize( npoints );
+
+  if( dev_pairs.empty() || !npoints )
+  {
+    for( size_t i = 0; i < npoints; ++i )
+      energies[i] = static_cast<float>( vals[i] );
+    return;
+  }//if( dev_pairs.empty() || !npoints )
+
+  const auto minmax = std::minmax_element( begin(values), end(values) );
+  DevPairCubics cubics;
+  if( !make_dev_pair_cubics( dev_pairs, *minmax.first, *minmax.second, cubics ) )
+  {
+    // Shouldnt happen, but if the deviation pair correction isnt piecewise cubic, fall back to
+    //  evaluating it for each channel.
+    for( size_t i = 0; i < npoints; ++i )
+      energies[i] = static_cast<float>( vals[i] + deviation_pair_correction( vals[i], dev_pairs ) );
+    return;
+  }//if( couldnt make cubics )
+
+  const vector<double> &lower_energies = cubics.lower_energies;
+  const size_t nintervals = lower_energies.size();
+  assert( nintervals > 0 );
+
+  size_t interval = 0;
+  for( size_t i = 0; i < npoints; ++i )
+  {
+    const double energy = vals[i];
+
+    // Walk the intervals forward as the energies increase; if the input channels arent sorted,
+    //  we'll search for the interval.
+    if( (interval > 0) && (energy < lower_energies[interval]) )
+    {
+      const auto pos = std::upper_bound( begin(lower_energies), end(lower_energies), energy );
+      interval = (pos == begin(lower_energies)) ? size_t(0) : static_cast<size_t>(pos - begin(lower_energies)) - 1;
+    }
+
+    while( ((interval + 1) < nintervals) && (energy >= lower_energies[interval + 1]) )
+      ++interval;
+
+    const array<double,4> &c = cubics.coefs[interval];
+    const double t = (energy - lower_energies[interval]) * cubics.inv_widths[interval];
+    energies[i] = static_cast<float>( energy + c[0] + t*(c[1] + t*(c[2] + t*c[3])) );
+  }//for( size_t i = 0; i < npoints; ++i )
+}//evaluate_channel_energies(...)
+
+
+std::vector<float> EnergyCal::batch_lower_channel_energies( const SpecUtils::EnergyCalType type,
+                                                const std::vector<float> &coefs,
+                                                const size_t nchannel,
+                                                const std::vector<std::pair<float,float>> &dev_pairs )
+{
+  if( nchannel < 1 )
+    throw runtime_error( "batch_lower_channel_energies: must have at least one channel" );
+
+  vector<double> channels( nchannel + 1 );
+  for( size_t i = 0; i <= nchannel; ++i )
+    channels[i] = static_cast<double>( i );
+
+  vector<float> energies;
+  evaluate_channel_energies( type, coefs, nchannel, dev_pairs, channels, energies );
+
+  for( size_t i = 1; i <= nchannel; ++i )
+  {
+    if( !(energies[i] > energies[i-1]) )
+      throw runtime_error( "batch_lower_channel_energies: channel energies are not increasing" );
+  }
+
+#if( PERFORM_DEVELOPER_CHECKS )
+  shared_ptr<const vector<float>> check;
+  if( type == SpecUtils::EnergyCalType::FullRangeFraction )
+    check = SpecUtils::fullrangefraction_binning( coefs, nchannel, dev_pairs, true );
+  else
+    check = SpecUtils::polynomial_binning( coefs, nchannel, dev_pairs );
+
+  if( !check || (check->size() != energies.size()) )
+  {
+    log_developer_error( __func__, "SpecUtils binning gave different number of channels" );
+  }else
+  {
+    for( size_t i = 0; i <= nchannel; ++i )
+    {
+      const double diff = fabs( (*check)[i] - energies[i] );
+      if( (diff > 0.001) && (diff > 1.0E-5*fabs((*check)[i])) )
+      {
+        char buffer[256];
+        snprintf( buffer, sizeof(buffer), "Batch channel energy %f for channel %i differs from"
+                 " SpecUtils value of %f", energies[i], static_cast<int>(i), (*check)[i] );
+        log_developer_error( __func__, buffer );
+        break;
+      }
+    }//for( size_t i = 0; i <= nchannel; ++i )
+  }
+#endif
+
+  return energies;
+}//batch_lower_channel_energies(...)
+
+
+
+
+EnergyCal::ReferencePeakScreen EnergyCal::locate_reference_peak( const std::vector<float> &energies,
+                                           const std::vector<float> &counts,
+                                           const double window_lower, const double window_upper,
+                                           const double wide_lower, const double wide_upper,
+                                           const double fwhm )
+{
+  ReferencePeakScreen answer;
+  answer.window_counts = answer.wide_counts = answer.net_counts = answer.significance = 0.0;
+  answer.centroid = std::numeric_limits<double>::quiet_NaN();
+  answer.searched = false;
+
+  const size_t nchannel = counts.size();
+  if( (nchannel < 1) || (energies.size() < (nchannel + 1)) )
+    throw runtime_error( "locate_reference_peak: inconsistent number of channels and energies" );
+
+  // Integrate both regions in a single pass over the channels that overlap either of them.
+  const double range_lower = std::min( window_lower, wide_lower );
+  const double range_upper = std::max( window_upper, wide_upper );
+  const auto first_iter = std::upper_bound( begin(energies), begin(energies) + nchannel + 1,
+                                            static_cast<float>(range_lower) );
+  const size_t first_channel = (first_iter == begin(energies)) ? size_t(0)
+                                : static_cast<size_t>(first_iter - begin(energies)) - 1;
+
+  // Channels entirely within the search window, that we will search for the peak in
+  size_t win_begin = nchannel, win_end = 0;
+
+  for( size_t i = first_channel; (i < nchannel) && (energies[i] < range_upper); ++i )
+  {
+    const double lower = energies[i], upper = energies[i+1];
+    const double width = upper - lower;
+    if( width <= 0.0 )
+      continue;
+
+    const double win_overlap = std::min(upper,window_upper) - std::max(lower,window_lower);
+    const double wide_overlap = std::min(upper,wide_upper) - std::max(lower,wide_lower);
+    answer.window_counts += counts[i] * std::max( 0.0, win_overlap ) / width;
+    answer.wide_counts += counts[i] * std::max( 0.0, wide_overlap ) / width;
+
+    if( (lower >= window_lower) && (upper <= window_upper) )
+    {
+      win_begin = std::min( win_begin, i );
+      win_end = i + 1;
+    }
+  }//for( loop over channels )
+
+  const size_t nwin = (win_end > win_begin) ? (win_end - win_begin) : size_t(0);
+  if( nwin < 10 )
+    return answer;
+
+  // Estimate a linear continuum from the outer tenth of the window on each side
+  const size_t nside = std::max( size_t(1), nwin / 10 );
+  double lower_side_counts = 0.0, upper_side_counts = 0.0;
+  for( size_t i = 0; i < nside; ++i )
+  {
+    lower_side_counts += counts[win_begin + i];
+    upper_side_counts += counts[win_end - 1 - i];
+  }
+
+  const double lower_side_mean = lower_side_counts / nside;
+  const double upper_side_mean = upper_side_counts / nside;
+  const double lower_side_index = 0.5*(nside - 1.0);
+  const double upper_side_index = (nwin - 1.0) - 0.5*(nside - 1.0);
+  const double continuum_slope = (upper_side_mean - lower_side_mean)
+                                 / (upper_side_index - lower_side_index);
+
+  vector<double> net( nwin ), continuum( nwin ), cumulative_net( nwin + 1, 0.0 );
+  for( size_t i = 0; i < nwin; ++i )
+  {
+    continuum[i] = lower_side_mean + continuum_slope*(i - lower_side_index);
+    net[i] = counts[win_begin + i] - continuum[i];
+  }
+
+  for( size_t i = 0; i < nwin; ++i )
+    cumulative_net[i+1] = cumulative_net[i] + net[i];
+
+  // Use the channel width in the middle of the window to get peak width in channels; the region
+  //  we sum is the center channel plus 'half_width' channels on either side, so about 'fwhm' wide.
+  const size_t mid_channel = win_begin + nwin/2;
+  const double channel_width = energies[mid_channel + 1] - energies[mid_channel];
+  const size_t half_width = std::max( size_t(1),
+                    static_cast<size_t>( std::round( fwhm / (2.0*std::max(channel_width, 1.0E-6)) ) ) );
+
+  // The peak region has to fit between the continuum regions
+  if( (nside + half_width) >= (nwin - nside - half_width) )
+    return answer;
+
+  answer.searched = true;
+
+  size_t best_center = 0;
+  double best_net = -std::numeric_limits<double>::infinity();
+  for( size_t center = nside + half_width; center < (nwin - nside - half_width); ++center )
+  {
+    const double roi_net = cumulative_net[center + half_width + 1] - cumulative_net[center - half_width];
+    if( roi_net > best_net )
+    {
+      best_net = roi_net;
+      best_center = center;
+    }
+  }//for( loop over candidate peak centers )
+
+  if( !(best_net > 0.0) )
+    return answer;
+
+  double gross = 0.0, continuum_sum = 0.0, energy_sum = 0.0, weight_sum = 0.0;
+  for( size_t i = best_center - half_width; i <= (best_center + half_width); ++i )
+  {
+    const size_t channel = win_begin + i;
+    const double energy = 0.5*(energies[channel] + energies[channel + 1]);
+    gross += counts[channel];
+    continuum_sum += continuum[i];
+    if( net[i] > 0.0 )
+    {
+      energy_sum += net[i] * energy;
+      weight_sum += net[i];
+    }
+  }//for( loop over peak region )
+
+  // Uncertainty of the continuum comes from the side regions it was estimated from
+  const double nroi = 2.0*half_width + 1.0;
+  const double variance = gross + continuum_sum*nroi/(2.0*nside);
+
+  answer.net_counts = best_net;
+  answer.centroid = (weight_sum > 0.0) ? (energy_sum / weight_sum) : answer.centroid;
+  answer.significance = (variance > 0.0) ? (best_net / std::sqrt(variance)) : 0.0;
+
+  return answer;
+}//locate_reference_peak(...)
+
+
+shared_ptr<const SpecUtils::EnergyCalibration>
+EnergyCal::intern_energy_cal( const shared_ptr<const SpecUtils::EnergyCalibration> &cal )
+{
+  if( !cal )
+    return nullptr;
+
+  ++ns_intern_lookups;
+
+  {// begin lock on ns_intern_mutex
+    std::lock_guard<std::mutex> lock( ns_intern_mutex );
+    const auto pos = ns_intern_pooled_ptrs.find( cal.get() );
+    if( (pos != end(ns_intern_pooled_ptrs)) && (pos->second.lock() == cal) )
+      return cal;
+  }// end lock on ns_intern_mutex
+
+  // Hashing may look at every channel energy, so we do it without holding the lock.
+  const size_t key = energy_cal_hash( *cal );
+
+  std::lock_guard<std::mutex> lock( ns_intern_mutex );
+
+  const auto range = ns_intern_pool.equal_range( key );
+  for( auto iter = range.first; iter != range.second; ++iter )
+  {
+    const shared_ptr<const SpecUtils::EnergyCalibration> pooled = iter->second.lock();
+    if( pooled == cal )
+      return cal;
+
+    if( pooled && energy_cals_equal( *pooled, *cal ) )
+    {
+      ++ns_intern_merged;
+      return pooled;
+    }
+  }//for( loop over calibrations with same hash )
+
+  ns_intern_pool.emplace( key, cal );
+  ns_intern_pooled_ptrs[cal.get()] = cal;
+
+  // Every so often clear out calibrations no longer in use
+  if( ++ns_intern_inserts_since_purge > 256 )
+  {
+    ns_intern_inserts_since_purge = 0;
+    for( auto iter = begin(ns_intern_pool); iter != end(ns_intern_pool); )
+    {
+      if( iter->second.expired() )
+        iter = ns_intern_pool.erase( iter );
+      else
+        ++iter;
+    }
+
+    for( auto iter = begin(ns_intern_pooled_ptrs); iter != end(ns_intern_pooled_ptrs); )
+    {
+      if( iter->second.expired() )
+        iter = ns_intern_pooled_ptrs.erase( iter );
+      else
+        ++iter;
+    }
+  }//if( time to purge expired entries )
+
+  return cal;
+}//intern_energy_cal(...)
+
+
+size_t EnergyCal::intern_energy_cals( SpecUtils::SpecFile &spec )
+{
+  size_t nchanged = 0;
+
+  // Measurements commonly share calibration objects, so we only look up each object once.
+  std::unordered_map<shared_ptr<const SpecUtils::EnergyCalibration>,shared_ptr<const SpecUtils::EnergyCalibration>> interned_cals;
+
+  // We'll grab a copy of the measurements, just to be safe while we modify them
+  const vector<shared_ptr<const SpecUtils::Measurement>> meass = spec.measurements();
+  for( const auto &m : meass )
+  {
+    const shared_ptr<const SpecUtils::EnergyCalibration> cal = m ? m->energy_calibration() : nullptr;
+    if( !cal || !cal->valid() || (m->num_gamma_channels() < 1) )
+      continue;
+
+    shared_ptr<const SpecUtils::EnergyCalibration> &interned = interned_cals[cal];
+    if( !interned )
+      interned = intern_energy_cal( cal );
+    
+    if( interned == cal )
+      continue;
+
+    try
+    {
+      spec.set_energy_calibration( interned, m );
+      ++nchanged;
+    }catch( std::exception & )
+    {
+      // Shouldnt happen since the calibrations are equal, but if it does, the measurement will
+      //  just keep its original calibration object.
+      assert( 0 );
+    }
+  }//for( const auto &m : meass )
+
+  return nchanged;
+}//intern_energy_cals(...)
+
+
+void EnergyCal::record_rebin_skipped()
+{
+  ++ns_rebins_skipped;
+}
+
+
+EnergyCal::EnergyCalInternStats EnergyCal::energy_cal_intern_stats()
+{
+  EnergyCalInternStats stats;
+  stats.num_lookups = ns_intern_lookups;
+  stats.num_merged = ns_intern_merged;
+  stats.num_rebins_skipped = ns_rebins_skipped;
+
+  std::lock_guard<std::mutex> lock( ns_intern_mutex );
+  stats.pool_size = ns_intern_pool.size();
+
+  return stats;
+}//energy_cal_intern_stats()
 
 
 shared_ptr<const SpecUtils::EnergyCalibration>
@@ -432,13 +1355,17 @@ EnergyCal::propogate_energy_cal_change( const shared_ptr<const SpecUtils::Energy
     if( nchannel >= old_lower.size() )
       throw runtime_error( "EnergyCal::propogate_energy_cal_change: really unexpected programing error" );
     
-    vector<float> new_lower( nchannel + 1 );
+    // We invert 'orig_cal' exactly for each channel (interpolating its channel energies would
+    //  change the answer, especially past either end of the spectrum), but then evaluate 'new_cal'
+    //  for all channels at once.
+    vector<double> equiv_channels( nchannel + 1 );
     for( size_t i = 0; i <= nchannel; ++i )
-    {
-      const double equiv_channel = orig_cal->channel_for_energy( old_lower[i] );
-      new_lower[i] = new_cal->energy_for_channel( equiv_channel );
-    }
-    
+      equiv_channels[i] = orig_cal->channel_for_energy( old_lower[i] );
+
+    vector<float> new_lower;
+    evaluate_channel_energies( new_cal->type(), new_cal->coefficients(), new_cal->num_channels(),
+                               new_cal->deviation_pairs(), equiv_channels, new_lower );
+
     answer->set_lower_channel_energy( nchannel, std::move(new_lower) );
     return answer;
   }//if( other_cal->type() == EnergyCalType::LowerChannelEdge )
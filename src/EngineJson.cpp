@@ -0,0 +1,405 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+
+#include "FullSpectrumId/EngineJson.h"
+
+using namespace std;
+
+
+namespace
+{
+  void write_string( const std::string &str, std::ostream &out )
+  {
+    out << '"';
+    for( const char c : str )
+    {
+      switch( c )
+      {
+        case '"':  out << "\\\""; break;
+        case '\\': out << "\\\\"; break;
+        case '\b': out << "\\b"; break;
+        case '\f': out << "\\f"; break;
+        case '\n': out << "\\n"; break;
+        case '\r': out << "\\r"; break;
+        case '\t': out << "\\t"; break;
+        default:
+          if( static_cast<unsigned char>(c) < 0x20 )
+          {
+            char buffer[8];
+            snprintf( buffer, sizeof(buffer), "\\u%04x", static_cast<unsigned int>(c) );
+            out << buffer;
+          }else
+          {
+            out << c;
+          }
+      }//switch( c )
+    }//for( const char c : str )
+    out << '"';
+  }//void write_string(...)
+
+
+  /** Writes the shortest representation that reads back as the same value; float_precision
+   should be true for values that came from a float, so e.g. 0.1f is written as "0.1", not
+   "0.100000001".
+   */
+  void write_number( const double val, const bool float_precision, std::ostream &out )
+  {
+    if( !std::isfinite( val ) )
+    {
+      out << "null";
+      return;
+    }
+
+    char buffer[32];
+    const int max_digits = float_precision ? 9 : 17;
+    for( int digits = 6; digits <= max_digits; ++digits )
+    {
+      snprintf( buffer, sizeof(buffer), "%.*g", digits, val );
+      const double readback = strtod( buffer, nullptr );
+      if( float_precision ? (static_cast<float>(readback) == static_cast<float>(val))
+                          : (readback == val) )
+        break;
+    }//for( increase digits until value round-trips )
+
+    out << buffer;
+  }//void write_number(...)
+}//namespace
+
+
+namespace EngineJson
+{
+
+Value::Value()
+  : m_type( Type::Null ), m_bool( false ), m_integer( 0 ), m_number( 0.0 )
+{
+}
+
+
+Value::Value( const bool val )
+  : m_type( Type::Bool ), m_bool( val ), m_integer( 0 ), m_number( 0.0 )
+{
+}
+
+
+Value::Value( const int val )
+  : m_type( Type::Integer ), m_bool( false ), m_integer( val ), m_number( 0.0 )
+{
+}
+
+
+Value::Value( const long val )
+  : m_type( Type::Integer ), m_bool( false ), m_integer( val ), m_number( 0.0 )
+{
+}
+
+
+Value::Value( const long long val )
+  : m_type( Type::Integer ), m_bool( false ), m_integer( val ), m_number( 0.0 )
+{
+}
+
+
+Value::Value( const size_t val )
+  : m_type( Type::Integer ), m_bool( false ), m_integer( static_cast<long long>(val) ), m_number( 0.0 )
+{
+}
+
+
+Value::Value( const float val )
+  : m_type( Type::Number ), m_bool( false ), m_integer( 0 ), m_number( val ), m_is_float( true )
+{
+}
+
+
+Value::Value( const double val )
+  : m_type( Type::Number ), m_bool( false ), m_integer( 0 ), m_number( val )
+{
+}
+
+
+Value::Value( const char *val )
+  : m_type( Type::String ), m_bool( false ), m_integer( 0 ), m_number( 0.0 ), m_string( val ? val : "" )
+{
+}
+
+
+Value::Value( std::string val )
+  : m_type( Type::String ), m_bool( false ), m_integer( 0 ), m_number( 0.0 ), m_string( std::move(val) )
+{
+}
+
+
+Value::Value( Array val )
+  : m_type( Type::Array ), m_bool( false ), m_integer( 0 ), m_number( 0.0 ),
+    m_array( new Array( std::move(val) ) )
+{
+}
+
+
+Value::Value( Object val )
+  : m_type( Type::Object ), m_bool( false ), m_integer( 0 ), m_number( 0.0 ),
+    m_object( new Object( std::move(val) ) )
+{
+}
+
+
+Value::Value( const Value &rhs )
+  : m_type( rhs.m_type ), m_bool( rhs.m_bool ), m_integer( rhs.m_integer ),
+    m_number( rhs.m_number ), m_is_float( rhs.m_is_float ), m_string( rhs.m_string ),
+    m_array( rhs.m_array ? new Array( *rhs.m_array ) : nullptr ),
+    m_object( rhs.m_object ? new Object( *rhs.m_object ) : nullptr )
+{
+}
+
+
+Value::Value( Value &&rhs ) = default;
+
+
+Value &Value::operator=( Value &&rhs ) = default;
+
+
+Value &Value::operator=( const Value &rhs )
+{
+  if( this != &rhs )
+  {
+    Value copy( rhs );
+    *this = std::move( copy );
+  }
+  return *this;
+}//Value &Value::operator=( const Value &rhs )
+
+
+Value::~Value()
+{
+}
+
+
+Value::Type Value::type() const
+{
+  return m_type;
+}
+
+
+bool Value::is_null() const
+{
+  return (m_type == Type::Null);
+}
+
+
+bool Value::is_float() const
+{
+  return (m_type == Type::Number) && m_is_float;
+}
+
+
+bool Value::as_bool() const
+{
+  if( m_type != Type::Bool )
+    throw runtime_error( "JSON value is not a bool" );
+  return m_bool;
+}
+
+
+long long Value::as_integer() const
+{
+  if( m_type != Type::Integer )
+    throw runtime_error( "JSON value is not an integer" );
+  return m_integer;
+}
+
+
+double Value::as_number() const
+{
+  if( m_type == Type::Integer )
+    return static_cast<double>( m_integer );
+  if( m_type != Type::Number )
+    throw runtime_error( "JSON value is not a number" );
+  return m_number;
+}
+
+
+const std::string &Value::as_string() const
+{
+  if( m_type != Type::String )
+    throw runtime_error( "JSON value is not a string" );
+  return m_string;
+}
+
+
+const Array &Value::as_array() const
+{
+  if( m_type != Type::Array )
+    throw runtime_error( "JSON value is not an array" );
+  return *m_array;
+}
+
+
+Array &Value::as_array()
+{
+  if( m_type != Type::Array )
+    throw runtime_error( "JSON value is not an array" );
+  return *m_array;
+}
+
+
+const Object &Value::as_object() const
+{
+  if( m_type != Type::Object )
+    throw runtime_error( "JSON value is not an object" );
+  return *m_object;
+}
+
+
+Object &Value::as_object()
+{
+  if( m_type != Type::Object )
+    throw runtime_error( "JSON value is not an object" );
+  return *m_object;
+}
+
+
+Value &Object::operator[]( const std::string &name )
+{
+  for( auto &member : m_members )
+  {
+    if( member.first == name )
+      return member.second;
+  }
+
+  m_members.emplace_back( name, Value() );
+  return m_members.back().second;
+}//Value &Object::operator[]( const std::string &name )
+
+
+const Value *Object::find( const std::string &name ) const
+{
+  for( const auto &member : m_members )
+  {
+    if( member.first == name )
+      return &member.second;
+  }
+
+  return nullptr;
+}//const Value *Object::find( const std::string &name ) const
+
+
+bool Object::empty() const
+{
+  return m_members.empty();
+}
+
+
+size_t Object::size() const
+{
+  return m_members.size();
+}
+
+
+Object::const_iterator Object::begin() const
+{
+  return m_members.begin();
+}
+
+
+Object::const_iterator Object::end() const
+{
+  return m_members.end();
+}
+
+
+void serialize( const Value &value, std::ostream &out )
+{
+  switch( value.type() )
+  {
+    case Value::Type::Null:
+      out << "null";
+      break;
+
+    case Value::Type::Bool:
+      out << (value.as_bool() ? "true" : "false");
+      break;
+
+    case Value::Type::Integer:
+      out << value.as_integer();
+      break;
+
+    case Value::Type::Number:
+      write_number( value.as_number(), value.is_float(), out );
+      break;
+
+    case Value::Type::String:
+      write_string( value.as_string(), out );
+      break;
+
+    case Value::Type::Array:
+    {
+      out << '[';
+      const Array &arr = value.as_array();
+      for( size_t i = 0; i < arr.size(); ++i )
+      {
+        if( i )
+          out << ',';
+        serialize( arr[i], out );
+      }
+      out << ']';
+      break;
+    }//case Value::Type::Array:
+
+    case Value::Type::Object:
+    {
+      out << '{';
+      bool first = true;
+      for( const auto &member : value.as_object() )
+      {
+        if( !first )
+          out << ',';
+        first = false;
+
+        write_string( member.first, out );
+        out << ':';
+        serialize( member.second, out );
+      }//for( const auto &member : value.as_object() )
+      out << '}';
+      break;
+    }//case Value::Type::Object:
+  }//switch( value.type() )
+}//void serialize( const Value &value, std::ostream &out )
+
+
+std::string serialize( const Value &value )
+{
+  std::ostringstream out;
+  serialize( value, out );
+  return out.str();
+}//std::string serialize( const Value &value )
+
+}//namespace EngineJson
@@ -0,0 +1,451 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+#include <condition_variable>
+
+#include "FullSpectrumId/EngineLog.h"
+
+using namespace std;
+
+
+namespace
+{
+  void default_sink( const std::string &type, const std::string &message )
+  {
+    if( type.compare( 0, 5, "debug" ) == 0 )
+      return;
+
+    cerr << "[" << type << "] " << message << endl;
+  }//void default_sink(...)
+
+  EngineLog::Sink ns_sink = &default_sink;
+  
+  std::atomic<int> ns_level( static_cast<int>(EngineLog::Level::Info) );
+  
+  // Tags of the values in EngineLog::Entry::m_record.
+  const char ns_bool_tag = 'b';
+  const char ns_char_tag = 'c';
+  const char ns_int_tag = 'i';
+  const char ns_uint_tag = 'u';
+  const char ns_double_tag = 'd';
+  const char ns_text_tag = 's';
+  
+  /** A message waiting to be written by the background thread. */
+  struct QueuedMessage
+  {
+    std::string type;
+    std::string record;
+  };//struct QueuedMessage
+  
+  // The ring buffer of messages waiting for the background thread; only used while ns_async.
+  std::atomic<bool> ns_async( false );
+  std::mutex ns_queue_mutex;
+  std::condition_variable ns_queue_cv;   //signalled when messages are added, or when stopping
+  std::condition_variable ns_space_cv;   //signalled when messages are taken from the queue
+  std::vector<QueuedMessage> ns_queue;
+  size_t ns_queue_head = 0;
+  size_t ns_queue_count = 0;
+  size_t ns_unreported_drops = 0;
+  bool ns_stopping = false;
+  
+  // Never destroyed in a forked child (see after_fork_in_child), so it is a raw pointer.
+  std::thread *ns_writer = nullptr;
+  
+  std::atomic<uint64_t> ns_num_logged( 0 ), ns_num_dropped( 0 );
+  
+  
+  template<class T>
+  void append_raw( std::string &record, const T &value )
+  {
+    record.append( reinterpret_cast<const char *>(&value), sizeof(value) );
+  }
+  
+  
+  template<class T>
+  T read_raw( const std::string &record, size_t &pos )
+  {
+    T value;
+    if( (pos + sizeof(T)) > record.size() )
+      throw std::runtime_error( "Truncated log record" );
+    memcpy( &value, record.data() + pos, sizeof(T) );
+    pos += sizeof(T);
+    return value;
+  }
+  
+  
+  /** Formats the values of a message record, the same as giving them to a std::ostream. */
+  std::string format_record( const std::string &record )
+  {
+    std::ostringstream strm;
+    
+    size_t pos = 0;
+    while( pos < record.size() )
+    {
+      const char tag = record[pos++];
+      switch( tag )
+      {
+        case ns_bool_tag:   strm << read_raw<bool>( record, pos );               break;
+        case ns_char_tag:   strm << read_raw<char>( record, pos );               break;
+        case ns_int_tag:    strm << read_raw<long long>( record, pos );          break;
+        case ns_uint_tag:   strm << read_raw<unsigned long long>( record, pos ); break;
+        case ns_double_tag: strm << read_raw<double>( record, pos );             break;
+        case ns_text_tag:
+        {
+          const uint32_t length = read_raw<uint32_t>( record, pos );
+          if( (pos + length) > record.size() )
+            throw std::runtime_error( "Truncated log record" );
+          strm.write( record.data() + pos, length );
+          pos += length;
+          break;
+        }//case ns_text_tag:
+        
+        default:
+          throw std::runtime_error( "Invalid log record" );
+      }//switch( tag )
+    }//while( pos < record.size() )
+    
+    return strm.str();
+  }//std::string format_record( const std::string &record )
+  
+  
+  /** Gives a message to the sink, from the current thread. */
+  void write_message( const std::string &type, const std::string &record )
+  {
+    if( !ns_sink )
+      return;
+    
+    try
+    {
+      ns_sink( type, format_record( record ) );
+    }catch( ... )
+    {
+      // Never let logging throw.
+    }
+  }//void write_message(...)
+  
+  
+  void writer_main()
+  {
+    vector<QueuedMessage> batch;
+    
+    for( ; ; )
+    {
+      size_t num_dropped = 0;
+      
+      {// Begin lock on ns_queue_mutex
+        std::unique_lock<std::mutex> lock( ns_queue_mutex );
+        ns_queue_cv.wait( lock, [](){ return (ns_queue_count > 0) || ns_stopping; } );
+        
+        if( (ns_queue_count == 0) && ns_stopping )
+          break;
+        
+        // Take everything queued, so the logging threads only wait on the lock for a moment.
+        while( ns_queue_count > 0 )
+        {
+          batch.push_back( std::move( ns_queue[ns_queue_head] ) );
+          ns_queue_head = (ns_queue_head + 1) % ns_queue.size();
+          --ns_queue_count;
+        }
+        
+        num_dropped = ns_unreported_drops;
+        ns_unreported_drops = 0;
+      }// End lock on ns_queue_mutex
+      
+      ns_space_cv.notify_all();
+      
+      if( num_dropped && ns_sink )
+      {
+        try
+        {
+          ns_sink( "warn", std::to_string(num_dropped) + " log messages were dropped, as the log queue was full." );
+        }catch( ... )
+        {
+        }
+      }//if( num_dropped && ns_sink )
+      
+      for( const QueuedMessage &message : batch )
+        write_message( message.type, message.record );
+      batch.clear();
+    }//for( ; ; )
+  }//void writer_main()
+  
+  
+  /** Adds the message to the queue for the background thread; returns false if not writing messages
+   from the background thread, in which case the caller should write it.
+   */
+  bool queue_message( const EngineLog::Level level, const char *type, std::string &record )
+  {
+    std::unique_lock<std::mutex> lock( ns_queue_mutex );
+    
+    if( ns_stopping || !ns_writer || ns_queue.empty() )
+      return false;
+    
+    if( ns_queue_count == ns_queue.size() )
+    {
+      if( level != EngineLog::Level::Error )
+      {
+        ++ns_unreported_drops;
+        ++ns_num_dropped;
+        return true;
+      }
+      
+      ns_space_cv.wait( lock, [](){ return (ns_queue_count < ns_queue.size()) || ns_stopping; } );
+      if( ns_stopping )
+        return false;
+    }//if( the queue is full )
+    
+    QueuedMessage &message = ns_queue[(ns_queue_head + ns_queue_count) % ns_queue.size()];
+    message.type = type;
+    message.record.swap( record );
+    ++ns_queue_count;
+    
+    // The writer only waits when the queue is empty, so only needs waking for the first message.
+    const bool was_empty = (ns_queue_count == 1);
+    lock.unlock();
+    
+    if( was_empty )
+      ns_queue_cv.notify_one();
+    
+    return true;
+  }//bool queue_message(...)
+}//namespace
+
+
+namespace EngineLog
+{
+
+Level level_from_str( const std::string &level )
+{
+  if( level == "debug" )
+    return Level::Debug;
+  if( level == "info" )
+    return Level::Info;
+  if( (level == "warning") || (level == "warn") )
+    return Level::Warning;
+  if( level == "error" )
+    return Level::Error;
+  
+  throw std::runtime_error( "Invalid log level '" + level + "'; must be debug, info, warning, or error." );
+}//Level level_from_str( const std::string &level )
+
+
+void set_sink( Sink sink )
+{
+  ns_sink = std::move( sink );
+}
+
+
+void set_level( Level level )
+{
+  ns_level = static_cast<int>( level );
+}
+
+
+bool enabled( Level level )
+{
+  return (static_cast<int>(level) >= ns_level.load( std::memory_order_relaxed ));
+}
+
+
+void start_async( size_t queue_size )
+{
+  if( !queue_size )
+    throw std::runtime_error( "EngineLog::start_async(): queue size must be non-zero." );
+  
+  std::lock_guard<std::mutex> lock( ns_queue_mutex );
+  if( ns_writer )
+    throw std::runtime_error( "EngineLog::start_async(): already started." );
+  
+  ns_queue.clear();
+  ns_queue.resize( queue_size );
+  ns_queue_head = ns_queue_count = 0;
+  ns_unreported_drops = 0;
+  ns_stopping = false;
+  ns_writer = new std::thread( &writer_main );
+  ns_async = true;
+}//void start_async( size_t queue_size )
+
+
+void stop_async()
+{
+  std::thread *writer = nullptr;
+  
+  {
+    std::lock_guard<std::mutex> lock( ns_queue_mutex );
+    if( !ns_writer )
+      return;
+    
+    writer = ns_writer;
+    ns_stopping = true;
+  }
+  
+  ns_queue_cv.notify_all();
+  ns_space_cv.notify_all();
+  
+  writer->join();
+  delete writer;
+  
+  std::lock_guard<std::mutex> lock( ns_queue_mutex );
+  ns_writer = nullptr;
+  ns_async = false;
+  ns_queue.clear();
+  ns_queue_head = ns_queue_count = 0;
+  ns_stopping = false;
+}//void stop_async()
+
+
+void after_fork_in_child()
+{
+  // The writer thread doesnt exist in this process, and the queue mutex may have been held by
+  //  some other thread when we were forked, so we just abandon both.
+  ns_async = false;
+}//void after_fork_in_child()
+
+
+EngineJson::Object status_json()
+{
+  EngineJson::Object status;
+  status["async"] = ns_async.load();
+  status["logged"] = static_cast<size_t>( ns_num_logged.load() );
+  status["dropped"] = static_cast<size_t>( ns_num_dropped.load() );
+  
+  if( ns_async )
+  {
+    std::lock_guard<std::mutex> lock( ns_queue_mutex );
+    status["queued"] = ns_queue_count;
+    status["queueSize"] = ns_queue.size();
+  }
+  
+  return status;
+}//EngineJson::Object status_json()
+
+
+Entry::Entry()
+  : m_level( Level::Debug ),
+    m_type( nullptr )
+{
+}
+
+
+Entry::Entry( Level level, const char *type )
+  : m_level( level ),
+    m_type( type )
+{
+}
+
+
+Entry::Entry( Entry &&rhs )
+  : m_level( rhs.m_level ),
+    m_type( rhs.m_type ),
+    m_record( std::move(rhs.m_record) )
+{
+  rhs.m_type = nullptr;
+}
+
+
+Entry::~Entry()
+{
+  if( !m_type || !ns_sink )
+    return;
+  
+  ++ns_num_logged;
+  
+  try
+  {
+    if( ns_async.load( std::memory_order_relaxed ) && queue_message( m_level, m_type, m_record ) )
+      return;
+    
+    write_message( m_type, m_record );
+  }catch( ... )
+  {
+    // Never let logging throw out of a destructor.
+  }
+}//Entry::~Entry()
+
+
+void Entry::put_bool( bool value )
+{
+  m_record += ns_bool_tag;
+  append_raw( m_record, value );
+}
+
+
+void Entry::put_char( char value )
+{
+  m_record += ns_char_tag;
+  m_record += value;
+}
+
+
+void Entry::put_int( long long value )
+{
+  m_record += ns_int_tag;
+  append_raw( m_record, value );
+}
+
+
+void Entry::put_uint( unsigned long long value )
+{
+  m_record += ns_uint_tag;
+  append_raw( m_record, value );
+}
+
+
+void Entry::put_double( double value )
+{
+  m_record += ns_double_tag;
+  append_raw( m_record, value );
+}
+
+
+void Entry::put_text( const char *value )
+{
+  put_text( value, value ? strlen(value) : 0 );
+}
+
+
+void Entry::put_text( const char *value, size_t length )
+{
+  const uint32_t len = static_cast<uint32_t>( std::min( length, static_cast<size_t>(UINT32_MAX) ) );
+  
+  m_record += ns_text_tag;
+  append_raw( m_record, len );
+  if( len )
+    m_record.append( value, len );
+}//void Entry::put_text( const char *value, size_t length )
+
+}//namespace EngineLog
@@ -0,0 +1,619 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <map>
+#include <set>
+#include <tuple>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <condition_variable>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "SpecUtils/SpecFile.h"
+#include "SpecUtils/EnergyCalibration.h"
+
+#include "FullSpectrumId/Analysis.h"
+#include "FullSpectrumId/EnergyCal.h"
+#include "FullSpectrumId/EngineLog.h"
+#include "FullSpectrumId/EngineJson.h"
+#include "FullSpectrumId/FullSpecCApi.h"
+
+using namespace std;
+
+
+namespace
+{
+  thread_local std::string ns_last_error;
+
+  /** Set while a #fsid_result_callback is being called on this thread. */
+  thread_local bool t_in_result_callback = false;
+
+  // Protects the variables below, which are shared by all engines.
+  std::mutex ns_global_mutex;
+  size_t ns_num_engines = 0;
+  bool ns_gadras_initialized = false;
+  bool ns_owns_analysis_thread = false;
+  std::string ns_gadras_lib_path;
+  std::string ns_gadras_run_dir;
+
+  // Job IDs are unique across engines, since they are also used as #AnalysisInput::ana_number.
+  std::atomic<fsid_job_id> ns_next_job_id( 1 );
+
+  const boost::posix_time::ptime ns_epoch( boost::gregorian::date(1970,1,1) );
+
+
+  int32_t set_error( const int32_t code, const std::string &msg )
+  {
+    ns_last_error = msg;
+    return code;
+  }
+
+
+  /** Sets the error for #fsid_submit, and returns the invalid job ID. */
+  fsid_job_id submit_error( const int32_t code, const std::string &msg )
+  {
+    set_error( code, msg );
+    return 0;
+  }
+
+
+  struct Job
+  {
+    fsid_job_id id;
+    fsid_result_callback callback;
+    void *user_data;
+  };//struct Job
+
+
+  /** Owns everything a #fsid_result points to. */
+  struct ResultHolder
+  {
+    fsid_result result;
+    Analysis::AnalysisOutput output;
+    std::string json;
+    std::vector<const char *> isotope_names, isotope_types, isotope_confidence_strs, warnings;
+  };//struct ResultHolder
+
+
+  std::unique_ptr<ResultHolder> make_result( const fsid_job_id id, Analysis::AnalysisOutput &&output )
+  {
+    auto holder = make_unique<ResultHolder>();
+    holder->output = std::move( output );
+    holder->output.spec_file.reset();
+
+    const Analysis::AnalysisOutput &out = holder->output;
+    holder->json = EngineJson::serialize( out.toJson() );
+
+    // The arrays should all be the same length, but be careful, like AnalysisOutput::toJson.
+    size_t num_isotopes = out.isotope_names.size();
+    num_isotopes = std::min( num_isotopes, out.isotope_types.size() );
+    num_isotopes = std::min( num_isotopes, out.isotope_count_rates.size() );
+    num_isotopes = std::min( num_isotopes, out.isotope_confidences.size() );
+    num_isotopes = std::min( num_isotopes, out.isotope_confidence_strs.size() );
+
+    for( size_t i = 0; i < num_isotopes; ++i )
+    {
+      holder->isotope_names.push_back( out.isotope_names[i].c_str() );
+      holder->isotope_types.push_back( out.isotope_types[i].c_str() );
+      holder->isotope_confidence_strs.push_back( out.isotope_confidence_strs[i].c_str() );
+    }
+
+    for( const string &warning : out.analysis_warnings )
+      holder->warnings.push_back( warning.c_str() );
+
+    const bool success = out.error_message.empty()
+                         && (out.gadras_intialization_error >= 0)
+                         && (out.gadras_analysis_error >= 0);
+
+    fsid_result &result = holder->result;
+    result.job = id;
+    result.status = success ? FSID_OK : FSID_ERROR;
+    result.error_message = out.error_message.c_str();
+    result.gadras_initialization_code = out.gadras_intialization_error;
+    result.gadras_analysis_code = out.gadras_analysis_error;
+    result.drf = out.drf_used.c_str();
+    result.isotopes = out.isotopes.c_str();
+    result.chi_sqr = out.chi_sqr;
+    result.alarm_basis_duration = out.alarm_basis_duration;
+    result.stuff_of_interest = out.stuff_of_interest;
+    result.num_isotopes = static_cast<uint32_t>( num_isotopes );
+    result.isotope_names = holder->isotope_names.data();
+    result.isotope_types = holder->isotope_types.data();
+    result.isotope_count_rates = out.isotope_count_rates.data();
+    result.isotope_confidences = out.isotope_confidences.data();
+    result.isotope_confidence_strs = holder->isotope_confidence_strs.data();
+    result.num_warnings = static_cast<uint32_t>( holder->warnings.size() );
+    result.warnings = holder->warnings.data();
+    result.json = holder->json.c_str();
+    result.internal = holder.get();
+
+    return holder;
+  }//make_result(...)
+
+
+  std::shared_ptr<const SpecUtils::EnergyCalibration> make_energy_cal( const fsid_spectrum &spec )
+  {
+    const size_t nchannel = spec.num_channels;
+    const vector<float> coefs( spec.energy_cal_coefs, spec.energy_cal_coefs + spec.num_energy_cal_coefs );
+
+    auto cal = make_shared<SpecUtils::EnergyCalibration>();
+    switch( spec.energy_cal_type )
+    {
+      case FSID_CAL_POLYNOMIAL:
+        cal->set_polynomial( nchannel, coefs, {} );
+        break;
+
+      case FSID_CAL_FULL_RANGE_FRACTION:
+        cal->set_full_range_fraction( nchannel, coefs, {} );
+        break;
+
+      case FSID_CAL_LOWER_CHANNEL_ENERGY:
+        cal->set_lower_channel_energy( nchannel, coefs );
+        break;
+
+      default:
+        throw runtime_error( "Invalid energy calibration type (" + std::to_string(spec.energy_cal_type) + ")" );
+    }//switch( spec.energy_cal_type )
+
+    return EnergyCal::intern_energy_cal( cal );
+  }//make_energy_cal(...)
+
+
+  /** Builds the spectrum file the analysis needs from the callers arrays, copying them, so the
+   caller may free them once #fsid_submit returns.
+   */
+  std::shared_ptr<SpecUtils::SpecFile> make_spec_file( const fsid_spectrum *spectra, const size_t num_spectra )
+  {
+    auto spec = make_shared<SpecUtils::SpecFile>();
+
+    // Spectra from many detectors, or time-slices, usually share a calibration, so only compute
+    //  channel energies once for each distinct set of coefficients.
+    map<tuple<int32_t,uint32_t,vector<float>>,shared_ptr<const SpecUtils::EnergyCalibration>> cals;
+
+    for( size_t i = 0; i < num_spectra; ++i )
+    {
+      const fsid_spectrum &s = spectra[i];
+
+      auto &cal = cals[make_tuple( s.energy_cal_type, s.num_channels,
+                         vector<float>( s.energy_cal_coefs, s.energy_cal_coefs + s.num_energy_cal_coefs ) )];
+      if( !cal )
+        cal = make_energy_cal( s );
+
+      auto m = make_shared<SpecUtils::Measurement>();
+      m->set_gamma_counts( make_shared<vector<float>>( s.counts, s.counts + s.num_channels ),
+                           s.live_time, s.real_time );
+      m->set_energy_calibration( cal );
+      m->set_sample_number( s.sample_number );
+      m->set_detector_name( s.detector_name ? s.detector_name : "" );
+
+      switch( s.source_type )
+      {
+        case FSID_FOREGROUND: m->set_source_type( SpecUtils::SourceType::Foreground ); break;
+        case FSID_BACKGROUND: m->set_source_type( SpecUtils::SourceType::Background ); break;
+        default:              m->set_source_type( SpecUtils::SourceType::Unknown );    break;
+      }//switch( s.source_type )
+
+      if( s.start_time_us )
+        m->set_start_time( ns_epoch + boost::posix_time::microseconds( s.start_time_us ) );
+
+      if( s.neutron_counts && s.num_neutron_counts )
+        m->set_neutron_counts( vector<float>( s.neutron_counts, s.neutron_counts + s.num_neutron_counts ) );
+
+      spec->add_measurement( m, false );
+    }//for( size_t i = 0; i < num_spectra; ++i )
+
+    spec->cleanup_after_load( SpecUtils::SpecFile::DontChangeOrReorderSamples );
+
+    return spec;
+  }//make_spec_file(...)
+}//namespace
+
+
+struct fsid_engine
+{
+  // Protects the members below; cv signals finished jobs to #fsid_wait and #fsid_engine_destroy.
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool stopping = false;
+  std::string drf;
+  size_t num_unfinished = 0;
+
+  /** Jobs submitted without a callback that havent finished. */
+  std::set<fsid_job_id> pending;
+
+  /** Finished jobs submitted without a callback, waiting to be polled. */
+  std::map<fsid_job_id,std::unique_ptr<ResultHolder>> results;
+
+  /** Given to every job's #Analysis::AnalysisInput; set when the engine is destroyed, so jobs that
+   havent started are skipped.
+   */
+  std::shared_ptr<std::atomic<bool>> cancelled = std::make_shared<std::atomic<bool>>( false );
+
+  /** Identifies the engine to the analysis queue, which takes jobs from each engine in turn. */
+  std::string client;
+};//struct fsid_engine
+
+
+namespace
+{
+  /** Gives the result to the jobs callback, or keeps it for #fsid_poll; called from the thread the
+   analysis queue posts results from (normally the analysis thread).
+   */
+  void deliver( fsid_engine *engine, const Job &job, Analysis::AnalysisOutput &&output )
+  {
+    unique_ptr<ResultHolder> holder = make_result( job.id, std::move(output) );
+
+    if( job.callback )
+    {
+      t_in_result_callback = true;
+      try
+      {
+        job.callback( &holder->result, job.user_data );
+      }catch( ... )
+      {
+        EngineLog::log("error") << "fsid_result_callback threw an exception for job " << job.id;
+      }
+      t_in_result_callback = false;
+    }//if( job.callback )
+
+    // #fsid_engine_destroy may delete the engine as soon as we release the lock, so we notify while
+    //  holding it, and dont touch the engine afterwards.
+    std::lock_guard<std::mutex> lock( engine->mutex );
+    if( !job.callback )
+    {
+      engine->pending.erase( job.id );
+      engine->results[job.id] = std::move( holder );
+    }
+    engine->num_unfinished -= 1;
+    engine->cv.notify_all();
+  }//void deliver(...)
+
+
+  std::unique_ptr<ResultHolder> take_result( fsid_engine *engine, const fsid_job_id job )
+  {
+    auto pos = engine->results.find( job );
+    if( pos == end(engine->results) )
+      return nullptr;
+
+    unique_ptr<ResultHolder> holder = std::move( pos->second );
+    engine->results.erase( pos );
+    return holder;
+  }//take_result(...)
+}//namespace
+
+
+extern "C"
+{
+
+const char *fsid_last_error( void )
+{
+  return ns_last_error.c_str();
+}
+
+
+int32_t fsid_gadras_version( void )
+{
+  try
+  {
+    std::lock_guard<std::mutex> lock( ns_global_mutex );
+    if( !ns_gadras_initialized )
+      return set_error( FSID_ERROR, "No engine has been created." );
+
+    return Analysis::gadras_version_number();
+  }catch( std::exception &e )
+  {
+    return set_error( FSID_ERROR, e.what() );
+  }
+}//int32_t fsid_gadras_version( void )
+
+
+fsid_engine *fsid_engine_create( const char *gadras_lib_path, const char *gadras_run_dir )
+{
+  try
+  {
+    std::lock_guard<std::mutex> lock( ns_global_mutex );
+
+    const string lib_path = gadras_lib_path ? gadras_lib_path : "";
+    const string run_dir = gadras_run_dir ? gadras_run_dir : "";
+
+    if( !ns_gadras_initialized )
+    {
+#if( !STATICALLY_LINK_TO_GADRAS )
+      string lib_to_load = lib_path;
+      if( lib_to_load.empty() )
+      {
+#ifdef _WIN32
+        lib_to_load = "libgadrasiid.dll";
+#elif( defined(__APPLE__) )
+        lib_to_load = "libgadrasiid.dylib";
+#else
+        lib_to_load = "libgadrasiid.so";
+#endif
+      }//if( lib_to_load.empty() )
+
+      if( !Analysis::load_gadras_lib( lib_to_load ) )
+        throw runtime_error( "Could not load the GADRAS library '" + lib_to_load + "'." );
+#endif
+
+      Analysis::set_gadras_app_dir( run_dir.empty() ? string("gadras_isotope_id_run_directory") : run_dir );
+
+      ns_gadras_initialized = true;
+      ns_gadras_lib_path = lib_path;
+      ns_gadras_run_dir = run_dir;
+    }else if( (!lib_path.empty() && (lib_path != ns_gadras_lib_path))
+              || (!run_dir.empty() && (run_dir != ns_gadras_run_dir)) )
+    {
+      set_error( FSID_INVALID_ARGUMENT, "GADRAS was already loaded with a different library or run directory." );
+      return nullptr;
+    }//if( !ns_gadras_initialized ) / else
+
+    if( ns_num_engines == 0 )
+    {
+      // If we are embedded in a program that already runs the analysis thread, we'll use it.
+      try
+      {
+        Analysis::start_analysis_thread();
+        ns_owns_analysis_thread = true;
+      }catch( std::exception & )
+      {
+        ns_owns_analysis_thread = false;
+      }
+    }//if( ns_num_engines == 0 )
+
+    unique_ptr<fsid_engine> engine = make_unique<fsid_engine>();
+    engine->client = "fsid_engine_" + std::to_string( reinterpret_cast<uintptr_t>(engine.get()) );
+
+    ns_num_engines += 1;
+
+    return engine.release();
+  }catch( std::exception &e )
+  {
+    set_error( FSID_ERROR, e.what() );
+  }catch( ... )
+  {
+    set_error( FSID_ERROR, "Unknown error creating engine." );
+  }
+
+  return nullptr;
+}//fsid_engine *fsid_engine_create(...)
+
+
+int32_t fsid_engine_destroy( fsid_engine *engine )
+{
+  if( !engine )
+    return FSID_OK;
+
+  // The callback is called from the analysis thread, which we would be waiting on below.
+  if( t_in_result_callback )
+    return set_error( FSID_INVALID_ARGUMENT, "fsid_engine_destroy can not be called from a result callback." );
+
+  {
+    std::unique_lock<std::mutex> lock( engine->mutex );
+    engine->stopping = true;
+
+    // Jobs that havent started are finished with an error by the analysis queue, and given to
+    //  deliver like any other result.
+    engine->cancelled->store( true );
+    engine->cv.wait( lock, [engine](){ return engine->num_unfinished == 0; } );
+  }
+
+  delete engine;
+
+  std::lock_guard<std::mutex> lock( ns_global_mutex );
+  ns_num_engines -= 1;
+  if( (ns_num_engines == 0) && ns_owns_analysis_thread )
+  {
+    try
+    {
+      Analysis::stop_analysis_thread();
+    }catch( std::exception &e )
+    {
+      EngineLog::log("error") << "Failed to stop analysis thread: " << e.what();
+    }
+    ns_owns_analysis_thread = false;
+  }//if( last engine )
+
+  return FSID_OK;
+}//int32_t fsid_engine_destroy( fsid_engine *engine )
+
+
+int32_t fsid_engine_select_drf( fsid_engine *engine, const char *drf )
+{
+  if( !engine || !drf )
+    return set_error( FSID_INVALID_ARGUMENT, "Null engine or DRF." );
+
+  try
+  {
+    const vector<string> drfs = Analysis::available_drfs();
+    if( std::find( begin(drfs), end(drfs), string(drf) ) == end(drfs) )
+      return set_error( FSID_INVALID_ARGUMENT, "DRF '" + string(drf) + "' is not available." );
+
+    std::lock_guard<std::mutex> lock( engine->mutex );
+    engine->drf = drf;
+  }catch( std::exception &e )
+  {
+    return set_error( FSID_ERROR, e.what() );
+  }
+
+  return FSID_OK;
+}//int32_t fsid_engine_select_drf(...)
+
+
+fsid_job_id fsid_submit( fsid_engine *engine, int32_t analysis_type,
+                         const fsid_spectrum *spectra, uint32_t num_spectra,
+                         fsid_result_callback callback, void *user_data )
+{
+  if( !engine || !spectra || !num_spectra )
+    return submit_error( FSID_INVALID_ARGUMENT, "Null engine, or no spectra." );
+
+  try
+  {
+    Job job;
+    Analysis::AnalysisType type;
+
+    switch( analysis_type )
+    {
+      case FSID_SIMPLE: type = Analysis::AnalysisType::Simple; break;
+      case FSID_SEARCH: type = Analysis::AnalysisType::Search; break;
+      case FSID_PORTAL: type = Analysis::AnalysisType::Portal; break;
+      default:
+        return submit_error( FSID_INVALID_ARGUMENT, "Invalid analysis type." );
+    }//switch( analysis_type )
+
+    if( (type == Analysis::AnalysisType::Simple) && (num_spectra > 2) )
+      return submit_error( FSID_INVALID_ARGUMENT, "Simple analysis takes a foreground, and optionally a background." );
+
+    for( uint32_t i = 0; i < num_spectra; ++i )
+    {
+      const fsid_spectrum &s = spectra[i];
+      if( !s.counts || !s.num_channels )
+        return submit_error( FSID_INVALID_ARGUMENT, "Spectrum " + std::to_string(i) + " has no channel counts." );
+
+      if( !s.energy_cal_coefs || !s.num_energy_cal_coefs )
+        return submit_error( FSID_INVALID_ARGUMENT, "Spectrum " + std::to_string(i) + " has no energy calibration." );
+
+      if( !s.neutron_counts && s.num_neutron_counts )
+        return submit_error( FSID_INVALID_ARGUMENT, "Spectrum " + std::to_string(i) + " has null neutron counts." );
+    }//for( uint32_t i = 0; i < num_spectra; ++i )
+
+    job.callback = callback;
+    job.user_data = user_data;
+
+    Analysis::AnalysisInput input;
+    input.analysis_type = type;
+    input.input = make_spec_file( spectra, num_spectra );
+
+    {
+      std::lock_guard<std::mutex> lock( engine->mutex );
+      if( engine->stopping )
+        return submit_error( FSID_ERROR, "The engine is being destroyed." );
+      input.drf_folder = engine->drf;
+      input.client = engine->client;
+      input.cancelled = engine->cancelled;
+    }
+
+    if( input.drf_folder.empty() )
+      input.drf_folder = Analysis::get_drf_name( input.input );
+    if( input.drf_folder.empty() )
+      return submit_error( FSID_INVALID_ARGUMENT, "No DRF was selected, and one could not be determined from the spectra." );
+
+    job.id = ns_next_job_id++;
+    input.ana_number = static_cast<size_t>( job.id );
+    input.callback = [engine,job]( Analysis::AnalysisOutput result ){
+      deliver( engine, job, std::move(result) );
+    };
+
+    // The job must be counted before it is posted, since the result may be delivered right away.
+    {
+      std::lock_guard<std::mutex> lock( engine->mutex );
+      if( engine->stopping )
+        return submit_error( FSID_ERROR, "The engine is being destroyed." );
+
+      if( !callback )
+        engine->pending.insert( job.id );
+      engine->num_unfinished += 1;
+    }
+
+    try
+    {
+      Analysis::post_analysis( input );
+    }catch( std::exception & )
+    {
+      std::lock_guard<std::mutex> lock( engine->mutex );
+      engine->pending.erase( job.id );
+      engine->num_unfinished -= 1;
+      engine->cv.notify_all();
+      throw;
+    }
+
+    return job.id;
+  }catch( std::exception &e )
+  {
+    return submit_error( FSID_ERROR, e.what() );
+  }
+}//fsid_job_id fsid_submit(...)
+
+
+int32_t fsid_poll( fsid_engine *engine, fsid_job_id job, fsid_result **result )
+{
+  return fsid_wait( engine, job, 0, result );
+}
+
+
+int32_t fsid_wait( fsid_engine *engine, fsid_job_id job, int32_t timeout_ms, fsid_result **result )
+{
+  if( !engine || !result )
+    return set_error( FSID_INVALID_ARGUMENT, "Null engine or result." );
+
+  *result = nullptr;
+
+  std::unique_lock<std::mutex> lock( engine->mutex );
+
+  auto finished = [engine,job](){ return !engine->pending.count( job ); };
+
+  if( timeout_ms < 0 )
+    engine->cv.wait( lock, finished );
+  else if( timeout_ms > 0 )
+    engine->cv.wait_for( lock, std::chrono::milliseconds(timeout_ms), finished );
+
+  unique_ptr<ResultHolder> holder = take_result( engine, job );
+  if( holder )
+  {
+    *result = &holder.release()->result;
+    return FSID_OK;
+  }
+
+  if( engine->pending.count( job ) )
+    return FSID_PENDING;
+
+  return set_error( FSID_NOT_FOUND, "Job " + std::to_string(job) + " not found." );
+}//int32_t fsid_wait(...)
+
+
+uint32_t fsid_queue_length( fsid_engine *engine )
+{
+  if( !engine )
+    return 0;
+
+  std::lock_guard<std::mutex> lock( engine->mutex );
+  return static_cast<uint32_t>( engine->num_unfinished );
+}
+
+
+void fsid_result_free( fsid_result *result )
+{
+  if( result )
+    delete static_cast<ResultHolder *>( result->internal );
+}
+
+}//extern "C"
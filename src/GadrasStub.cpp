@@ -0,0 +1,810 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/** A stand-in for the GADRAS Full Spectrum Isotope ID shared library.
+
+ Exports the same functions that #Analysis::load_gadras_lib resolves, so the server, REST API,
+ and GUI can be exercised (and load-tested) on machines without the GADRAS library; it does not
+ do any actual analysis.  Point the "GadrasLibPath" app config option at the built
+ libgadrasiid_stub.so, and have the "GadrasRunDirectory" contain a "drfs/<name>/Detector.dat"
+ for each DRF you want listed (the files can be empty).
+
+ Behavior is controlled by environment variables, read the first time any function is called:
+   - GADRAS_STUB_LATENCY_MS: milliseconds each analysis call (StaticIsotopeID, SearchIsotopeID
+     ANALYZE calls, StreamingSearch ANALYZE calls, PortalIsotopeIDCInterface) takes.  Default 0.
+   - GADRAS_STUB_INIT_LATENCY_MS: milliseconds each DRF initialization takes.  Default 0.
+   - GADRAS_STUB_BUSY_WAIT: if "1", spin the CPU for the latency, rather than sleeping, to
+     better mimic the (CPU bound) real library.
+   - GADRAS_STUB_ISOTOPES: comma separated list of nuclides results are drawn from, each
+     optionally followed by ":<type>"; default "Cs137:Industrial,Co60:Industrial,Ba133:Industrial,
+     K40:NORM,Ra226:NORM,Am241:Industrial".  Which nuclides (if any), and their confidences, are
+     a deterministic function of the input spectrum, so the same input always gives the same answer.
+   - GADRAS_STUB_FAIL_EVERY: if N > 0, every Nth analysis call returns GADRAS_STUB_FAIL_CODE
+     (default -1) instead of a result.
+   - GADRAS_STUB_INIT_FAIL_CODE: if non-zero, DRF initialization returns this code.
+   - GADRAS_STUB_K40_CODE: return code of RebinUsingK40; default 0 (success, with the K40 peak
+     found at 1460.75 keV, so no recalibration is applied).
+   - GADRAS_STUB_VERSION: value returned by gadrasversionnumber; default 18811.
+   - GADRAS_STUB_RECORD: if set, the path of a file to append one tab-separated line to for each
+     call, containing a sequence number, the function name, and a summary of the arguments.
+
+ In addition to the GADRAS functions, the following are exported for test harnesses to dlsym:
+   - `int64_t GadrasStubCallCount( const char *function )`: number of calls to the named function
+     since loading (or the last reset); a null or empty name gives the total of all functions.
+   - `void GadrasStubResetCounts()`: zeros the call counts and the error-injection counter.
+ */
+
+#include <mutex>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <cstdio>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <sstream>
+#include <type_traits>
+
+// The few GADRAS declarations the stub needs, so it can be built without the GADRAS distribution;
+//  these mirror GadrasIsotopeID.h for the fields Analysis.cpp uses.  If CMake finds the GADRAS
+//  header, GADRAS_STUB_CHECK_HEADER is defined, and they are checked against it below.
+namespace GadrasDecls
+{
+  enum AnalysisMode : int
+  {
+    INITIALIZE = 0,
+    ANALYZE = 1,
+    RESET = 2
+  };//enum AnalysisMode
+  
+  const size_t MaxIsotopes = 20;
+  
+  struct IsotopeIDResult
+  {
+    int32_t nIsotopes;
+    char *listOfIsotopeStrings;
+    char *listOfIsotopeTypes;
+    float isotopeCountRates[MaxIsotopes];
+    float isotopeConfidences[MaxIsotopes];
+    float chiSqr;
+    float alarmBasisDuration;
+  };//struct IsotopeIDResult
+  
+  // The stub only passes these along, so doesnt need their contents.
+  struct PortalIsotopeIDOptions;
+  struct PortalPlotOptions;
+  
+  struct PortalIsotopeIDOutput
+  {
+    char *dateTime;
+    float foregroundTotalTime;
+    float backgroundTotalTime;
+    float netGammaRate;
+    float netNeutronRate;
+    float sigmaGamma;
+    float sigmaNeutron;
+    float chiSquare;
+    float snmProbabilityIndex;
+    char *snmProbabilityString;
+    int threatProbabilityIndex;
+    char *threatProbabilityString;
+    char *eventType;
+    char *alarmColor;
+    char *alarmDescription;
+    char *isotopeString;
+  };//struct PortalIsotopeIDOutput
+}//namespace GadrasDecls
+
+#if( GADRAS_STUB_CHECK_HEADER )
+// The header declares the functions we export with some different parameter types (e.g.,
+//  StreamingSearch has a 2D array parameter), so we rename its declarations out of the way.
+#define gadrasversionnumber GadrasHeader_gadrasversionnumber
+#define InitializeIsotopeIdCalibrated GadrasHeader_InitializeIsotopeIdCalibrated
+#define InitializeIsotopeIdRaw GadrasHeader_InitializeIsotopeIdRaw
+#define StaticIsotopeID GadrasHeader_StaticIsotopeID
+#define SearchIsotopeID GadrasHeader_SearchIsotopeID
+#define StreamingSearch GadrasHeader_StreamingSearch
+#define GetCurrentIsotopeIDResults GadrasHeader_GetCurrentIsotopeIDResults
+#define ClearIsotopeIDResults GadrasHeader_ClearIsotopeIDResults
+#define RebinUsingK40 GadrasHeader_RebinUsingK40
+#define PortalIsotopeIDCInterface GadrasHeader_PortalIsotopeIDCInterface
+
+#include "GadrasIsotopeID.h"
+
+#undef gadrasversionnumber
+#undef InitializeIsotopeIdCalibrated
+#undef InitializeIsotopeIdRaw
+#undef StaticIsotopeID
+#undef SearchIsotopeID
+#undef StreamingSearch
+#undef GetCurrentIsotopeIDResults
+#undef ClearIsotopeIDResults
+#undef RebinUsingK40
+#undef PortalIsotopeIDCInterface
+
+#define GADRAS_STUB_CHECK_FIELD(type,field) \
+  static_assert( (offsetof(::type,field) == offsetof(GadrasDecls::type,field)) \
+                 && (sizeof(::type::field) == sizeof(GadrasDecls::type::field)), \
+                 "GadrasDecls::" #type "::" #field " does not match GadrasIsotopeID.h" )
+
+static_assert( (static_cast<int>(::INITIALIZE) == GadrasDecls::INITIALIZE)
+               && (static_cast<int>(::ANALYZE) == GadrasDecls::ANALYZE)
+               && (static_cast<int>(::RESET) == GadrasDecls::RESET),
+               "GadrasDecls::AnalysisMode does not match GadrasIsotopeID.h" );
+
+GADRAS_STUB_CHECK_FIELD( IsotopeIDResult, nIsotopes );
+GADRAS_STUB_CHECK_FIELD( IsotopeIDResult, listOfIsotopeStrings );
+GADRAS_STUB_CHECK_FIELD( IsotopeIDResult, listOfIsotopeTypes );
+GADRAS_STUB_CHECK_FIELD( IsotopeIDResult, isotopeCountRates );
+GADRAS_STUB_CHECK_FIELD( IsotopeIDResult, isotopeConfidences );
+GADRAS_STUB_CHECK_FIELD( IsotopeIDResult, chiSqr );
+GADRAS_STUB_CHECK_FIELD( IsotopeIDResult, alarmBasisDuration );
+
+GADRAS_STUB_CHECK_FIELD( PortalIsotopeIDOutput, chiSquare );
+GADRAS_STUB_CHECK_FIELD( PortalIsotopeIDOutput, threatProbabilityIndex );
+GADRAS_STUB_CHECK_FIELD( PortalIsotopeIDOutput, threatProbabilityString );
+GADRAS_STUB_CHECK_FIELD( PortalIsotopeIDOutput, eventType );
+GADRAS_STUB_CHECK_FIELD( PortalIsotopeIDOutput, alarmColor );
+GADRAS_STUB_CHECK_FIELD( PortalIsotopeIDOutput, alarmDescription );
+GADRAS_STUB_CHECK_FIELD( PortalIsotopeIDOutput, isotopeString );
+
+#undef GADRAS_STUB_CHECK_FIELD
+#else
+using GadrasDecls::AnalysisMode;
+using GadrasDecls::IsotopeIDResult;
+using GadrasDecls::PortalIsotopeIDOptions;
+using GadrasDecls::PortalPlotOptions;
+using GadrasDecls::PortalIsotopeIDOutput;
+#endif //GADRAS_STUB_CHECK_HEADER
+
+#ifdef _WIN32
+#define GADRAS_STUB_EXPORT extern "C" __declspec(dllexport)
+#define GADRAS_STUB_CALL __cdecl
+#else
+#define GADRAS_STUB_EXPORT extern "C" __attribute__((visibility("default")))
+#define GADRAS_STUB_CALL
+#endif
+
+using namespace std;
+
+namespace
+{
+  enum StubFunction
+  {
+    VersionNumber, InitCalibrated, InitRaw, StaticId, SearchId, Streaming,
+    GetResults, ClearResults, Rebin, Portal, NumStubFunctions
+  };//enum StubFunction
+
+  const char * const ns_function_names[NumStubFunctions] =
+  {
+    "gadrasversionnumber", "InitializeIsotopeIdCalibrated", "InitializeIsotopeIdRaw",
+    "StaticIsotopeID", "SearchIsotopeID", "StreamingSearch", "GetCurrentIsotopeIDResults",
+    "ClearIsotopeIDResults", "RebinUsingK40", "PortalIsotopeIDCInterface"
+  };
+
+
+  struct StubNuclide
+  {
+    string name;
+    string type;
+  };//struct StubNuclide
+
+
+  struct StubConfig
+  {
+    int latency_ms = 0;
+    int init_latency_ms = 0;
+    bool busy_wait = false;
+    vector<StubNuclide> nuclides;
+    int fail_every = 0;
+    int32_t fail_code = -1;
+    int32_t init_fail_code = 0;
+    int32_t k40_code = 0;
+    int32_t version = 18811;
+    string record_path;
+  };//struct StubConfig
+
+
+  int env_int( const char *name, const int default_value )
+  {
+    const char *val = std::getenv( name );
+    if( !val || !val[0] )
+      return default_value;
+
+    char *end = nullptr;
+    const long answer = std::strtol( val, &end, 10 );
+    if( end == val )
+    {
+      fprintf( stderr, "GADRAS stub: invalid value '%s' for %s; using %i\n", val, name, default_value );
+      return default_value;
+    }
+
+    return static_cast<int>( answer );
+  }//env_int(...)
+
+
+  StubConfig read_config()
+  {
+    StubConfig config;
+    config.latency_ms = std::max( 0, env_int( "GADRAS_STUB_LATENCY_MS", 0 ) );
+    config.init_latency_ms = std::max( 0, env_int( "GADRAS_STUB_INIT_LATENCY_MS", 0 ) );
+    config.busy_wait = (env_int( "GADRAS_STUB_BUSY_WAIT", 0 ) != 0);
+    config.fail_every = std::max( 0, env_int( "GADRAS_STUB_FAIL_EVERY", 0 ) );
+    config.fail_code = env_int( "GADRAS_STUB_FAIL_CODE", -1 );
+    config.init_fail_code = env_int( "GADRAS_STUB_INIT_FAIL_CODE", 0 );
+    config.k40_code = env_int( "GADRAS_STUB_K40_CODE", 0 );
+    config.version = env_int( "GADRAS_STUB_VERSION", 18811 );
+
+    const char *record = std::getenv( "GADRAS_STUB_RECORD" );
+    if( record )
+      config.record_path = record;
+
+    const char *isos = std::getenv( "GADRAS_STUB_ISOTOPES" );
+    string isos_str = (isos && isos[0]) ? isos
+                       : "Cs137:Industrial,Co60:Industrial,Ba133:Industrial,"
+                         "K40:NORM,Ra226:NORM,Am241:Industrial";
+
+    stringstream strm( isos_str );
+    string field;
+    while( std::getline( strm, field, ',' ) )
+    {
+      const size_t colon_pos = field.find( ':' );
+      StubNuclide nuc;
+      nuc.name = field.substr( 0, colon_pos );
+      nuc.type = (colon_pos == string::npos) ? string("Unknown") : field.substr( colon_pos + 1 );
+
+      // The isotope strings get split on ',' and '+' and parsed for "(H)" etc, so dont allow those.
+      if( !nuc.name.empty() && (nuc.name.find_first_of( "+()" ) == string::npos) )
+        config.nuclides.push_back( nuc );
+    }//while( std::getline( strm, field, ',' ) )
+
+    return config;
+  }//StubConfig read_config()
+
+
+  const StubConfig &config()
+  {
+    static const StubConfig s_config = read_config();
+    return s_config;
+  }
+
+
+  std::atomic<int64_t> ns_call_counts[NumStubFunctions];
+  std::atomic<int64_t> ns_analysis_calls( 0 );
+  std::atomic<int64_t> ns_record_sequence( 0 );
+
+  std::mutex ns_record_mutex;
+
+  // The "current" results, as returned by GetCurrentIsotopeIDResults, along with the number of
+  //  channels and detectors the last initialization was for; protected by ns_state_mutex.
+  std::mutex ns_state_mutex;
+  int32_t ns_nchannel = 0;
+  int32_t ns_ndetectors = 1;
+  vector<size_t> ns_current_nuclides;
+  vector<char> ns_current_confidences;
+  float ns_current_rate = 0.0f;
+  float ns_current_live_time = 0.0f;
+
+
+  void record_call( const StubFunction fcn, const string &args )
+  {
+    ++ns_call_counts[fcn];
+
+    const StubConfig &conf = config();
+    if( conf.record_path.empty() )
+      return;
+
+    std::lock_guard<std::mutex> lock( ns_record_mutex );
+    ofstream output( conf.record_path.c_str(), ios::out | ios::app );
+    if( output )
+      output << ++ns_record_sequence << "\t" << ns_function_names[fcn] << "\t" << args << "\n";
+  }//void record_call(...)
+
+
+  void simulate_work( const int milliseconds )
+  {
+    if( milliseconds <= 0 )
+      return;
+
+    const auto duration = std::chrono::milliseconds( milliseconds );
+    if( !config().busy_wait )
+    {
+      std::this_thread::sleep_for( duration );
+      return;
+    }
+
+    const auto end_time = std::chrono::steady_clock::now() + duration;
+    volatile double dummy = 0.0;
+    while( std::chrono::steady_clock::now() < end_time )
+    {
+      for( int i = 0; i < 1000; ++i )
+        dummy = dummy + std::sqrt( static_cast<double>(i) );
+    }
+  }//void simulate_work( const int milliseconds )
+
+
+  /** Returns true if this analysis call should have an error injected, in which case the current
+   results are also cleared, like a failed analysis would.
+   */
+  bool inject_failure()
+  {
+    const int fail_every = config().fail_every;
+    const int64_t ncalls = ++ns_analysis_calls;
+    if( (fail_every <= 0) || ((ncalls % fail_every) != 0) )
+      return false;
+
+    std::lock_guard<std::mutex> lock( ns_state_mutex );
+    ns_current_nuclides.clear();
+    ns_current_confidences.clear();
+    ns_current_rate = ns_current_live_time = 0.0f;
+
+    return true;
+  }//bool inject_failure()
+
+
+  /** FNV-1a hash of a block of memory, used to make results a deterministic function of input. */
+  uint64_t hash_bytes( const void *data, const size_t nbytes, uint64_t hash = 14695981039346656037ULL )
+  {
+    const unsigned char *bytes = static_cast<const unsigned char *>( data );
+    for( size_t i = 0; i < nbytes; ++i )
+    {
+      hash ^= bytes[i];
+      hash *= 1099511628211ULL;
+    }
+    return hash;
+  }//hash_bytes(...)
+
+
+  template<class T>
+  double sum_array( const T *values, const size_t n )
+  {
+    double sum = 0.0;
+    for( size_t i = 0; values && (i < n); ++i )
+      sum += values[i];
+    return sum;
+  }//sum_array(...)
+
+
+  /** Picks the result nuclides and confidences from the input hash, sets them as the "current"
+   results, and returns the GADRAS style isotope string (e.g., "Cs137(H)+Ba133(F)", or "None").
+   */
+  string make_result( const uint64_t hash, const double total_counts, const float live_time )
+  {
+    const vector<StubNuclide> &nuclides = config().nuclides;
+
+    vector<size_t> indices;
+    vector<char> confidences;
+
+    // A quarter of inputs get no nuclides, the rest get between one and three.
+    if( !nuclides.empty() && ((hash % 4) != 0) )
+    {
+      const size_t nwanted = std::min( nuclides.size(), static_cast<size_t>(1 + ((hash >> 2) % 3)) );
+      const size_t start = static_cast<size_t>( (hash >> 8) % nuclides.size() );
+      const char conf_letters[3] = { 'H', 'F', 'L' };
+
+      for( size_t i = 0; i < nwanted; ++i )
+      {
+        indices.push_back( (start + i) % nuclides.size() );
+        confidences.push_back( conf_letters[(hash >> (16 + 2*i)) % 3] );
+      }
+    }//if( we will give some nuclides )
+
+    string isostr;
+    for( size_t i = 0; i < indices.size(); ++i )
+      isostr += (i ? "+" : "") + nuclides[indices[i]].name + "(" + confidences[i] + ")";
+    if( isostr.empty() )
+      isostr = "None";
+
+    std::lock_guard<std::mutex> lock( ns_state_mutex );
+    ns_current_nuclides = indices;
+    ns_current_confidences = confidences;
+    ns_current_live_time = live_time;
+    ns_current_rate = (live_time > 0.0f) ? static_cast<float>(total_counts / live_time) : 0.0f;
+
+    return isostr;
+  }//string make_result(...)
+
+
+  /** Returns a malloc'ed copy of the string, as callers free() the strings GADRAS returns. */
+  char *malloc_str( const string &str )
+  {
+    char *answer = static_cast<char *>( std::malloc( str.size() + 1 ) );
+    if( answer )
+      memcpy( answer, str.c_str(), str.size() + 1 );
+    return answer;
+  }//char *malloc_str( const string &str )
+
+
+  void copy_to_static_str( char *dest, const size_t dest_size, const string &src )
+  {
+    if( !dest || !dest_size )
+      return;
+
+    const size_t len = std::min( dest_size - 1, src.size() );
+    memcpy( dest, src.c_str(), len );
+    dest[len] = '\0';
+  }//copy_to_static_str(...)
+
+
+  int32_t do_init( const StubFunction fcn, const char *app_folder, const char *drf,
+                  const int32_t nchannel, const int32_t ndet, const char *cal_tag )
+  {
+    string args = "app=" + string(app_folder ? app_folder : "")
+                  + "\tdrf=" + string(drf ? drf : "")
+                  + "\tnchannel=" + std::to_string(nchannel)
+                  + "\tndet=" + std::to_string(ndet);
+    if( cal_tag )
+      args += "\tcalTag=" + string(cal_tag);
+
+    record_call( fcn, args );
+    simulate_work( config().init_latency_ms );
+
+    if( config().init_fail_code != 0 )
+      return config().init_fail_code;
+
+    if( (nchannel <= 0) || (ndet <= 0) )
+      return -2;
+
+    std::lock_guard<std::mutex> lock( ns_state_mutex );
+    ns_nchannel = nchannel;
+    ns_ndetectors = ndet;
+    ns_current_nuclides.clear();
+    ns_current_confidences.clear();
+
+    return 0;
+  }//do_init(...)
+
+
+  std::pair<int32_t,int32_t> current_dimensions()
+  {
+    std::lock_guard<std::mutex> lock( ns_state_mutex );
+    return { ns_nchannel, ns_ndetectors };
+  }
+}//namespace
+
+
+GADRAS_STUB_EXPORT int32_t GADRAS_STUB_CALL gadrasversionnumber()
+{
+  record_call( VersionNumber, "" );
+  return config().version;
+}
+
+
+GADRAS_STUB_EXPORT int32_t GADRAS_STUB_CALL InitializeIsotopeIdCalibrated( const char *applicationFolder,
+                                                           const char *detectorName,
+                                                           int32_t numChannels )
+{
+  return do_init( InitCalibrated, applicationFolder, detectorName, numChannels, 1, nullptr );
+}
+
+
+GADRAS_STUB_EXPORT int32_t GADRAS_STUB_CALL InitializeIsotopeIdRaw( const char *applicationFolder,
+                                                    const char *detectorName,
+                                                    int32_t nChannels, int32_t nDetectors,
+                                                    const char *calTag )
+{
+  return do_init( InitRaw, applicationFolder, detectorName, nChannels, nDetectors, calTag );
+}
+
+
+GADRAS_STUB_EXPORT int32_t GADRAS_STUB_CALL StaticIsotopeID( float tl, float tt, float foregroundSpectrum[],
+                                             float tlb, float ttb, float backgroundSpectrum[],
+                                             float *SOI, char **isotopeStr,
+                                             float rebinnedEnergyGroups[],
+                                             int neutronsForeground, int neutronsBackground,
+                                             float *rateNotNorm )
+{
+  const size_t nchannel = static_cast<size_t>( std::max( 0, current_dimensions().first ) );
+  const double fore_sum = sum_array( foregroundSpectrum, nchannel );
+  const double back_sum = sum_array( backgroundSpectrum, nchannel );
+
+  record_call( StaticId, "nchannel=" + std::to_string(nchannel)
+                         + "\tlt=" + std::to_string(tl) + "\trt=" + std::to_string(tt)
+                         + "\tsum=" + std::to_string(fore_sum)
+                         + "\tback_lt=" + std::to_string(tlb) + "\tback_rt=" + std::to_string(ttb)
+                         + "\tback_sum=" + std::to_string(back_sum)
+                         + "\tneutrons=" + std::to_string(neutronsForeground)
+                         + "\tback_neutrons=" + std::to_string(neutronsBackground)
+                         + "\tlower_energy=" + std::to_string(rebinnedEnergyGroups ? rebinnedEnergyGroups[0] : 0.0f) );
+
+  simulate_work( config().latency_ms );
+
+  if( !nchannel || !foregroundSpectrum || !backgroundSpectrum )
+    return -1;
+
+  if( inject_failure() )
+    return config().fail_code;
+
+  uint64_t hash = hash_bytes( foregroundSpectrum, nchannel*sizeof(float) );
+  hash = hash_bytes( &tl, sizeof(tl), hash );
+
+  const string isostr = make_result( hash, fore_sum, tl );
+
+  if( isotopeStr )
+    *isotopeStr = malloc_str( isostr );
+  if( SOI )
+    *SOI = (tlb > 0.0f && tl > 0.0f) ? static_cast<float>((fore_sum/tl) / std::max(back_sum/tlb, 1.0)) : 0.0f;
+  if( rateNotNorm )
+    *rateNotNorm = (tl > 0.0f) ? static_cast<float>(fore_sum / tl) : 0.0f;
+
+  return 0;
+}//StaticIsotopeID(...)
+
+
+GADRAS_STUB_EXPORT int32_t GADRAS_STUB_CALL SearchIsotopeID( float tl, float tt, float *spectrum, float *SOI,
+                                             char **isotopeStr, int mode, float *energyGroups,
+                                             int neutrons, float *rateNotNorm )
+{
+  const size_t nchannel = static_cast<size_t>( std::max( 0, current_dimensions().first ) );
+  const double sum = sum_array( spectrum, nchannel );
+
+  record_call( SearchId, "mode=" + std::to_string(mode) + "\tnchannel=" + std::to_string(nchannel)
+                         + "\tlt=" + std::to_string(tl) + "\trt=" + std::to_string(tt)
+                         + "\tsum=" + std::to_string(sum) + "\tneutrons=" + std::to_string(neutrons)
+                         + "\tlower_energy=" + std::to_string(energyGroups ? energyGroups[0] : 0.0f) );
+
+  if( !nchannel || !spectrum )
+    return -1;
+
+  // Initialization calls dont give results, or use the isotope string.
+  if( mode == AnalysisMode::INITIALIZE )
+    return 0;
+
+  simulate_work( config().latency_ms );
+
+  if( inject_failure() )
+    return config().fail_code;
+
+  uint64_t hash = hash_bytes( spectrum, nchannel*sizeof(float) );
+  hash = hash_bytes( &tl, sizeof(tl), hash );
+
+  const string isostr = make_result( hash, sum, tl );
+
+  if( isotopeStr )
+    *isotopeStr = malloc_str( isostr );
+  if( SOI )
+    *SOI = 0.0f;
+  if( rateNotNorm )
+    *rateNotNorm = (tl > 0.0f) ? static_cast<float>(sum / tl) : 0.0f;
+
+  return 0;
+}//SearchIsotopeID(...)
+
+
+GADRAS_STUB_EXPORT int32_t GADRAS_STUB_CALL StreamingSearch( float *liveTimes, float *realTimes,
+                                             int32_t *spectrumBuffer, float *SOI,
+                                             char **isotopeStr, float *energyMax, int mode,
+                                             int32_t *detectorStatus, int32_t neutrons,
+                                             float *rateNotNorm )
+{
+  const auto dims = current_dimensions();
+  const size_t nchannel = static_cast<size_t>( std::max( 0, dims.first ) );
+  const size_t ndet = static_cast<size_t>( std::max( 0, dims.second ) );
+  const double sum = sum_array( spectrumBuffer, nchannel*ndet );
+  const double live_time = sum_array( liveTimes, ndet );
+  const double real_time = sum_array( realTimes, ndet );
+
+  record_call( Streaming, "mode=" + std::to_string(mode) + "\tnchannel=" + std::to_string(nchannel)
+                          + "\tndet=" + std::to_string(ndet)
+                          + "\tlt=" + std::to_string(live_time) + "\trt=" + std::to_string(real_time)
+                          + "\tsum=" + std::to_string(sum) + "\tneutrons=" + std::to_string(neutrons)
+                          + "\tenergy_max=" + std::to_string(energyMax ? energyMax[0] : 0.0f) );
+
+  if( !nchannel || !ndet || !spectrumBuffer || !liveTimes )
+    return -1;
+
+  for( size_t i = 0; detectorStatus && (i < ndet); ++i )
+    detectorStatus[i] = 0;
+
+  if( mode == AnalysisMode::INITIALIZE )
+    return 0;
+
+  simulate_work( config().latency_ms );
+
+  if( inject_failure() )
+    return config().fail_code;
+
+  uint64_t hash = hash_bytes( spectrumBuffer, nchannel*ndet*sizeof(int32_t) );
+  hash = hash_bytes( liveTimes, ndet*sizeof(float), hash );
+
+  const string isostr = make_result( hash, sum, static_cast<float>(live_time) );
+
+  if( isotopeStr )
+    *isotopeStr = malloc_str( isostr );
+  if( SOI )
+    *SOI = 0.0f;
+  if( rateNotNorm )
+    *rateNotNorm = (live_time > 0.0) ? static_cast<float>(sum / live_time) : 0.0f;
+
+  // Status code 0 is "Energy calibration was not performed"
+  return 0;
+}//StreamingSearch(...)
+
+
+GADRAS_STUB_EXPORT void GADRAS_STUB_CALL GetCurrentIsotopeIDResults( struct IsotopeIDResult *isotopeInfoOut )
+{
+  record_call( GetResults, "" );
+
+  if( !isotopeInfoOut )
+    return;
+
+  const size_t max_isotopes = GadrasDecls::MaxIsotopes;
+
+  // We only set the fields we know of, in case the callers struct has more.
+  for( size_t i = 0; i < max_isotopes; ++i )
+    isotopeInfoOut->isotopeCountRates[i] = isotopeInfoOut->isotopeConfidences[i] = 0.0f;
+
+  const vector<StubNuclide> &nuclides = config().nuclides;
+
+  std::lock_guard<std::mutex> lock( ns_state_mutex );
+
+  const size_t nisotopes = std::min( max_isotopes, ns_current_nuclides.size() );
+
+  string names, types;
+  for( size_t i = 0; i < nisotopes; ++i )
+  {
+    const StubNuclide &nuc = nuclides[ns_current_nuclides[i]];
+    names += (i ? "," : "") + nuc.name;
+    types += (i ? "," : "") + nuc.type;
+
+    const char conf = ns_current_confidences[i];
+    isotopeInfoOut->isotopeConfidences[i] = (conf == 'H') ? 9.0f : ((conf == 'F') ? 5.0f : 2.0f);
+    isotopeInfoOut->isotopeCountRates[i] = ns_current_rate / (i + 2);
+  }//for( size_t i = 0; i < nisotopes; ++i )
+
+  isotopeInfoOut->nIsotopes = static_cast<int32_t>( nisotopes );
+  isotopeInfoOut->chiSqr = nisotopes ? 1.0f + 0.1f*nisotopes : 0.0f;
+  isotopeInfoOut->alarmBasisDuration = ns_current_live_time;
+
+  // Callers only free() these if there are isotopes
+  isotopeInfoOut->listOfIsotopeStrings = nisotopes ? malloc_str( names ) : nullptr;
+  isotopeInfoOut->listOfIsotopeTypes = nisotopes ? malloc_str( types ) : nullptr;
+}//GetCurrentIsotopeIDResults(...)
+
+
+GADRAS_STUB_EXPORT void GADRAS_STUB_CALL ClearIsotopeIDResults()
+{
+  record_call( ClearResults, "" );
+
+  std::lock_guard<std::mutex> lock( ns_state_mutex );
+  ns_current_nuclides.clear();
+  ns_current_confidences.clear();
+  ns_current_rate = ns_current_live_time = 0.0f;
+}//ClearIsotopeIDResults()
+
+
+GADRAS_STUB_EXPORT int32_t GADRAS_STUB_CALL RebinUsingK40( int32_t nChannels, float liveTime, float *energies,
+                                           float *spectrum, float *rebinnedSpectrum,
+                                           float *centroidK40 )
+{
+  const size_t nchannel = static_cast<size_t>( std::max( 0, nChannels ) );
+
+  record_call( Rebin, "nchannel=" + std::to_string(nchannel)
+                      + "\tlt=" + std::to_string(liveTime)
+                      + "\tsum=" + std::to_string(sum_array( spectrum, nchannel ))
+                      + "\tlower_energy=" + std::to_string(energies && nchannel ? energies[0] : 0.0f)
+                      + "\tcentroid=" + std::to_string(centroidK40 ? *centroidK40 : 0.0f) );
+
+  if( !nchannel || !spectrum || !energies )
+    return 2;
+
+  if( rebinnedSpectrum )
+    memcpy( rebinnedSpectrum, spectrum, nchannel*sizeof(float) );
+
+  const int32_t code = config().k40_code;
+  if( (code == 0) && centroidK40 )
+    *centroidK40 = 1460.75f;
+
+  return code;
+}//RebinUsingK40(...)
+
+
+GADRAS_STUB_EXPORT int GADRAS_STUB_CALL PortalIsotopeIDCInterface( char *dbPath, char *pcfPath,
+                                                   struct PortalIsotopeIDOptions *options,
+                                                   int writePlotFlag,
+                                                   struct PortalPlotOptions *plotOptions,
+                                                   struct PortalIsotopeIDOutput *output,
+                                                   char *message )
+{
+  // Hash the PCF file contents, so results are a function of the data, and not the temp file name
+  uint64_t hash = 14695981039346656037ULL;
+  size_t file_size = 0;
+  if( pcfPath )
+  {
+    ifstream input( pcfPath, ios::in | ios::binary );
+    char buffer[4096];
+    while( input.read( buffer, sizeof(buffer) ) || input.gcount() )
+    {
+      const size_t nread = static_cast<size_t>( input.gcount() );
+      hash = hash_bytes( buffer, nread, hash );
+      file_size += nread;
+    }
+  }//if( pcfPath )
+
+  record_call( Portal, "db=" + string(dbPath ? dbPath : "")
+                       + "\tpcf=" + string(pcfPath ? pcfPath : "")
+                       + "\tpcf_bytes=" + std::to_string(file_size)
+                       + "\twritePlot=" + std::to_string(writePlotFlag)
+                       + "\thaveOptions=" + std::to_string(options != nullptr)
+                       + "\thavePlotOptions=" + std::to_string(plotOptions != nullptr) );
+
+  simulate_work( config().latency_ms );
+
+  if( !output || !file_size )
+  {
+    copy_to_static_str( message, 1024, "GADRAS stub: could not read PCF file" );
+    return -1;
+  }
+
+  if( inject_failure() )
+  {
+    copy_to_static_str( message, 1024, "GADRAS stub: injected failure" );
+    return config().fail_code;
+  }
+
+  const string isostr = make_result( hash, static_cast<double>(file_size), 1.0f );
+  const bool alarm = (isostr != "None");
+
+  // The caller allocates the output strings; the sizes here are the smallest used in Analysis.cpp
+  copy_to_static_str( output->isotopeString, 129, isostr );
+  copy_to_static_str( output->eventType, 17, alarm ? "Gamma" : "None" );
+  copy_to_static_str( output->alarmColor, 17, alarm ? "Red" : "Green" );
+  copy_to_static_str( output->alarmDescription, 17, alarm ? "Gamma Alarm" : "No Alarm" );
+  copy_to_static_str( output->threatProbabilityString, 13, alarm ? "Medium" : "Low" );
+  output->chiSquare = alarm ? 1.2f : 0.0f;
+  output->threatProbabilityIndex = alarm ? 1 : 0;
+
+  copy_to_static_str( message, 1024, "GADRAS stub analysis" );
+
+  return 0;
+}//PortalIsotopeIDCInterface(...)
+
+
+GADRAS_STUB_EXPORT int64_t GADRAS_STUB_CALL GadrasStubCallCount( const char *function )
+{
+  int64_t total = 0;
+  for( int i = 0; i < NumStubFunctions; ++i )
+  {
+    if( !function || !function[0] )
+      total += ns_call_counts[i];
+    else if( strcmp( function, ns_function_names[i] ) == 0 )
+      return ns_call_counts[i];
+  }
+
+  return total;
+}//GadrasStubCallCount(...)
+
+
+GADRAS_STUB_EXPORT void GADRAS_STUB_CALL GadrasStubResetCounts()
+{
+  for( int i = 0; i < NumStubFunctions; ++i )
+    ns_call_counts[i] = 0;
+  ns_analysis_calls = 0;
+}//GadrasStubResetCounts()
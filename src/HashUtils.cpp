@@ -0,0 +1,176 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include "FullSpectrumId/HashUtils.h"
+
+using namespace std;
+
+
+namespace
+{
+  const uint32_t ns_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+  };
+  
+  inline uint32_t rotr( const uint32_t x, const int n )
+  {
+    return (x >> n) | (x << (32 - n));
+  }
+  
+  /** Processes one 64 byte block into the hash state. */
+  void sha256_block( uint32_t state[8], const unsigned char *block )
+  {
+    uint32_t w[64];
+    for( int i = 0; i < 16; ++i )
+      w[i] = (uint32_t(block[4*i]) << 24) | (uint32_t(block[4*i+1]) << 16)
+             | (uint32_t(block[4*i+2]) << 8) | uint32_t(block[4*i+3]);
+    
+    for( int i = 16; i < 64; ++i )
+    {
+      const uint32_t s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+      const uint32_t s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+      w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    
+    for( int i = 0; i < 64; ++i )
+    {
+      const uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+      const uint32_t ch = (e & f) ^ (~e & g);
+      const uint32_t t1 = h + s1 + ch + ns_sha256_k[i] + w[i];
+      const uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+      const uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      const uint32_t t2 = s0 + maj;
+      
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }//for( int i = 0; i < 64; ++i )
+    
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+  }//void sha256_block(...)
+}//namespace
+
+
+namespace HashUtils
+{
+
+uint64_t murmur64( const char *data, const size_t len, const uint64_t seed )
+{
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  
+  uint64_t h = seed ^ (len * m);
+  
+  const size_t nblocks = len / 8;
+  for( size_t i = 0; i < nblocks; ++i )
+  {
+    uint64_t k;
+    memcpy( &k, data + 8*i, sizeof(k) );
+    
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    
+    h ^= k;
+    h *= m;
+  }//for( size_t i = 0; i < nblocks; ++i )
+  
+  const unsigned char *tail = reinterpret_cast<const unsigned char *>( data + 8*nblocks );
+  switch( len & 7 )
+  {
+    case 7: h ^= uint64_t(tail[6]) << 48; [[fallthrough]];
+    case 6: h ^= uint64_t(tail[5]) << 40; [[fallthrough]];
+    case 5: h ^= uint64_t(tail[4]) << 32; [[fallthrough]];
+    case 4: h ^= uint64_t(tail[3]) << 24; [[fallthrough]];
+    case 3: h ^= uint64_t(tail[2]) << 16; [[fallthrough]];
+    case 2: h ^= uint64_t(tail[1]) << 8;  [[fallthrough]];
+    case 1: h ^= uint64_t(tail[0]);
+      h *= m;
+  }//switch( len & 7 )
+  
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  
+  return h;
+}//uint64_t murmur64(...)
+
+
+std::string sha256_hex( const char *data, const size_t len )
+{
+  uint32_t state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  
+  const unsigned char *bytes = reinterpret_cast<const unsigned char *>( data );
+  
+  const size_t nblocks = len / 64;
+  for( size_t i = 0; i < nblocks; ++i )
+    sha256_block( state, bytes + 64*i );
+  
+  // The remaining bytes, then 0x80, zeros, and the message length in bits, big-endian, padded
+  //  out to one or two blocks.
+  unsigned char tail[128] = { 0 };
+  const size_t nleft = len - 64*nblocks;
+  if( nleft )
+    memcpy( tail, bytes + 64*nblocks, nleft );
+  tail[nleft] = 0x80;
+  
+  const size_t tail_len = (nleft < 56) ? 64 : 128;
+  const uint64_t nbits = static_cast<uint64_t>( len ) * 8;
+  for( int i = 0; i < 8; ++i )
+    tail[tail_len - 1 - i] = static_cast<unsigned char>( nbits >> (8*i) );
+  
+  for( size_t i = 0; i < tail_len; i += 64 )
+    sha256_block( state, tail + i );
+  
+  char hex[65];
+  for( int i = 0; i < 8; ++i )
+    snprintf( hex + 8*i, 9, "%08x", static_cast<unsigned int>( state[i] ) );
+  
+  return string( hex, 64 );
+}//std::string sha256_hex(...)
+
+}//namespace HashUtils
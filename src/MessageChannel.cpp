@@ -0,0 +1,405 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#include "SpecUtils/StringAlgo.h"
+
+#include "FullSpectrumId/MessageChannel.h"
+#include "FullSpectrumId/AnalysisSerialization.h"
+
+using namespace std;
+
+using AnalysisSerialization::Reader;
+using AnalysisSerialization::Writer;
+
+#if( !defined(_WIN32) && !defined(MSG_NOSIGNAL) )
+#define MSG_NOSIGNAL 0
+#endif
+
+
+#ifndef _WIN32
+namespace
+{
+  /** Blocking write of all the data; returns false on error. */
+  bool write_all( const int fd, const char *data, size_t len, const bool is_socket )
+  {
+    while( len )
+    {
+      const ssize_t nwritten = is_socket ? send( fd, data, len, MSG_NOSIGNAL ) : write( fd, data, len );
+      if( nwritten < 0 )
+      {
+        if( errno == EINTR )
+          continue;
+        return false;
+      }
+
+      data += nwritten;
+      len -= static_cast<size_t>( nwritten );
+    }//while( len )
+
+    return true;
+  }//write_all(...)
+
+
+  /** Blocking read of exactly len bytes; returns false on error or EOF. */
+  bool read_all( const int fd, char *data, size_t len )
+  {
+    while( len )
+    {
+      const ssize_t nread = read( fd, data, len );
+      if( nread < 0 && errno == EINTR )
+        continue;
+      if( nread <= 0 )
+        return false;
+
+      data += nread;
+      len -= static_cast<size_t>( nread );
+    }//while( len )
+
+    return true;
+  }//read_all(...)
+}//namespace
+
+
+namespace MessageChannel
+{
+
+bool write_frame( const int fd, const string &msg, const bool is_socket )
+{
+  string length;
+  Writer( length ).u64( msg.size() );
+  return write_all( fd, length.data(), length.size(), is_socket )
+         && write_all( fd, msg.data(), msg.size(), is_socket );
+}//write_frame(...)
+
+
+bool read_frame( const int fd, string &msg )
+{
+  string length( 8, '\0' );
+  if( !read_all( fd, &length[0], length.size() ) )
+    return false;
+
+  const uint64_t msg_size = Reader( length ).u64();
+  if( msg_size > sm_max_message_size )
+    return false;
+
+  msg.resize( static_cast<size_t>( msg_size ) );
+  return msg.empty() || read_all( fd, &msg[0], msg.size() );
+}//read_frame(...)
+
+
+void set_non_blocking( const int fd )
+{
+  const int flags = fcntl( fd, F_GETFL, 0 );
+  fcntl( fd, F_SETFL, flags | O_NONBLOCK );
+}
+
+
+int poll_timeout_ms( const std::chrono::steady_clock::time_point &deadline, const int max_ms )
+{
+  const auto remaining = deadline - std::chrono::steady_clock::now();
+  const long long ms = std::chrono::duration_cast<std::chrono::milliseconds>( remaining ).count() + 1;
+  return static_cast<int>( std::min( std::max( ms, 0LL ), static_cast<long long>(max_ms) ) );
+}//int poll_timeout_ms(...)
+
+
+void parse_address( const std::string &address, bool &is_unix, std::string &path,
+                    std::string &host, std::string &port )
+{
+  is_unix = SpecUtils::istarts_with( address, "unix:" );
+  if( is_unix )
+  {
+    path = address.substr( 5 );
+    if( path.empty() || (path.size() >= sizeof(sockaddr_un::sun_path)) )
+      throw runtime_error( "Invalid Unix socket path in address '" + address + "'" );
+    return;
+  }
+
+  const string hostport = SpecUtils::istarts_with( address, "tcp:" ) ? address.substr( 4 ) : address;
+  const size_t colon = hostport.rfind( ':' );
+  if( (colon == string::npos) || ((colon + 1) == hostport.size()) )
+    throw runtime_error( "Invalid address '" + address + "'; must be like 'unix:/path', or 'tcp:host:port'" );
+
+  host = hostport.substr( 0, colon );
+  port = hostport.substr( colon + 1 );
+
+  // Allow "[::1]:9000"
+  if( (host.size() >= 2) && (host.front() == '[') && (host.back() == ']') )
+    host = host.substr( 1, host.size() - 2 );
+}//void parse_address(...)
+
+
+int listen_on( const std::string &address )
+{
+  bool is_unix;
+  string path, host, port;
+  parse_address( address, is_unix, path, host, port );
+
+  if( is_unix )
+  {
+    // Remove a socket left over from a previous run, but dont remove anything else.
+    struct stat info;
+    if( (lstat( path.c_str(), &info ) == 0) && S_ISSOCK(info.st_mode) )
+      unlink( path.c_str() );
+
+    const int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if( fd < 0 )
+      throw runtime_error( "Failed to create socket: " + string(strerror(errno)) );
+
+    sockaddr_un addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    strncpy( addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1 );
+
+    if( (::bind( fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr) ) != 0)
+        || (listen( fd, 64 ) != 0) )
+    {
+      const string msg = strerror( errno );
+      close( fd );
+      throw runtime_error( "Failed to listen on '" + path + "': " + msg );
+    }
+
+    return fd;
+  }//if( is_unix )
+
+  addrinfo hints;
+  memset( &hints, 0, sizeof(hints) );
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  addrinfo *results = nullptr;
+  const int rc = getaddrinfo( host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &results );
+  if( rc != 0 )
+    throw runtime_error( "Invalid address '" + address + "': " + string(gai_strerror(rc)) );
+
+  string error_msg = "no addresses";
+  for( addrinfo *ai = results; ai; ai = ai->ai_next )
+  {
+    const int fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+    if( fd < 0 )
+      continue;
+
+    const int one = 1;
+    setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+
+    if( (::bind( fd, ai->ai_addr, ai->ai_addrlen ) == 0) && (listen( fd, 64 ) == 0) )
+    {
+      freeaddrinfo( results );
+      return fd;
+    }
+
+    error_msg = strerror( errno );
+    close( fd );
+  }//for( loop over addresses )
+
+  freeaddrinfo( results );
+  throw runtime_error( "Failed to listen on '" + address + "': " + error_msg );
+}//int listen_on( const std::string &address )
+
+
+int connect_to( const std::string &address )
+{
+  bool is_unix;
+  string path, host, port;
+  parse_address( address, is_unix, path, host, port );
+
+  if( is_unix )
+  {
+    const int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if( fd < 0 )
+      return -1;
+
+    sockaddr_un addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    strncpy( addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1 );
+
+    if( connect( fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr) ) != 0 )
+    {
+      close( fd );
+      return -1;
+    }
+
+    return fd;
+  }//if( is_unix )
+
+  addrinfo hints;
+  memset( &hints, 0, sizeof(hints) );
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  addrinfo *results = nullptr;
+  if( getaddrinfo( host.c_str(), port.c_str(), &hints, &results ) != 0 )
+    return -1;
+
+  int fd = -1;
+  for( addrinfo *ai = results; ai && (fd < 0); ai = ai->ai_next )
+  {
+    fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+    if( fd < 0 )
+      continue;
+
+    if( connect( fd, ai->ai_addr, ai->ai_addrlen ) != 0 )
+    {
+      close( fd );
+      fd = -1;
+      continue;
+    }
+
+    // Heartbeats and results are small; dont let Nagle delay them.
+    const int one = 1;
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+  }//for( loop over addresses )
+
+  freeaddrinfo( results );
+  return fd;
+}//int connect_to( const std::string &address )
+
+
+Channel::Channel( const int socket_fd )
+  : fd( socket_fd ),
+    in(),
+    in_pos( 0 ),
+    out(),
+    out_pos( 0 )
+{
+  set_non_blocking( fd );
+}
+
+
+Channel::~Channel()
+{
+  if( fd >= 0 )
+    close( fd );
+}
+
+
+bool Channel::wants_write() const
+{
+  return out_pos < out.size();
+}
+
+
+void Channel::queue_frame( const string &msg )
+{
+  if( out_pos == out.size() )
+  {
+    out.clear();
+    out_pos = 0;
+  }
+
+  Writer( out ).u64( msg.size() );
+  out += msg;
+}//void Channel::queue_frame( const string &msg )
+
+
+bool Channel::read_available()
+{
+  char buffer[64*1024];
+  while( true )
+  {
+    const ssize_t nread = read( fd, buffer, sizeof(buffer) );
+    if( nread > 0 )
+    {
+      in.append( buffer, static_cast<size_t>(nread) );
+      continue;
+    }
+
+    if( nread < 0 && errno == EINTR )
+      continue;
+
+    if( nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+      return true;
+
+    return false;
+  }//while( true )
+}//bool Channel::read_available()
+
+
+bool Channel::write_available()
+{
+  while( out_pos < out.size() )
+  {
+    const ssize_t nwritten = send( fd, out.data() + out_pos, out.size() - out_pos, MSG_NOSIGNAL );
+    if( nwritten < 0 && errno == EINTR )
+      continue;
+    if( nwritten < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+      return true;
+    if( nwritten < 0 )
+      return false;
+    out_pos += static_cast<size_t>( nwritten );
+  }//while( out_pos < out.size() )
+
+  return true;
+}//bool Channel::write_available()
+
+
+bool Channel::pop_frame( string &msg )
+{
+  if( (in.size() - in_pos) < 8 )
+    return false;
+
+  Reader length( in );
+  length.pos = in_pos;
+  const uint64_t msg_size = length.u64();
+  if( msg_size > sm_max_message_size )
+    throw runtime_error( "Invalid message length (" + std::to_string(msg_size) + " bytes)" );
+
+  if( (in.size() - in_pos - 8) < msg_size )
+    return false;
+
+  msg = in.substr( in_pos + 8, static_cast<size_t>(msg_size) );
+  in_pos += 8 + static_cast<size_t>(msg_size);
+
+  if( in_pos == in.size() )
+  {
+    in.clear();
+    in_pos = 0;
+  }
+
+  return true;
+}//bool Channel::pop_frame( string &msg )
+
+}//namespace MessageChannel
+#endif //#ifndef _WIN32
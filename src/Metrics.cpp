@@ -0,0 +1,92 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <map>
+#include <mutex>
+#include <vector>
+#include <utility>
+
+#include <Wt/WString.h>
+#include <Wt/WLogger.h>
+
+#include "FullSpectrumId/Metrics.h"
+
+using namespace std;
+
+
+namespace
+{
+  std::mutex ns_sources_mutex;
+  map<string,function<Wt::Json::Value()>> ns_sources;
+}//namespace
+
+
+namespace Metrics
+{
+
+void add_source( const std::string &name, std::function<Wt::Json::Value()> source )
+{
+  std::lock_guard<std::mutex> lock( ns_sources_mutex );
+  ns_sources[name] = std::move( source );
+}
+
+
+void remove_source( const std::string &name )
+{
+  std::lock_guard<std::mutex> lock( ns_sources_mutex );
+  ns_sources.erase( name );
+}
+
+
+Wt::Json::Object to_json()
+{
+  // Copy the sources so we dont hold the lock while calling them.
+  vector<pair<string,function<Wt::Json::Value()>>> sources;
+  {
+    std::lock_guard<std::mutex> lock( ns_sources_mutex );
+    sources.insert( end(sources), begin(ns_sources), end(ns_sources) );
+  }
+
+  Wt::Json::Object metrics;
+  for( const auto &name_source : sources )
+  {
+    try
+    {
+      metrics[name_source.first] = name_source.second();
+    }catch( std::exception &e )
+    {
+      Wt::log("error:app") << "Error getting metrics '" << name_source.first << "': " << e.what();
+
+      Wt::Json::Object error;
+      error["error"] = Wt::WString::fromUTF8( e.what() );
+      metrics[name_source.first] = std::move( error );
+    }//try / catch
+  }//for( const auto &name_source : sources )
+
+  return metrics;
+}//Wt::Json::Object to_json()
+
+}//namespace Metrics
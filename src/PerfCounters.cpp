@@ -0,0 +1,334 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <cerrno>
+
+#if( defined(__linux__) )
+#include <unistd.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "SpecUtils/Filesystem.h"
+#include "FullSpectrumId/EngineLog.h"
+#include "FullSpectrumId/PerfCounters.h"
+
+using namespace std;
+
+namespace
+{
+  const size_t ns_num_counters = PerfCounters::CallScope::sm_num_counters;
+
+  /** The JSON names of the counters, indexed the same as in open_counter(). */
+  const char * const ns_counter_names[ns_num_counters] = {
+    "cycles", "instructions", "cacheMisses", "pageFaults"
+  };
+
+  std::atomic<bool> ns_enabled( false );
+  std::atomic<bool> ns_counter_available[ns_num_counters];
+
+
+  /** Accumulated values for a single DRF and call type. */
+  struct Totals
+  {
+    uint64_t calls = 0;
+    uint64_t wall_ns = 0;
+
+    /** Sum of the (scaled) counter values. */
+    double counts[ns_num_counters] = { 0.0, 0.0, 0.0, 0.0 };
+
+    /** The number of calls that had a valid reading for each counter. */
+    uint64_t counted_calls[ns_num_counters] = { 0, 0, 0, 0 };
+  };//struct Totals
+
+  std::mutex ns_totals_mutex;
+  map<pair<string,PerfCounters::CallType>,Totals> ns_totals;
+
+
+  uint64_t wall_now_ns()
+  {
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return static_cast<uint64_t>( std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() );
+  }
+
+
+#if( defined(__linux__) )
+  int open_counter( const size_t index )
+  {
+    struct perf_event_attr attr;
+    memset( &attr, 0, sizeof(attr) );
+    attr.size = sizeof(attr);
+
+    switch( index )
+    {
+      case 0: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_CPU_CYCLES;   break;
+      case 1: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+      case 2: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+      case 3: attr.type = PERF_TYPE_SOFTWARE; attr.config = PERF_COUNT_SW_PAGE_FAULTS;  break;
+      default: return -1;
+    }//switch( index )
+
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.disabled = 0;
+    attr.inherit = 0;
+    attr.exclude_kernel = 1; //Kernel counting is usually not allowed for unprivileged users
+    attr.exclude_hv = 1;
+
+    // Count for this thread, on whatever CPU it runs on.
+    const long fd = syscall( __NR_perf_event_open, &attr, 0, -1, -1, 0 );
+    return static_cast<int>( fd );
+  }//int open_counter( const size_t index )
+#endif //#if( defined(__linux__) )
+
+
+  /** The counters for the current thread; opened the first time they are used. */
+  struct ThreadCounters
+  {
+    int fds[ns_num_counters] = { -1, -1, -1, -1 };
+    bool opened = false;
+
+    void open()
+    {
+      opened = true;
+#if( defined(__linux__) )
+      for( size_t i = 0; i < ns_num_counters; ++i )
+        fds[i] = ns_counter_available[i] ? open_counter( i ) : -1;
+#endif
+    }//void open()
+
+    ~ThreadCounters()
+    {
+#if( defined(__linux__) )
+      for( const int fd : fds )
+      {
+        if( fd >= 0 )
+          close( fd );
+      }
+#endif
+    }//~ThreadCounters()
+  };//struct ThreadCounters
+
+  thread_local ThreadCounters t_counters;
+}//namespace
+
+
+namespace PerfCounters
+{
+
+const char *to_str( const CallType type )
+{
+  switch( type )
+  {
+    case CallType::InitDrf:                   return "InitDrf";
+    case CallType::StaticIsotopeID:           return "StaticIsotopeID";
+    case CallType::StreamingSearch:           return "StreamingSearch";
+    case CallType::SearchIsotopeID:           return "SearchIsotopeID";
+    case CallType::PortalIsotopeIDCInterface: return "PortalIsotopeIDCInterface";
+    case CallType::NumCallTypes:              break;
+  }//switch( type )
+
+  return "Invalid";
+}//const char *to_str( const CallType type )
+
+
+void set_enabled( const bool enable )
+{
+  if( enable )
+  {
+    // Check which counters we can actually open, so we can log it once, instead of failing
+    //  silently on every thread.
+    for( size_t i = 0; i < ns_num_counters; ++i )
+    {
+      int fd = -1;
+#if( defined(__linux__) )
+      fd = open_counter( i );
+      if( fd >= 0 )
+        close( fd );
+      else
+        EngineLog::log("warn:app") << "Performance counter '" << ns_counter_names[i] << "' not available: "
+                                   << strerror(errno);
+#endif
+      ns_counter_available[i] = (fd >= 0);
+    }//for( size_t i = 0; i < ns_num_counters; ++i )
+
+#if( !defined(__linux__) )
+    EngineLog::log("warn:app") << "Hardware performance counters are only supported on Linux; will only"
+                           " record GADRAS call counts and times.";
+#endif
+  }//if( enable )
+
+  ns_enabled = enable;
+}//void set_enabled( const bool enable )
+
+
+bool enabled()
+{
+  return ns_enabled.load( std::memory_order_relaxed );
+}
+
+
+CallScope::CallScope( const CallType type, const std::string &drf )
+  : m_type( type ),
+    m_drf(),
+    m_active( ns_enabled.load( std::memory_order_relaxed ) ),
+    m_start_ns( 0 ),
+    m_start{}
+{
+  if( !m_active )
+    return;
+
+  // The DRF is usually given as a path, like "drfs/IdentiFINDER-NGH", so just keep its name.
+  m_drf = SpecUtils::filename( drf );
+
+  if( !t_counters.opened )
+    t_counters.open();
+
+#if( defined(__linux__) )
+  for( size_t i = 0; i < ns_num_counters; ++i )
+  {
+    const int fd = t_counters.fds[i];
+    if( (fd < 0) || (read( fd, &m_start[i], sizeof(Reading) ) != sizeof(Reading)) )
+      m_start[i] = Reading{ 0, 0, 0 };
+  }
+#endif
+
+  // Get the wall time last, so it doesnt include reading the counters.
+  m_start_ns = wall_now_ns();
+}//CallScope constructor
+
+
+CallScope::~CallScope()
+{
+  if( !m_active )
+    return;
+
+  const uint64_t end_ns = wall_now_ns();
+
+  bool valid[ns_num_counters] = { false, false, false, false };
+  double deltas[ns_num_counters] = { 0.0, 0.0, 0.0, 0.0 };
+
+#if( defined(__linux__) )
+  for( size_t i = 0; i < ns_num_counters; ++i )
+  {
+    const int fd = t_counters.fds[i];
+    Reading end;
+    if( (fd < 0) || (read( fd, &end, sizeof(end) ) != sizeof(end)) )
+      continue;
+
+    const Reading &start = m_start[i];
+    const uint64_t enabled_ns = end.time_enabled - start.time_enabled;
+    const uint64_t running_ns = end.time_running - start.time_running;
+
+    // If the counter never got scheduled, (e.g., too many counters for the PMU), we cant say
+    //  anything about this call.
+    if( !running_ns )
+      continue;
+
+    // Scale up the value if the kernel multiplexed this counter with others.
+    double delta = static_cast<double>( end.value - start.value );
+    if( running_ns < enabled_ns )
+      delta *= static_cast<double>(enabled_ns) / running_ns;
+
+    valid[i] = true;
+    deltas[i] = delta;
+  }//for( size_t i = 0; i < ns_num_counters; ++i )
+#endif
+
+  std::lock_guard<std::mutex> lock( ns_totals_mutex );
+  Totals &totals = ns_totals[make_pair(m_drf, m_type)];
+  totals.calls += 1;
+  totals.wall_ns += (end_ns - m_start_ns);
+  for( size_t i = 0; i < ns_num_counters; ++i )
+  {
+    if( valid[i] )
+    {
+      totals.counts[i] += deltas[i];
+      totals.counted_calls[i] += 1;
+    }
+  }//for( size_t i = 0; i < ns_num_counters; ++i )
+}//CallScope destructor
+
+
+EngineJson::Object to_json()
+{
+  EngineJson::Object json;
+  json["enabled"] = enabled();
+
+  EngineJson::Object available;
+  for( size_t i = 0; i < ns_num_counters; ++i )
+    available[ns_counter_names[i]] = ns_counter_available[i].load();
+  json["countersAvailable"] = std::move( available );
+
+  EngineJson::Array calls;
+
+  std::lock_guard<std::mutex> lock( ns_totals_mutex );
+  for( const auto &key_totals : ns_totals )
+  {
+    const string &drf = key_totals.first.first;
+    const CallType type = key_totals.first.second;
+    const Totals &totals = key_totals.second;
+
+    EngineJson::Object call;
+    call["drf"] = drf;
+    call["call"] = to_str(type);
+    call["count"] = static_cast<long long>( totals.calls );
+    call["wallSeconds"] = 1.0E-9 * totals.wall_ns;
+
+    for( size_t i = 0; i < ns_num_counters; ++i )
+    {
+      if( totals.counted_calls[i] )
+        call[ns_counter_names[i]] = static_cast<long long>( totals.counts[i] + 0.5 );
+      else
+        call[ns_counter_names[i]] = EngineJson::Value();
+    }//for( size_t i = 0; i < ns_num_counters; ++i )
+
+    // Instructions per cycle is the quickest indicator something is stalling on memory.
+    if( totals.counted_calls[0] && totals.counted_calls[1] && (totals.counts[0] > 0.0) )
+      call["instructionsPerCycle"] = totals.counts[1] / totals.counts[0];
+
+    calls.emplace_back( std::move(call) );
+  }//for( const auto &key_totals : ns_totals )
+
+  json["calls"] = std::move( calls );
+
+  return json;
+}//EngineJson::Object to_json()
+
+
+void reset()
+{
+  std::lock_guard<std::mutex> lock( ns_totals_mutex );
+  ns_totals.clear();
+}
+
+}//namespace PerfCounters
@@ -22,10 +22,21 @@
  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <cmath>
 #include <tuple>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <sstream>
 #include <iostream>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
 
-#include <Wt/WLogger.h>
 #include <Wt/WResource.h>
 #include <Wt/Json/Array.h>
 #include <Wt/Json/Value.h>
@@ -34,19 +45,202 @@
 #include <Wt/Http/Request.h>
 #include <Wt/Http/Response.h>
 #include <Wt/Json/Serializer.h>
+#include <Wt/Http/ResponseContinuation.h>
 
 
 #include "SpecUtils/SpecFile.h"
+#include "SpecUtils/DateTime.h"
 #include "SpecUtils/Filesystem.h"
 #include "SpecUtils/StringAlgo.h"
 
 #include "FullSpectrumId/Analysis.h"
+#include "FullSpectrumId/Tracing.h"
+#include "FullSpectrumId/Metrics.h"
+#include "FullSpectrumId/EngineLog.h"
+#include "FullSpectrumId/EngineJson.h"
+#include "FullSpectrumId/ResultStore.h"
+#include "FullSpectrumId/ClientLimits.h"
 #include "FullSpectrumId/RestResources.h"
+#include "FullSpectrumId/AnalysisBatch.h"
+#include "FullSpectrumId/AnalysisCapture.h"
+#include "FullSpectrumId/AnalysisEnsemble.h"
 #include "FullSpectrumId/AnalysisFromFiles.h"
 
 using namespace std;
 using namespace Wt;
 
+namespace
+{
+  struct DoWorkOnDestruct
+  {
+    std::function<void(void)> m_work;
+    explicit DoWorkOnDestruct( std::function<void(void)> work ) : m_work( work ){}
+    
+    ~DoWorkOnDestruct()
+    {
+      if( m_work )
+        m_work();
+    }
+  };//struct DoWorkOnDestruct
+  
+  
+  /** Returns if the request may use the admin endpoints: it has the admin token, or it came from
+   this machine, and not through a reverse proxy (which would make every request look local).
+   */
+  bool is_admin_request( const Http::Request &request, const string &admin_token )
+  {
+    if( !admin_token.empty() )
+    {
+      // Compare in a time that doesnt depend on how much of the token was right.
+      const string token = request.headerValue( "X-Admin-Token" );
+      if( token.size() == admin_token.size() )
+      {
+        unsigned char diff = 0;
+        for( size_t i = 0; i < token.size(); ++i )
+          diff |= static_cast<unsigned char>( token[i] ^ admin_token[i] );
+        if( diff == 0 )
+          return true;
+      }
+    }//if( !admin_token.empty() )
+    
+    if( !request.headerValue( "X-Forwarded-For" ).empty()
+        || !request.headerValue( "Forwarded" ).empty()
+        || !request.headerValue( "X-Real-IP" ).empty() )
+      return false;
+    
+    const string address = request.clientAddress();
+    return (address == "::1")
+           || SpecUtils::istarts_with( address, "127." )
+           || SpecUtils::istarts_with( address, "::ffff:127." );
+  }//bool is_admin_request(...)
+  
+  
+  void write_admin_forbidden( Http::Response &response )
+  {
+    response.setStatus( 403 );
+    response.setMimeType( "application/json" );
+    response.out() << "{\"code\": 12, \"message\": \"The admin endpoints may only be used from this"
+                      " machine, or with the admin token.\"}";
+  }
+  
+  
+  /** A response that streams the progress of an analysis to the client, one JSON object per line,
+   with the result as the last line (see the "progress" option).  The response is written over
+   several calls to AnalysisResource::handleRequest, using a Wt response continuation, as lines are
+   added by the analysis callbacks.
+   */
+  struct ProgressStream
+  {
+    std::mutex mutex;
+    
+    /** JSON lines not yet written to the response. */
+    vector<string> lines;
+    
+    /** Set once the result has been added to #lines. */
+    bool done = false;
+    
+    /** Set if the client closes the connection (see AnalysisResource::handleAbort). */
+    shared_ptr<std::atomic<bool>> cancelled;
+    
+    /** Counts the request as pending for its client, until the result has been written. */
+    unique_ptr<ClientLimits::Ticket> ticket;
+  };//struct ProgressStream
+  
+  
+  /** Writes the lines added to the stream so far; if the result hasnt been added yet, waits for
+   more lines (the analysis callbacks call WResource::haveMoreData after adding a line).
+   */
+  void write_progress_stream( const shared_ptr<ProgressStream> &stream, Http::Response &response )
+  {
+    std::lock_guard<std::mutex> lock( stream->mutex );
+    
+    for( const string &line : stream->lines )
+      response.out() << line << "\n";
+    stream->lines.clear();
+    
+    if( stream->done )
+    {
+      stream->ticket.reset();
+      return;
+    }
+    
+    // We hold the mutex until we are waiting, so a line added after we return wakes us back up.
+    Http::ResponseContinuation *continuation = response.createContinuation();
+    continuation->setData( stream );
+    continuation->waitForMoreData();
+  }//void write_progress_stream(...)
+  
+  
+  /** Analyzes every foreground sample of the uploaded file(s) (see
+   #AnalysisFromFiles::create_sample_inputs), and writes the per-sample results to the response.
+
+   The trace ID, client, deadline, etc, of each samples input are taken from base_template.
+   */
+  void analyze_all_samples( const tuple<AnalysisFromFiles::SpecClassType,string,string> &input1,
+                            const boost::optional<tuple<AnalysisFromFiles::SpecClassType,string,string>> &input2,
+                            string drf, const Analysis::AnalysisInput &base_template,
+                            Http::Response &response )
+  {
+    vector<AnalysisFromFiles::SampleInput> samples;
+    
+    try
+    {
+      samples = AnalysisFromFiles::create_sample_inputs( input1, input2 );
+    }catch( std::exception &e )
+    {
+      response.setStatus(400);
+      
+      Json::Object returnjson;
+      returnjson["code"] = 3;
+      returnjson["message"] = WString::fromUTF8(e.what());
+      
+      response.out() << Json::serialize(returnjson);
+      return;
+    }//try / catch to create input spectrum files
+    
+    if( drf == "auto" )
+    {
+      drf.clear();
+      for( size_t i = 0; drf.empty() && (i < samples.size()); ++i )
+        drf = Analysis::get_drf_name( samples[i].input );
+    }//if( drf == "auto" )
+    
+    if( drf.empty() || AnalysisEnsemble::is_ensemble_request(drf) )
+    {
+      response.setStatus(400);
+      response.out() << "{\"code\": 5, \"message\": \"Could not determine detector response to use; please specify one (DRF ensembles are not supported with allSamples).\"}";
+      return;
+    }//if( drf.empty() || AnalysisEnsemble::is_ensemble_request(drf) )
+    
+    Analysis::AnalysisInput base = base_template;
+    base.ana_number = 0;
+    base.drf_folder = drf;
+    base.analysis_type = Analysis::AnalysisType::Simple;
+    
+    vector<AnalysisBatch::SampleResult> results;
+    
+    try
+    {
+      Tracing::Span span( "wait_for_analysis", "rest" );
+      results = AnalysisBatch::analyze_samples( base, samples );
+    }catch( std::exception &e )
+    {
+      response.setStatus(400);
+      
+      Json::Object returnjson;
+      returnjson["code"] = 3;
+      returnjson["message"] = WString::fromUTF8(e.what());
+      
+      response.out() << Json::serialize(returnjson);
+      return;
+    }//try / catch
+    
+    Tracing::Span span( "write_response", "rest" );
+    EngineJson::serialize( AnalysisBatch::to_json( results ), response.out() );
+  }//void analyze_all_samples(...)
+}//namespace
+
+
 namespace RestResources
 {
 
@@ -71,7 +265,10 @@ InfoResource::InfoResource()
   drf["name"] = "drf";
   drf["comment"] = "Optional name of the Detector Response Function to use in the analysis.\n"
   "If not provided, or a value of \"auto\" is provided, the DRF to use"
-  " will be guessed, and if it cant be guessed, analysis will fail.\n"
+  " will be guessed, and if it cant be guessed (or only a generic DRF would be used), the spectrum"
+  " is analyzed with several candidate DRFs and the best fitting result returned, along with the"
+  " results for each candidate under \"ensemble\"; this may be requested explicitly with a value"
+  " of \"ensemble\", or \"ensemble:\" followed by a comma-separated list of DRFs.\n"
   "Value provided must be from provided list of possible values.";
   drf["type"] = "Enumerated";
   drf["required"] = false;
@@ -79,9 +276,59 @@ InfoResource::InfoResource()
   Json::Array &possibleDrfs = drf["possibleValues"];
   
   possibleDrfs.push_back( WString::fromUTF8("auto") );
+  possibleDrfs.push_back( WString::fromUTF8("ensemble") );
   for( const auto &s : m_drfs )
     possibleDrfs.push_back( WString::fromUTF8(s) );
   
+  options.push_back( Json::Object() );
+  Json::Object &allsamples = options.back();
+  allsamples["name"] = "allSamples";
+  allsamples["comment"] = "Optional; if true, every foreground sample of a multi-record file is"
+  " analyzed, each paired with the uploaded background file, or else the files own background,"
+  " and an array of per-sample results is returned under \"samples\".  May also be given as the"
+  " URL parameter allSamples=1.";
+  allsamples["type"] = "Boolean";
+  allsamples["required"] = false;
+  
+  options.push_back( Json::Object() );
+  Json::Object &timeout = options.back();
+  timeout["name"] = "timeoutSeconds";
+  timeout["comment"] = "Optional number of seconds the client will wait for the result; if the"
+  " analysis hasnt finished by then, it is stopped, and an error returned with HTTP status 504."
+  "  May also be given as the X-Request-Timeout header.";
+  timeout["type"] = "Number";
+  timeout["required"] = false;
+  
+  options.push_back( Json::Object() );
+  Json::Object &progress = options.back();
+  progress["name"] = "progress";
+  progress["comment"] = "Optional; if true, the response is streamed as newline-delimited JSON"
+  " (application/x-ndjson): about once a second while a search-mode or portal analysis runs, a line"
+  " like {\"progress\": 0.42, \"isotopes\": \"Cs137(H)\"} gives the fraction done and the isotopes"
+  " found so far, and the last line is the analysis result.  The HTTP status is always 200, so"
+  " check the result for errors.  May also be given as the URL parameter progress=1; cant be used"
+  " with allSamples.";
+  progress["type"] = "Boolean";
+  progress["required"] = false;
+  
+  // Every error code the REST API returns; each code has only one meaning, across all endpoints.
+  m_result["errorCodes"] = Json::Object();
+  Json::Object &codes = m_result["errorCodes"];
+  codes["0"] = "Success.";
+  codes["1"] = "Invalid option or header format.";
+  codes["2"] = "Invalid DRF specified.";
+  codes["3"] = "Missing, unreadable, or unsuitable spectrum file(s).";
+  codes["4"] = "Analysis queue is currently full.";
+  codes["5"] = "Could not determine the DRF to use.";
+  codes["6"] = "GADRAS failed to initialize or analyze the spectrum.";
+  codes["7"] = "Invalid start or end time (result history).";
+  codes["8"] = "Invalid limit (result history).";
+  codes["9"] = "An instrument serial number must be specified (result history).";
+  codes["10"] = "Too many requests from this client; retry after the Retry-After header seconds.";
+  codes["11"] = "Too many analyses already pending for this client.";
+  codes["12"] = "The admin endpoints may only be used from this machine, or with the admin token.";
+  codes["999"] = "Unknown error.";
+  
   m_result["comment"] = "To make an analysis request, you must POST to /v1/Analysis "
                         "Using multipart/form-data."
   "You "
@@ -122,9 +369,33 @@ AnalysisResource::AnalysisResource()
 
 void AnalysisResource::handleRequest( const Wt::Http::Request &request, Wt::Http::Response &response )
 {
+  // Streamed responses are written over several calls; see write_progress_stream.
+  if( request.continuation() )
+  {
+    const auto stream = cpp17::any_cast<shared_ptr<ProgressStream>>( request.continuation()->data() );
+    write_progress_stream( stream, response );
+    return;
+  }//if( request.continuation() )
+  
+  Tracing::RequestScope trace_scope( Tracing::new_request_id() );
+  Tracing::Span request_span( "handle_request", "rest" );
+  
+  // Set if the client closes the connection (see handleAbort), so we can skip its analysis.
+  const shared_ptr<std::atomic<bool>> cancelled = make_shared<std::atomic<bool>>( false );
+  
+  {
+    std::lock_guard<std::mutex> lock( m_active_mutex );
+    m_active[&request] = cancelled;
+  }
+  
+  DoWorkOnDestruct unregister( [this,&request](){
+    std::lock_guard<std::mutex> lock( m_active_mutex );
+    m_active.erase( &request );
+  } );
+  
   try
   {
-    Wt::log("debug:app") << "AnalysisResource::handleRequest";
+    EngineLog::log("debug:app") << "AnalysisResource::handleRequest";
     
     
     // Check to see if the currently pending analysis queue is really long.
@@ -145,7 +416,54 @@ void AnalysisResource::handleRequest( const Wt::Http::Request &request, Wt::Http
     }//if( ana_queue_len > 50 )
     
     
+    // So one client cant fill the whole queue, each client is rate limited, and limited in how
+    //  many analyses it can have pending; its queued analyses then share the analysis thread
+    //  fairly with other clients (see ClientLimits.h).  The ticket counts this request as pending
+    //  until we return (or until the result is written, for a streamed response).
+    const string client = ClientLimits::client_id(
+                                request.headerValue( ClientLimits::options().api_key_header ),
+                                request.clientAddress() );
+    ClientLimits::Rejection rejection = ClientLimits::Rejection::None;
+    double retry_after = 0.0;
+    unique_ptr<ClientLimits::Ticket> ticket = ClientLimits::admit( client, rejection, retry_after );
+    if( !ticket )
+    {
+      const bool rate_limited = (rejection == ClientLimits::Rejection::RateLimited);
+      
+      response.setStatus(429); //Too Many Requests
+      response.addHeader( "Retry-After", std::to_string( std::max( 1, static_cast<int>( std::ceil(retry_after) ) ) ) );
+      if( rate_limited )
+        response.out() << "{\"code\": 10, \"message\": \"Too many requests; please slow down.\"}";
+      else
+        response.out() << "{\"code\": 11, \"message\": \"Too many analyses already pending for this client.\"}";
+      return;
+    }//if( !ticket )
+    
+    
     string drf = "auto";
+    bool all_samples = false;
+    bool stream_progress = false;
+    double timeout_seconds = 0.0;
+    
+    // The client may tell us how long it will wait, so we dont analyze after it has given up.
+    const string timeout_header = request.headerValue( "X-Request-Timeout" );
+    if( !timeout_header.empty() )
+    {
+      try
+      {
+        timeout_seconds = std::stod( timeout_header );
+      }catch( std::exception & )
+      {
+        timeout_seconds = -1.0;
+      }
+      
+      if( !(timeout_seconds > 0.0) )
+      {
+        response.setStatus(400);
+        response.out() << "{\"code\": 1, \"message\": \"Invalid X-Request-Timeout header value.\"}";
+        return;
+      }
+    }//if( !timeout_header.empty() )
     
     const std::string *optionsstr = request.getParameter( "options" );
     if( optionsstr )
@@ -155,6 +473,45 @@ void AnalysisResource::handleRequest( const Wt::Http::Request &request, Wt::Http
         Json::Object options;
         Json::parse(*optionsstr, options );
         
+        if( options.contains("allSamples") )
+        {
+          const Json::Value &allopt = options.get("allSamples");
+          if( allopt.type() != Json::Type::Bool )
+          {
+            response.setStatus(400);
+            response.out() << "{\"code\": 1, \"message\": \"Invalid allSamples specification format.\"}";
+            return;
+          }
+          
+          all_samples = (bool)allopt;
+        }//if( options.contains("allSamples") )
+        
+        if( options.contains("timeoutSeconds") )
+        {
+          const Json::Value &timeoutopt = options.get("timeoutSeconds");
+          if( (timeoutopt.type() != Json::Type::Number) || !((double)timeoutopt > 0.0) )
+          {
+            response.setStatus(400);
+            response.out() << "{\"code\": 1, \"message\": \"Invalid timeoutSeconds specification format.\"}";
+            return;
+          }
+          
+          timeout_seconds = (double)timeoutopt;
+        }//if( options.contains("timeoutSeconds") )
+        
+        if( options.contains("progress") )
+        {
+          const Json::Value &progressopt = options.get("progress");
+          if( progressopt.type() != Json::Type::Bool )
+          {
+            response.setStatus(400);
+            response.out() << "{\"code\": 1, \"message\": \"Invalid progress specification format.\"}";
+            return;
+          }
+          
+          stream_progress = (bool)progressopt;
+        }//if( options.contains("progress") )
+        
         if( options.contains("drf") )
         {
           const Json::Value &drfopt = options.get("drf");
@@ -166,20 +523,20 @@ void AnalysisResource::handleRequest( const Wt::Http::Request &request, Wt::Http
           }
           
           drf = (const string &)drfopt;
-          cout << "Got DRF '" << drf << "' from options." << endl;
+          EngineLog::log("debug:app") << "Got DRF '" << drf << "' from options.";
         }
         
         // TODO: warn about other options specified?
       }catch( Json::ParseError &e )
       {
-        cerr << "Error parsing options parameter: " << e.what() << endl;
+        EngineLog::log("info:app") << "Error parsing options parameter: " << e.what();
         response.setStatus(400);
         response.out() << "{\"code\": 1, \"message\": \"Invalid drf JSON format.\"}";
         return;
       }catch( WException &e )
       {
         // I dont think we would ever end up here, but JIC.
-        cerr << "Error decoding options parameter: " << e.what() << endl;
+        EngineLog::log("info:app") << "Error decoding options parameter: " << e.what();
         response.setStatus(400);
         response.out() << "{\"code\": 1, \"message\": \"Invalid drf type.\"}";
         return;
@@ -197,7 +554,7 @@ void AnalysisResource::handleRequest( const Wt::Http::Request &request, Wt::Http
         if( iter->second.size() == 1 )
         {
           drf = iter->second.at(0);
-          cout << "url param drf=" << drf << endl;
+          EngineLog::log("debug:app") << "url param drf=" << drf;
         }else
         {
           response.setStatus(400);
@@ -211,7 +568,24 @@ void AnalysisResource::handleRequest( const Wt::Http::Request &request, Wt::Http
     }//if( we should try to get drf from URL parameters ) / else
     
     
-    if( (drf != "auto") && (std::find(begin(m_drfs), end(m_drfs), drf) == end(m_drfs)) )
+    const std::string *allsamplesstr = request.getParameter( "allSamples" );
+    if( allsamplesstr )
+      all_samples = ((*allsamplesstr == "1") || SpecUtils::iequals_ascii(*allsamplesstr, "true"));
+    
+    const std::string *progressstr = request.getParameter( "progress" );
+    if( progressstr )
+      stream_progress = ((*progressstr == "1") || SpecUtils::iequals_ascii(*progressstr, "true"));
+    
+    if( stream_progress && all_samples )
+    {
+      response.setStatus(400);
+      response.out() << "{\"code\": 1, \"message\": \"The progress option can not be used with allSamples.\"}";
+      return;
+    }//if( stream_progress && all_samples )
+    
+    
+    if( (drf != "auto") && !AnalysisEnsemble::is_ensemble_request(drf)
+       && (std::find(begin(m_drfs), end(m_drfs), drf) == end(m_drfs)) )
     {
       response.setStatus(400);
       response.out() << "{\"code\": 2, \"message\": \"Invalid drf value specified.\"}";
@@ -295,6 +669,28 @@ void AnalysisResource::handleRequest( const Wt::Http::Request &request, Wt::Http
     }//if( foreFromClientName && backFromClientName )
     
     
+    // What is common to every input we will post for this request.
+    Analysis::AnalysisInput request_input;
+    request_input.ana_number = 0;
+    request_input.trace_id = Tracing::current_request_id();
+    request_input.client = ticket->client();
+    request_input.client_weight = ticket->weight();
+    request_input.cancelled = cancelled;
+    if( timeout_seconds > 0.0 )
+    {
+      // Clamp to a day, so a huge value cant overflow the clock.
+      const std::chrono::duration<double> timeout( std::min( timeout_seconds, 86400.0 ) );
+      request_input.deadline = std::chrono::steady_clock::now()
+                          + std::chrono::duration_cast<std::chrono::steady_clock::duration>( timeout );
+    }//if( timeout_seconds > 0.0 )
+    
+    if( all_samples )
+    {
+      analyze_all_samples( input1, input2, drf, request_input, response );
+      return;
+    }//if( all_samples )
+    
+    
     shared_ptr<SpecUtils::SpecFile> inputspec;
     
     try
@@ -314,20 +710,52 @@ void AnalysisResource::handleRequest( const Wt::Http::Request &request, Wt::Http
     
     assert( inputspec );
     
+    // If the DRF cant be determined (or only a generic one would be used), try several of them.
+    vector<string> ensemble_drfs;
+    
     if( drf == "auto" )
     {
-      drf = Analysis::get_drf_name( inputspec );
+      const string auto_drf = Analysis::get_drf_name( inputspec );
       
-      if( drf.empty() )
+      if( AnalysisEnsemble::should_use_ensemble( auto_drf ) )
+      {
+        try
+        {
+          ensemble_drfs = AnalysisEnsemble::candidate_drfs( inputspec, drf );
+        }catch( std::exception &e )
+        {
+          EngineLog::log("error:app") << "Could not choose candidate DRFs: " << e.what();
+        }
+      }//if( AnalysisEnsemble::should_use_ensemble( auto_drf ) )
+      
+      drf = auto_drf;
+      
+      if( drf.empty() && ensemble_drfs.empty() )
       {
         response.setStatus(400);
         response.out() << "{\"code\": 5, \"message\": \"Could not determine detector response to use; please specify one.\"}";
+        return;
       }//if( drf == "" )
-    }//if( drf == "auto" )
+    }else if( AnalysisEnsemble::is_ensemble_request( drf ) )
+    {
+      try
+      {
+        ensemble_drfs = AnalysisEnsemble::candidate_drfs( inputspec, drf );
+      }catch( std::exception &e )
+      {
+        response.setStatus(400);
+        
+        Json::Object returnjson;
+        returnjson["code"] = 2;
+        returnjson["message"] = WString::fromUTF8(e.what());
+        
+        response.out() << Json::serialize(returnjson);
+        return;
+      }//try / catch
+    }//if( drf == "auto" ) / else if( ensemble )
     
     
-    Analysis::AnalysisInput anainput;
-    anainput.ana_number = 0;//
+    Analysis::AnalysisInput anainput = request_input;
     //anainput.wt_app_id = "";
     anainput.drf_folder = drf;
     //std::vector<std::string> anainput.input_warnings;
@@ -344,41 +772,241 @@ void AnalysisResource::handleRequest( const Wt::Http::Request &request, Wt::Http
     anainput.input = inputspec;
     
     
+    if( stream_progress )
+    {
+      // Once we start streaming, the HTTP status is 200; any error is given in the result line.
+      auto stream = make_shared<ProgressStream>();
+      stream->cancelled = cancelled;
+      stream->ticket = std::move( ticket );
+      
+      anainput.callback = [this,stream]( Analysis::AnalysisOutput output ){
+        {
+          std::lock_guard<std::mutex> lock( stream->mutex );
+          stream->lines.push_back( EngineJson::serialize( output.toJson() ) );
+          stream->done = true;
+        }
+        haveMoreData();
+      };//anainput.callback
+      
+      // Progress of the candidates of an ensemble isnt reported; just its result.
+      if( ensemble_drfs.empty() )
+      {
+        anainput.progress = [this,stream]( const Analysis::AnalysisProgress &progress ){
+          Json::Object progressjson;
+          progressjson["progress"] = progress.fraction_done;
+          progressjson["isotopes"] = WString::fromUTF8( progress.isotopes );
+          
+          {
+            std::lock_guard<std::mutex> lock( stream->mutex );
+            stream->lines.push_back( Json::serialize( progressjson, 0 ) );
+          }
+          haveMoreData();
+        };//anainput.progress
+      }//if( ensemble_drfs.empty() )
+      
+      AnalysisCapture::capture( anainput, AnalysisCapture::Submitter::Rest );
+      
+      response.setMimeType( "application/x-ndjson" );
+      
+      if( ensemble_drfs.empty() )
+        Analysis::post_analysis( anainput );
+      else
+        AnalysisEnsemble::post_analysis( anainput, ensemble_drfs );
+      
+      write_progress_stream( stream, response );
+      return;
+    }//if( stream_progress )
+    
+    
     std::mutex ana_mutex;
     std::condition_variable ana_cv;
     Analysis::AnalysisOutput result;
+    bool ana_done = false;
     
-    anainput.callback = [&ana_mutex,&ana_cv,&result]( Analysis::AnalysisOutput output ){
+    anainput.callback = [&ana_mutex,&ana_cv,&result,&ana_done]( Analysis::AnalysisOutput output ){
       {
         std::unique_lock<std::mutex> lock( ana_mutex );
         result = output;
+        ana_done = true;
       }
       ana_cv.notify_all();
     };// inputspec.callback definition
     
-    {// begin lock on ana_mutex
+    AnalysisCapture::capture( anainput, AnalysisCapture::Submitter::Rest );
+    
+    {// begin wait for analysis
+      Tracing::Span span( "wait_for_analysis", "rest" );
+      
+      // If the result store already has the result, the callback is called before post_analysis
+      //  returns, so we cant hold ana_mutex while posting.
+      if( ensemble_drfs.empty() )
+        Analysis::post_analysis( anainput );
+      else
+        AnalysisEnsemble::post_analysis( anainput, ensemble_drfs );
+      
       std::unique_lock<std::mutex> lock( ana_mutex );
-      Analysis::post_analysis( anainput );
-      ana_cv.wait( lock );
-    }// end lock on ana_mutex
+      ana_cv.wait( lock, [&ana_done](){ return ana_done; } );
+    }// end wait for analysis
     
     //result.spec_file; //std::shared_ptr<SpecUtils::SpecFile>
     
     // once we're here, the analysis should be done.
-    const Wt::Json::Object resultjson = result.toJson();
-    response.out() << Json::serialize(resultjson);
+    {
+      Tracing::Span span( "write_response", "rest" );
+      EngineJson::serialize( result.toJson(), response.out() );
+    }
     
-    if( (result.gadras_intialization_error < 0) || (result.gadras_analysis_error < 0) )
+    if( !result.error_message.empty() && Analysis::is_abandoned( anainput ) )
+      response.setStatus(504); //Gateway Timeout
+    else if( (result.gadras_intialization_error < 0) || (result.gadras_analysis_error < 0) )
       response.setStatus(400);
   }catch( ... )
   {
-    cerr << "AnalysisResource::handleRequest: Uncaught exception type!!!" << endl;
+    EngineLog::log("error:app") << "AnalysisResource::handleRequest: Uncaught exception type!!!";
     response.out() << "{\"code\": 999, \"message\": \"Unknown error.\"}";
     response.setStatus(400);
   }
 }//AnalysisResource::handleRequest(...)
 
 
+void AnalysisResource::handleAbort( const Wt::Http::Request &request )
+{
+  // A streamed response; its ProgressStream has the cancelled flag.
+  if( request.continuation() )
+  {
+    const auto stream = cpp17::any_cast<shared_ptr<ProgressStream>>( request.continuation()->data() );
+    if( stream && stream->cancelled )
+    {
+      EngineLog::log("info:app") << "Client closed streamed connection; its analysis will be stopped.";
+      stream->cancelled->store( true );
+    }
+    return;
+  }//if( request.continuation() )
+  
+  std::lock_guard<std::mutex> lock( m_active_mutex );
+  
+  const auto iter = m_active.find( &request );
+  if( iter != end(m_active) )
+  {
+    EngineLog::log("info:app") << "Client closed connection; its analysis will be skipped.";
+    iter->second->store( true );
+  }
+}//void AnalysisResource::handleAbort( const Wt::Http::Request &request )
+
+
+TraceResource::TraceResource( const std::string &admin_token )
+: WResource(),
+  m_admin_token( admin_token )
+{
+  
+}
+
+
+void TraceResource::handleRequest( const Wt::Http::Request &request, Wt::Http::Response &response )
+{
+  if( !is_admin_request( request, m_admin_token ) )
+  {
+    write_admin_forbidden( response );
+    return;
+  }
+  
+  const std::string *clearstr = request.getParameter( "clear" );
+  const bool clear = clearstr && ((*clearstr == "1") || SpecUtils::iequals_ascii(*clearstr, "true"));
+  
+  response.setMimeType( "application/json" );
+  response.out() << Tracing::chrome_trace_json( clear );
+}//void TraceResource::handleRequest(...)
+
+
+MetricsResource::MetricsResource( const std::string &admin_token )
+: WResource(),
+  m_admin_token( admin_token )
+{
+  
+}
+
+
+void MetricsResource::handleRequest( const Wt::Http::Request &request, Wt::Http::Response &response )
+{
+  if( !is_admin_request( request, m_admin_token ) )
+  {
+    write_admin_forbidden( response );
+    return;
+  }
+  
+  Wt::Json::Object metrics = Metrics::to_json();
+  metrics["analysisQueueLength"] = static_cast<long long>( Analysis::analysis_queue_length() );
+  
+  response.setMimeType( "application/json" );
+  response.out() << Json::serialize(metrics);
+}//void MetricsResource::handleRequest(...)
+
+
+ResultHistoryResource::ResultHistoryResource()
+: WResource()
+{
+  
+}
+
+
+void ResultHistoryResource::handleRequest( const Wt::Http::Request &request, Wt::Http::Response &response )
+{
+  response.setMimeType( "application/json" );
+  
+  const std::string *serial = request.getParameter( "serial" );
+  if( !serial || serial->empty() )
+  {
+    response.setStatus(400);
+    response.out() << "{\"code\": 9, \"message\": \"An instrument serial number must be specified.\"}";
+    return;
+  }
+  
+  // Parses an ISO 8601 time URL argument into microseconds since the epoch.
+  const boost::posix_time::ptime epoch( boost::gregorian::date(1970,1,1) );
+  auto time_arg = [&request,&epoch]( const char *name, int64_t &us ) -> bool {
+    const std::string *value = request.getParameter( name );
+    if( !value || value->empty() )
+      return true;
+    
+    const boost::posix_time::ptime t = SpecUtils::time_from_string( value->c_str() );
+    if( t.is_special() )
+      return false;
+    
+    us = (t - epoch).total_microseconds();
+    return true;
+  };//time_arg
+  
+  int64_t start_us = std::numeric_limits<int64_t>::min();
+  int64_t end_us = std::numeric_limits<int64_t>::max();
+  if( !time_arg( "start", start_us ) || !time_arg( "end", end_us ) )
+  {
+    response.setStatus(400);
+    response.out() << "{\"code\": 7, \"message\": \"Invalid start or end time.\"}";
+    return;
+  }
+  
+  size_t limit = 100;
+  const std::string *limitstr = request.getParameter( "limit" );
+  if( limitstr && !limitstr->empty() )
+  {
+    try
+    {
+      limit = static_cast<size_t>( std::stoul( *limitstr ) );
+    }catch( std::exception & )
+    {
+      response.setStatus(400);
+      response.out() << "{\"code\": 8, \"message\": \"Invalid limit.\"}";
+      return;
+    }
+  }//if( limitstr )
+  
+  EngineJson::Object result;
+  result["serial"] = *serial;
+  result["results"] = ResultStore::history( *serial, start_us, end_us, std::min( limit, size_t(1000) ) );
+  
+  EngineJson::serialize( result, response.out() );
+}//void ResultHistoryResource::handleRequest(...)
+
 }//namespace RestResources
 
 
@@ -0,0 +1,1259 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <Wt/WLogger.h>
+
+#include "SpecUtils/SpecFile.h"
+#include "SpecUtils/DateTime.h"
+#include "SpecUtils/Filesystem.h"
+
+#include "FullSpectrumId/EngineJson.h"
+#include "FullSpectrumId/HashUtils.h"
+#include "FullSpectrumId/ResultStore.h"
+#include "FullSpectrumId/AnalysisSerialization.h"
+
+using namespace std;
+
+using AnalysisSerialization::Reader;
+using AnalysisSerialization::Writer;
+
+
+namespace
+{
+  std::atomic<bool> ns_open( false );
+  std::atomic<int32_t> ns_engine_version( 0 );
+  std::atomic<uint64_t> ns_hits( 0 ), ns_misses( 0 );
+
+#ifndef _WIN32
+  const char ns_log_magic[8] = { 'F', 'S', 'R', 'L', 'O', 'G', '0', '1' };
+  const char ns_idx_magic[8] = { 'F', 'S', 'R', 'I', 'D', 'X', '0', '1' };
+
+  /** Bytes at the start of the log before the first record: the magic and the log ID. */
+  const uint64_t ns_log_header_size = 16;
+
+  /** Bytes before each record body: the body size and hash. */
+  const uint64_t ns_record_header_size = 16;
+
+  /** Largest record body we will read back; protects against allocating garbage sizes. */
+  const uint64_t ns_max_record_size = uint64_t(1024)*1024*1024;
+
+  /** Bytes of a record body read to get its #RecordMeta when scanning the log; the whole body is
+   read if the meta-data is longer than this.
+   */
+  const size_t ns_meta_read_size = 1024;
+
+  /** Smallest number of index slots; the number of slots is always a power of two. */
+  const uint64_t ns_min_index_slots = 1024;
+
+  /** Changed if what goes into the key changes. */
+  const uint32_t ns_key_version = 1;
+
+  const uint64_t ns_key_seed_hi = 0x9E3779B97F4A7C15ULL;
+  const uint64_t ns_key_seed_lo = 0xC2B2AE3D27D4EB4FULL;
+  const uint64_t ns_checksum_seed = 0x165667B19E3779F9ULL;
+
+
+  struct Key
+  {
+    uint64_t hi;
+    uint64_t lo;
+
+    bool operator==( const Key &rhs ) const { return (hi == rhs.hi) && (lo == rhs.lo); }
+  };//struct Key
+
+
+  struct IndexHeader
+  {
+    char magic[8];
+    uint64_t log_id;
+    uint64_t log_size;
+    uint64_t num_slots;
+    uint64_t num_entries;
+    uint64_t reserved[3];
+  };//struct IndexHeader
+
+
+  struct IndexSlot
+  {
+    uint64_t key_hi;
+    uint64_t key_lo;
+
+    /** Offset of the record in the log, plus one; zero for an empty slot. */
+    uint64_t offset_plus_one;
+  };//struct IndexSlot
+
+  static_assert( sizeof(IndexHeader) == 64, "Unexpected IndexHeader padding" );
+  static_assert( sizeof(IndexSlot) == 24, "Unexpected IndexSlot padding" );
+
+
+  /** An index file mapped into memory. */
+  struct MappedIndex
+  {
+    int fd = -1;
+    void *map = nullptr;
+    size_t map_size = 0;
+    IndexHeader *header = nullptr;
+    IndexSlot *slots = nullptr;
+  };//struct MappedIndex
+
+
+  /** The fields at the start of each record body, before the analysis output. */
+  struct RecordMeta
+  {
+    Key key;
+    uint64_t stored_us;
+    int64_t meas_start_us;
+    std::string serial;
+    std::string drf;
+    uint8_t analysis_type;
+  };//struct RecordMeta
+
+
+  struct HistoryEntry
+  {
+    int64_t meas_start_us;
+    uint64_t offset;
+    Key key;
+  };//struct HistoryEntry
+
+
+  struct Stats
+  {
+    uint64_t stores = 0;
+    uint64_t store_errors = 0;
+    uint64_t compactions = 0;
+    uint64_t index_rebuilds = 0;
+  };//struct Stats
+
+
+  // Everything below is protected by ns_mutex.
+  std::mutex ns_mutex;
+  ResultStore::Options ns_options;
+  std::string ns_log_path, ns_idx_path;
+  int ns_log_fd = -1;
+  uint64_t ns_log_id = 0;
+  uint64_t ns_log_size = 0;
+  MappedIndex ns_index;
+  Stats ns_stats;
+
+  /** If a thread is compacting the log; only one does at a time. */
+  bool ns_compacting = false;
+
+  /** Records for each instrument serial number, in the order they were stored. */
+  std::map<std::string,std::vector<HistoryEntry>> ns_history;
+
+
+  uint64_t now_us()
+  {
+    const auto now = std::chrono::system_clock::now().time_since_epoch();
+    return static_cast<uint64_t>( std::chrono::duration_cast<std::chrono::microseconds>(now).count() );
+  }
+
+
+  Key make_key( const Analysis::AnalysisInput &input )
+  {
+    string buffer;
+    Writer out( buffer );
+    out.u32( ns_key_version );
+    out.i32( ns_engine_version );
+    out.str( input.drf_folder );
+    out.u8( static_cast<uint8_t>( input.analysis_type ) );
+    AnalysisSerialization::write_spec( out, *input.input );
+
+    return Key{ HashUtils::murmur64( buffer.data(), buffer.size(), ns_key_seed_hi ),
+                HashUtils::murmur64( buffer.data(), buffer.size(), ns_key_seed_lo ) };
+  }//Key make_key( const Analysis::AnalysisInput &input )
+
+
+  /** Returns the key #lookup saved in the input, or else computes it. */
+  Key input_key( const Analysis::AnalysisInput &input )
+  {
+    if( input.result_key.size() != 16 )
+      return make_key( input );
+
+    Reader in( input.result_key );
+    Key key;
+    key.hi = in.u64();
+    key.lo = in.u64();
+    return key;
+  }//Key input_key( const Analysis::AnalysisInput &input )
+
+
+  const boost::posix_time::ptime ns_epoch( boost::gregorian::date(1970,1,1) );
+
+  /** Returns microseconds since the UNIX epoch of the earliest measurement start time, or the
+   minimum int64_t value if no measurement has a start time.
+   */
+  int64_t earliest_start_us( const SpecUtils::SpecFile &spec )
+  {
+    int64_t earliest = std::numeric_limits<int64_t>::max();
+    for( const auto &m : spec.measurements() )
+    {
+      if( m && !m->start_time().is_special() )
+        earliest = std::min( earliest, (m->start_time() - ns_epoch).total_microseconds() );
+    }
+
+    return (earliest == std::numeric_limits<int64_t>::max()) ? std::numeric_limits<int64_t>::min()
+                                                             : earliest;
+  }//int64_t earliest_start_us( const SpecUtils::SpecFile &spec )
+
+
+  EngineJson::Value iso_time_json( const int64_t us )
+  {
+    if( us == std::numeric_limits<int64_t>::min() )
+      return EngineJson::Value();
+
+    const boost::posix_time::ptime t = ns_epoch + boost::posix_time::microseconds( us );
+    return EngineJson::Value( SpecUtils::to_extended_iso_string( t ) );
+  }//EngineJson::Value iso_time_json( const int64_t us )
+
+
+  void write_meta( Writer &out, const RecordMeta &meta )
+  {
+    out.u64( meta.key.hi );
+    out.u64( meta.key.lo );
+    out.u64( meta.stored_us );
+    out.i64( meta.meas_start_us );
+    out.str( meta.serial );
+    out.str( meta.drf );
+    out.u8( meta.analysis_type );
+  }//void write_meta( Writer &out, const RecordMeta &meta )
+
+
+  RecordMeta read_meta( Reader &in )
+  {
+    RecordMeta meta;
+    meta.key.hi = in.u64();
+    meta.key.lo = in.u64();
+    meta.stored_us = in.u64();
+    meta.meas_start_us = in.i64();
+    meta.serial = in.str();
+    meta.drf = in.str();
+    meta.analysis_type = in.u8();
+    return meta;
+  }//RecordMeta read_meta( Reader &in )
+
+
+  /** Returns the record, including its header, as written to the log. */
+  string encode_record( const RecordMeta &meta, const Analysis::AnalysisOutput &output,
+                        const shared_ptr<const SpecUtils::SpecFile> &input_spec )
+  {
+    string body;
+    Writer body_out( body );
+    write_meta( body_out, meta );
+    AnalysisSerialization::write_output( body_out, output, input_spec );
+
+    string record;
+    Writer out( record );
+    out.u64( body.size() );
+    out.u64( HashUtils::murmur64( body.data(), body.size(), ns_checksum_seed ) );
+    record += body;
+
+    return record;
+  }//string encode_record(...)
+
+
+  string errno_str()
+  {
+    return strerror( errno );
+  }
+
+
+  /** Writes all the data at the offset; throws exception on error. */
+  void write_all( const int fd, const char *data, size_t len, uint64_t offset )
+  {
+    while( len )
+    {
+      const ssize_t nwritten = pwrite( fd, data, len, static_cast<off_t>(offset) );
+      if( nwritten < 0 )
+      {
+        if( errno == EINTR )
+          continue;
+        throw runtime_error( "write failed: " + errno_str() );
+      }
+
+      data += nwritten;
+      len -= static_cast<size_t>( nwritten );
+      offset += static_cast<uint64_t>( nwritten );
+    }//while( len )
+  }//void write_all(...)
+
+
+  /** Reads len bytes at the offset; returns false if the file ends first, and throws exception on
+   error.
+   */
+  bool read_all( const int fd, char *data, size_t len, uint64_t offset )
+  {
+    while( len )
+    {
+      const ssize_t nread = pread( fd, data, len, static_cast<off_t>(offset) );
+      if( nread < 0 )
+      {
+        if( errno == EINTR )
+          continue;
+        throw runtime_error( "read failed: " + errno_str() );
+      }
+
+      if( nread == 0 )
+        return false;
+
+      data += nread;
+      len -= static_cast<size_t>( nread );
+      offset += static_cast<uint64_t>( nread );
+    }//while( len )
+
+    return true;
+  }//bool read_all(...)
+
+
+  uint64_t file_size( const int fd )
+  {
+    struct stat info;
+    if( fstat( fd, &info ) != 0 )
+      throw runtime_error( "stat failed: " + errno_str() );
+    return static_cast<uint64_t>( info.st_size );
+  }
+
+
+  /** Reads the body size and hash of the record at the offset; returns false if past log_size. */
+  bool read_record_header( const int fd, const uint64_t offset, const uint64_t log_size,
+                           uint64_t &body_size, uint64_t &checksum )
+  {
+    if( (offset + ns_record_header_size) > log_size )
+      return false;
+
+    string header( ns_record_header_size, '\0' );
+    if( !read_all( fd, &header[0], header.size(), offset ) )
+      return false;
+
+    Reader in( header );
+    body_size = in.u64();
+    checksum = in.u64();
+
+    return (body_size <= ns_max_record_size)
+           && ((offset + ns_record_header_size + body_size) <= log_size);
+  }//bool read_record_header(...)
+
+
+  /** Reads the body of the record at the offset; returns false if it is truncated or corrupt. */
+  bool read_record( const int fd, const uint64_t offset, const uint64_t log_size, string &body )
+  {
+    uint64_t body_size, checksum;
+    if( !read_record_header( fd, offset, log_size, body_size, checksum ) )
+      return false;
+
+    body.resize( body_size );
+    if( body_size && !read_all( fd, &body[0], body.size(), offset + ns_record_header_size ) )
+      return false;
+
+    return HashUtils::murmur64( body.data(), body.size(), ns_checksum_seed ) == checksum;
+  }//bool read_record(...)
+
+
+  void unmap_index( MappedIndex &index )
+  {
+    if( index.map )
+      munmap( index.map, index.map_size );
+    if( index.fd >= 0 )
+      ::close( index.fd );
+    index = MappedIndex();
+  }//void unmap_index( MappedIndex &index )
+
+
+  /** Creates an empty index file with the given number of slots, and maps it. */
+  MappedIndex create_index( const string &path, const uint64_t num_slots )
+  {
+    MappedIndex index;
+    index.fd = ::open( path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    if( index.fd < 0 )
+      throw runtime_error( "Could not create result index '" + path + "': " + errno_str() );
+
+    index.map_size = sizeof(IndexHeader) + num_slots*sizeof(IndexSlot);
+    if( ftruncate( index.fd, static_cast<off_t>(index.map_size) ) != 0 )
+    {
+      const string msg = errno_str();
+      unmap_index( index );
+      throw runtime_error( "Could not size result index '" + path + "': " + msg );
+    }
+
+    // ftruncate fills the file with zeros, so all the slots start out empty.
+    index.map = mmap( nullptr, index.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, index.fd, 0 );
+    if( index.map == MAP_FAILED )
+    {
+      index.map = nullptr;
+      const string msg = errno_str();
+      unmap_index( index );
+      throw runtime_error( "Could not map result index '" + path + "': " + msg );
+    }
+
+    index.header = static_cast<IndexHeader *>( index.map );
+    index.slots = reinterpret_cast<IndexSlot *>( static_cast<char *>(index.map) + sizeof(IndexHeader) );
+    memcpy( index.header->magic, ns_idx_magic, sizeof(ns_idx_magic) );
+    index.header->num_slots = num_slots;
+
+    return index;
+  }//MappedIndex create_index(...)
+
+
+  /** Maps an existing index file; returns an unmapped index if the file doesnt exist, or isnt a
+   valid index for the current log.
+   */
+  MappedIndex open_index( const string &path )
+  {
+    MappedIndex index;
+    index.fd = ::open( path.c_str(), O_RDWR );
+    if( index.fd < 0 )
+      return index;
+
+    const uint64_t size = file_size( index.fd );
+    if( size < sizeof(IndexHeader) )
+    {
+      unmap_index( index );
+      return index;
+    }
+
+    index.map_size = static_cast<size_t>( size );
+    index.map = mmap( nullptr, index.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, index.fd, 0 );
+    if( index.map == MAP_FAILED )
+    {
+      index.map = nullptr;
+      unmap_index( index );
+      return index;
+    }
+
+    index.header = static_cast<IndexHeader *>( index.map );
+    index.slots = reinterpret_cast<IndexSlot *>( static_cast<char *>(index.map) + sizeof(IndexHeader) );
+
+    const IndexHeader &header = *index.header;
+    const uint64_t num_slots = header.num_slots;
+    const bool valid = !memcmp( header.magic, ns_idx_magic, sizeof(ns_idx_magic) )
+                       && (num_slots >= ns_min_index_slots)
+                       && !(num_slots & (num_slots - 1))
+                       && (size == (sizeof(IndexHeader) + num_slots*sizeof(IndexSlot)))
+                       && (2*header.num_entries <= num_slots)
+                       && (header.log_id == ns_log_id)
+                       && (header.log_size == ns_log_size);
+    if( !valid )
+      unmap_index( index );
+
+    return index;
+  }//MappedIndex open_index( const string &path )
+
+
+  /** Writes the index to disk, and moves it over the current index file. */
+  void commit_index( MappedIndex &index, const string &tmp_path )
+  {
+    if( msync( index.map, index.map_size, MS_SYNC ) != 0 )
+      throw runtime_error( "Could not write result index: " + errno_str() );
+
+    if( rename( tmp_path.c_str(), ns_idx_path.c_str() ) != 0 )
+      throw runtime_error( "Could not replace result index '" + ns_idx_path + "': " + errno_str() );
+
+    unmap_index( ns_index );
+    ns_index = index;
+    index = MappedIndex();
+  }//void commit_index(...)
+
+
+  /** Returns the smallest valid number of index slots that leaves room for growth. */
+  uint64_t index_slots_for( const uint64_t num_entries )
+  {
+    uint64_t num_slots = ns_min_index_slots;
+    while( num_slots < 4*num_entries )
+      num_slots *= 2;
+    return num_slots;
+  }//uint64_t index_slots_for( const uint64_t num_entries )
+
+
+  /** Returns the log offset plus one for the key, or zero if not in the index. */
+  uint64_t index_find( const MappedIndex &index, const Key &key )
+  {
+    // The index is never more than half full, so there is always an empty slot to stop at.
+    const uint64_t mask = index.header->num_slots - 1;
+    for( uint64_t i = key.lo & mask; ; i = (i + 1) & mask )
+    {
+      const IndexSlot &slot = index.slots[i];
+      if( !slot.offset_plus_one )
+        return 0;
+      if( (slot.key_hi == key.hi) && (slot.key_lo == key.lo) )
+        return slot.offset_plus_one;
+    }//for( loop over slots )
+  }//uint64_t index_find(...)
+
+
+  /** Inserts the key, or updates its offset if already in the index. */
+  void index_insert( MappedIndex &index, const Key &key, const uint64_t offset )
+  {
+    const uint64_t mask = index.header->num_slots - 1;
+    for( uint64_t i = key.lo & mask; ; i = (i + 1) & mask )
+    {
+      IndexSlot &slot = index.slots[i];
+      if( !slot.offset_plus_one )
+      {
+        slot.key_hi = key.hi;
+        slot.key_lo = key.lo;
+        slot.offset_plus_one = offset + 1;
+        index.header->num_entries += 1;
+        return;
+      }//if( an empty slot )
+
+      if( (slot.key_hi == key.hi) && (slot.key_lo == key.lo) )
+      {
+        slot.offset_plus_one = offset + 1;
+        return;
+      }
+    }//for( loop over slots )
+  }//void index_insert(...)
+
+
+  /** Replaces the index with one twice the size. */
+  void grow_index()
+  {
+    const string tmp_path = ns_idx_path + ".tmp";
+    MappedIndex bigger = create_index( tmp_path, 2*ns_index.header->num_slots );
+
+    try
+    {
+      for( uint64_t i = 0; i < ns_index.header->num_slots; ++i )
+      {
+        const IndexSlot &slot = ns_index.slots[i];
+        if( slot.offset_plus_one )
+          index_insert( bigger, Key{slot.key_hi, slot.key_lo}, slot.offset_plus_one - 1 );
+      }
+
+      bigger.header->log_id = ns_log_id;
+      bigger.header->log_size = ns_log_size;
+
+      commit_index( bigger, tmp_path );
+    }catch( std::exception & )
+    {
+      unmap_index( bigger );
+      unlink( tmp_path.c_str() );
+      throw;
+    }//try / catch
+  }//void grow_index()
+
+
+  /** Reads the log, adding each record to the history.
+
+   If rebuild is true, the whole of each record is read and checked, the log is truncated at the
+   first bad record, and a new index is built; otherwise only the start of each record is read.
+   */
+  void load_log( const bool rebuild )
+  {
+    ns_history.clear();
+
+    vector<pair<Key,uint64_t>> entries;
+    uint64_t offset = ns_log_header_size;
+    string body;
+
+    while( offset < ns_log_size )
+    {
+      uint64_t body_size, checksum;
+
+      try
+      {
+        if( rebuild )
+        {
+          if( !read_record( ns_log_fd, offset, ns_log_size, body ) )
+            break;
+          body_size = body.size();
+        }else
+        {
+          if( !read_record_header( ns_log_fd, offset, ns_log_size, body_size, checksum ) )
+            break;
+
+          body.resize( std::min( static_cast<uint64_t>(ns_meta_read_size), body_size ) );
+          if( !read_all( ns_log_fd, &body[0], body.size(), offset + ns_record_header_size ) )
+            break;
+        }//if( rebuild ) / else
+
+        RecordMeta meta;
+        try
+        {
+          Reader in( body );
+          meta = read_meta( in );
+        }catch( std::exception & )
+        {
+          if( rebuild || (body.size() == body_size) )
+            throw;
+
+          body.resize( body_size );
+          if( !read_all( ns_log_fd, &body[0], body.size(), offset + ns_record_header_size ) )
+            break;
+
+          Reader in( body );
+          meta = read_meta( in );
+        }//try / catch
+
+        if( rebuild )
+          entries.push_back( make_pair( meta.key, offset ) );
+
+        if( !meta.serial.empty() )
+          ns_history[meta.serial].push_back( HistoryEntry{ meta.meas_start_us, offset, meta.key } );
+      }catch( std::exception &e )
+      {
+        Wt::log("error:app") << "Invalid record at offset " << offset << " of '" << ns_log_path
+                             << "': " << e.what();
+        break;
+      }//try / catch
+
+      offset += ns_record_header_size + body_size;
+    }//while( offset < ns_log_size )
+
+    if( !rebuild )
+    {
+      if( offset != ns_log_size )
+        Wt::log("error:app") << "Could only read the first " << offset << " of " << ns_log_size
+                             << " bytes of '" << ns_log_path << "'; history will be incomplete.";
+      return;
+    }//if( !rebuild )
+
+    if( offset != ns_log_size )
+    {
+      Wt::log("warning:app") << "Truncating " << (ns_log_size - offset) << " bytes of partially"
+                             << " written or corrupt records from the end of '" << ns_log_path << "'";
+      if( ftruncate( ns_log_fd, static_cast<off_t>(offset) ) != 0 )
+        throw runtime_error( "Could not truncate '" + ns_log_path + "': " + errno_str() );
+      ns_log_size = offset;
+    }//if( offset != ns_log_size )
+
+    const string tmp_path = ns_idx_path + ".tmp";
+    MappedIndex index = create_index( tmp_path, index_slots_for( entries.size() ) );
+    for( const auto &entry : entries )
+      index_insert( index, entry.first, entry.second );
+    index.header->log_id = ns_log_id;
+    index.header->log_size = ns_log_size;
+
+    try
+    {
+      commit_index( index, tmp_path );
+    }catch( std::exception & )
+    {
+      unmap_index( index );
+      unlink( tmp_path.c_str() );
+      throw;
+    }
+
+    ns_stats.index_rebuilds += 1;
+
+    Wt::log("info:app") << "Rebuilt result store index from " << entries.size() << " records.";
+  }//void load_log( const bool rebuild )
+
+
+  uint64_t new_log_id()
+  {
+    return now_us() ^ (static_cast<uint64_t>( getpid() ) << 40);
+  }
+
+
+  string log_header( const uint64_t log_id )
+  {
+    string header( ns_log_magic, sizeof(ns_log_magic) );
+    Writer( header ).u64( log_id );
+    return header;
+  }
+
+
+  /** Closes a file descriptor when it goes out of scope. */
+  struct FdCloser
+  {
+    int fd;
+    ~FdCloser(){ if( fd >= 0 ) ::close( fd ); }
+  };//struct FdCloser
+
+
+  /** A record in the log, with its key. */
+  struct LogRecord
+  {
+    uint64_t offset;
+    uint64_t size;
+    Key key;
+  };//struct LogRecord
+
+
+  /** Reads the offset, size, and key of each record in [begin_offset, end_offset) of the log. */
+  vector<LogRecord> scan_records( const int fd, const uint64_t begin_offset, const uint64_t end_offset )
+  {
+    vector<LogRecord> records;
+    for( uint64_t offset = begin_offset; offset < end_offset; )
+    {
+      uint64_t body_size, checksum;
+      if( !read_record_header( fd, offset, end_offset, body_size, checksum ) )
+        throw runtime_error( "invalid record at offset " + std::to_string(offset) );
+
+      string key_bytes( 16, '\0' );
+      if( (body_size < key_bytes.size())
+         || !read_all( fd, &key_bytes[0], key_bytes.size(), offset + ns_record_header_size ) )
+        throw runtime_error( "invalid record at offset " + std::to_string(offset) );
+
+      Reader in( key_bytes );
+      LogRecord record;
+      record.offset = offset;
+      record.size = ns_record_header_size + body_size;
+      record.key.hi = in.u64();
+      record.key.lo = in.u64();
+      records.push_back( record );
+
+      offset += record.size;
+    }//for( loop over records )
+
+    return records;
+  }//vector<LogRecord> scan_records(...)
+
+
+  /** Rewrites the log without superseded records, and without the oldest records as needed to
+   get under three quarters of the size budget.
+
+   Must be called without ns_mutex held, and only by the thread that set ns_compacting.  Most of
+   the work - reading the log, and writing and indexing the new one - is done without holding
+   ns_mutex, so lookups and stores carry on meanwhile.  The lock is held to decide which records
+   are current, and at the end to copy over records stored in the meantime, and swap in the new
+   files.
+   */
+  void compact()
+  {
+    uint64_t target = 0, orig_size = 0, orig_log_id = 0;
+
+    // We read the log through our own descriptor, so it stays valid if the store is closed.
+    FdCloser read_fd{ -1 };
+    {// begin lock on ns_mutex
+      std::lock_guard<std::mutex> lock( ns_mutex );
+      if( !ns_open )
+        return;
+
+      target = ns_options.max_bytes - ns_options.max_bytes/4;
+      orig_size = ns_log_size;
+      orig_log_id = ns_log_id;
+      read_fd.fd = dup( ns_log_fd );
+      if( read_fd.fd < 0 )
+        throw runtime_error( "could not duplicate log descriptor: " + errno_str() );
+    }// end lock on ns_mutex
+
+    // The log is append-only, so the records before orig_size wont change under us.
+    vector<LogRecord> live = scan_records( read_fd.fd, ns_log_header_size, orig_size );
+
+    {// begin lock on ns_mutex
+      std::lock_guard<std::mutex> lock( ns_mutex );
+      if( !ns_open || (ns_log_id != orig_log_id) )
+        return;
+
+      // Keep the records that are still in the index, oldest first.
+      const auto is_superseded = []( const LogRecord &record ){
+        return index_find( ns_index, record.key ) != (record.offset + 1);
+      };
+      live.erase( std::remove_if( begin(live), end(live), is_superseded ), end(live) );
+    }// end lock on ns_mutex
+
+    uint64_t live_bytes = 0;
+    for( const LogRecord &record : live )
+      live_bytes += record.size;
+
+    const size_t num_live = live.size();
+    size_t first_kept = 0;
+    while( (first_kept < live.size()) && ((ns_log_header_size + live_bytes) > target) )
+      live_bytes -= live[first_kept++].size;
+
+    // Write the kept records to a new log, and index them; we use our own temporary file names,
+    //  since #grow_index may be called while we work.
+    const string tmp_log_path = ns_log_path + ".compact.tmp";
+    const string tmp_idx_path = ns_idx_path + ".compact.tmp";
+    const uint64_t log_id = new_log_id();
+
+    int fd = ::open( tmp_log_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    if( fd < 0 )
+      throw runtime_error( "could not create '" + tmp_log_path + "': " + errno_str() );
+
+    MappedIndex index;
+    unordered_map<uint64_t,uint64_t> new_offsets;
+    uint64_t new_size = 0;
+
+    const auto copy_record = [&index,&new_offsets,&new_size,fd]( const int from_fd, const LogRecord &rec, string &buffer ){
+      buffer.resize( rec.size );
+      if( !read_all( from_fd, &buffer[0], buffer.size(), rec.offset ) )
+        throw runtime_error( "log ended unexpectedly" );
+      write_all( fd, buffer.data(), buffer.size(), new_size );
+
+      index_insert( index, rec.key, new_size );
+      new_offsets[rec.offset] = new_size;
+      new_size += rec.size;
+    };//copy_record lambda
+
+    std::unique_lock<std::mutex> lock( ns_mutex, std::defer_lock );
+
+    try
+    {
+      const string header = log_header( log_id );
+      write_all( fd, header.data(), header.size(), 0 );
+      new_size = header.size();
+
+      // Slots are sized for four times the kept records, so there is room for the records stored
+      //  while we work.
+      index = create_index( tmp_idx_path, index_slots_for( live.size() - first_kept ) );
+
+      string record;
+      for( size_t i = first_kept; i < live.size(); ++i )
+        copy_record( read_fd.fd, live[i], record );
+
+      // Get the bulk of the data to disk before taking the lock, so the syncs below are quick.
+      if( fsync( fd ) != 0 )
+        throw runtime_error( "could not sync '" + tmp_log_path + "': " + errno_str() );
+      if( msync( index.map, index.map_size, MS_SYNC ) != 0 )
+        throw runtime_error( "could not sync '" + tmp_idx_path + "': " + errno_str() );
+
+      lock.lock();
+      if( !ns_open || (ns_log_id != orig_log_id) )
+        throw runtime_error( "result store was closed during compaction" );
+
+      // Copy over the results stored since we started; these also replace any of the records we
+      //  copied that were re-stored under the same key.
+      for( const LogRecord &rec : scan_records( ns_log_fd, orig_size, ns_log_size ) )
+      {
+        if( 2*(index.header->num_entries + 1) > index.header->num_slots )
+          throw runtime_error( "too many results stored during compaction" );
+        copy_record( ns_log_fd, rec, record );
+      }
+
+      if( fsync( fd ) != 0 )
+        throw runtime_error( "could not sync '" + tmp_log_path + "': " + errno_str() );
+
+      index.header->log_id = log_id;
+      index.header->log_size = new_size;
+      if( msync( index.map, index.map_size, MS_SYNC ) != 0 )
+        throw runtime_error( "could not sync '" + tmp_idx_path + "': " + errno_str() );
+
+      // If we are killed between these renames, the index wont match the logs ID, and will be
+      //  rebuilt when next opened.
+      if( rename( tmp_log_path.c_str(), ns_log_path.c_str() ) != 0 )
+        throw runtime_error( "could not replace '" + ns_log_path + "': " + errno_str() );
+    }catch( std::exception & )
+    {
+      ::close( fd );
+      unlink( tmp_log_path.c_str() );
+      unmap_index( index );
+      unlink( tmp_idx_path.c_str() );
+      throw;
+    }//try / catch
+
+    // We still hold ns_mutex from here on.
+    ::close( ns_log_fd );
+    ns_log_fd = fd;
+    ns_log_id = log_id;
+    ns_log_size = new_size;
+
+    try
+    {
+      commit_index( index, tmp_idx_path );
+    }catch( std::exception &e )
+    {
+      // The log has already been replaced, so we cant go back to the old index.
+      unmap_index( index );
+      unlink( tmp_idx_path.c_str() );
+      ns_open = false;
+      throw runtime_error( string(e.what()) + "; result store closed" );
+    }//try / catch
+
+    for( auto &serial_entries : ns_history )
+    {
+      vector<HistoryEntry> kept;
+      for( const HistoryEntry &entry : serial_entries.second )
+      {
+        const auto pos = new_offsets.find( entry.offset );
+        if( pos != end(new_offsets) )
+          kept.push_back( HistoryEntry{ entry.meas_start_us, pos->second, entry.key } );
+      }
+      serial_entries.second.swap( kept );
+    }//for( auto &serial_entries : ns_history )
+
+    for( auto iter = begin(ns_history); iter != end(ns_history); )
+      iter = iter->second.empty() ? ns_history.erase( iter ) : std::next( iter );
+
+    ns_stats.compactions += 1;
+
+    Wt::log("info:app") << "Compacted result store from " << orig_size << " to " << new_size
+                        << " bytes; dropped " << first_kept << " of " << num_live
+                        << " current results.";
+  }//void compact()
+
+
+  /** Appends the record to the log and indexes it. */
+  void append_record( const RecordMeta &meta, const string &record )
+  {
+    const uint64_t offset = ns_log_size;
+    write_all( ns_log_fd, record.data(), record.size(), offset );
+    ns_log_size += record.size();
+
+    if( 2*(ns_index.header->num_entries + 1) > ns_index.header->num_slots )
+      grow_index();
+
+    index_insert( ns_index, meta.key, offset );
+    ns_index.header->log_size = ns_log_size;
+
+    if( !meta.serial.empty() )
+      ns_history[meta.serial].push_back( HistoryEntry{ meta.meas_start_us, offset, meta.key } );
+
+    ns_stats.stores += 1;
+  }//void append_record(...)
+
+
+  /** Closes the files; ns_mutex must be held. */
+  void close_files()
+  {
+    if( ns_index.map )
+      msync( ns_index.map, ns_index.map_size, MS_ASYNC );
+    unmap_index( ns_index );
+
+    if( ns_log_fd >= 0 )
+      ::close( ns_log_fd );
+    ns_log_fd = -1;
+
+    ns_history.clear();
+  }//void close_files()
+#endif //#ifndef _WIN32
+}//namespace
+
+
+namespace ResultStore
+{
+
+void open( const Options &options, const int32_t engine_version )
+{
+#ifdef _WIN32
+  throw runtime_error( "The analysis result store is not supported on Windows" );
+#else
+  std::lock_guard<std::mutex> lock( ns_mutex );
+
+  if( ns_open )
+    throw runtime_error( "Result store already open" );
+
+  if( options.directory.empty() )
+    throw runtime_error( "No result store directory specified" );
+
+  if( !SpecUtils::is_directory( options.directory ) )
+    SpecUtils::create_directory( options.directory );
+  if( !SpecUtils::is_directory( options.directory ) )
+    throw runtime_error( "Could not create result store directory '" + options.directory + "'" );
+
+  ns_options = options;
+  ns_engine_version = engine_version;
+  ns_log_path = SpecUtils::append_path( options.directory, "results.log" );
+  ns_idx_path = SpecUtils::append_path( options.directory, "results.idx" );
+
+  ns_log_fd = ::open( ns_log_path.c_str(), O_RDWR | O_CREAT, 0644 );
+  if( ns_log_fd < 0 )
+    throw runtime_error( "Could not open result log '" + ns_log_path + "': " + errno_str() );
+
+  try
+  {
+    ns_log_size = file_size( ns_log_fd );
+
+    if( ns_log_size == 0 )
+    {
+      ns_log_id = new_log_id();
+      const string header = log_header( ns_log_id );
+      write_all( ns_log_fd, header.data(), header.size(), 0 );
+      ns_log_size = header.size();
+    }else
+    {
+      string header( ns_log_header_size, '\0' );
+      if( !read_all( ns_log_fd, &header[0], header.size(), 0 )
+          || memcmp( header.data(), ns_log_magic, sizeof(ns_log_magic) ) )
+        throw runtime_error( "'" + ns_log_path + "' is not a result store log" );
+
+      Reader in( header );
+      in.pos = sizeof(ns_log_magic);
+      ns_log_id = in.u64();
+    }//if( new log ) / else
+
+    ns_index = open_index( ns_idx_path );
+    load_log( !ns_index.map );
+  }catch( std::exception & )
+  {
+    close_files();
+    throw;
+  }//try / catch
+
+  ns_open = true;
+
+  Wt::log("info:app") << "Opened result store '" << options.directory << "' with "
+                      << ns_index.header->num_entries << " results (" << ns_log_size << " bytes).";
+#endif
+}//void open( const Options &options, const int32_t engine_version )
+
+
+void close()
+{
+#ifndef _WIN32
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  ns_open = false;
+  close_files();
+#endif
+}//void close()
+
+
+bool is_open()
+{
+  return ns_open;
+}
+
+
+bool lookup( Analysis::AnalysisInput &input, Analysis::AnalysisOutput &output )
+{
+#ifdef _WIN32
+  return false;
+#else
+  if( !ns_open || !input.input )
+    return false;
+
+  try
+  {
+    const Key key = input_key( input );
+
+    // Save the key so #store doesnt have to serialize the spectrum again.
+    input.result_key.clear();
+    Writer key_out( input.result_key );
+    key_out.u64( key.hi );
+    key_out.u64( key.lo );
+
+    string body;
+    {// begin lock on ns_mutex
+      std::lock_guard<std::mutex> lock( ns_mutex );
+      if( !ns_open )
+        return false;
+
+      const uint64_t offset_plus_one = index_find( ns_index, key );
+      if( !offset_plus_one )
+      {
+        ns_misses += 1;
+        return false;
+      }
+
+      if( !read_record( ns_log_fd, offset_plus_one - 1, ns_log_size, body ) )
+        throw runtime_error( "corrupt record at offset " + std::to_string(offset_plus_one - 1) );
+    }// end lock on ns_mutex
+
+    Reader in( body );
+    const RecordMeta meta = read_meta( in );
+    if( !(meta.key == key) )
+      throw runtime_error( "record key doesnt match index" );
+
+    output = AnalysisSerialization::read_output( in, input.input );
+    in.check_at_end();
+    output.ana_number = input.ana_number;
+
+    ns_hits += 1;
+    return true;
+  }catch( std::exception &e )
+  {
+    Wt::log("error:app") << "Failed to look up stored analysis result: " << e.what();
+  }//try / catch
+
+  ns_misses += 1;
+  return false;
+#endif
+}//bool lookup(...)
+
+
+void store( const Analysis::AnalysisInput &input, const Analysis::AnalysisOutput &output )
+{
+#ifndef _WIN32
+  if( !ns_open || !input.input )
+    return;
+
+  if( (output.gadras_intialization_error < 0) || (output.gadras_analysis_error < 0)
+     || !output.error_message.empty() )
+    return;
+
+  try
+  {
+    RecordMeta meta;
+    meta.key = input_key( input );
+    meta.stored_us = now_us();
+    meta.meas_start_us = earliest_start_us( *input.input );
+    meta.serial = input.input->instrument_id();
+    meta.drf = input.drf_folder;
+    meta.analysis_type = static_cast<uint8_t>( input.analysis_type );
+
+    const string record = encode_record( meta, output, input.input );
+
+    bool should_compact = false;
+    {// begin lock on ns_mutex
+      std::lock_guard<std::mutex> lock( ns_mutex );
+      if( !ns_open )
+        return;
+
+      try
+      {
+        append_record( meta, record );
+      }catch( std::exception & )
+      {
+        ns_stats.store_errors += 1;
+        throw;
+      }
+
+      should_compact = ns_options.max_bytes && (ns_log_size > ns_options.max_bytes) && !ns_compacting;
+      ns_compacting = ns_compacting || should_compact;
+    }// end lock on ns_mutex
+
+    // The log is compacted by whichever thread first takes it over the budget; other threads keep
+    //  storing (and looking up) meanwhile.
+    if( should_compact )
+    {
+      try
+      {
+        compact();
+      }catch( std::exception &e )
+      {
+        Wt::log("error:app") << "Failed to compact result store: " << e.what();
+      }
+
+      std::lock_guard<std::mutex> lock( ns_mutex );
+      ns_compacting = false;
+    }//if( should_compact )
+  }catch( std::exception &e )
+  {
+    Wt::log("error:app") << "Failed to store analysis result: " << e.what();
+  }//try / catch
+#endif
+}//void store(...)
+
+
+EngineJson::Array history( const std::string &serial, const int64_t start_us, const int64_t end_us,
+                           const size_t max_results )
+{
+  EngineJson::Array results;
+
+#ifndef _WIN32
+  vector<string> bodies;
+
+  {// begin lock on ns_mutex
+    std::lock_guard<std::mutex> lock( ns_mutex );
+    if( !ns_open )
+      return results;
+
+    const auto pos = ns_history.find( serial );
+    if( pos == end(ns_history) )
+      return results;
+
+    const vector<HistoryEntry> &entries = pos->second;
+    for( auto iter = entries.rbegin(); (iter != entries.rend()) && (bodies.size() < max_results); ++iter )
+    {
+      if( (iter->meas_start_us < start_us) || (iter->meas_start_us > end_us) )
+        continue;
+
+      // Skip results that were re-stored later, under the same key.
+      if( index_find( ns_index, iter->key ) != (iter->offset + 1) )
+        continue;
+
+      string body;
+      try
+      {
+        if( read_record( ns_log_fd, iter->offset, ns_log_size, body ) )
+          bodies.push_back( std::move(body) );
+      }catch( std::exception &e )
+      {
+        Wt::log("error:app") << "Failed to read stored analysis result: " << e.what();
+      }
+    }//for( loop over entries, most recent first )
+  }// end lock on ns_mutex
+
+  for( const string &body : bodies )
+  {
+    try
+    {
+      Reader in( body );
+      const RecordMeta meta = read_meta( in );
+      const Analysis::AnalysisOutput output = AnalysisSerialization::read_output( in, nullptr );
+
+      EngineJson::Object entry;
+      entry["measurementStartTime"] = iso_time_json( meta.meas_start_us );
+      entry["analysisTime"] = iso_time_json( static_cast<int64_t>(meta.stored_us) );
+      entry["drf"] = meta.drf;
+      entry["result"] = output.toJson();
+
+      results.push_back( std::move(entry) );
+    }catch( std::exception &e )
+    {
+      Wt::log("error:app") << "Failed to decode stored analysis result: " << e.what();
+    }//try / catch
+  }//for( const string &body : bodies )
+#endif
+
+  return results;
+}//EngineJson::Array history(...)
+
+
+EngineJson::Object status_json()
+{
+  EngineJson::Object json;
+
+  json["open"] = static_cast<bool>( ns_open );
+  json["hits"] = static_cast<long long>( ns_hits );
+  json["misses"] = static_cast<long long>( ns_misses );
+
+#ifndef _WIN32
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  if( ns_open )
+  {
+    json["results"] = static_cast<long long>( ns_index.header->num_entries );
+    json["indexSlots"] = static_cast<long long>( ns_index.header->num_slots );
+    json["logBytes"] = static_cast<long long>( ns_log_size );
+    json["serialNumbers"] = static_cast<long long>( ns_history.size() );
+  }//if( ns_open )
+
+  json["maxBytes"] = static_cast<long long>( ns_options.max_bytes );
+  json["stores"] = static_cast<long long>( ns_stats.stores );
+  json["storeErrors"] = static_cast<long long>( ns_stats.store_errors );
+  json["compactions"] = static_cast<long long>( ns_stats.compactions );
+  json["indexRebuilds"] = static_cast<long long>( ns_stats.index_rebuilds );
+#endif
+
+  return json;
+}//EngineJson::Object status_json()
+
+}//namespace ResultStore
@@ -0,0 +1,478 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <map>
+#include <mutex>
+#include <deque>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <condition_variable>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <zstd.h>
+
+#include "SpecUtils/Filesystem.h"
+
+#include "FullSpectrumId/EngineLog.h"
+#include "FullSpectrumId/HashUtils.h"
+#include "FullSpectrumId/SessionArchive.h"
+
+using namespace std;
+
+
+namespace
+{
+  /** An uploaded file waiting to be archived. */
+  struct UploadJob
+  {
+    string file;
+    string log_path;
+    string log_context;
+  };//struct UploadJob
+  
+  
+  std::mutex ns_mutex;
+  std::condition_variable ns_cv;
+  
+  SessionArchive::Options ns_options;
+  std::thread *ns_writer = nullptr;
+  bool ns_stopping = false;
+  
+  // Log text waiting to be written, in the order appended, and when the oldest of it was appended.
+  vector<pair<string,string>> ns_appends;
+  size_t ns_queued_bytes = 0;
+  std::chrono::steady_clock::time_point ns_oldest_append;
+  
+  deque<UploadJob> ns_uploads;
+  
+  // Statistics for the metrics; protected by ns_mutex.
+  struct Stats
+  {
+    size_t batches_written = 0;
+    size_t bytes_written = 0;
+    size_t bytes_dropped = 0;
+    size_t uploads_archived = 0;
+    size_t uploads_duplicate = 0;
+    size_t uploads_failed = 0;
+    size_t uploads_dropped = 0;
+    size_t upload_bytes = 0;
+    size_t upload_bytes_stored = 0;
+    size_t duplicate_bytes_saved = 0;
+  };//struct Stats
+  
+  Stats ns_stats;
+  
+  
+  /** Returns the name, relative to the upload directory, an upload with the given contents is
+   archived as; e.g., "3f/3f9a...c2-20480.zst".  Uploads come from users, so the name is from a
+   SHA-256 of the contents, which cant practically be made to collide with another upload.
+   */
+  string archive_name( const string &contents )
+  {
+    const string hex = HashUtils::sha256_hex( contents.data(), contents.size() );
+    
+    return hex.substr( 0, 2 ) + "/" + hex + "-" + std::to_string( contents.size() ) + ".zst";
+  }//string archive_name( const string &contents )
+  
+  
+  /** Flushes the file, and if the fsync policy calls for it, syncs it to disk. */
+  bool flush_file( FILE *file, const SessionArchive::FsyncPolicy policy )
+  {
+    if( fflush( file ) != 0 )
+      return false;
+    
+    if( policy == SessionArchive::FsyncPolicy::None )
+      return true;
+    
+#ifdef _WIN32
+    return (_commit( _fileno(file) ) == 0);
+#else
+    return (fsync( fileno(file) ) == 0);
+#endif
+  }//bool flush_file(...)
+  
+  
+  /** Appends the text to the file; returns false on failure. */
+  bool append_to_file( const string &path, const string &text, const SessionArchive::FsyncPolicy policy )
+  {
+    FILE *file = fopen( path.c_str(), "ab" );
+    if( !file )
+      return false;
+    
+    bool ok = (fwrite( text.data(), 1, text.size(), file ) == text.size());
+    ok = flush_file( file, policy ) && ok;
+    ok = (fclose( file ) == 0) && ok;
+    
+    return ok;
+  }//bool append_to_file(...)
+  
+  
+  /** Writes the appended text, grouped by file, so each file is opened and synced once. */
+  void write_appends( const vector<pair<string,string>> &appends, const SessionArchive::FsyncPolicy policy )
+  {
+    map<string,string> by_file;
+    for( const auto &append : appends )
+      by_file[append.first] += append.second;
+    
+    size_t bytes = 0;
+    for( const auto &file : by_file )
+    {
+      if( append_to_file( file.first, file.second, policy ) )
+        bytes += file.second.size();
+      else
+        EngineLog::log("error:app") << "Failed to write session log '" << file.first << "'.";
+    }//for( const auto &file : by_file )
+    
+    std::lock_guard<std::mutex> lock( ns_mutex );
+    ns_stats.batches_written += 1;
+    ns_stats.bytes_written += bytes;
+  }//void write_appends(...)
+  
+  
+  enum class ArchiveStatus { Success, Duplicate, Failed };
+  
+  const char *to_str( const ArchiveStatus status )
+  {
+    switch( status )
+    {
+      case ArchiveStatus::Success:   return "Success";
+      case ArchiveStatus::Duplicate: return "AlreadyArchived";
+      case ArchiveStatus::Failed:    return "Failed";
+    }
+    return "";
+  }//const char *to_str( const ArchiveStatus status )
+  
+  
+  /** Compresses and stores the upload, unless an identical file is already stored; sets name to the
+   archived file name, relative to the upload directory.
+   */
+  ArchiveStatus archive_file( const UploadJob &job, const SessionArchive::Options &options, string &name )
+  {
+    string contents;
+    {
+      ifstream input( job.file.c_str(), ios::in | ios::binary );
+      if( !input )
+        throw runtime_error( "could not open uploaded file" );
+      
+      ostringstream strm;
+      strm << input.rdbuf();
+      contents = strm.str();
+    }
+    
+    name = archive_name( contents );
+    
+    const string path = SpecUtils::append_path( options.upload_dir, name );
+    
+    if( SpecUtils::is_file( path ) )
+    {
+      std::lock_guard<std::mutex> lock( ns_mutex );
+      ns_stats.uploads_duplicate += 1;
+      ns_stats.upload_bytes += contents.size();
+      ns_stats.duplicate_bytes_saved += contents.size();
+      return ArchiveStatus::Duplicate;
+    }//if( already archived )
+    
+    const string dir = SpecUtils::append_path( options.upload_dir, name.substr( 0, 2 ) );
+    if( !SpecUtils::is_directory( dir ) && !SpecUtils::create_directory( dir ) )
+      throw runtime_error( "could not create directory '" + dir + "'" );
+    
+    string compressed( ZSTD_compressBound( contents.size() ), '\0' );
+    const size_t compressed_size = ZSTD_compress( &(compressed[0]), compressed.size(),
+                                                  contents.data(), contents.size(),
+                                                  options.compression_level );
+    if( ZSTD_isError( compressed_size ) )
+      throw runtime_error( string("compression failed: ") + ZSTD_getErrorName( compressed_size ) );
+    
+    // Write to a temporary file, and rename it into place, so a crash cant leave a partial file
+    //  under the content name.
+    const string tmp_path = path + ".tmp";
+    FILE *file = fopen( tmp_path.c_str(), "wb" );
+    if( !file )
+      throw runtime_error( "could not create '" + tmp_path + "'" );
+    
+    bool ok = (fwrite( compressed.data(), 1, compressed_size, file ) == compressed_size);
+    ok = flush_file( file, options.fsync ) && ok;
+    ok = (fclose( file ) == 0) && ok;
+    
+    if( !ok || (std::rename( tmp_path.c_str(), path.c_str() ) != 0) )
+    {
+      std::remove( tmp_path.c_str() );
+      throw runtime_error( "could not write '" + path + "'" );
+    }
+    
+    std::lock_guard<std::mutex> lock( ns_mutex );
+    ns_stats.uploads_archived += 1;
+    ns_stats.upload_bytes += contents.size();
+    ns_stats.upload_bytes_stored += compressed_size;
+    
+    return ArchiveStatus::Success;
+  }//ArchiveStatus archive_file(...)
+  
+  
+  /** Archives the upload, deletes it, and appends the result to the sessions log. */
+  void process_upload( const UploadJob &job, const SessionArchive::Options &options )
+  {
+    string name;
+    ArchiveStatus status = ArchiveStatus::Failed;
+    
+    try
+    {
+      status = archive_file( job, options, name );
+    }catch( std::exception &e )
+    {
+      EngineLog::log("error:app") << "Unable to archive user upload '" << job.file << "': " << e.what();
+      
+      std::lock_guard<std::mutex> lock( ns_mutex );
+      ns_stats.uploads_failed += 1;
+    }//try / catch
+    
+    std::remove( job.file.c_str() );
+    
+    if( job.log_path.empty() )
+      return;
+    
+    string entry = "<UploadArchived>\n" + job.log_context
+                   + "\t<ArchivedStatus>" + to_str(status) + "</ArchivedStatus>\n";
+    if( status != ArchiveStatus::Failed )
+      entry += "\t<ArchiveFile>" + name + "</ArchiveFile>\n";
+    entry += "</UploadArchived>\n";
+    
+    if( !append_to_file( job.log_path, entry, options.fsync ) )
+      EngineLog::log("error:app") << "Failed to write session log '" << job.log_path << "'.";
+  }//void process_upload(...)
+  
+  
+  void writer_main()
+  {
+    for( ; ; )
+    {
+      vector<pair<string,string>> appends;
+      deque<UploadJob> uploads;
+      SessionArchive::Options options;
+      bool stopping = false;
+      
+      {// Begin lock on ns_mutex
+        std::unique_lock<std::mutex> lock( ns_mutex );
+        
+        ns_cv.wait( lock, [](){ return ns_stopping || !ns_appends.empty() || !ns_uploads.empty(); } );
+        
+        // Let log text collect for a while, so its written in one go, unless we are stopping, or
+        //  there is a lot of it.
+        if( ns_uploads.empty() && !ns_stopping )
+        {
+          const auto batch_duration = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                          std::chrono::duration<double>( ns_options.batch_seconds ) );
+          const auto batch_end = ns_oldest_append + batch_duration;
+          ns_cv.wait_until( lock, batch_end, [](){
+            return ns_stopping || !ns_uploads.empty() || (ns_queued_bytes > (ns_options.max_queued_bytes / 2));
+          } );
+        }//if( only log text to write )
+        
+        appends.swap( ns_appends );
+        ns_queued_bytes = 0;
+        uploads.swap( ns_uploads );
+        options = ns_options;
+        stopping = ns_stopping;
+      }// End lock on ns_mutex
+      
+      // Write the log text first, so an uploads <UploadArchived> entry comes after the entry
+      //  recording the upload.
+      if( !appends.empty() )
+        write_appends( appends, options.fsync );
+      
+      for( const UploadJob &job : uploads )
+        process_upload( job, options );
+      
+      if( stopping )
+      {
+        std::lock_guard<std::mutex> lock( ns_mutex );
+        if( ns_appends.empty() && ns_uploads.empty() )
+          break;
+      }
+    }//for( ; ; )
+  }//void writer_main()
+}//namespace
+
+
+namespace SessionArchive
+{
+
+FsyncPolicy fsync_policy_from_str( const std::string &policy )
+{
+  if( policy == "none" )
+    return FsyncPolicy::None;
+  if( policy == "batch" )
+    return FsyncPolicy::Batch;
+  
+  throw runtime_error( "Invalid fsync policy '" + policy + "'; must be 'none' or 'batch'." );
+}//FsyncPolicy fsync_policy_from_str( const std::string &policy )
+
+
+void start( const Options &options )
+{
+  if( options.upload_dir.empty() )
+    throw runtime_error( "SessionArchive::start(): no upload directory given." );
+  
+  if( options.compression_level < 1 || options.compression_level > ZSTD_maxCLevel() )
+    throw runtime_error( "SessionArchive::start(): invalid compression level "
+                         + std::to_string(options.compression_level) + "." );
+  
+  if( !(options.batch_seconds >= 0.0) )
+    throw runtime_error( "SessionArchive::start(): batch time must not be negative." );
+  
+  if( !SpecUtils::is_directory( options.upload_dir )
+      && !SpecUtils::create_directory( options.upload_dir ) )
+    throw runtime_error( "SessionArchive::start(): could not create upload directory '"
+                         + options.upload_dir + "'." );
+  
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  if( ns_writer )
+    throw runtime_error( "SessionArchive::start(): already started." );
+  
+  ns_options = options;
+  ns_stopping = false;
+  ns_writer = new std::thread( &writer_main );
+}//void start( const Options &options )
+
+
+void stop()
+{
+  std::thread *writer = nullptr;
+  {
+    std::lock_guard<std::mutex> lock( ns_mutex );
+    writer = ns_writer;
+    ns_stopping = true;
+  }
+  
+  if( !writer )
+    return;
+  
+  ns_cv.notify_all();
+  writer->join();
+  delete writer;
+  
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  ns_writer = nullptr;
+  ns_stopping = false;
+}//void stop()
+
+
+void append( const std::string &path, const std::string &text )
+{
+  {// Begin lock on ns_mutex
+    std::unique_lock<std::mutex> lock( ns_mutex );
+    
+    if( ns_writer && !ns_stopping )
+    {
+      if( (ns_queued_bytes + text.size()) > ns_options.max_queued_bytes )
+      {
+        ns_stats.bytes_dropped += text.size();
+        return;
+      }
+      
+      if( ns_appends.empty() )
+        ns_oldest_append = std::chrono::steady_clock::now();
+      
+      ns_appends.emplace_back( path, text );
+      ns_queued_bytes += text.size();
+      
+      const bool first = (ns_appends.size() == 1);
+      lock.unlock();
+      
+      if( first )
+        ns_cv.notify_all();
+      return;
+    }//if( ns_writer && !ns_stopping )
+  }// End lock on ns_mutex
+  
+  if( !append_to_file( path, text, FsyncPolicy::None ) )
+    EngineLog::log("error:app") << "Failed to open '" << path << "' for writing.";
+}//void append(...)
+
+
+bool archive_upload( const std::string &file, const std::string &log_path,
+                     const std::string &log_context )
+{
+  {// Begin lock on ns_mutex
+    std::lock_guard<std::mutex> lock( ns_mutex );
+    
+    if( ns_writer && !ns_stopping && (ns_uploads.size() < ns_options.max_queued_uploads) )
+    {
+      ns_uploads.push_back( UploadJob{ file, log_path, log_context } );
+      ns_cv.notify_all();
+      return true;
+    }
+    
+    ns_stats.uploads_dropped += 1;
+  }// End lock on ns_mutex
+  
+  std::remove( file.c_str() );
+  return false;
+}//bool archive_upload(...)
+
+
+EngineJson::Object status_json()
+{
+  std::lock_guard<std::mutex> lock( ns_mutex );
+  
+  EngineJson::Object log;
+  log["queuedBytes"] = ns_queued_bytes;
+  log["batchesWritten"] = ns_stats.batches_written;
+  log["bytesWritten"] = ns_stats.bytes_written;
+  log["bytesDropped"] = ns_stats.bytes_dropped;
+  
+  EngineJson::Object uploads;
+  uploads["queued"] = ns_uploads.size();
+  uploads["archived"] = ns_stats.uploads_archived;
+  uploads["duplicates"] = ns_stats.uploads_duplicate;
+  uploads["failed"] = ns_stats.uploads_failed;
+  uploads["dropped"] = ns_stats.uploads_dropped;
+  uploads["bytes"] = ns_stats.upload_bytes;
+  uploads["bytesStored"] = ns_stats.upload_bytes_stored;
+  uploads["duplicateBytesSaved"] = ns_stats.duplicate_bytes_saved;
+  
+  EngineJson::Object status;
+  status["running"] = (ns_writer != nullptr);
+  status["log"] = log;
+  status["uploads"] = uploads;
+  
+  return status;
+}//EngineJson::Object status_json()
+
+}//namespace SessionArchive
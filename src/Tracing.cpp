@@ -0,0 +1,472 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#include "FullSpectrumId/Tracing.h"
+#include "FullSpectrumId/EngineLog.h"
+
+using namespace std;
+
+
+namespace
+{
+  /** A recorded event; the phase is the Chrome trace event type ('X', 'b', or 'e'). */
+  struct Event
+  {
+    const char *name;
+    const char *category;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint64_t request_id;
+    char phase;
+  };//struct Event
+
+
+  /** The ring buffer of events for a single thread.  The mutex is only contended when the trace
+   is being dumped.
+   */
+  struct ThreadBuffer
+  {
+    std::mutex mutex;
+    vector<Event> events;
+    size_t next_index;
+    bool wrapped;
+    bool retired;
+    uint32_t thread_index;
+    const char *thread_name;
+  };//struct ThreadBuffer
+
+
+  /** Owns the current threads buffer; retires the buffer when the thread exits. */
+  struct ThreadBufferOwner
+  {
+    shared_ptr<ThreadBuffer> buffer;
+    ~ThreadBufferOwner();
+  };//struct ThreadBufferOwner
+
+
+  const std::chrono::steady_clock::time_point ns_trace_epoch = std::chrono::steady_clock::now();
+
+  std::atomic<uint64_t> ns_next_request_id( 1 );
+  std::atomic<size_t> ns_events_per_thread( 65536 );
+
+  // Buffers of exited threads are kept (trimmed to the events they hold) so their events still
+  //  show up in the trace, but only up to ns_events_per_thread events in total; past that the
+  //  oldest retired buffers are dropped.
+  std::mutex ns_buffers_mutex;
+  vector<shared_ptr<ThreadBuffer>> ns_buffers;
+  uint32_t ns_next_thread_index = 1;
+
+  thread_local ThreadBufferOwner t_owner;
+  thread_local uint64_t t_request_id = 0;
+  thread_local const char *t_thread_name = nullptr;
+
+
+  ThreadBuffer &thread_buffer()
+  {
+    if( !t_owner.buffer )
+    {
+      auto buffer = make_shared<ThreadBuffer>();
+      buffer->events.resize( std::max( size_t(16), ns_events_per_thread.load() ) );
+      buffer->next_index = 0;
+      buffer->wrapped = false;
+      buffer->retired = false;
+      buffer->thread_name = t_thread_name;
+
+      std::lock_guard<std::mutex> lock( ns_buffers_mutex );
+      buffer->thread_index = ns_next_thread_index++;
+      ns_buffers.push_back( buffer );
+      t_owner.buffer = buffer;
+    }//if( !t_owner.buffer )
+
+    return *t_owner.buffer;
+  }//ThreadBuffer &thread_buffer()
+
+
+  /** Removes retired buffers, oldest first, until the retired events fit in ns_events_per_thread;
+   also removes any retired buffers with no events.  ns_buffers_mutex must be held; the retired
+   flag, and the events of retired buffers, are only changed while holding it.
+   */
+  void trim_retired_buffers()
+  {
+    const size_t max_retired = ns_events_per_thread.load();
+
+    size_t retired_events = 0;
+    for( const shared_ptr<ThreadBuffer> &buffer : ns_buffers )
+      retired_events += buffer->retired ? buffer->events.size() : size_t(0);
+
+    for( auto iter = begin(ns_buffers); iter != end(ns_buffers); )
+    {
+      ThreadBuffer &buffer = **iter;
+      if( !buffer.retired
+          || (!buffer.events.empty() && (retired_events <= max_retired)) )
+      {
+        ++iter;
+        continue;
+      }
+
+      retired_events -= buffer.events.size();
+      iter = ns_buffers.erase( iter );
+    }//for( loop over buffers )
+  }//void trim_retired_buffers()
+
+
+  ThreadBufferOwner::~ThreadBufferOwner()
+  {
+    if( !buffer )
+      return;
+
+    // Keep only the recorded events, in order, so the full ring buffer can be freed.
+    std::lock_guard<std::mutex> lock( buffer->mutex );
+
+    vector<Event> events;
+    if( buffer->wrapped )
+    {
+      events.reserve( buffer->events.size() );
+      events.insert( end(events), begin(buffer->events) + buffer->next_index, end(buffer->events) );
+    }
+    events.insert( end(events), begin(buffer->events), begin(buffer->events) + buffer->next_index );
+
+    buffer->events.swap( events );
+    buffer->next_index = 0;
+    buffer->wrapped = true;
+
+    // The retired flag and the size of retired buffers are also read under ns_buffers_mutex.
+    std::lock_guard<std::mutex> buffers_lock( ns_buffers_mutex );
+    buffer->retired = true;
+    trim_retired_buffers();
+  }//ThreadBufferOwner::~ThreadBufferOwner()
+
+
+  void record( const char *name, const char *category, const char phase,
+               const uint64_t start_ns, const uint64_t duration_ns, const uint64_t request_id )
+  {
+    ThreadBuffer &buffer = thread_buffer();
+
+    std::lock_guard<std::mutex> lock( buffer.mutex );
+    Event &event = buffer.events[buffer.next_index];
+    event.name = name;
+    event.category = category;
+    event.start_ns = start_ns;
+    event.duration_ns = duration_ns;
+    event.request_id = request_id;
+    event.phase = phase;
+
+    buffer.next_index += 1;
+    if( buffer.next_index >= buffer.events.size() )
+    {
+      buffer.next_index = 0;
+      buffer.wrapped = true;
+    }
+  }//record(...)
+
+
+  void append_json_str( string &out, const char *str )
+  {
+    out += '"';
+    for( const char *c = str ? str : ""; *c; ++c )
+    {
+      switch( *c )
+      {
+        case '"':  out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n";  break;
+        case '\t': out += "\\t";  break;
+        default:
+          if( static_cast<unsigned char>(*c) < 0x20 )
+          {
+            char buf[8];
+            snprintf( buf, sizeof(buf), "\\u%04x", static_cast<unsigned int>(*c) );
+            out += buf;
+          }else
+          {
+            out += *c;
+          }
+      }//switch( *c )
+    }//for( loop over characters )
+    out += '"';
+  }//append_json_str(...)
+
+
+  /** Chrome trace timestamps are in microseconds; we'll keep sub-microsecond precision. */
+  string to_us_str( const uint64_t ns )
+  {
+    char buf[32];
+    snprintf( buf, sizeof(buf), "%llu.%03u", static_cast<unsigned long long>(ns / 1000),
+              static_cast<unsigned int>(ns % 1000) );
+    return buf;
+  }
+
+
+#ifndef _WIN32
+  volatile sig_atomic_t ns_dump_requested = 0;
+
+  void dump_signal_handler( int )
+  {
+    ns_dump_requested = 1;
+  }
+#endif
+}//namespace
+
+
+namespace Tracing
+{
+namespace detail
+{
+  std::atomic<bool> sm_enabled( false );
+}
+
+
+void set_enabled( const bool enable )
+{
+  detail::sm_enabled = enable;
+  EngineLog::log("info:app") << "Request tracing " << (enable ? "enabled" : "disabled");
+}
+
+
+void set_events_per_thread( const size_t num_events )
+{
+  ns_events_per_thread = num_events;
+}
+
+
+uint64_t new_request_id()
+{
+  if( !enabled() )
+    return 0;
+  return ns_next_request_id++;
+}
+
+
+uint64_t current_request_id()
+{
+  return t_request_id;
+}
+
+
+RequestScope::RequestScope( const uint64_t request_id )
+  : m_previous_id( t_request_id )
+{
+  t_request_id = request_id;
+}
+
+
+RequestScope::~RequestScope()
+{
+  t_request_id = m_previous_id;
+}
+
+
+uint64_t Span::now_ns()
+{
+  const auto elapsed = std::chrono::steady_clock::now() - ns_trace_epoch;
+  // Add one so a valid time is never zero, which we use to indicate not recording.
+  return 1 + static_cast<uint64_t>( std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() );
+}
+
+
+void Span::finish()
+{
+  const uint64_t end_ns = now_ns();
+  record( m_name, m_category, 'X', m_start_ns, end_ns - m_start_ns, t_request_id );
+}
+
+
+void async_begin( const char *name, const char *category, const uint64_t request_id )
+{
+  if( enabled() && request_id )
+    record( name, category, 'b', Span::now_ns(), 0, request_id );
+}
+
+
+void async_end( const char *name, const char *category, const uint64_t request_id )
+{
+  if( enabled() && request_id )
+    record( name, category, 'e', Span::now_ns(), 0, request_id );
+}
+
+
+void set_thread_name( const char *name )
+{
+  // We'll hold off creating the buffer until an event is actually recorded.
+  t_thread_name = name;
+  
+  if( t_owner.buffer )
+  {
+    std::lock_guard<std::mutex> lock( t_owner.buffer->mutex );
+    t_owner.buffer->thread_name = name;
+  }
+}
+
+
+std::string chrome_trace_json( const bool clear )
+{
+  vector<shared_ptr<ThreadBuffer>> buffers;
+  {
+    std::lock_guard<std::mutex> lock( ns_buffers_mutex );
+    buffers = ns_buffers;
+  }
+
+#ifdef _WIN32
+  const string pid = "1";
+#else
+  const string pid = std::to_string( getpid() );
+#endif
+
+  string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+
+  for( const shared_ptr<ThreadBuffer> &buffer : buffers )
+  {
+    std::lock_guard<std::mutex> lock( buffer->mutex );
+
+    const string tid = std::to_string( buffer->thread_index );
+
+    if( buffer->thread_name )
+    {
+      json += first ? "\n" : ",\n";
+      first = false;
+      json += "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" + pid + ",\"tid\":" + tid
+              + ",\"args\":{\"name\":";
+      append_json_str( json, buffer->thread_name );
+      json += "}}";
+    }//if( buffer->thread_name )
+
+    const size_t nevents = buffer->wrapped ? buffer->events.size() : buffer->next_index;
+    const size_t first_index = buffer->wrapped ? buffer->next_index : 0;
+
+    for( size_t i = 0; i < nevents; ++i )
+    {
+      const Event &event = buffer->events[(first_index + i) % buffer->events.size()];
+
+      json += first ? "\n" : ",\n";
+      first = false;
+
+      json += "{\"ph\":\"";
+      json += event.phase;
+      json += "\",\"name\":";
+      append_json_str( json, event.name );
+      json += ",\"cat\":";
+      append_json_str( json, event.category );
+      json += ",\"pid\":" + pid + ",\"tid\":" + tid + ",\"ts\":" + to_us_str( event.start_ns );
+
+      if( event.phase == 'X' )
+        json += ",\"dur\":" + to_us_str( event.duration_ns );
+      else
+        json += ",\"id\":" + std::to_string( event.request_id );
+
+      if( event.request_id )
+        json += ",\"args\":{\"request\":" + std::to_string( event.request_id ) + "}";
+
+      json += "}";
+    }//for( size_t i = 0; i < nevents; ++i )
+
+    if( clear && buffer->retired )
+    {
+      std::lock_guard<std::mutex> buffers_lock( ns_buffers_mutex );
+      buffer->events.clear();
+    }else if( clear )
+    {
+      buffer->next_index = 0;
+      buffer->wrapped = false;
+    }
+  }//for( const shared_ptr<ThreadBuffer> &buffer : buffers )
+
+  if( clear )
+  {
+    std::lock_guard<std::mutex> lock( ns_buffers_mutex );
+    trim_retired_buffers();
+  }
+
+  json += "\n]}\n";
+
+  return json;
+}//std::string chrome_trace_json( const bool clear )
+
+
+void write_chrome_trace( const std::string &filename, const bool clear )
+{
+  const string json = chrome_trace_json( clear );
+
+  ofstream output( filename.c_str(), ios::out | ios::binary );
+  if( !output || !output.write( json.data(), json.size() ) )
+    throw runtime_error( "Failed to write trace to '" + filename + "'" );
+}//void write_chrome_trace(...)
+
+
+#ifndef _WIN32
+void install_dump_signal_handler( const std::string &filename )
+{
+  static std::once_flag s_installed;
+
+  std::call_once( s_installed, [filename](){
+    struct sigaction action;
+    memset( &action, 0, sizeof(action) );
+    action.sa_handler = &dump_signal_handler;
+    sigemptyset( &action.sa_mask );
+    action.sa_flags = SA_RESTART;
+    sigaction( SIGUSR1, &action, nullptr );
+
+    std::thread watcher( [filename](){
+      while( true )
+      {
+        std::this_thread::sleep_for( std::chrono::milliseconds(250) );
+        if( !ns_dump_requested )
+          continue;
+
+        ns_dump_requested = 0;
+        try
+        {
+          write_chrome_trace( filename, false );
+          EngineLog::log("info:app") << "Wrote request trace to '" << filename << "'";
+        }catch( std::exception &e )
+        {
+          EngineLog::log("error:app") << e.what();
+        }
+      }//while( true )
+    } );
+    watcher.detach();
+
+    EngineLog::log("info:app") << "Send SIGUSR1 to write request trace to '" << filename << "'";
+  } );
+}//void install_dump_signal_handler( const std::string &filename )
+#endif
+}//namespace Tracing
@@ -0,0 +1,969 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/** full-spec-bench: micro-benchmarks for the spectrum file handling, and other non-GADRAS, parts
+ of the analysis and display.
+
+ Spectrum files are generated in memory (and written to temporary files for the parsing
+ benchmarks), parameterized by the number of channels, detectors, and samples; each combination
+ of these specified on the command line is ran.
+
+ Results can be written to a JSON file using --output, and a previous output can be given as a
+ baseline using --baseline, in which case the median time of each benchmark is compared to the
+ baseline, and the program returns a non-zero exit code if any benchmark is slower than allowed
+ by --tolerance.
+
+ Example:
+   full-spec-bench --channels=1024,16384 --detectors=8 --samples=200 --output=bench.json
+   full-spec-bench --channels=1024,16384 --detectors=8 --samples=200 --baseline=bench.json
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <map>
+#include <set>
+#include <tuple>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+
+#include <boost/optional.hpp>
+#include <boost/program_options.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <Wt/WColor.h>
+#include <Wt/WLogger.h>
+#include <Wt/WString.h>
+#include <Wt/Json/Array.h>
+#include <Wt/Json/Value.h>
+#include <Wt/Json/Object.h>
+#include <Wt/Json/Parser.h>
+#include <Wt/Json/Serializer.h>
+
+#include "SpecUtils/SpecFile.h"
+#include "SpecUtils/DateTime.h"
+#include "SpecUtils/Filesystem.h"
+#include "SpecUtils/StringAlgo.h"
+#include "SpecUtils/D3SpectrumExport.h"
+#include "SpecUtils/EnergyCalibration.h"
+
+#include "FullSpectrumId/Analysis.h"
+#include "FullSpectrumId/EnergyCal.h"
+#include "FullSpectrumId/EngineJson.h"
+#include "FullSpectrumId/D3TimeChart.h"
+#include "FullSpectrumId/AnalysisFromFiles.h"
+
+#include "SyntheticSpec.h"
+
+
+using namespace std;
+
+namespace
+{
+/** The input size a benchmark was ran with. */
+struct BenchConfig
+{
+  size_t nchannel;
+  size_t ndetector;
+  size_t nsample;
+};//struct BenchConfig
+
+
+struct BenchResult
+{
+  string name;
+  BenchConfig config;
+  size_t iterations;
+  double min_ns;
+  double median_ns;
+  double mean_ns;
+  double p90_ns;
+  string error;
+};//struct BenchResult
+
+
+struct RunOptions
+{
+  double min_seconds;
+  size_t min_iterations;
+  size_t max_iterations;
+  string filter;
+};//struct RunOptions
+
+
+// Accumulates results of benchmarked functions, so the compiler cant optimize things away.
+volatile size_t g_sink = 0;
+
+
+/** Times 'fcn' until it has ran at least 'min_iterations' times and for at least 'min_seconds'
+ (or 'max_iterations' is reached); 'fcn' is called once before timing starts, as a warmup.
+ */
+BenchResult time_it( const string &name, const BenchConfig &config, const RunOptions &opts,
+                     const std::function<void()> &fcn )
+{
+  BenchResult result;
+  result.name = name;
+  result.config = config;
+  result.iterations = 0;
+  result.min_ns = result.median_ns = result.mean_ns = result.p90_ns = 0.0;
+
+  try
+  {
+    fcn();
+
+    vector<double> times;
+    double total_ns = 0.0;
+    while( (times.size() < opts.max_iterations)
+           && ((times.size() < opts.min_iterations) || (total_ns < 1.0E9*opts.min_seconds)) )
+    {
+      const auto start = std::chrono::steady_clock::now();
+      fcn();
+      const auto end = std::chrono::steady_clock::now();
+
+      const double ns = std::chrono::duration<double,std::nano>( end - start ).count();
+      times.push_back( ns );
+      total_ns += ns;
+    }//while( need more iterations )
+
+    std::sort( begin(times), end(times) );
+
+    result.iterations = times.size();
+    if( !times.empty() )
+    {
+      result.min_ns = times.front();
+      result.median_ns = times[times.size()/2];
+      result.mean_ns = total_ns / times.size();
+      result.p90_ns = times[std::min( times.size() - 1, (9*times.size())/10 )];
+    }
+  }catch( std::exception &e )
+  {
+    result.error = e.what();
+  }//try / catch
+
+  return result;
+}//time_it(...)
+
+
+/** Creates a search-mode file, with the number of channels, detectors, and samples from 'config',
+ with a Cs137 source passing by during the middle third of the foreground samples.
+
+ @param distinct_cals If true, each detector has a slightly different energy calibration,
+        otherwise all detectors share the same calibration object.
+ @param cal_variants Energy calibration variants each detector is written out for; see
+        SyntheticSpec::Options::calibration_variants.
+ */
+shared_ptr<SpecUtils::SpecFile> generate_search_file( const BenchConfig &config,
+                                                      const bool distinct_cals,
+                                                      const vector<string> &cal_variants = {} )
+{
+  SyntheticSpec::Options options;
+  options.type = SyntheticSpec::FileType::Search;
+  options.num_detectors = config.ndetector;
+  options.num_channels = config.nchannel;
+  options.num_slices = config.nsample;
+  options.distinct_calibrations = distinct_cals;
+  options.calibration_variants = cal_variants;
+  options.sources.push_back( SyntheticSpec::parse_source( "Cs137:500" ) );
+
+  return SyntheticSpec::generate( options );
+}//generate_search_file(...)
+
+
+/** Writes 'spec' to a temporary file with the given format and extension, returning the path. */
+string write_temp_file( const shared_ptr<const SpecUtils::SpecFile> &spec,
+                        const SpecUtils::SaveSpectrumAsType type,
+                        const string &extension,
+                        vector<string> &files_to_remove )
+{
+  const string path = SpecUtils::temp_file_name( "full_spec_bench", SpecUtils::temp_dir() )
+                      + "." + extension;
+  spec->write_to_file( path, type );
+  files_to_remove.push_back( path );
+
+  return path;
+}//write_temp_file(...)
+
+
+/** The equivalent of the `fill_inputs` lambda in Analysis::do_search_analysis: sums or gets the
+ requested samples, for each detector, and rebins the results to both the per-detector, and the
+ summed, energy calibrations.
+ */
+size_t fill_inputs( const shared_ptr<const SpecUtils::SpecFile> &spec,
+                    const set<int> &samples_to_get,
+                    const map<string,shared_ptr<const SpecUtils::EnergyCalibration>> &energy_cals,
+                    const shared_ptr<const SpecUtils::EnergyCalibration> &cal_of_summed )
+{
+  const vector<float> &energy_binning_of_summed = *cal_of_summed->channel_energies();
+  const size_t nchannels = cal_of_summed->num_channels();
+  const size_t ndet = energy_cals.size();
+
+  vector<int32_t> spectrum_buffer( ndet*nchannels, 0 );
+  vector<float> channel_counts_summed( nchannels, 0.0f );
+
+  size_t det_index = 0;
+  for( const auto &name_cal : energy_cals )
+  {
+    const string &name = name_cal.first;
+    const auto &cal = name_cal.second;
+
+    shared_ptr<const SpecUtils::Measurement> h;
+    if( samples_to_get.size() > 1 )
+      h = spec->sum_measurements( samples_to_get, {name}, cal );
+    else
+      h = spec->measurement( *begin(samples_to_get), name );
+
+    if( !h || !h->gamma_channel_contents() || !h->gamma_channel_energies() )
+      throw runtime_error( "Missing measurement for detector " + name );
+
+    vector<float> countsv_indiv = *h->gamma_channel_contents();
+    vector<float> countsv_sum = *h->gamma_channel_contents();
+
+    if( h->energy_calibration() != cal_of_summed )
+      SpecUtils::rebin_by_lower_edge( *h->gamma_channel_energies(), *h->gamma_channel_contents(),
+                                      energy_binning_of_summed, countsv_sum );
+
+    if( h->energy_calibration() != cal )
+      SpecUtils::rebin_by_lower_edge( *h->gamma_channel_energies(), *h->gamma_channel_contents(),
+                                      *cal->channel_energies(), countsv_indiv );
+
+    for( size_t i = 0; i < nchannels && i < countsv_sum.size() && i < countsv_indiv.size(); ++i )
+    {
+      channel_counts_summed[i] += countsv_sum[i];
+      spectrum_buffer[det_index*nchannels + i] = static_cast<int32_t>( std::round(countsv_indiv[i]) );
+    }
+
+    ++det_index;
+  }//for( loop over detectors )
+
+  return spectrum_buffer.size() + static_cast<size_t>( channel_counts_summed[nchannels/2] );
+}//fill_inputs(...)
+
+
+/** Peaks, for fitting an energy calibration, at common background energies, that are found off
+ from where 'cal' puts them by a few percent, and by differing amounts, so the fits are not exact.
+ */
+vector<EnergyCal::RecalPeakInfo> synthetic_recal_peaks( const shared_ptr<const SpecUtils::EnergyCalibration> &cal )
+{
+  const double energies[] = { 238.6, 583.2, 661.7, 911.2, 1460.8, 2614.5 };
+  const double offsets[] = { 0.8, -1.1, 0.3, 1.9, -0.6, 2.4 };
+
+  vector<EnergyCal::RecalPeakInfo> peaks;
+  for( size_t i = 0; i < 6; ++i )
+  {
+    EnergyCal::RecalPeakInfo peak;
+    peak.photopeakEnergy = energies[i];
+    peak.peakMean = 1.01*energies[i] + 0.00001*energies[i]*energies[i] + offsets[i];
+    peak.peakMeanUncert = 0.3 + 0.1*i;
+    peak.peakMeanBinNumber = cal->channel_for_energy( peak.peakMean );
+    peaks.push_back( peak );
+  }
+
+  return peaks;
+}//synthetic_recal_peaks(...)
+
+
+/** Fits the energy calibration using both EnergyCal::fit_energy_cal_poly (or _frf), and
+ EnergyCal::fit_energy_cal_general, and throws exception if the answers dont agree.
+
+ Poorly constrained coefficients can legitimately differ between the two solutions by a small
+ fraction of their uncertainty, so this is the tolerance allowed, along with a relative difference
+ of 1E-4; the fixed-size solution may not have a worse chi2 (by more than 0.1%).
+ */
+void check_energy_cal_fits( const bool is_frf,
+                            const vector<EnergyCal::RecalPeakInfo> &peaks,
+                            const vector<bool> &fitfor,
+                            const size_t nchannel,
+                            const vector<pair<float,float>> &dev_pairs,
+                            const vector<float> &start_coefs )
+{
+  vector<float> coefs = start_coefs, uncerts;
+  const double chi2 = is_frf
+              ? EnergyCal::fit_energy_cal_frf( peaks, fitfor, nchannel, dev_pairs, coefs, uncerts )
+              : EnergyCal::fit_energy_cal_poly( peaks, fitfor, nchannel, dev_pairs, coefs, uncerts );
+
+  vector<float> general_coefs = start_coefs, general_uncerts;
+  const double general_chi2 = EnergyCal::fit_energy_cal_general( is_frf, peaks, fitfor, nchannel,
+                                                      dev_pairs, general_coefs, general_uncerts );
+
+  auto too_different = []( const double lhs, const double rhs, const double tol ) -> bool {
+    const double diff = fabs( lhs - rhs );
+    return (diff > 1.0E-4*std::max(fabs(lhs),fabs(rhs))) && (diff > tol);
+  };
+
+  stringstream msg;
+  if( chi2 > (general_chi2 + 1.0E-3*general_chi2 + 1.0E-3) )
+    msg << "chi2 of " << chi2 << " vs " << general_chi2 << " for general solution";
+
+  if( (coefs.size() != general_coefs.size()) || (uncerts.size() != general_uncerts.size()) )
+    msg << (msg.str().empty() ? "" : ", ") << "different number of coefficients";
+
+  for( size_t i = 0; i < coefs.size() && i < general_coefs.size() && i < general_uncerts.size(); ++i )
+  {
+    if( too_different( coefs[i], general_coefs[i], 1.0E-3*general_uncerts[i] + 1.0E-9 )
+        || too_different( uncerts[i], general_uncerts[i], 1.0E-9 ) )
+    {
+      msg << (msg.str().empty() ? "" : ", ") << "coefficient " << i << " is " << coefs[i] << " +- "
+          << uncerts[i] << " vs " << general_coefs[i] << " +- " << general_uncerts[i]
+          << " for general solution";
+    }
+  }//for( size_t i = 0; i < coefs.size(); ++i )
+
+  if( !msg.str().empty() )
+    throw runtime_error( "Fixed-size fit disagrees with general fit: " + msg.str() );
+}//check_energy_cal_fits(...)
+
+
+/** Runs all the benchmarks, whose names match the filter, for the given input size. */
+void run_benchmarks( const BenchConfig &config, const bool first_config, const RunOptions &opts,
+                     vector<BenchResult> &results, vector<string> &files_to_remove )
+{
+  auto wanted = [&opts]( const string &name ) -> bool {
+    return opts.filter.empty() || SpecUtils::icontains( name, opts.filter );
+  };
+
+  auto run = [&]( const string &name, const std::function<void()> &fcn ){
+    if( !wanted(name) )
+      return;
+
+    results.push_back( time_it( name, config, opts, fcn ) );
+
+    const BenchResult &r = results.back();
+    cout << std::left << std::setw(40) << r.name << " ch=" << std::setw(6) << config.nchannel
+         << " det=" << std::setw(3) << config.ndetector << " samp=" << std::setw(6) << config.nsample;
+    if( r.error.empty() )
+      cout << " median=" << std::setw(12) << (r.median_ns / 1000.0) << " us (n=" << r.iterations << ")";
+    else
+      cout << " error: " << r.error;
+    cout << endl;
+  };//run lambda
+
+  // Checks results, rather than timing them; a failure is reported like a benchmark error.
+  auto check = [&]( const string &name, const std::function<void()> &fcn ){
+    if( !wanted(name) )
+      return;
+
+    cout << std::left << std::setw(40) << name << " ch=" << std::setw(6) << config.nchannel
+         << " det=" << std::setw(3) << config.ndetector << " samp=" << std::setw(6) << config.nsample;
+    try
+    {
+      fcn();
+      cout << " ok" << endl;
+    }catch( std::exception &e )
+    {
+      BenchResult result;
+      result.name = name;
+      result.config = config;
+      result.iterations = 0;
+      result.min_ns = result.median_ns = result.mean_ns = result.p90_ns = 0.0;
+      result.error = e.what();
+      results.push_back( result );
+
+      cout << " error: " << result.error << endl;
+    }//try / catch
+  };//check lambda
+
+  const shared_ptr<const SpecUtils::SpecFile> search_distinct = generate_search_file( config, true );
+  const shared_ptr<const SpecUtils::SpecFile> search_shared = generate_search_file( config, false );
+
+  // Parsing each file format.
+  const vector<tuple<string,SpecUtils::SaveSpectrumAsType,string>> formats{
+    { "n42_2012", SpecUtils::SaveSpectrumAsType::N42_2012, "n42" },
+    { "n42_2006", SpecUtils::SaveSpectrumAsType::N42_2006, "xml" },
+    { "pcf", SpecUtils::SaveSpectrumAsType::Pcf, "pcf" },
+    { "csv", SpecUtils::SaveSpectrumAsType::Csv, "csv" },
+    { "spc", SpecUtils::SaveSpectrumAsType::SpcBinaryInt, "spc" },
+    { "chn", SpecUtils::SaveSpectrumAsType::Chn, "chn" },
+    { "spe", SpecUtils::SaveSpectrumAsType::SpeIaea, "spe" }
+  };
+
+  string n42_path;
+  for( const auto &format : formats )
+  {
+    const string name = "parse_file/" + get<0>(format);
+    if( !wanted(name) && (get<0>(format) != "n42_2012") )
+      continue;
+
+    string path;
+    try
+    {
+      path = write_temp_file( search_distinct, get<1>(format), get<2>(format), files_to_remove );
+    }catch( std::exception &e )
+    {
+      cerr << "Failed to write " << get<0>(format) << " file: " << e.what() << endl;
+      continue;
+    }
+
+    if( get<0>(format) == "n42_2012" )
+      n42_path = path;
+
+    const string filename = "bench." + get<2>(format);
+    run( name, [path,filename](){
+      auto spec = AnalysisFromFiles::parse_file( path, filename );
+      if( !spec )
+        throw runtime_error( "Failed to parse file" );
+      g_sink += spec->num_measurements();
+    } );
+  }//for( const auto &format : formats )
+
+
+  // Creating analysis input from search-mode file, as well as a foreground + background file pair
+  if( !n42_path.empty() )
+  {
+    run( "create_input/search", [n42_path](){
+      const auto input = std::make_tuple( AnalysisFromFiles::SpecClassType::Unknown, n42_path, string("search.n42") );
+      auto spec = AnalysisFromFiles::create_input( input );
+      g_sink += spec->num_measurements();
+    } );
+  }//if( !n42_path.empty() )
+
+  if( wanted("create_input/fore_back") )
+  {
+    const set<int> fore_samples{ static_cast<int>(std::max(size_t(1),config.nsample/2)) };
+    const auto fore = search_distinct->sum_measurements( fore_samples, search_distinct->detector_names(),
+                                                         search_distinct->measurements().front()->energy_calibration() );
+    const auto back = search_distinct->sum_measurements( {0}, search_distinct->detector_names(),
+                                                         search_distinct->measurements().front()->energy_calibration() );
+
+    auto fore_file = make_shared<SpecUtils::SpecFile>();
+    auto fore_meas = make_shared<SpecUtils::Measurement>( *fore );
+    fore_meas->set_source_type( SpecUtils::SourceType::Foreground );
+    fore_file->add_measurement( fore_meas, true );
+
+    auto back_file = make_shared<SpecUtils::SpecFile>();
+    auto back_meas = make_shared<SpecUtils::Measurement>( *back );
+    back_meas->set_source_type( SpecUtils::SourceType::Background );
+    back_file->add_measurement( back_meas, true );
+
+    try
+    {
+      const string fore_path = write_temp_file( fore_file, SpecUtils::SaveSpectrumAsType::N42_2012, "n42", files_to_remove );
+      const string back_path = write_temp_file( back_file, SpecUtils::SaveSpectrumAsType::N42_2012, "n42", files_to_remove );
+
+      run( "create_input/fore_back", [fore_path,back_path](){
+        const auto fore = std::make_tuple( AnalysisFromFiles::SpecClassType::Foreground, fore_path, string("foreground.n42") );
+        const auto back = std::make_tuple( AnalysisFromFiles::SpecClassType::Background, back_path, string("background.n42") );
+        auto spec = AnalysisFromFiles::create_input( fore, back );
+        g_sink += spec->num_measurements();
+      } );
+    }catch( std::exception &e )
+    {
+      cerr << "Failed to write foreground/background files: " << e.what() << endl;
+    }
+  }//if( wanted("create_input/fore_back") )
+
+
+  // Selecting between energy calibration variants; the "by_name" variant is decided based on names
+  //  alone, while "by_data" requires looking at the data.
+  const vector<pair<string,vector<string>>> cal_variants{
+    { "filter_energy_cal_variants/by_name", {"LinEnCal", "CmpEnCal"} },
+    { "filter_energy_cal_variants/by_data", {"VariantA", "VariantB"} }
+  };
+
+  for( const auto &variant : cal_variants )
+  {
+    if( !wanted(variant.first) )
+      continue;
+
+    const shared_ptr<const SpecUtils::SpecFile> spec = generate_search_file( config, true, variant.second );
+    run( variant.first, [spec](){
+      // filter_energy_cal_variants modifies the file, so we have to make a copy each time
+      auto copy = make_shared<SpecUtils::SpecFile>();
+      *copy = *spec;
+      AnalysisFromFiles::filter_energy_cal_variants( copy );
+      g_sink += copy->num_measurements();
+    } );
+  }//for( const auto &variant : cal_variants )
+
+
+  // Search-mode summing and rebinning: sum the background, then get each foreground sample
+  const vector<pair<string,shared_ptr<const SpecUtils::SpecFile>>> fill_inputs_files{
+    { "fill_inputs/distinct_cals", search_distinct },
+    { "fill_inputs/shared_cal", search_shared }
+  };
+
+  for( const auto &name_spec : fill_inputs_files )
+  {
+    const shared_ptr<const SpecUtils::SpecFile> spec = name_spec.second;
+
+    map<string,shared_ptr<const SpecUtils::EnergyCalibration>> energy_cals;
+    for( const string &name : spec->detector_names() )
+    {
+      const auto m = spec->measurement( 0, name );
+      if( m && m->energy_calibration() )
+        energy_cals[name] = m->energy_calibration();
+    }
+
+    if( energy_cals.empty() )
+      continue;
+
+    const auto cal_of_summed = begin(energy_cals)->second;
+
+    run( name_spec.first, [spec,energy_cals,cal_of_summed](){
+      g_sink += fill_inputs( spec, {0}, energy_cals, cal_of_summed );
+      for( const int sample : spec->sample_numbers() )
+      {
+        if( sample != 0 )
+          g_sink += fill_inputs( spec, {sample}, energy_cals, cal_of_summed );
+      }
+    } );
+  }//for( const auto &name_spec : fill_inputs_files )
+
+
+  // Summing all the samples and detectors; the distinct calibrations require rebinning each one
+  for( const auto &name_spec : fill_inputs_files )
+  {
+    const string name = "sum_measurements/" + name_spec.first.substr( name_spec.first.find('/') + 1 );
+    const shared_ptr<const SpecUtils::SpecFile> spec = name_spec.second;
+    const auto cal = spec->measurements().front()->energy_calibration();
+
+    run( name, [spec,cal](){
+      auto sum = spec->sum_measurements( spec->sample_numbers(), spec->detector_names(), cal );
+      g_sink += sum ? sum->num_gamma_channels() : 0;
+    } );
+  }//for( const auto &name_spec : fill_inputs_files )
+
+
+  // Computing the lower channel energies of each detectors (polynomial, with deviation pairs)
+  //  calibration, as the search-mode renormalization does, using the batch evaluation, and using
+  //  SpecUtils; the two are first checked to agree.
+  {
+    vector<shared_ptr<const SpecUtils::EnergyCalibration>> cals;
+    for( const string &name : search_distinct->detector_names() )
+    {
+      const auto m = search_distinct->measurement( 0, name );
+      if( m && m->energy_calibration() && m->energy_calibration()->valid() )
+        cals.push_back( m->energy_calibration() );
+    }
+
+    check( "lower_channel_energies/vs_polynomial_binning", [cals](){
+      for( const auto &cal : cals )
+      {
+        const vector<float> batch = EnergyCal::batch_lower_channel_energies( cal->type(),
+                                     cal->coefficients(), cal->num_channels(), cal->deviation_pairs() );
+        const auto binning = SpecUtils::polynomial_binning( cal->coefficients(), cal->num_channels(),
+                                                            cal->deviation_pairs() );
+        if( !binning || (binning->size() != batch.size()) )
+          throw runtime_error( "Different number of channel energies" );
+
+        for( size_t i = 0; i < batch.size(); ++i )
+        {
+          const double diff = fabs( (*binning)[i] - batch[i] );
+          if( (diff > 0.001) && (diff > 1.0E-5*fabs((*binning)[i])) )
+            throw runtime_error( "Channel " + std::to_string(i) + " energy of "
+                                 + std::to_string(batch[i]) + " keV vs "
+                                 + std::to_string((*binning)[i]) + " keV from SpecUtils" );
+        }
+      }//for( const auto &cal : cals )
+    } );
+
+    run( "lower_channel_energies/batch", [cals](){
+      for( const auto &cal : cals )
+      {
+        const vector<float> energies = EnergyCal::batch_lower_channel_energies( cal->type(),
+                                     cal->coefficients(), cal->num_channels(), cal->deviation_pairs() );
+        g_sink += energies.size();
+      }
+    } );
+
+    run( "lower_channel_energies/polynomial_binning", [cals](){
+      for( const auto &cal : cals )
+      {
+        const auto energies = SpecUtils::polynomial_binning( cal->coefficients(), cal->num_channels(),
+                                                             cal->deviation_pairs() );
+        g_sink += energies ? energies->size() : size_t(0);
+      }
+    } );
+  }
+
+
+  // Fitting the energy calibration for 1 (gain only), 2, 3, and 4 coefficients, using both the
+  //  fixed-size solution fit_energy_cal_poly/frf use for these, and the general solution; the
+  //  two solutions are first checked to agree.
+  {
+    const auto cal = search_distinct->measurements().front()->energy_calibration();
+    const vector<EnergyCal::RecalPeakInfo> peaks = synthetic_recal_peaks( cal );
+    const vector<pair<float,float>> dev_pairs = cal->deviation_pairs();
+    const size_t nchannel = cal->num_channels();
+
+    for( const bool is_frf : { false, true } )
+    {
+      for( size_t nfit = 1; nfit <= 4; ++nfit )
+      {
+        const string name = string(is_frf ? "fit_energy_cal_frf/" : "fit_energy_cal_poly/")
+                            + std::to_string(nfit) + "par";
+
+        // For a single parameter, fit for gain, with the offset fixed.
+        vector<bool> fitfor( std::max(nfit,size_t(2)), true );
+        vector<float> start_coefs( fitfor.size(), 0.0f );
+        if( nfit == 1 )
+        {
+          fitfor[0] = false;
+          start_coefs[0] = 1.5f;
+        }
+
+        check( name + "/vs_general", [=](){
+          check_energy_cal_fits( is_frf, peaks, fitfor, nchannel, dev_pairs, start_coefs );
+        } );
+
+        run( name, [=](){
+          vector<float> coefs = start_coefs, uncerts;
+          const double chi2 = is_frf
+                 ? EnergyCal::fit_energy_cal_frf( peaks, fitfor, nchannel, dev_pairs, coefs, uncerts )
+                 : EnergyCal::fit_energy_cal_poly( peaks, fitfor, nchannel, dev_pairs, coefs, uncerts );
+          g_sink += static_cast<size_t>( chi2 > 0.0 );
+        } );
+
+        run( name + "/general", [=](){
+          vector<float> coefs = start_coefs, uncerts;
+          const double chi2 = EnergyCal::fit_energy_cal_general( is_frf, peaks, fitfor, nchannel,
+                                                                 dev_pairs, coefs, uncerts );
+          g_sink += static_cast<size_t>( chi2 > 0.0 );
+        } );
+      }//for( size_t nfit = 1; nfit <= 4; ++nfit )
+    }//for( const bool is_frf : { false, true } )
+  }
+
+
+  // Things that dont depend on the input size only need to be ran once
+  if( first_config )
+  {
+    Analysis::AnalysisOutput output;
+    output.ana_number = 42;
+    output.drf_used = "Detective-X";
+    output.gadras_intialization_error = 0;
+    output.gadras_analysis_error = 0;
+    output.stuff_of_interest = 12.5f;
+    output.rate_not_norm = 1234.5f;
+    output.chi_sqr = 1.1f;
+    output.alarm_basis_duration = 5.0f;
+    output.analysis_warnings = { "Energy calibration check was skipped." };
+
+    const vector<string> nucs{ "Cs137", "Co60", "Ba133", "K40", "Ra226", "Am241", "U235", "Ir192" };
+    for( size_t i = 0; i < nucs.size(); ++i )
+    {
+      output.isotopes += (i ? "+" : "") + nucs[i] + "(H)";
+      output.isotope_names.push_back( nucs[i] );
+      output.isotope_types.push_back( "Industrial" );
+      output.isotope_count_rates.push_back( 100.0f*(i + 1) );
+      output.isotope_confidences.push_back( 9.0f - i );
+      output.isotope_confidence_strs.push_back( "H" );
+    }
+
+    run( "AnalysisOutput::toJson", [output](){
+      const string json = EngineJson::serialize( output.toJson() );
+      g_sink += json.size();
+    } );
+  }//if( first_config )
+
+
+  // Payloads sent to the client-side charts
+  run( "D3TimeChart::timeDataJson", [search_distinct](){
+    const string json = D3TimeChart::timeDataJson( search_distinct, Wt::WColor(), Wt::WColor(), Wt::WColor() );
+    g_sink += json.size();
+  } );
+
+  {
+    const auto cal = search_distinct->measurements().front()->energy_calibration();
+    const shared_ptr<const SpecUtils::Measurement> summed
+      = search_distinct->sum_measurements( search_distinct->sample_numbers(), search_distinct->detector_names(), cal );
+
+    run( "D3SpectrumDisplayDiv/spectrum_data", [summed](){
+      D3SpectrumExport::D3SpectrumOptions options;
+      options.line_color = "black";
+      options.peak_color = "blue";
+      options.spectrum_type = SpecUtils::SpectrumType::Foreground;
+      options.display_scale_factor = 1.0;
+
+      std::vector< std::pair<const SpecUtils::Measurement *,D3SpectrumExport::D3SpectrumOptions> > measurements;
+      measurements.push_back( { summed.get(), options } );
+
+      std::ostringstream ostr;
+      if( !D3SpectrumExport::write_and_set_data_for_chart( ostr, "bench_chart", measurements ) )
+        throw runtime_error( "write_and_set_data_for_chart failed" );
+      g_sink += static_cast<size_t>( ostr.tellp() );
+    } );
+  }
+}//void run_benchmarks(...)
+
+
+string result_key( const string &name, const BenchConfig &config )
+{
+  return name + "|" + std::to_string(config.nchannel) + "|" + std::to_string(config.ndetector)
+         + "|" + std::to_string(config.nsample);
+}
+
+
+Wt::Json::Object results_to_json( const vector<BenchResult> &results )
+{
+  Wt::Json::Object root;
+  root["version"] = Wt::Json::Value( 1 );
+  root["time"] = Wt::Json::Value( Wt::WString::fromUTF8(
+                          SpecUtils::to_iso_string( boost::posix_time::second_clock::local_time() ) ) );
+#if( PERFORM_DEVELOPER_CHECKS )
+  root["developerChecks"] = Wt::Json::Value( true );
+#endif
+#ifndef NDEBUG
+  root["debugBuild"] = Wt::Json::Value( true );
+#endif
+
+  Wt::Json::Array &arr = root["results"] = Wt::Json::Value( Wt::Json::ArrayType );
+  for( const BenchResult &r : results )
+  {
+    Wt::Json::Object obj;
+    obj["name"] = Wt::Json::Value( Wt::WString::fromUTF8(r.name) );
+    obj["channels"] = Wt::Json::Value( static_cast<long long>(r.config.nchannel) );
+    obj["detectors"] = Wt::Json::Value( static_cast<long long>(r.config.ndetector) );
+    obj["samples"] = Wt::Json::Value( static_cast<long long>(r.config.nsample) );
+    obj["iterations"] = Wt::Json::Value( static_cast<long long>(r.iterations) );
+    obj["minNs"] = Wt::Json::Value( r.min_ns );
+    obj["medianNs"] = Wt::Json::Value( r.median_ns );
+    obj["meanNs"] = Wt::Json::Value( r.mean_ns );
+    obj["p90Ns"] = Wt::Json::Value( r.p90_ns );
+    if( !r.error.empty() )
+      obj["error"] = Wt::Json::Value( Wt::WString::fromUTF8(r.error) );
+
+    arr.push_back( std::move(obj) );
+  }//for( const BenchResult &r : results )
+
+  return root;
+}//results_to_json(...)
+
+
+/** Reads the median times of a previous --output file, keyed by #result_key. */
+map<string,double> read_baseline( const string &filename )
+{
+  std::ifstream input( filename.c_str(), ios::in | ios::binary );
+  if( !input )
+    throw runtime_error( "Could not open baseline file '" + filename + "'" );
+
+  const string contents( (std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>() );
+
+  Wt::Json::Object root;
+  Wt::Json::parse( contents, root );
+
+  map<string,double> answer;
+  const Wt::Json::Array &arr = root.get( "results" );
+  for( const Wt::Json::Value &val : arr )
+  {
+    const Wt::Json::Object &obj = val;
+    if( obj.contains( "error" ) )
+      continue;
+
+    const Wt::WString &name = obj.get( "name" );
+    BenchConfig config;
+    config.nchannel = static_cast<size_t>( static_cast<long long>(obj.get("channels")) );
+    config.ndetector = static_cast<size_t>( static_cast<long long>(obj.get("detectors")) );
+    config.nsample = static_cast<size_t>( static_cast<long long>(obj.get("samples")) );
+
+    answer[result_key(name.toUTF8(), config)] = obj.get( "medianNs" );
+  }//for( const Wt::Json::Value &val : arr )
+
+  return answer;
+}//read_baseline(...)
+
+
+vector<size_t> parse_size_list( const string &str, const string &option_name )
+{
+  vector<string> fields;
+  SpecUtils::split( fields, str, ", " );
+
+  vector<size_t> answer;
+  for( const string &field : fields )
+  {
+    size_t value = 0;
+    if( !(stringstream(field) >> value) || !value )
+      throw runtime_error( "Invalid value '" + field + "' for --" + option_name );
+    answer.push_back( value );
+  }
+
+  if( answer.empty() )
+    throw runtime_error( "No values given for --" + option_name );
+
+  return answer;
+}//parse_size_list(...)
+}//namespace
+
+
+int main( int argc, char **argv )
+{
+  namespace po = boost::program_options;
+
+  string channels_str, detectors_str, samples_str, output_path, baseline_path;
+  double tolerance = 0.15;
+  RunOptions opts;
+
+  po::options_description desc( "full-spec-bench options" );
+  desc.add_options()
+  ( "channels", po::value<string>(&channels_str)->default_value("1024,16384"),
+    "Comma separated list of number of channels to benchmark with." )
+  ( "detectors", po::value<string>(&detectors_str)->default_value("1,8"),
+    "Comma separated list of number of detectors to benchmark with." )
+  ( "samples", po::value<string>(&samples_str)->default_value("100"),
+    "Comma separated list of number of (0.1 second) foreground samples to benchmark with." )
+  ( "min-time", po::value<double>(&opts.min_seconds)->default_value(0.5),
+    "Minimum number of seconds to run each benchmark for." )
+  ( "min-iterations", po::value<size_t>(&opts.min_iterations)->default_value(5),
+    "Minimum number of times to run each benchmark." )
+  ( "max-iterations", po::value<size_t>(&opts.max_iterations)->default_value(100000),
+    "Maximum number of times to run each benchmark." )
+  ( "filter", po::value<string>(&opts.filter),
+    "Only run benchmarks whose name contains this (case insensitive) string." )
+  ( "output", po::value<string>(&output_path), "File to write JSON results to." )
+  ( "baseline", po::value<string>(&baseline_path),
+    "JSON results from a previous run to compare against." )
+  ( "tolerance", po::value<double>(&tolerance)->default_value(0.15),
+    "Fractional increase in median time, relative to baseline, considered a regression." )
+  ( "help,h", "produce help message" )
+  ;
+
+  po::variables_map cl_vm;
+
+  try
+  {
+    po::store( po::parse_command_line( argc, argv, desc ), cl_vm );
+    po::notify( cl_vm );
+  }catch( std::exception &e )
+  {
+    cerr << "Error parsing arguments from command line: " << string(e.what()) << endl;
+    return EXIT_FAILURE;
+  }//try catch
+
+  if( cl_vm.count("help") )
+  {
+    desc.print( cout );
+    return EXIT_SUCCESS;
+  }
+
+  vector<size_t> channels, detectors, samples;
+  try
+  {
+    channels = parse_size_list( channels_str, "channels" );
+    detectors = parse_size_list( detectors_str, "detectors" );
+    samples = parse_size_list( samples_str, "samples" );
+
+    if( opts.min_iterations < 1 )
+      opts.min_iterations = 1;
+    if( opts.max_iterations < opts.min_iterations )
+      throw runtime_error( "--max-iterations must be at least --min-iterations" );
+  }catch( std::exception &e )
+  {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+
+  map<string,double> baseline;
+  if( !baseline_path.empty() )
+  {
+    try
+    {
+      baseline = read_baseline( baseline_path );
+    }catch( std::exception &e )
+    {
+      cerr << "Failed to read baseline: " << e.what() << endl;
+      return EXIT_FAILURE;
+    }
+  }//if( !baseline_path.empty() )
+
+  // The parsing and analysis code logs at debug and info levels, which we dont want to time.
+  Wt::logInstance().configure( "* -debug -info" );
+
+  vector<BenchResult> results;
+  vector<string> files_to_remove;
+
+  bool first_config = true;
+  for( const size_t nchannel : channels )
+  {
+    for( const size_t ndetector : detectors )
+    {
+      for( const size_t nsample : samples )
+      {
+        const BenchConfig config{ nchannel, ndetector, nsample };
+        run_benchmarks( config, first_config, opts, results, files_to_remove );
+        first_config = false;
+
+        for( const string &filename : files_to_remove )
+          SpecUtils::remove_file( filename );
+        files_to_remove.clear();
+      }//for( const size_t nsample : samples )
+    }//for( const size_t ndetector : detectors )
+  }//for( const size_t nchannel : channels )
+
+
+  int rval = EXIT_SUCCESS;
+
+  for( const BenchResult &r : results )
+  {
+    if( !r.error.empty() )
+      rval = EXIT_FAILURE;
+  }
+
+  if( !output_path.empty() )
+  {
+    std::ofstream output( output_path.c_str(), ios::out | ios::binary );
+    output << Wt::Json::serialize( results_to_json(results) ) << endl;
+    if( !output )
+    {
+      cerr << "Failed to write results to '" << output_path << "'" << endl;
+      rval = EXIT_FAILURE;
+    }
+  }//if( !output_path.empty() )
+
+  if( !baseline.empty() )
+  {
+    cout << "\nComparison to baseline '" << baseline_path << "' (tolerance "
+         << 100.0*tolerance << "%):" << endl;
+
+    size_t nregressions = 0;
+    for( const BenchResult &r : results )
+    {
+      const auto pos = baseline.find( result_key(r.name, r.config) );
+      if( !r.error.empty() || (pos == end(baseline)) || (pos->second <= 0.0) )
+        continue;
+
+      const double ratio = r.median_ns / pos->second;
+      const bool regressed = (ratio > (1.0 + tolerance));
+      nregressions += regressed;
+
+      cout << (regressed ? "  REGRESSION " : "             ")
+           << std::left << std::setw(40) << r.name << " ch=" << std::setw(6) << r.config.nchannel
+           << " det=" << std::setw(3) << r.config.ndetector << " samp=" << std::setw(6) << r.config.nsample
+           << " ratio=" << ratio << endl;
+    }//for( const BenchResult &r : results )
+
+    if( nregressions )
+    {
+      cout << nregressions << " benchmark(s) regressed." << endl;
+      rval = EXIT_FAILURE;
+    }
+  }//if( !baseline.empty() )
+
+  return rval;
+}//int main( int argc, char **argv )
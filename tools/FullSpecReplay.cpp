@@ -0,0 +1,454 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/** full-spec-replay: re-submits the analysis requests recorded in a capture file (see the
+ "AnalysisCaptureFile" app config option, and FullSpectrumId/AnalysisCapture.h), either to a
+ running server through the REST API, or directly to the analysis queue in this process, and
+ reports the latency and throughput.
+
+ Requests are submitted with the same relative timing they were captured with, scaled by
+ --speed (e.g., --speed=10 submits ten times faster), or as fast as possible with --speed=max.
+
+ Examples:
+   full-spec-replay --capture=capture.bin --target=http://127.0.0.1:8085/api/v1/analysis --speed=4
+   full-spec-replay --capture=capture.bin --target=queue --speed=max \
+                    --gadras-lib=./libgadrasiid.so --gadras-run-dir=gadras_isotope_id_run_directory
+
+ When replaying through the REST API, the spectrum file is uploaded as a single N42 file, so the
+ server re-determines the analysis type; the captured DRF is always used.
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <condition_variable>
+
+#include <boost/program_options.hpp>
+
+#include <Wt/WString.h>
+#include <Wt/WLogger.h>
+#include <Wt/WIOService.h>
+#include <Wt/Http/Client.h>
+#include <Wt/Http/Message.h>
+#include <Wt/Json/Value.h>
+#include <Wt/Json/Object.h>
+#include <Wt/Json/Serializer.h>
+
+#include "SpecUtils/SpecFile.h"
+
+#include "FullSpectrumId/Analysis.h"
+#include "FullSpectrumId/AnalysisCapture.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+namespace
+{
+/** The result of a single replayed request. */
+struct ReplayResult
+{
+  Analysis::AnalysisType type;
+  double latency_ms;
+  bool success;
+};//struct ReplayResult
+
+
+/** Limits the number of requests in-flight, and waits for them all to finish. */
+class InFlightLimiter
+{
+public:
+  explicit InFlightLimiter( const size_t max_in_flight )
+    : m_max( std::max( size_t(1), max_in_flight ) ), m_in_flight( 0 )
+  {
+  }
+
+  void acquire()
+  {
+    std::unique_lock<std::mutex> lock( m_mutex );
+    m_cv.wait( lock, [this](){ return m_in_flight < m_max; } );
+    ++m_in_flight;
+  }
+
+  void release()
+  {
+    {
+      std::lock_guard<std::mutex> lock( m_mutex );
+      --m_in_flight;
+    }
+    m_cv.notify_all();
+  }
+
+  void wait_for_all()
+  {
+    std::unique_lock<std::mutex> lock( m_mutex );
+    m_cv.wait( lock, [this](){ return m_in_flight == 0; } );
+  }
+
+protected:
+  const size_t m_max;
+  size_t m_in_flight;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+};//class InFlightLimiter
+
+
+/** Creates the multipart/form-data body for a request to the /api/v1/analysis endpoint. */
+string multipart_body( const AnalysisCapture::CapturedRequest &request, const string &boundary )
+{
+  stringstream n42;
+  if( !request.input->write_2012_N42( n42 ) )
+    throw runtime_error( "Failed to write N42 file" );
+
+  Wt::Json::Object options;
+  options["drf"] = Wt::WString::fromUTF8( request.drf );
+
+  string body;
+  body += "--" + boundary + "\r\n";
+  body += "Content-Disposition: form-data; name=\"options\"\r\n\r\n";
+  body += Wt::Json::serialize( options ) + "\r\n";
+  body += "--" + boundary + "\r\n";
+  body += "Content-Disposition: form-data; name=\"foreground\"; filename=\"replay.n42\"\r\n";
+  body += "Content-Type: application/octet-stream\r\n\r\n";
+  body += n42.str() + "\r\n";
+  body += "--" + boundary + "--\r\n";
+
+  return body;
+}//multipart_body(...)
+
+
+double percentile( const vector<double> &sorted_vals, const double fraction )
+{
+  if( sorted_vals.empty() )
+    return 0.0;
+
+  const size_t index = static_cast<size_t>( fraction * (sorted_vals.size() - 1) + 0.5 );
+  return sorted_vals[std::min( index, sorted_vals.size() - 1 )];
+}//percentile(...)
+
+
+const char *type_str( const Analysis::AnalysisType type )
+{
+  switch( type )
+  {
+    case Analysis::AnalysisType::Simple: return "simple";
+    case Analysis::AnalysisType::Search: return "search";
+    case Analysis::AnalysisType::Portal: return "portal";
+  }
+  return "";
+}//type_str(...)
+}//namespace
+
+
+int main( int argc, char **argv )
+{
+  string capture_path, target, speed_str, output_path, gadras_run_dir;
+  size_t limit = 0, concurrency = 0;
+
+#if( !STATICALLY_LINK_TO_GADRAS )
+  string gadras_lib_path;
+#endif
+
+  po::options_description desc( "Allowed options" );
+  desc.add_options()
+    ( "help,h", "Produce help message" )
+    ( "capture,c", po::value<string>(&capture_path), "Analysis capture file to replay" )
+    ( "target,t", po::value<string>(&target)->default_value( "queue" ),
+      "Either \"queue\" to submit directly to the analysis queue in this process, or the URL of a"
+      " servers analysis endpoint, e.g. http://127.0.0.1:8085/api/v1/analysis" )
+    ( "speed,s", po::value<string>(&speed_str)->default_value( "1" ),
+      "Replay speed relative to capture: a positive multiplier (e.g., 1, 2.5, 10), or \"max\" to"
+      " submit requests as fast as possible" )
+    ( "concurrency", po::value<size_t>(&concurrency)->default_value( 64 ),
+      "Maximum number of requests in-flight at once" )
+    ( "limit", po::value<size_t>(&limit)->default_value( 0 ),
+      "Maximum number of requests to replay (0 for all)" )
+    ( "output,o", po::value<string>(&output_path), "Write a JSON summary to this file" )
+#if( !STATICALLY_LINK_TO_GADRAS )
+    ( "gadras-lib", po::value<string>(&gadras_lib_path)->default_value( "libgadrasiid.so" ),
+      "GADRAS shared library to load, for --target=queue" )
+#endif
+    ( "gadras-run-dir", po::value<string>(&gadras_run_dir)->default_value( "gadras_isotope_id_run_directory" ),
+      "GADRAS run directory, for --target=queue" )
+  ;
+
+  po::variables_map vm;
+  try
+  {
+    po::store( po::parse_command_line( argc, argv, desc ), vm );
+    po::notify( vm );
+  }catch( std::exception &e )
+  {
+    cerr << "Invalid command line argument: " << e.what() << endl << endl << desc << endl;
+    return EXIT_FAILURE;
+  }
+
+  if( vm.count("help") || capture_path.empty() )
+  {
+    cout << desc << endl;
+    return capture_path.empty() ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  double speed = 0.0; //zero means as fast as possible
+  if( speed_str != "max" )
+  {
+    if( !(stringstream(speed_str) >> speed) || !(speed > 0.0) )
+    {
+      cerr << "Invalid --speed '" << speed_str << "'" << endl;
+      return EXIT_FAILURE;
+    }
+  }//if( speed_str != "max" )
+
+  const bool use_queue = (target == "queue");
+
+  Wt::logInstance().configure( "* -debug -info" );
+
+  // Read in all the requests first, so file reading doesnt perturb the replay timing.
+  vector<AnalysisCapture::CapturedRequest> requests;
+  try
+  {
+    AnalysisCapture::CaptureReader reader( capture_path );
+    AnalysisCapture::CapturedRequest request;
+    while( (!limit || (requests.size() < limit)) && reader.next( request ) )
+      requests.push_back( request );
+  }catch( std::exception &e )
+  {
+    cerr << "Error reading capture file: " << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+
+  if( requests.empty() )
+  {
+    cerr << "No requests in '" << capture_path << "'" << endl;
+    return EXIT_FAILURE;
+  }
+
+  // For REST replays, create the upload bodies up front too.
+  const string boundary = "FullSpecReplayBoundary3f6c1e9a";
+  vector<string> bodies;
+  if( !use_queue )
+  {
+    try
+    {
+      for( const auto &request : requests )
+        bodies.push_back( multipart_body( request, boundary ) );
+    }catch( std::exception &e )
+    {
+      cerr << "Error creating request upload: " << e.what() << endl;
+      return EXIT_FAILURE;
+    }
+  }//if( !use_queue )
+
+  if( use_queue )
+  {
+    try
+    {
+#if( !STATICALLY_LINK_TO_GADRAS )
+      if( !Analysis::load_gadras_lib( gadras_lib_path ) )
+        throw runtime_error( "Could not load GADRAS library '" + gadras_lib_path + "'" );
+#endif
+      Analysis::set_gadras_app_dir( gadras_run_dir );
+      Analysis::start_analysis_thread();
+    }catch( std::exception &e )
+    {
+      cerr << "Error setting up analysis: " << e.what() << endl;
+      return EXIT_FAILURE;
+    }
+  }//if( use_queue )
+
+  Wt::WIOService io_service;
+  vector<unique_ptr<Wt::Http::Client>> clients;
+  if( !use_queue )
+    io_service.start();
+
+  std::mutex results_mutex;
+  vector<ReplayResult> results;
+  InFlightLimiter limiter( concurrency );
+
+  typedef std::chrono::steady_clock clock_type;
+  auto record_result = [&]( const Analysis::AnalysisType type, const clock_type::time_point start,
+                            const bool success ){
+    const double ms = std::chrono::duration<double,std::milli>( clock_type::now() - start ).count();
+    {
+      std::lock_guard<std::mutex> lock( results_mutex );
+      results.push_back( ReplayResult{ type, ms, success } );
+    }
+    limiter.release();
+  };//record_result lambda
+
+  cout << "Replaying " << requests.size() << " requests to " << target << " at "
+       << (speed > 0.0 ? (speed_str + "x") : string("max")) << " speed" << endl;
+
+  const uint64_t first_submit_us = requests.front().submit_time_us;
+  const clock_type::time_point replay_start = clock_type::now();
+
+  for( size_t i = 0; i < requests.size(); ++i )
+  {
+    const AnalysisCapture::CapturedRequest &request = requests[i];
+
+    if( speed > 0.0 )
+    {
+      const double offset_us = (request.submit_time_us > first_submit_us)
+                               ? (request.submit_time_us - first_submit_us) / speed : 0.0;
+      std::this_thread::sleep_until( replay_start
+                                     + std::chrono::microseconds( static_cast<int64_t>(offset_us) ) );
+    }//if( speed > 0.0 )
+
+    limiter.acquire();
+
+    const Analysis::AnalysisType type = request.analysis_type;
+    const clock_type::time_point start = clock_type::now();
+
+    if( use_queue )
+    {
+      Analysis::AnalysisInput anainput = request.to_analysis_input( i );
+      anainput.callback = [type,start,&record_result]( Analysis::AnalysisOutput output ){
+        record_result( type, start, (output.gadras_intialization_error >= 0)
+                                    && (output.gadras_analysis_error >= 0) );
+      };
+
+      try
+      {
+        Analysis::post_analysis( anainput );
+      }catch( std::exception &e )
+      {
+        cerr << "Failed to post request " << i << ": " << e.what() << endl;
+        record_result( type, start, false );
+      }
+    }else
+    {
+      auto client = std::make_unique<Wt::Http::Client>( io_service );
+      client->setTimeout( std::chrono::seconds(600) );
+      client->setMaximumResponseSize( 16*1024*1024 );
+      client->done().connect( [type,start,&record_result]( Wt::AsioWrapper::error_code err,
+                                                           const Wt::Http::Message &response ){
+        record_result( type, start, !err && (response.status() == 200) );
+      } );
+
+      Wt::Http::Message message;
+      message.addHeader( "Content-Type", "multipart/form-data; boundary=" + boundary );
+      message.addBodyText( bodies[i] );
+
+      if( !client->post( target, message ) )
+      {
+        cerr << "Failed to submit request " << i << " to '" << target << "'" << endl;
+        record_result( type, start, false );
+      }
+
+      clients.push_back( std::move(client) );
+    }//if( use_queue ) / else
+  }//for( size_t i = 0; i < requests.size(); ++i )
+
+  limiter.wait_for_all();
+  const double wall_seconds
+                = std::chrono::duration<double>( clock_type::now() - replay_start ).count();
+
+  if( use_queue )
+    Analysis::stop_analysis_thread();
+  else
+    io_service.stop();
+  clients.clear();
+
+  // Summarize, overall, and per analysis type.
+  size_t nerrors = 0;
+  for( const auto &r : results )
+    nerrors += !r.success;
+
+  auto latency_summary = [&results]( const bool all_types, const Analysis::AnalysisType type ) -> Wt::Json::Object {
+    vector<double> latencies;
+    for( const auto &r : results )
+    {
+      if( all_types || (r.type == type) )
+        latencies.push_back( r.latency_ms );
+    }
+    std::sort( begin(latencies), end(latencies) );
+
+    double sum = 0.0;
+    for( const double ms : latencies )
+      sum += ms;
+
+    Wt::Json::Object summary;
+    summary["count"] = static_cast<long long>( latencies.size() );
+    summary["meanMs"] = latencies.empty() ? 0.0 : (sum / latencies.size());
+    summary["minMs"] = latencies.empty() ? 0.0 : latencies.front();
+    summary["p50Ms"] = percentile( latencies, 0.50 );
+    summary["p90Ms"] = percentile( latencies, 0.90 );
+    summary["p99Ms"] = percentile( latencies, 0.99 );
+    summary["maxMs"] = latencies.empty() ? 0.0 : latencies.back();
+    return summary;
+  };//latency_summary lambda
+
+  const Wt::Json::Object overall = latency_summary( true, Analysis::AnalysisType::Simple );
+  const double throughput = (wall_seconds > 0.0) ? (results.size() / wall_seconds) : 0.0;
+
+  cout << "Requests:   " << results.size() << " (" << nerrors << " errors)" << endl
+       << "Wall time:  " << wall_seconds << " s" << endl
+       << "Throughput: " << throughput << " requests/s" << endl
+       << "Latency ms: p50=" << (double)overall.get("p50Ms")
+       << " p90=" << (double)overall.get("p90Ms")
+       << " p99=" << (double)overall.get("p99Ms")
+       << " max=" << (double)overall.get("maxMs") << endl;
+
+  if( !output_path.empty() )
+  {
+    Wt::Json::Object summary;
+    summary["capture"] = Wt::WString::fromUTF8( capture_path );
+    summary["target"] = Wt::WString::fromUTF8( target );
+    summary["speed"] = Wt::WString::fromUTF8( speed_str );
+    summary["requests"] = static_cast<long long>( results.size() );
+    summary["errors"] = static_cast<long long>( nerrors );
+    summary["wallSeconds"] = wall_seconds;
+    summary["throughput"] = throughput;
+    summary["latency"] = overall;
+
+    Wt::Json::Object by_type;
+    for( const auto type : { Analysis::AnalysisType::Simple, Analysis::AnalysisType::Search,
+                             Analysis::AnalysisType::Portal } )
+    {
+      const Wt::Json::Object type_summary = latency_summary( false, type );
+      if( (long long)type_summary.get("count") > 0 )
+        by_type[type_str(type)] = type_summary;
+    }
+    summary["latencyByType"] = by_type;
+
+    ofstream output( output_path.c_str() );
+    if( !output || !(output << Wt::Json::serialize( summary ) << endl) )
+    {
+      cerr << "Failed to write '" << output_path << "'" << endl;
+      return EXIT_FAILURE;
+    }
+  }//if( !output_path.empty() )
+
+  return nerrors ? EXIT_FAILURE : EXIT_SUCCESS;
+}//int main( int argc, char **argv )
@@ -0,0 +1,184 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/** full-spec-synth: writes synthetic search, portal, or simple spectrum files, so scaling
+ problems can be reproduced without needing (non-shareable) real data.
+
+ The output format is determined by each output files extension: ".n42" for N42-2012, or ".pcf"
+ for GADRAS PCF.
+
+ Example:
+   full-spec-synth --type=portal --detectors=8 --channels=16384 --slices=600 \
+                   --source=Cs137:300 --source=Co60:100:200-260 --derived \
+                   --output=portal.n42 --output=portal.pcf
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+
+#include <boost/program_options.hpp>
+
+#include "SpecUtils/SpecFile.h"
+#include "SpecUtils/StringAlgo.h"
+#include "SpecUtils/Filesystem.h"
+
+#include "SyntheticSpec.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+
+int main( int argc, char **argv )
+{
+  SyntheticSpec::Options options;
+  string type_str, variants_str;
+  vector<string> sources, outputs;
+  bool shared_cal = false, no_neutrons = false, overwrite = false;
+
+  po::options_description desc( "Allowed options" );
+  desc.add_options()
+    ( "help,h", "Produce help message" )
+    ( "type", po::value<string>(&type_str)->default_value( "search" ),
+      "The type of file to create: search, portal, or simple" )
+    ( "detectors", po::value<size_t>(&options.num_detectors)->default_value( options.num_detectors ),
+      "Number of gamma detectors" )
+    ( "channels", po::value<size_t>(&options.num_channels)->default_value( options.num_channels ),
+      "Number of gamma channels (16 to 65536)" )
+    ( "slices", po::value<size_t>(&options.num_slices)->default_value( options.num_slices ),
+      "Number of foreground time slices (not used for simple files)" )
+    ( "slice-duration", po::value<float>(&options.slice_duration)->default_value( options.slice_duration ),
+      "Real time, in seconds, of each foreground time slice" )
+    ( "background-duration", po::value<float>(&options.background_duration)->default_value( options.background_duration ),
+      "Real time, in seconds, of the background" )
+    ( "max-energy", po::value<float>(&options.max_energy)->default_value( options.max_energy ),
+      "Energy, in keV, of the upper edge of the last channel" )
+    ( "continuum-cps", po::value<float>(&options.continuum_cps)->default_value( options.continuum_cps ),
+      "Background gamma counts per second, per detector" )
+    ( "shared-cal", po::bool_switch(&shared_cal),
+      "Use the same energy calibration for all detectors, instead of slightly different ones" )
+    ( "cal-variants", po::value<string>(&variants_str),
+      "Comma separated energy calibration variants (e.g., \"LinEnCal,CmpEnCal\"); each detector"
+      " is written once per variant" )
+    ( "derived", po::bool_switch(&options.derived_data),
+      "Include derived data (summed background and item-of-interest spectra)" )
+    ( "no-neutrons", po::bool_switch(&no_neutrons), "Do not include neutron counts" )
+    ( "source", po::value<vector<string>>(&sources),
+      "Source to inject, as <nuclide>[:<gamma cps>[:<first slice>-<last slice>]]; may be"
+      " specified multiple times.  Ex. \"Cs137:300\" or \"Ba133:100:20-40\"" )
+    ( "seed", po::value<uint32_t>(&options.seed)->default_value( options.seed ),
+      "Random number generator seed" )
+    ( "output,o", po::value<vector<string>>(&outputs),
+      "Output file; the format is chosen by extension (.n42 or .pcf).  May be specified"
+      " multiple times." )
+    ( "overwrite", po::bool_switch(&overwrite), "Overwrite output files if they already exist" )
+  ;
+
+  po::variables_map vm;
+  try
+  {
+    po::store( po::parse_command_line( argc, argv, desc ), vm );
+    po::notify( vm );
+  }catch( std::exception &e )
+  {
+    cerr << "Invalid command line argument: " << e.what() << endl << endl << desc << endl;
+    return EXIT_FAILURE;
+  }
+
+  if( vm.count("help") )
+  {
+    cout << desc << endl;
+    return EXIT_SUCCESS;
+  }
+
+  if( outputs.empty() )
+  {
+    cerr << "You must specify at least one output file." << endl << endl << desc << endl;
+    return EXIT_FAILURE;
+  }
+
+  vector<SpecUtils::SaveSpectrumAsType> formats;
+  for( const string &output : outputs )
+  {
+    if( SpecUtils::iends_with( output, ".n42" ) )
+      formats.push_back( SpecUtils::SaveSpectrumAsType::N42_2012 );
+    else if( SpecUtils::iends_with( output, ".pcf" ) )
+      formats.push_back( SpecUtils::SaveSpectrumAsType::Pcf );
+    else
+    {
+      cerr << "Output file '" << output << "' must have a .n42 or .pcf extension." << endl;
+      return EXIT_FAILURE;
+    }
+
+    if( SpecUtils::is_file( output ) && !overwrite )
+    {
+      cerr << "Output file '" << output << "' already exists; use --overwrite to replace it." << endl;
+      return EXIT_FAILURE;
+    }
+  }//for( const string &output : outputs )
+
+  shared_ptr<SpecUtils::SpecFile> spec;
+
+  try
+  {
+    options.type = SyntheticSpec::file_type_from_str( type_str );
+    options.distinct_calibrations = !shared_cal;
+    options.neutrons = !no_neutrons;
+
+    if( !variants_str.empty() )
+      SpecUtils::split( options.calibration_variants, variants_str, "," );
+
+    for( const string &src : sources )
+      options.sources.push_back( SyntheticSpec::parse_source( src ) );
+
+    spec = SyntheticSpec::generate( options );
+  }catch( std::exception &e )
+  {
+    cerr << "Failed to generate spectrum file: " << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+
+  int rval = EXIT_SUCCESS;
+  for( size_t i = 0; i < outputs.size(); ++i )
+  {
+    try
+    {
+      if( SpecUtils::is_file( outputs[i] ) && !SpecUtils::remove_file( outputs[i] ) )
+        throw runtime_error( "could not remove existing file" );
+
+      spec->write_to_file( outputs[i], formats[i] );
+      cout << "Wrote " << outputs[i] << " (" << spec->num_measurements() << " measurements)" << endl;
+    }catch( std::exception &e )
+    {
+      cerr << "Failed to write '" << outputs[i] << "': " << e.what() << endl;
+      rval = EXIT_FAILURE;
+    }
+  }//for( size_t i = 0; i < outputs.size(); ++i )
+
+  return rval;
+}//int main( int argc, char **argv )
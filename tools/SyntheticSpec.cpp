@@ -0,0 +1,547 @@
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "FullSpectrumId_config.h"
+
+#include <set>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "SpecUtils/SpecFile.h"
+#include "SpecUtils/StringAlgo.h"
+#include "SpecUtils/EnergyCalibration.h"
+
+#include "SyntheticSpec.h"
+
+using namespace std;
+
+namespace
+{
+  /** Gamma lines of the nuclides we know about, as {energy keV, relative intensity}. */
+  const vector<pair<string,vector<pair<float,float>>>> ns_nuclide_lines{
+    { "Am241", { {59.5f, 0.36f} } },
+    { "Ba133", { {81.0f, 0.33f}, {276.4f, 0.07f}, {302.9f, 0.18f}, {356.0f, 0.62f}, {383.8f, 0.09f} } },
+    { "Co57",  { {122.1f, 0.86f}, {136.5f, 0.11f} } },
+    { "Co60",  { {1173.2f, 1.0f}, {1332.5f, 1.0f} } },
+    { "Cs137", { {661.7f, 0.85f} } },
+    { "I131",  { {284.3f, 0.06f}, {364.5f, 0.81f}, {637.0f, 0.07f} } },
+    { "Ir192", { {296.0f, 0.29f}, {308.5f, 0.30f}, {316.5f, 0.83f}, {468.1f, 0.48f}, {604.4f, 0.08f} } },
+    { "Ra226", { {295.2f, 0.18f}, {351.9f, 0.36f}, {609.3f, 0.45f}, {1120.3f, 0.15f}, {1764.5f, 0.15f} } },
+    { "Tc99m", { {140.5f, 0.89f} } },
+    { "Th232", { {238.6f, 0.43f}, {583.2f, 0.30f}, {911.2f, 0.26f}, {2614.5f, 0.36f} } },
+    { "U235",  { {143.8f, 0.11f}, {185.7f, 0.57f} } },
+    { "U238",  { {766.4f, 0.0029f}, {1001.0f, 0.0084f} } }
+  };//ns_nuclide_lines
+
+
+  /** A Measurement we can mark as derived data; SpecUtils only sets this flag when parsing files. */
+  class DerivedMeasurement : public SpecUtils::Measurement
+  {
+  public:
+    void set_derived_data_properties( const uint32_t properties )
+    {
+      derived_data_properties_ = properties;
+    }
+  };//class DerivedMeasurement
+
+
+  /** Adds a Gaussian peak with the given total counts-per-second to the per-channel rates. */
+  void add_peak( const vector<float> &energies, const float energy, const float cps,
+                 vector<double> &rates )
+  {
+    // A NaI-ish resolution, of 7% at 661 keV, scaling with sqrt(energy).
+    const double fwhm = 0.07 * std::sqrt( 661.7 * energy );
+    const double sigma = fwhm / 2.35482;
+    const double lower = energy - 5.0*sigma, upper = energy + 5.0*sigma;
+
+    const size_t nchannel = rates.size();
+    const auto begin_iter = std::upper_bound( begin(energies), begin(energies) + nchannel, lower );
+    size_t channel = (begin_iter == begin(energies)) ? 0 : static_cast<size_t>(begin_iter - begin(energies)) - 1;
+
+    for( ; (channel < nchannel) && (energies[channel] < upper); ++channel )
+    {
+      const double x0 = (energies[channel] - energy) / (sigma * std::sqrt(2.0));
+      const double x1 = (energies[channel+1] - energy) / (sigma * std::sqrt(2.0));
+      rates[channel] += cps * 0.5 * (std::erf(x1) - std::erf(x0));
+    }
+  }//add_peak(...)
+
+
+  /** Per-channel count rates for background (a falling continuum, with K40 and Th232 lines). */
+  vector<double> background_rates( const vector<float> &energies, const size_t nchannel,
+                                   const float continuum_cps )
+  {
+    vector<double> rates( nchannel, 0.0 );
+
+    double sum = 0.0;
+    for( size_t channel = 0; channel < nchannel; ++channel )
+    {
+      const double energy = 0.5*(energies[channel] + energies[channel+1]);
+      const double width = energies[channel+1] - energies[channel];
+      const double rolloff = 1.0 - std::exp( -std::max(energy, 0.0) / 40.0 );
+      rates[channel] = std::exp( -energy / 300.0 ) * rolloff * std::max( width, 0.0 );
+      sum += rates[channel];
+    }
+
+    if( sum > 0.0 )
+    {
+      for( double &rate : rates )
+        rate *= continuum_cps / sum;
+    }
+
+    add_peak( energies, 1460.8f, 0.0015f*continuum_cps, rates );
+    add_peak( energies, 2614.5f, 0.0005f*continuum_cps, rates );
+
+    return rates;
+  }//background_rates(...)
+
+
+  /** Per-channel count rates for a source. */
+  vector<double> source_rates( const vector<float> &energies, const size_t nchannel,
+                               const SyntheticSpec::Source &src )
+  {
+    vector<double> rates( nchannel, 0.0 );
+    for( const auto &line : src.lines )
+      add_peak( energies, line.first, line.second, rates );
+
+    return rates;
+  }//source_rates(...)
+
+
+  shared_ptr<vector<float>> poisson_counts( const vector<double> &rates, const double live_time,
+                                            std::mt19937 &rng )
+  {
+    auto counts = make_shared<vector<float>>( rates.size(), 0.0f );
+    for( size_t channel = 0; channel < rates.size(); ++channel )
+    {
+      const double mean = rates[channel] * live_time;
+      if( mean > 1.0E-9 )
+      {
+        std::poisson_distribution<int> poisson( mean );
+        (*counts)[channel] = static_cast<float>( poisson(rng) );
+      }
+    }//for( loop over channels )
+
+    return counts;
+  }//poisson_counts(...)
+
+
+  /** The per-variant information needed to create the spectra of a detector. */
+  struct DetectorModel
+  {
+    string name;
+    shared_ptr<const SpecUtils::EnergyCalibration> cal;
+    vector<double> background;
+    vector<vector<double>> sources;
+  };//struct DetectorModel
+}//namespace
+
+
+namespace SyntheticSpec
+{
+Source::Source()
+  : name(),
+    lines(),
+    neutron_cps( 0.0f ),
+    first_slice( 0 ),
+    last_slice( 0 )
+{
+}
+
+
+Options::Options()
+  : type( FileType::Search ),
+    num_detectors( 4 ),
+    num_channels( 1024 ),
+    num_slices( 100 ),
+    slice_duration( 0.1f ),
+    background_duration( 300.0f ),
+    max_energy( 3000.0f ),
+    distinct_calibrations( true ),
+    calibration_variants(),
+    derived_data( false ),
+    neutrons( true ),
+    continuum_cps( 2000.0f ),
+    sources(),
+    seed( 3141 )
+{
+}
+
+
+const char *to_str( const FileType type )
+{
+  switch( type )
+  {
+    case FileType::Search: return "search";
+    case FileType::Portal: return "portal";
+    case FileType::Simple: return "simple";
+  }
+
+  return "";
+}//to_str( FileType )
+
+
+FileType file_type_from_str( const std::string &str )
+{
+  for( const FileType type : { FileType::Search, FileType::Portal, FileType::Simple } )
+  {
+    if( SpecUtils::iequals_ascii( str, to_str(type) ) )
+      return type;
+  }
+
+  throw runtime_error( "Invalid file type '" + str + "'; must be search, portal, or simple" );
+}//file_type_from_str(...)
+
+
+Source parse_source( const std::string &str )
+{
+  vector<string> fields;
+  SpecUtils::split( fields, str, ":" );
+
+  if( fields.empty() || (fields.size() > 3) )
+    throw runtime_error( "Invalid source '" + str + "'" );
+
+  Source src;
+  src.name = fields[0];
+  SpecUtils::trim( src.name );
+
+  float cps = 250.0f;
+  if( fields.size() > 1 )
+  {
+    if( !(stringstream(fields[1]) >> cps) || (cps < 0.0f) )
+      throw runtime_error( "Invalid counts per second in source '" + str + "'" );
+  }
+
+  if( fields.size() > 2 )
+  {
+    char dash = '\0';
+    stringstream range( fields[2] );
+    if( !(range >> src.first_slice >> dash >> src.last_slice) || (dash != '-')
+        || (src.first_slice < 1) || (src.last_slice < src.first_slice) )
+      throw runtime_error( "Invalid slice range in source '" + str + "'" );
+  }//if( a slice range was given )
+
+  if( SpecUtils::iequals_ascii( src.name, "Cf252" ) )
+  {
+    // Only a neutron source, for our purposes.
+    src.name = "Cf252";
+    src.neutron_cps = cps;
+    return src;
+  }
+
+  const auto pos = std::find_if( begin(ns_nuclide_lines), end(ns_nuclide_lines),
+                    [&src]( const pair<string,vector<pair<float,float>>> &nuc ){
+    return SpecUtils::iequals_ascii( nuc.first, src.name );
+  } );
+
+  if( pos == end(ns_nuclide_lines) )
+    throw runtime_error( "Unknown nuclide '" + src.name + "' in source '" + str + "'" );
+
+  src.name = pos->first;
+
+  double total_intensity = 0.0;
+  for( const auto &line : pos->second )
+    total_intensity += line.second;
+
+  for( const auto &line : pos->second )
+    src.lines.emplace_back( line.first, static_cast<float>( cps * line.second / total_intensity ) );
+
+  return src;
+}//parse_source(...)
+
+
+std::shared_ptr<SpecUtils::SpecFile> generate( const Options &options )
+{
+  if( (options.num_channels < 16) || (options.num_channels > 65536) )
+    throw runtime_error( "Number of channels must be between 16 and 65536" );
+
+  if( (options.num_detectors < 1) || (options.num_detectors > 128) )
+    throw runtime_error( "Number of detectors must be between 1 and 128" );
+
+  const size_t num_slices = (options.type == FileType::Simple) ? size_t(1) : options.num_slices;
+  if( num_slices < 1 )
+    throw runtime_error( "Number of time slices must be at least 1" );
+
+  if( !(options.slice_duration > 0.0f) || !(options.background_duration > 0.0f) )
+    throw runtime_error( "Time slice and background durations must be positive" );
+
+  if( !(options.max_energy > 100.0f) )
+    throw runtime_error( "Maximum energy must be above 100 keV" );
+
+  if( options.calibration_variants.size() > 4 )
+    throw runtime_error( "At most four calibration variants are supported" );
+
+  for( const string &variant : options.calibration_variants )
+  {
+    if( variant.empty() || (variant.find_first_of( " \t_" ) != string::npos) )
+      throw runtime_error( "Invalid calibration variant name '" + variant + "'" );
+  }
+
+  // Figure out which time slices each source is present for.
+  vector<pair<size_t,size_t>> source_slices;
+  for( const Source &src : options.sources )
+  {
+    size_t first = src.first_slice, last = src.last_slice;
+    if( options.type == FileType::Simple )
+    {
+      first = last = 1;
+    }else if( !first && !last )
+    {
+      first = 1 + num_slices/3;
+      last = std::max( first, (2*num_slices)/3 );
+    }
+
+    source_slices.emplace_back( first, last );
+  }//for( const Source &src : options.sources )
+
+  auto slice_occupancy = [&options,num_slices]( const size_t slice ) -> SpecUtils::OccupancyStatus {
+    switch( options.type )
+    {
+      case FileType::Search:
+      case FileType::Simple:
+        return SpecUtils::OccupancyStatus::Unknown;
+
+      case FileType::Portal:
+      {
+        const size_t edge = num_slices / 10;
+        const bool occupied = (slice > edge) && (slice <= (num_slices - edge));
+        return occupied ? SpecUtils::OccupancyStatus::Occupied
+                        : SpecUtils::OccupancyStatus::NotOccupied;
+      }
+    }//switch( options.type )
+
+    return SpecUtils::OccupancyStatus::Unknown;
+  };//slice_occupancy lambda
+
+  std::mt19937 rng( options.seed );
+
+  const vector<string> variants = options.calibration_variants.empty()
+                                  ? vector<string>{ "" } : options.calibration_variants;
+  const boost::posix_time::ptime start_time
+                     = boost::posix_time::time_from_string( "2021-10-03 12:00:00.000" );
+  const float live_fraction = 0.98f;
+
+  auto spec = make_shared<SpecUtils::SpecFile>();
+
+  for( size_t variant_index = 0; variant_index < variants.size(); ++variant_index )
+  {
+    const string &variant = variants[variant_index];
+    const size_t nchannel = std::max( size_t(16), options.num_channels >> variant_index );
+
+    vector<DetectorModel> detectors;
+    shared_ptr<SpecUtils::EnergyCalibration> shared_cal;
+
+    for( size_t det = 0; det < options.num_detectors; ++det )
+    {
+      DetectorModel model;
+      model.name = "Det" + std::to_string(det + 1);
+      if( !variant.empty() )
+        model.name += "_intercal_" + variant;
+
+      shared_ptr<SpecUtils::EnergyCalibration> cal = shared_cal;
+      if( !cal )
+      {
+        const float gain_mult = options.distinct_calibrations ? (1.0f + 0.0025f*det) : 1.0f;
+        const float n = static_cast<float>( nchannel );
+        const vector<float> coefs{ 0.0f, gain_mult*0.99f*options.max_energy/n,
+                                   0.01f*options.max_energy/(n*n) };
+        const vector<pair<float,float>> dev_pairs{ {0.0f, 0.0f}, {661.7f, -5.0f}, {1460.8f, 0.0f} };
+
+        cal = make_shared<SpecUtils::EnergyCalibration>();
+        cal->set_polynomial( nchannel, coefs, dev_pairs );
+
+        if( !options.distinct_calibrations )
+          shared_cal = cal;
+      }//if( we need to create the calibration )
+
+      const vector<float> &energies = *cal->channel_energies();
+
+      model.cal = cal;
+      model.background = background_rates( energies, nchannel, options.continuum_cps );
+      for( const Source &src : options.sources )
+        model.sources.push_back( source_rates( energies, nchannel, src ) );
+
+      detectors.push_back( std::move(model) );
+    }//for( loop over detectors )
+
+
+    // Returns the rates for a time slice (slice 0 being the background).
+    auto rates_for_slice = [&]( const DetectorModel &model, const size_t slice ) -> vector<double> {
+      vector<double> rates = model.background;
+      for( size_t src = 0; slice && (src < options.sources.size()); ++src )
+      {
+        if( (slice >= source_slices[src].first) && (slice <= source_slices[src].second) )
+        {
+          for( size_t i = 0; i < rates.size(); ++i )
+            rates[i] += model.sources[src][i];
+        }
+      }
+      return rates;
+    };//rates_for_slice lambda
+
+    auto neutron_rate_for_slice = [&]( const size_t slice ) -> double {
+      double rate = 2.0;
+      for( size_t src = 0; slice && (src < options.sources.size()); ++src )
+      {
+        if( (slice >= source_slices[src].first) && (slice <= source_slices[src].second) )
+          rate += options.sources[src].neutron_cps;
+      }
+      return rate;
+    };//neutron_rate_for_slice lambda
+
+
+    for( size_t slice = 0; slice <= num_slices; ++slice )
+    {
+      const bool is_background = (slice == 0);
+      const float real_time = is_background ? options.background_duration : options.slice_duration;
+      const float live_time = live_fraction * real_time;
+
+      boost::posix_time::ptime slice_start = start_time;
+      if( !is_background )
+      {
+        const double offset = options.background_duration + (slice - 1)*options.slice_duration;
+        slice_start += boost::posix_time::microseconds( static_cast<int64_t>(1.0E6*offset) );
+      }
+
+      for( const DetectorModel &model : detectors )
+      {
+        auto m = make_shared<SpecUtils::Measurement>();
+        m->set_gamma_counts( poisson_counts( rates_for_slice(model, slice), live_time, rng ),
+                             live_time, real_time );
+        m->set_energy_calibration( model.cal );
+        m->set_sample_number( static_cast<int>(slice) );
+        m->set_detector_name( model.name );
+        m->set_source_type( is_background ? SpecUtils::SourceType::Background
+                                          : SpecUtils::SourceType::Foreground );
+        m->set_occupancy_status( is_background ? SpecUtils::OccupancyStatus::NotOccupied
+                                               : slice_occupancy(slice) );
+        m->set_start_time( slice_start );
+
+        if( options.neutrons )
+        {
+          std::poisson_distribution<int> neutrons( neutron_rate_for_slice(slice) * real_time );
+          m->set_neutron_counts( vector<float>{ static_cast<float>( neutrons(rng) ) } );
+        }
+
+        spec->add_measurement( m, false );
+      }//for( loop over detectors )
+    }//for( loop over time slices )
+
+
+    if( options.derived_data )
+    {
+      // Derived data is summed over all detectors, using the first detectors calibration; we
+      //  give a background, and a foreground summed over the slices any source is present for
+      //  (or over the occupied slices, or all slices, if there are no sources).
+      set<size_t> ioi_slices;
+      for( const auto &range : source_slices )
+      {
+        for( size_t slice = range.first; (slice <= range.second) && (slice <= num_slices); ++slice )
+          ioi_slices.insert( slice );
+      }
+
+      for( size_t slice = 1; ioi_slices.empty() && (slice <= num_slices); ++slice )
+      {
+        if( slice_occupancy(slice) != SpecUtils::OccupancyStatus::NotOccupied )
+          ioi_slices.insert( slice );
+      }
+
+      const DetectorModel &first_det = detectors.front();
+      const string derived_name = "Sum" + (variant.empty() ? string() : ("_intercal_" + variant));
+
+      using ddp = SpecUtils::Measurement::DerivedDataProperties;
+      const uint32_t background_flags = static_cast<uint32_t>(ddp::IsDerived)
+                                        | static_cast<uint32_t>(ddp::IsBackground)
+                                        | static_cast<uint32_t>(ddp::UsedForAnalysis);
+      const uint32_t ioi_flags = static_cast<uint32_t>(ddp::IsDerived)
+                                 | static_cast<uint32_t>(ddp::ItemOfInterestSum)
+                                 | static_cast<uint32_t>(ddp::UsedForAnalysis);
+
+      for( const bool is_background : { true, false } )
+      {
+        vector<double> rates( nchannel, 0.0 );
+        double neutron_counts = 0.0;
+        float real_time = 0.0f;
+
+        const set<size_t> slices = is_background ? set<size_t>{ 0 } : ioi_slices;
+        for( const size_t slice : slices )
+        {
+          const float slice_real_time = slice ? options.slice_duration : options.background_duration;
+          const vector<double> slice_rates = rates_for_slice( first_det, slice );
+          for( size_t i = 0; i < nchannel; ++i )
+            rates[i] += slice_rates[i] * live_fraction * slice_real_time * options.num_detectors;
+          neutron_counts += neutron_rate_for_slice(slice) * slice_real_time * options.num_detectors;
+          real_time += slice_real_time;
+        }//for( const size_t slice : slices )
+
+        auto m = make_shared<DerivedMeasurement>();
+        m->set_derived_data_properties( is_background ? background_flags : ioi_flags );
+        m->set_gamma_counts( poisson_counts( rates, 1.0, rng ), live_fraction * real_time, real_time );
+        m->set_energy_calibration( first_det.cal );
+        m->set_sample_number( static_cast<int>(num_slices + (is_background ? 1 : 2)) );
+        m->set_detector_name( derived_name );
+        m->set_title( is_background ? "Derived background" : "Derived item of interest" );
+        m->set_source_type( is_background ? SpecUtils::SourceType::Background
+                                          : SpecUtils::SourceType::Foreground );
+        m->set_occupancy_status( is_background ? SpecUtils::OccupancyStatus::NotOccupied
+                                               : SpecUtils::OccupancyStatus::Occupied );
+        m->set_start_time( start_time );
+
+        if( options.neutrons )
+        {
+          std::poisson_distribution<int> neutrons( std::max( neutron_counts, 1.0E-9 ) );
+          m->set_neutron_counts( vector<float>{ static_cast<float>( neutrons(rng) ) } );
+        }
+
+        spec->add_measurement( m, false );
+      }//for( background, then item of interest )
+    }//if( options.derived_data )
+  }//for( loop over calibration variants )
+
+
+  vector<string> remarks;
+  remarks.push_back( string("Synthetic ") + to_str(options.type) + " data generated by full-spec-synth"
+                     + " (seed " + std::to_string(options.seed) + ")." );
+  for( size_t src = 0; src < options.sources.size(); ++src )
+  {
+    remarks.push_back( "Source " + options.sources[src].name + " present for slices "
+                       + std::to_string(source_slices[src].first) + " through "
+                       + std::to_string(source_slices[src].second) + "." );
+  }
+
+  spec->set_manufacturer( "FullSpectrum" );
+  spec->set_instrument_model( string("Synthetic ") + to_str(options.type) );
+  spec->set_remarks( remarks );
+  spec->cleanup_after_load();
+
+  return spec;
+}//generate(...)
+}//namespace SyntheticSpec
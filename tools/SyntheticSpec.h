@@ -0,0 +1,169 @@
+#ifndef SyntheticSpec_h
+#define SyntheticSpec_h
+/* FullSpectrum: a command-line and web interface to the GADRAS Full Spectrum
+ Isotope ID algorithm.  Lee Harding and Will Johnson, SNL.
+
+ Copyright 2021 National Technology & Engineering Solutions of Sandia, LLC
+ (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the U.S.
+ Government retains certain rights in this software.
+ For questions contact William Johnson via email at wcjohns@sandia.gov, or
+ alternative email of full-spectrum@sandia.gov.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <utility>
+
+namespace SpecUtils
+{
+  class SpecFile;
+}//namespace SpecUtils
+
+
+/** Generates spectrum files with a simple, but realistic enough, physics model (a falling
+ continuum, K40, and optionally injected sources with Poisson statistics), so benchmarks and
+ load tests can reproducibly sweep input size without needing real (and usually not shareable)
+ data files.
+
+ Output is fully determined by the #Options (including the seed).
+ */
+namespace SyntheticSpec
+{
+  enum class FileType
+  {
+    /** A long background (sample number 0), followed by short, continuous, time slices with
+     unknown occupancy; e.g., a backpack or vehicle search system.
+     */
+    Search,
+
+    /** A long background (sample number 0), followed by short time slices, the middle 80% of
+     which are marked as occupied; e.g., an RPM vehicle pass-by.
+     */
+    Portal,
+
+    /** A single background and a single foreground sample; e.g., a handheld. */
+    Simple
+  };//enum class FileType
+
+
+  /** A source that is added to the foreground for a range of time slices. */
+  struct Source
+  {
+    /** Name, only used in the file remarks. */
+    std::string name;
+
+    /** Gamma lines as {energy keV, counts per second per detector}.  Lines are given a Gaussian
+     shape with a NaI like resolution.
+     */
+    std::vector<std::pair<float,float>> lines;
+
+    /** Neutron counts per second, per detector, added while source is present. */
+    float neutron_cps;
+
+    /** The first and last time slices (1-based, inclusive, not including the background) the
+     source is present for.  If both are zero, the middle third of the slices is used.
+     Ignored for #FileType::Simple, where the source is always in the foreground.
+     */
+    size_t first_slice;
+    size_t last_slice;
+
+    Source();
+  };//struct Source
+
+
+  struct Options
+  {
+    FileType type;
+
+    /** Number of gamma detectors; each will also have a neutron detector, if #neutrons is true. */
+    size_t num_detectors;
+
+    /** Number of gamma channels; must be between 16 and 65536. */
+    size_t num_channels;
+
+    /** Number of foreground time slices, not including the background; ignored for Simple. */
+    size_t num_slices;
+
+    /** Real time, in seconds, of each foreground time slice (or of the foreground, for Simple). */
+    float slice_duration;
+
+    /** Real time, in seconds, of the background. */
+    float background_duration;
+
+    /** Upper energy of the last channel, in keV. */
+    float max_energy;
+
+    /** If true, each detector gets a slightly different gain, so summing between detectors
+     requires rebinning; otherwise all detectors share the same calibration object.
+     */
+    bool distinct_calibrations;
+
+    /** Energy calibration variants (e.g., "LinEnCal", "CmpEnCal"); if non-empty each detector
+     is written out once for each variant, with the detector name suffixed by
+     "_intercal_<variant>".  The Nth (zero-based) variant has num_channels/2^N channels.
+     */
+    std::vector<std::string> calibration_variants;
+
+    /** If true, derived data (background, and item-of-interest sum, spectra summed over all
+     detectors) is added, as a N42-2012 file from a portal or search system might have.
+     */
+    bool derived_data;
+
+    /** Whether to include neutron counts. */
+    bool neutrons;
+
+    /** Gamma continuum, in counts per second per detector, above about 50 keV. */
+    float continuum_cps;
+
+    std::vector<Source> sources;
+
+    /** Seed for the random number generator. */
+    uint32_t seed;
+
+    Options();
+  };//struct Options
+
+
+  /** Generates a spectrum file according to the options.
+
+   Throws std::exception on invalid options.
+   */
+  std::shared_ptr<SpecUtils::SpecFile> generate( const Options &options );
+
+  /** Parses a source from a string of the form "<nuclide>[:<gamma cps>[:<first slice>-<last slice>]]",
+   for example "Cs137", "Co60:250", or "Ba133:100:20-40".
+
+   Only a handful of common nuclides are known (Am241, Ba133, Co57, Co60, Cs137, I131, Ir192,
+   Ra226, Tc99m, Th232, U235, U238); the gamma cps is split between the nuclides lines
+   proportional to their (approximate) intensities.  The default cps is 250.
+
+   Throws std::exception if the string cannot be parsed, or nuclide isnt known.
+   */
+  Source parse_source( const std::string &str );
+
+  /** Returns the FileType from its name ("search", "portal", or "simple"; case insensitive).
+
+   Throws std::exception if not a valid name.
+   */
+  FileType file_type_from_str( const std::string &str );
+
+  const char *to_str( const FileType type );
+}//namespace SyntheticSpec
+
+#endif //SyntheticSpec_h